@@ -0,0 +1,336 @@
+/**@file
+ *  This file dispatches the builtins. Every builtin, including the ones loaded
+ *  from shared libraries with `enable -f`, is in a table indexed by a perfect
+ *  hash: the seed of the hash is searched, when the table is built, so that
+ *  no two builtins share a slot. A lookup is then a hash and a single strcmp.
+ *
+ *  The table is only built at startup and when a builtin is loaded or
+ *  removed, so the search costs nothing when commands run.
+ */
+#include <dlfcn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "builtins.h"
+#include "nash_builtin.h"
+#include "util.h"
+#include "logger.h"
+
+/* Seeds tried for a table size before the table is doubled */
+#define SEED_TRIES 256
+
+/** This struct holds a builtin.
+ *
+ *  -name: name of the builtin.
+ *  -run: the builtin of the shell itself, NULL for a loaded builtin.
+ *  -readonly: the builtin does not change the state of the shell.
+ *  -ext: the loaded builtin, NULL for a builtin of the shell.
+ *  -handle: handle of the library of a loaded builtin.
+ *  -path: path of the library of a loaded builtin.
+ *
+ */
+struct builtin {
+    const char *name;
+    int (*run)(char **);
+    bool readonly;
+    const struct nash_builtin *ext;
+    void *handle;
+    char *path;
+};
+
+static struct builtin *entries = NULL;
+static size_t entries_sz = 0;
+static size_t entries_limit = 0;
+
+static struct builtin **table = NULL;
+static size_t table_sz = 0;
+static uint32_t table_seed = 0;
+
+/** This function returns the FNV-1a hash of a name under a seed. The low bits
+ *  of FNV-1a only depend on the low bits of where it starts, so the seed is
+ *  mixed in at the end for every seed to give a different table.
+ *
+ */
+static uint32_t hash(const char *name, uint32_t seed){
+
+    uint32_t h = fnv1a(FNV1A_START, name, strlen(name));
+    h ^= seed * 0x9e3779b9U;
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    return h;
+}
+
+/** This function builds the table. It looks for a seed under which every
+ *  builtin has its own slot, and doubles the table until it finds one.
+ *
+ *  Returns: 0 if succeded. -1 if memory could not be allocated.
+ */
+static int table_build(void){
+
+    size_t size = 16;
+    while(size < 2 * entries_sz)
+        size *= 2;
+
+    while(true){
+        struct builtin **slots = calloc(size, sizeof(struct builtin *));
+        if(!slots){
+            perror("calloc");
+            return -1;
+        }
+
+        for(uint32_t seed = 0; seed < SEED_TRIES; seed++){
+
+            size_t i;
+            for(i = 0; i < entries_sz; i++){
+                struct builtin **slot = &slots[hash(entries[i].name, seed)
+                    & (size - 1)];
+                if(*slot != NULL)
+                    break;
+                *slot = &entries[i];
+            }
+
+            if(i == entries_sz){
+                free(table);
+                table = slots;
+                table_sz = size;
+                table_seed = seed;
+                LOG("builtins: %zu in %zu slots, seed %u\n", entries_sz, size,
+                        seed);
+                return 0;
+            }
+            memset(slots, 0, size * sizeof(struct builtin *));
+        }
+
+        free(slots);
+        size *= 2;
+    }
+}
+
+/** This function appends a builtin to the list. The table has to be built
+ *  again afterwards, as the list may move.
+ *
+ *  Returns: the builtin, NULL if memory could not be allocated.
+ */
+static struct builtin *entries_add(const char *name){
+
+    if(entries_sz == entries_limit){
+        size_t limit = entries_limit ? entries_limit * 2 : 32;
+        struct builtin *temp = realloc(entries, limit * sizeof(struct builtin));
+        if(!temp){
+            perror("realloc");
+            return NULL;
+        }
+        entries = temp;
+        entries_limit = limit;
+    }
+
+    struct builtin *b = &entries[entries_sz++];
+    memset(b, 0, sizeof(struct builtin));
+    b->name = name;
+    return b;
+}
+
+/** This function sets the builtins of the shell itself and builds the table.
+ *
+ *  -defs: the builtins.
+ *  -defs_sz: number of builtins.
+ *
+ */
+void builtins_init(const struct builtin_def *defs, size_t defs_sz){
+
+    for(size_t i = 0; i < defs_sz; i++){
+        struct builtin *b = entries_add(defs[i].name);
+        if(b == NULL)
+            exit(EXIT_FAILURE);
+        b->run = defs[i].run;
+        b->readonly = defs[i].readonly;
+    }
+
+    if(table_build() == -1)
+        exit(EXIT_FAILURE);
+}
+
+/** This function frees the table and unloads the libraries of the loaded
+ *  builtins.
+ *
+ */
+void builtins_destroy(void){
+
+    for(size_t i = 0; i < entries_sz; i++){
+        if(entries[i].handle != NULL)
+            dlclose(entries[i].handle);
+        free(entries[i].path);
+    }
+    free(entries);
+    free(table);
+    entries = NULL;
+    table = NULL;
+    entries_sz = entries_limit = table_sz = 0;
+}
+
+/** This function looks a builtin up.
+ *
+ *  Returns: the builtin, NULL if name is not a builtin.
+ */
+const struct builtin *builtin_lookup(const char *name){
+
+    if(table == NULL)
+        return NULL;
+
+    const struct builtin *b = table[hash(name, table_seed) & (table_sz - 1)];
+    return b != NULL && !strcmp(b->name, name) ? b : NULL;
+}
+
+/** This function tells whether a builtin only reads the state of the shell.
+ *  A loaded builtin says so with NASH_BUILTIN_READONLY, from ABI 2.
+ *
+ */
+bool builtin_readonly(const struct builtin *b){
+
+    return b->readonly;
+}
+
+/** This function runs a builtin. A loaded builtin gets the command through
+ *  the struct nash_command of its ABI.
+ *
+ *  -b: the builtin.
+ *  -cmd: the command, after being expanded.
+ *
+ *  Returns: the exit code of the builtin.
+ */
+int builtin_run(const struct builtin *b, const struct command_line *cmd){
+
+    if(b->run != NULL)
+        return b->run(cmd->tokens);
+
+    struct nash_command command = {
+        .argc = cmd->total_tokens,
+        .argv = cmd->tokens,
+        .stdin_file = cmd->stdin_file,
+        .stdout_file = cmd->stdout_file,
+        .append = cmd->append == 0,
+        .in_fd = STDIN_FILENO,
+        .out_fd = STDOUT_FILENO
+    };
+    return b->ext->run(&command);
+}
+
+/** This function loads a builtin from a shared library, which defines it as
+ *  the nash_builtin_name symbol.
+ *
+ *  Returns: 0 if succeded. -1 if the builtin could not be loaded.
+ */
+static int builtin_load(const char *path, const char *name){
+
+    if(builtin_lookup(name) != NULL){
+        fprintf(stderr, "enable: %s: already a builtin\n", name);
+        return -1;
+    }
+
+    void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if(!handle){
+        fprintf(stderr, "enable: %s\n", dlerror());
+        return -1;
+    }
+
+    char symbol[256];
+    snprintf(symbol, sizeof(symbol), "nash_builtin_%s", name);
+    const struct nash_builtin *ext = dlsym(handle, symbol);
+    /* ABI 1 is ABI 2 without the flags */
+    if(ext == NULL || ext->abi < 1 || ext->abi > NASH_BUILTIN_ABI
+            || ext->run == NULL
+            || ext->name == NULL || strcmp(ext->name, name)){
+        if(ext == NULL)
+            fprintf(stderr, "enable: %s: no %s symbol\n", path, symbol);
+        else
+            fprintf(stderr, "enable: %s: %s is not a builtin of ABI %d\n",
+                    path, symbol, NASH_BUILTIN_ABI);
+        dlclose(handle);
+        return -1;
+    }
+
+    struct builtin *b = entries_add(ext->name);
+    if(b == NULL || !(b->path = strdup(path))){
+        if(b != NULL)
+            entries_sz--;
+        dlclose(handle);
+        return -1;
+    }
+    b->ext = ext;
+    b->handle = handle;
+    b->readonly = ext->abi >= 2 && (ext->flags & NASH_BUILTIN_READONLY);
+
+    return table_build();
+}
+
+/** This function removes a loaded builtin and unloads its library.
+ *
+ *  Returns: 0 if succeded. -1 if name is not a loaded builtin.
+ */
+static int builtin_unload(const char *name){
+
+    const struct builtin *found = builtin_lookup(name);
+    if(found == NULL || found->ext == NULL){
+        fprintf(stderr, "enable: %s: not a loaded builtin\n", name);
+        return -1;
+    }
+
+    struct builtin *b = &entries[found - entries];
+    dlclose(b->handle);
+    free(b->path);
+    memmove(b, b + 1, (entries + entries_sz - b - 1) * sizeof(struct builtin));
+    entries_sz--;
+
+    return table_build();
+}
+
+/** This function handles the enable builtin.
+ *
+ *      enable                      prints the builtins
+ *      enable -f lib.so name...    loads builtins from a shared library
+ *      enable -d name...           removes loaded builtins
+ *
+ *  -args: command entered after being expanded.
+ *
+ *  Returns: 0 if succeded. -1 if a builtin could not be loaded or removed.
+ */
+int builtins_enable(char **args){
+
+    if(args[1] == NULL){
+        for(size_t i = 0; i < entries_sz; i++){
+            if(entries[i].ext == NULL){
+                printf("enable %s\n", entries[i].name);
+                continue;
+            }
+            printf("enable -f %s %s", entries[i].path, entries[i].name);
+            if(entries[i].ext->usage != NULL)
+                printf("\t# %s", entries[i].ext->usage);
+            printf("\n");
+        }
+        return 0;
+    }
+
+    int ret = 0;
+    if(!strcmp(args[1], "-f") && args[2] != NULL && args[3] != NULL){
+        for(int i = 3; args[i] != NULL; i++){
+            if(builtin_load(args[2], args[i]) == -1)
+                ret = -1;
+        }
+        return ret;
+    }
+
+    if(!strcmp(args[1], "-d") && args[2] != NULL){
+        for(int i = 2; args[i] != NULL; i++){
+            if(builtin_unload(args[i]) == -1)
+                ret = -1;
+        }
+        return ret;
+    }
+
+    fprintf(stderr, "usage: enable [-f lib.so name... | -d name...]\n");
+    return -1;
+}
@@ -0,0 +1,36 @@
+/**@file
+ *  Header file which contains the dispatch table of the builtins, and the
+ *  builtins loaded from shared libraries.
+ */
+#ifndef _BUILTINS_H_
+#define _BUILTINS_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "parse.h"
+
+/** This struct holds a builtin of the shell itself.
+ *
+ *  -name: name of the builtin.
+ *  -run: runs the builtin with its arguments, NULL terminated, and returns its
+ *   exit code.
+ *  -readonly: the builtin does not change the state of the shell, so it may
+ *   run in the shell when it leads a pipeline.
+ *
+ */
+struct builtin_def {
+    const char *name;
+    int (*run)(char **);
+    bool readonly;
+};
+
+struct builtin;
+
+void builtins_init(const struct builtin_def *, size_t);
+void builtins_destroy(void);
+const struct builtin *builtin_lookup(const char *);
+bool builtin_readonly(const struct builtin *);
+int builtin_run(const struct builtin *, const struct command_line *);
+int builtins_enable(char **);
+#endif
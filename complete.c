@@ -0,0 +1,551 @@
+/**@file
+ *  This file handles the completion of the line being edited, for readline and
+ *  for the built-in editor alike: command names, the arguments of commands with
+ *  a completion spec (see compspec.c) and file names.
+ *
+ *  File names are completed from a cache of the directories. Directories are
+ *  read with
+ *  getdents64 in large batches and the listing is cached until the mtime of
+ *  the directory changes. Reading stops as soon as enough matches are found,
+ *  and the next Tab in the same directory continues from where it stopped, so
+ *  the cost of a Tab does not depend on the size of the directory.
+ */
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "complete.h"
+#include "compspec.h"
+#include "history.h"
+#include "stats.h"
+#include "util.h"
+#include "logger.h"
+
+#define DIR_CACHE_SLOTS 8
+#define DENTS_BUF_SZ (256 * 1024)
+#define DEFAULT_MATCH_CAP 1000
+
+static const char *const builtins[] = {"cd", "history", "exit", "jobs",
+    "limit", "nashstat", "alias", "unalias", "pushd", "popd", "dirs", "enable",
+    "snapshot", "restore"};
+
+/** This struct holds the cached listing of a directory.
+ *
+ *  -path: the directory.
+ *  -mtime: mtime of the directory when the listing was started.
+ *  -fd: descriptor used to continue the listing, -1 once it is complete.
+ *  -names: names of the entries, each one terminated by a NUL.
+ *  -names_sz, names_cap: used and allocated bytes of names.
+ *  -offsets: offset of each entry in names.
+ *  -types: d_type of each entry.
+ *  -total, limit: used and allocated entries of offsets and types.
+ *
+ */
+struct dir_cache {
+    char *path;
+    struct timespec mtime;
+    int fd;
+    char *names;
+    size_t names_sz;
+    size_t names_cap;
+    size_t *offsets;
+    unsigned char *types;
+    size_t total;
+    size_t limit;
+};
+
+static struct dir_cache cache[DIR_CACHE_SLOTS];
+static unsigned int next_slot = 0;
+
+/** This function frees a cache entry.
+ *
+ */
+static void cache_clear(struct dir_cache *entry){
+
+    if(entry->fd != -1)
+        close(entry->fd);
+
+    free(entry->path);
+    free(entry->names);
+    free(entry->offsets);
+    free(entry->types);
+    memset(entry, 0, sizeof(struct dir_cache));
+    entry->fd = -1;
+}
+
+/** This function frees every cached listing.
+ *
+ */
+void complete_destroy(void){
+
+    for(int i = 0; i < DIR_CACHE_SLOTS; i++){
+        if(cache[i].path != NULL)
+            cache_clear(&cache[i]);
+    }
+}
+
+/** This function returns the cached listing of a directory. A listing whose
+ *  directory changed since it was started is thrown away; in that case, or if
+ *  the directory is not cached, a new listing is started in the oldest slot.
+ *
+ *  -path: the directory.
+ *
+ *  Returns: the cache entry, NULL if the directory can't be opened.
+ */
+static struct dir_cache *cache_lookup(const char *path){
+
+    struct stat st;
+    if(stat(path, &st) == -1 || !S_ISDIR(st.st_mode))
+        return NULL;
+
+    for(int i = 0; i < DIR_CACHE_SLOTS; i++){
+        if(cache[i].path == NULL || strcmp(cache[i].path, path))
+            continue;
+
+        if(cache[i].mtime.tv_sec == st.st_mtim.tv_sec
+                && cache[i].mtime.tv_nsec == st.st_mtim.tv_nsec){
+            stats_inc(STAT_DIR_CACHE_HITS);
+            return &cache[i];
+        }
+
+        LOG("Directory %s changed, dropping its listing\n", path);
+        cache_clear(&cache[i]);
+    }
+
+    stats_inc(STAT_DIR_CACHE_MISSES);
+    struct dir_cache *entry = &cache[next_slot];
+    next_slot = (next_slot + 1) % DIR_CACHE_SLOTS;
+    if(entry->path != NULL)
+        cache_clear(entry);
+
+    entry->fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(entry->fd == -1)
+        return NULL;
+
+    entry->path = strdup(path);
+    if(!entry->path){
+        perror("strdup");
+        cache_clear(entry);
+        return NULL;
+    }
+    entry->mtime = st.st_mtim;
+    return entry;
+}
+
+/** This function appends an entry to a cached listing.
+ *
+ *  Returns: 0 if succeded. -1 if memory could not be allocated.
+ */
+static int cache_append(struct dir_cache *entry, const char *name,
+        unsigned char type){
+
+    size_t name_sz = strlen(name) + 1;
+    if(entry->names_sz + name_sz > entry->names_cap){
+        size_t cap = entry->names_cap ? entry->names_cap * 2 : 65536;
+        while(cap < entry->names_sz + name_sz)
+            cap *= 2;
+
+        char *temp = realloc(entry->names, cap);
+        if(!temp){
+            perror("realloc");
+            return -1;
+        }
+        entry->names = temp;
+        entry->names_cap = cap;
+    }
+
+    if(entry->total == entry->limit){
+        size_t limit = entry->limit ? entry->limit * 2 : 1024;
+        size_t *offsets = realloc(entry->offsets, limit * sizeof(size_t));
+        if(offsets)
+            entry->offsets = offsets;
+
+        unsigned char *types = realloc(entry->types, limit);
+        if(types)
+            entry->types = types;
+
+        if(!offsets || !types){
+            perror("realloc");
+            return -1;
+        }
+        entry->limit = limit;
+    }
+
+    memcpy(entry->names + entry->names_sz, name, name_sz);
+    entry->offsets[entry->total] = entry->names_sz;
+    entry->types[entry->total] = type;
+    entry->names_sz += name_sz;
+    entry->total += 1;
+    return 0;
+}
+
+/** This function checks if a directory entry completes the prefix. Hidden
+ *  files only match a prefix starting with a dot. d_type is enough to tell
+ *  directories apart, except for symlinks and file systems which don't fill
+ *  it, which are treated as possible directories.
+ *
+ */
+static bool entry_matches(const char *name, unsigned char type,
+        const char *prefix, size_t prefix_sz, bool dirs_only){
+
+    if(*name == '.' && *prefix != '.')
+        return false;
+
+    if(!strcmp(name, ".") || !strcmp(name, ".."))
+        return false;
+
+    if(dirs_only && type != DT_DIR && type != DT_LNK && type != DT_UNKNOWN)
+        return false;
+
+    return !strncmp(name, prefix, prefix_sz);
+}
+
+/** This function adds a match to the list of matches. The match keeps the
+ *  directory part typed by the user.
+ *
+ *  Returns: 0 if succeded. -1 if memory could not be allocated.
+ */
+static int add_match(char ***matches, size_t *matches_sz, const char *dir,
+        size_t dir_sz, const char *name){
+
+    char *match = malloc(dir_sz + strlen(name) + 1);
+    if(!match){
+        perror("malloc");
+        return -1;
+    }
+    memcpy(match, dir, dir_sz);
+    strcpy(match + dir_sz, name);
+
+    char **temp = realloc(*matches, (*matches_sz + 2) * sizeof(char *));
+    if(!temp){
+        perror("realloc");
+        free(match);
+        return -1;
+    }
+    *matches = temp;
+    (*matches)[(*matches_sz)++] = match;
+    (*matches)[*matches_sz] = NULL;
+    return 0;
+}
+
+/** This function returns the maximum number of matches returned by one
+ *  completion. It can be changed with NASH_COMPLETE_MAX.
+ *
+ */
+static size_t match_cap(void){
+
+    char *env = getenv("NASH_COMPLETE_MAX");
+    if(env != NULL && atol(env) > 0)
+        return atol(env);
+
+    return DEFAULT_MATCH_CAP;
+}
+
+/** This function completes a file name. The cached part of the listing is
+ *  searched first; if the listing is not complete yet, it is continued with
+ *  getdents64 until enough matches are found or the directory ends.
+ *
+ *  -text: the word being completed, e.g. "src/ma" or "~/.ba".
+ *  -dirs_only: only complete directories (for cd).
+ *  -matches_sz: set to the number of matches.
+ *
+ *  Returns: a NULL terminated list of matches, NULL if there is none. The list
+ *  and the matches have to be freed by the caller.
+ */
+char **complete_files(const char *text, bool dirs_only, size_t *matches_sz){
+
+    char path[4096];
+    const char *slash = strrchr(text, '/');
+    const char *prefix = slash ? slash + 1 : text;
+    size_t dir_sz = slash ? (size_t) (slash - text) + 1 : 0;
+
+    if(slash == NULL){
+        strcpy(path, ".");
+    } else if(*text == '~' && (text[1] == '/')){
+        snprintf(path, sizeof(path), "%s%.*s", getpwd(), (int) dir_sz - 1,
+                text + 1);
+    } else {
+        snprintf(path, sizeof(path), "%.*s", (int) dir_sz, text);
+    }
+
+    *matches_sz = 0;
+    struct dir_cache *entry = cache_lookup(path);
+    if(entry == NULL)
+        return NULL;
+
+    char **matches = NULL;
+    size_t prefix_sz = strlen(prefix);
+    size_t cap = match_cap();
+
+    for(size_t i = 0; i < entry->total && *matches_sz < cap; i++){
+        char *name = entry->names + entry->offsets[i];
+        if(entry_matches(name, entry->types[i], prefix, prefix_sz, dirs_only)
+                && add_match(&matches, matches_sz, text, dir_sz, name) == -1)
+            return matches;
+    }
+
+    if(entry->fd == -1 || *matches_sz >= cap)
+        return matches;
+
+    char *buf = malloc(DENTS_BUF_SZ);
+    if(!buf){
+        perror("malloc");
+        return matches;
+    }
+
+    ssize_t read_sz;
+    while(*matches_sz < cap
+            && (read_sz = getdents64(entry->fd, buf, DENTS_BUF_SZ)) > 0){
+
+        for(ssize_t pos = 0; pos < read_sz;){
+            struct dirent64 *dent = (struct dirent64 *) (buf + pos);
+            pos += dent->d_reclen;
+
+            if(cache_append(entry, dent->d_name, dent->d_type) == -1)
+                break;
+
+            if(*matches_sz < cap
+                    && entry_matches(dent->d_name, dent->d_type, prefix,
+                        prefix_sz, dirs_only))
+                add_match(&matches, matches_sz, text, dir_sz, dent->d_name);
+        }
+    }
+    free(buf);
+
+    /* The listing is complete, the descriptor is not needed anymore */
+    if(*matches_sz < cap){
+        close(entry->fd);
+        entry->fd = -1;
+    }
+
+    return matches;
+}
+
+/** This struct is used to rank the matches of the command completion.
+ *
+ *  -name: the match.
+ *  -score: frecency of the match in the history.
+ *
+ */
+struct ranked_match {
+    char *name;
+    double score;
+};
+
+/** This function compares two matches: higher frecency first, then by name so
+ *  that duplicates found in several PATH directories stay adjacent.
+ *
+ */
+static int compare_matches(const void *a, const void *b){
+
+    const struct ranked_match *m1 = a;
+    const struct ranked_match *m2 = b;
+
+    if(m1->score != m2->score)
+        return m1->score < m2->score ? 1 : -1;
+
+    return strcmp(m1->name, m2->name);
+}
+
+/** This function sorts the completion matches by the frecency of the commands
+ *  in the history, so the most likely commands are listed first. The scores
+ *  are looked up once per match.
+ *
+ */
+static void rank_matches(char **matches, size_t matches_sz){
+
+    struct ranked_match *ranked = malloc(matches_sz * sizeof(struct ranked_match));
+    if(!ranked){
+        perror("malloc");
+        return;
+    }
+
+    for(size_t i = 0; i < matches_sz; i++){
+        ranked[i].name = matches[i];
+        ranked[i].score = hist_frecency(matches[i]);
+    }
+
+    qsort(ranked, matches_sz, sizeof(struct ranked_match), compare_matches);
+
+    for(size_t i = 0; i < matches_sz; i++)
+        matches[i] = ranked[i].name;
+
+    free(ranked);
+}
+
+/** This function completes a command name, from the directories of PATH and
+ *  the builtins.
+ *
+ *  -text: the word being completed.
+ *  -matches_sz: set to the number of matches.
+ *
+ *  Returns: a NULL terminated list of matches, NULL if there is none.
+ */
+static char **complete_commands(const char *text, size_t *matches_sz){
+
+    char **matches = NULL;
+    size_t text_sz = strlen(text);
+    *matches_sz = 0;
+
+    const char *path = getenv("PATH");
+    char *dirs = strdup(path != NULL ? path : "");
+    if(!dirs){
+        perror("strdup");
+        return NULL;
+    }
+
+    char *next = dirs;
+    char *dir;
+    while((dir = next_token(&next, ":")) != NULL){
+
+        DIR *d = opendir(dir);
+        if(d == NULL)
+            continue;
+
+        struct dirent *entry;
+        while((entry = readdir(d)) != NULL){
+            if(!strncmp(entry->d_name, text, text_sz)
+                    && add_match(&matches, matches_sz, "", 0,
+                        entry->d_name) == -1)
+                break;
+        }
+        closedir(d);
+    }
+    free(dirs);
+
+    for(size_t i = 0; i < sizeof(builtins) / sizeof(*builtins); i++){
+        if(!strncmp(builtins[i], text, text_sz))
+            add_match(&matches, matches_sz, "", 0, builtins[i]);
+    }
+
+    return matches;
+}
+
+/** This function checks if the word starting at start is a command name, i.e.
+ *  it is the first word of the line or it follows a pipe.
+ *
+ */
+static bool command_position(const char *line, int start){
+
+    int i = start - 1;
+    while(i >= 0 && (line[i] == ' ' || line[i] == '\t'))
+        i--;
+
+    return i < 0 || line[i] == '|';
+}
+
+/** This function puts the longest common prefix of the matches in front of
+ *  them, the way readline lists completions: a single match is alone, without
+ *  a prefix.
+ *
+ *  -matches: the matches, NULL terminated, freed if there is none.
+ *  -matches_sz: number of matches.
+ *
+ *  Returns: the list, NULL if there is no match.
+ */
+static char **add_prefix(char **matches, size_t matches_sz){
+
+    if(matches_sz == 0){
+        free(matches);
+        return NULL;
+    }
+    if(matches_sz == 1)
+        return matches;
+
+    size_t prefix_sz = strlen(matches[0]);
+    for(size_t i = 1; i < matches_sz; i++){
+        size_t j = 0;
+        while(j < prefix_sz && matches[i][j] == matches[0][j])
+            j++;
+        prefix_sz = j;
+    }
+
+    char *prefix = strndup(matches[0], prefix_sz);
+    char **temp = prefix != NULL
+        ? realloc(matches, (matches_sz + 2) * sizeof(char *)) : NULL;
+    if(!temp){
+        perror("realloc");
+        free(prefix);
+        for(size_t i = 0; i < matches_sz; i++)
+            free(matches[i]);
+        free(matches);
+        return NULL;
+    }
+
+    memmove(temp + 1, temp, (matches_sz + 1) * sizeof(char *));
+    temp[0] = prefix;
+    return temp;
+}
+
+/** This function completes the word being edited. A word in the position of a
+ *  command completes a command name, ranked by frecency; the arguments of a
+ *  command with a completion spec complete from the spec, followed by the file
+ *  names if the spec offers them; anything else completes a file name, or a
+ *  directory for cd.
+ *
+ *  -line: the line being edited.
+ *  -text: the word being completed.
+ *  -start: start of the word in line.
+ *  -kind: set to COMPLETE_COMMANDS, COMPLETE_WORDS or COMPLETE_FILES, the
+ *   last one when the matches include file names.
+ *
+ *  Returns: the matches, NULL terminated, the first one being their longest
+ *  common prefix unless there is a single match. NULL if there is none. The
+ *  list and the matches have to be freed by the caller.
+ */
+char **complete_line(const char *line, const char *text, int start,
+        int *kind){
+
+    uint64_t started = stats_now();
+    stats_inc(STAT_COMPLETIONS);
+
+    char **matches = NULL;
+    size_t matches_sz = 0;
+    *kind = COMPLETE_COMMANDS;
+
+    bool command = command_position(line, start);
+    if(command && (matches = complete_commands(text, &matches_sz)) != NULL)
+        rank_matches(matches, matches_sz);
+
+    int files = COMPSPEC_FILES;
+    if(!command && (matches = compspec_complete(line, start, text,
+                    &files)) != NULL){
+        while(matches[matches_sz] != NULL)
+            matches_sz++;
+        *kind = COMPLETE_WORDS;
+    }
+
+    if(matches == NULL || (*kind == COMPLETE_WORDS
+                && files != COMPSPEC_NO_FILES)){
+
+        while(*line == ' ' || *line == '\t')
+            line++;
+        bool dirs_only = files == COMPSPEC_DIRS || !strncmp(line, "cd ", 3);
+
+        size_t names_sz;
+        char **names = complete_files(text, dirs_only, &names_sz);
+        char **temp = names_sz > 0 ? realloc(matches,
+                (matches_sz + names_sz + 1) * sizeof(char *)) : matches;
+        if(temp == NULL && names_sz > 0){
+            perror("realloc");
+            for(size_t i = 0; i < names_sz; i++)
+                free(names[i]);
+        } else if(names_sz > 0){
+            memcpy(temp + matches_sz, names, (names_sz + 1) * sizeof(char *));
+            matches = temp;
+            matches_sz += names_sz;
+        }
+        free(names);
+        *kind = COMPLETE_FILES;
+    }
+
+    matches = add_prefix(matches, matches_sz);
+    stats_time(TIMER_COMPLETION, stats_now() - started);
+    return matches;
+}
@@ -0,0 +1,19 @@
+/**@file
+ *  Header file which contains the functions for completing the line being
+ *  edited and file names.
+ */
+#ifndef _COMPLETE_H_
+#define _COMPLETE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* What complete_line() completed */
+#define COMPLETE_COMMANDS 0
+#define COMPLETE_WORDS 1
+#define COMPLETE_FILES 2
+
+char **complete_files(const char *, bool, size_t *);
+char **complete_line(const char *, const char *, int, int *);
+void complete_destroy(void);
+#endif
@@ -0,0 +1,674 @@
+/**@file
+ *  This file completes the arguments of commands from completion specs. The
+ *  spec of a command is the file named after it in ~/.nash_completions (or
+ *  the directory in NASH_COMPLETIONS):
+ *
+ *      # completion of git
+ *      words add commit push checkout remote
+ *      flags --version --help
+ *      [checkout]
+ *      run 500 git branch --format='%(refname:short)'
+ *      files
+ *      [remote add]
+ *      flags -f --tags
+ *
+ *  A [section] holds the completions after its subcommands, the lines before
+ *  the first one those of the command itself. `words` and `flags` list words
+ *  (the flags are only offered for a word starting with -), `run [ms] cmd`
+ *  offers each line printed by cmd and `files` or `dirs` adds the file or
+ *  directory names.
+ *
+ *  A spec is read on the first Tab after its command and cached until its
+ *  file changes. The commands of `run` are killed after their timeout (1s by
+ *  default) and their output is kept for the rest of the session, so a slow
+ *  tool only makes a single Tab wait, once.
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "compspec.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "util.h"
+#include "logger.h"
+
+/* Timeout of a run source which doesn't set one, in milliseconds */
+#define SOURCE_TIMEOUT 1000
+/* Output kept from a run source */
+#define SOURCE_MAX (64 * 1024)
+#define SPEC_WORDS 256
+
+enum item_kind { ITEM_WORD, ITEM_FLAG, ITEM_RUN };
+
+/** This struct holds an item of a section.
+ *
+ *  -kind: a word, a flag, or a command whose output lines are offered.
+ *  -text: the word, the flag or the command.
+ *  -timeout: timeout of the command, in milliseconds.
+ *
+ */
+struct spec_item {
+    enum item_kind kind;
+    char *text;
+    int timeout;
+};
+
+/** This struct holds a section of a spec.
+ *
+ *  -path: the subcommands it follows, separated by a space, "" for the
+ *   command itself.
+ *  -items, items_sz: its words, flags and commands.
+ *  -files: COMPSPEC_FILES or COMPSPEC_DIRS if file names are offered too.
+ *
+ */
+struct spec_section {
+    char *path;
+    struct spec_item *items;
+    size_t items_sz;
+    int files;
+};
+
+/** This struct holds the spec of a command.
+ *
+ *  -command: the command.
+ *  -mtime: mtime of the file the spec was read from.
+ *  -found: the command has a spec file.
+ *  -sections, sections_sz: its sections, the first one being the command's.
+ *
+ */
+struct compspec {
+    char *command;
+    struct timespec mtime;
+    bool found;
+    struct spec_section *sections;
+    size_t sections_sz;
+};
+
+/** This struct holds the memoised output of a run source.
+ *
+ *  -command: the command.
+ *  -lines, lines_sz: the lines it printed.
+ *
+ */
+struct source {
+    char *command;
+    char **lines;
+    size_t lines_sz;
+};
+
+static struct compspec *specs = NULL;
+static size_t specs_sz = 0;
+static struct source *sources = NULL;
+static size_t sources_sz = 0;
+
+/** This function frees the sections of a spec.
+ *
+ */
+static void spec_clear(struct compspec *spec){
+
+    for(size_t i = 0; i < spec->sections_sz; i++){
+        for(size_t j = 0; j < spec->sections[i].items_sz; j++)
+            free(spec->sections[i].items[j].text);
+        free(spec->sections[i].items);
+        free(spec->sections[i].path);
+    }
+    free(spec->sections);
+    spec->sections = NULL;
+    spec->sections_sz = 0;
+    spec->found = false;
+}
+
+/** This function frees the cached specs and the output of the run sources.
+ *
+ */
+void compspec_destroy(void){
+
+    for(size_t i = 0; i < specs_sz; i++){
+        spec_clear(&specs[i]);
+        free(specs[i].command);
+    }
+    free(specs);
+    specs = NULL;
+    specs_sz = 0;
+
+    for(size_t i = 0; i < sources_sz; i++){
+        for(size_t j = 0; j < sources[i].lines_sz; j++)
+            free(sources[i].lines[j]);
+        free(sources[i].lines);
+        free(sources[i].command);
+    }
+    free(sources);
+    sources = NULL;
+    sources_sz = 0;
+}
+
+/** This helper function appends a section to a spec.
+ *
+ *  Returns: the section, NULL if memory could not be allocated.
+ */
+static struct spec_section *section_add(struct compspec *spec,
+        const char *path){
+
+    struct spec_section *temp = realloc(spec->sections,
+            (spec->sections_sz + 1) * sizeof(struct spec_section));
+    if(!temp){
+        perror("realloc");
+        return NULL;
+    }
+    spec->sections = temp;
+
+    struct spec_section *section = &spec->sections[spec->sections_sz];
+    memset(section, 0, sizeof(struct spec_section));
+    if(!(section->path = strdup(path))){
+        perror("strdup");
+        return NULL;
+    }
+    spec->sections_sz++;
+    return section;
+}
+
+/** This helper function appends an item to a section.
+ *
+ *  Returns: 0 if succeded. -1 if memory could not be allocated.
+ */
+static int item_add(struct spec_section *section, enum item_kind kind,
+        const char *text, int timeout){
+
+    struct spec_item *temp = realloc(section->items,
+            (section->items_sz + 1) * sizeof(struct spec_item));
+    if(!temp){
+        perror("realloc");
+        return -1;
+    }
+    section->items = temp;
+
+    struct spec_item *item = &section->items[section->items_sz];
+    item->kind = kind;
+    item->timeout = timeout;
+    if(!(item->text = strdup(text))){
+        perror("strdup");
+        return -1;
+    }
+    section->items_sz++;
+    return 0;
+}
+
+/** This helper function normalizes the path of a section: the subcommands
+ *  separated by a single space.
+ *
+ */
+static void path_normalize(char *path){
+
+    char *out = path;
+    for(char *word, *next = path; (word = next_token(&next, " \t")) != NULL;){
+        if(out != path)
+            *out++ = ' ';
+        memmove(out, word, strlen(word));
+        out += strlen(word);
+    }
+    *out = '\0';
+}
+
+/** This function reads a spec file.
+ *
+ *  -spec: the spec, empty.
+ *  -file: the file.
+ *
+ *  Returns: 0 if succeded. -1 if the file could not be read.
+ */
+static int spec_read(struct compspec *spec, FILE *file){
+
+    struct spec_section *section = section_add(spec, "");
+    if(section == NULL)
+        return -1;
+
+    char *line = NULL;
+    size_t line_sz = 0;
+    int line_no = 0;
+    while(getline(&line, &line_sz, file) != -1){
+
+        line_no++;
+        line[strcspn(line, "\r\n")] = '\0';
+        char *rest = line + strspn(line, " \t");
+        if(*rest == '\0' || *rest == '#')
+            continue;
+
+        if(*rest == '['){
+            char *end = strchr(rest, ']');
+            if(end == NULL){
+                LOG("%s:%d: missing ]\n", spec->command, line_no);
+                continue;
+            }
+            *end = '\0';
+            path_normalize(++rest);
+            if((section = section_add(spec, rest)) == NULL)
+                break;
+            continue;
+        }
+
+        char *keyword = next_token(&rest, " \t");
+        if(rest != NULL)
+            rest += strspn(rest, " \t");
+
+        if(!strcmp(keyword, "files")){
+            section->files = COMPSPEC_FILES;
+        } else if(!strcmp(keyword, "dirs")){
+            section->files = COMPSPEC_DIRS;
+        } else if(!strcmp(keyword, "words") || !strcmp(keyword, "flags")){
+            enum item_kind kind = *keyword == 'w' ? ITEM_WORD : ITEM_FLAG;
+            char *word;
+            while((word = next_token(&rest, " \t")) != NULL){
+                if(*word != '\0' && item_add(section, kind, word, 0) == -1)
+                    break;
+            }
+        } else if(!strcmp(keyword, "run") && rest != NULL && *rest != '\0'){
+            int timeout = SOURCE_TIMEOUT;
+            char *end;
+            long ms = strtol(rest, &end, 10);
+            if(end != rest && (*end == ' ' || *end == '\t') && ms > 0){
+                timeout = ms;
+                rest = end + strspn(end, " \t");
+            }
+            item_add(section, ITEM_RUN, rest, timeout);
+        } else {
+            LOG("%s:%d: unknown line\n", spec->command, line_no);
+        }
+    }
+    free(line);
+
+    spec->found = true;
+    return 0;
+}
+
+/** This function returns the spec of a command, reading its file if it is not
+ *  cached or changed since it was read.
+ *
+ *  Returns: the spec, NULL if the command has none.
+ */
+static struct compspec *spec_get(const char *command){
+
+    if(*command == '\0' || *command == '.' || strchr(command, '/'))
+        return NULL;
+
+    char path[4096];
+    char *dir = getenv("NASH_COMPLETIONS");
+    if(dir != NULL)
+        snprintf(path, sizeof(path), "%s/%s", dir, command);
+    else
+        snprintf(path, sizeof(path), "%s/.nash_completions/%s", getpwd(),
+                command);
+
+    struct stat st;
+    bool exists = stat(path, &st) == 0 && S_ISREG(st.st_mode);
+
+    struct compspec *spec = NULL;
+    for(size_t i = 0; i < specs_sz; i++){
+        if(!strcmp(specs[i].command, command)){
+            spec = &specs[i];
+            break;
+        }
+    }
+
+    if(spec != NULL && spec->found == exists && (!exists
+                || (spec->mtime.tv_sec == st.st_mtim.tv_sec
+                    && spec->mtime.tv_nsec == st.st_mtim.tv_nsec)))
+        return exists ? spec : NULL;
+
+    /* Commands without a spec are cached too, so that they cost a stat */
+    if(spec == NULL){
+        struct compspec *temp = realloc(specs,
+                (specs_sz + 1) * sizeof(struct compspec));
+        if(!temp){
+            perror("realloc");
+            return NULL;
+        }
+        specs = temp;
+        spec = &specs[specs_sz];
+        memset(spec, 0, sizeof(struct compspec));
+        if(!(spec->command = strdup(command))){
+            perror("strdup");
+            return NULL;
+        }
+        specs_sz++;
+    }
+
+    spec_clear(spec);
+    if(!exists)
+        return NULL;
+
+    LOG("Reading the completion spec %s\n", path);
+    spec->mtime = st.st_mtim;
+    FILE *file = fopen(path, "re");
+    if(file == NULL){
+        spec->found = true;
+        return spec;
+    }
+    spec_read(spec, file);
+    fclose(file);
+    return spec;
+}
+
+/** This function runs the command of a run source and keeps the lines it
+ *  prints. The command is killed, with the processes it started, once the
+ *  timeout is reached; the lines printed so far are kept.
+ *
+ *  -source: the source, command set.
+ *  -timeout: timeout in milliseconds.
+ *
+ */
+static void source_run(struct source *source, int timeout){
+
+    int fd[2];
+    if(pipe2(fd, O_CLOEXEC) == -1){
+        perror("pipe");
+        return;
+    }
+
+    /* The shell's SIGCHLD handler must not reap the command */
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &old);
+
+    pid_t pid = fork();
+    if(pid == 0){
+
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        signal(SIGINT, SIG_DFL);
+        setpgid(0, 0);
+
+        int null = open("/dev/null", O_RDWR);
+        if(null == -1 || dup2(null, STDIN_FILENO) == -1
+                || dup2(fd[1], STDOUT_FILENO) == -1
+                || dup2(null, STDERR_FILENO) == -1)
+            _exit(EXIT_FAILURE);
+        close_inherited_fds(NULL, 0);
+
+        execl("/bin/sh", "sh", "-c", source->command, (char *) NULL);
+        _exit(127);
+
+    } else if(pid == -1){
+
+        perror("fork");
+        close(fd[0]);
+        close(fd[1]);
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        return;
+    }
+    close(fd[1]);
+
+    char *buf = malloc(SOURCE_MAX + 1);
+    size_t buf_sz = 0;
+    uint64_t deadline = stats_now() + (uint64_t) timeout * 1000000;
+    bool timed_out = false;
+    while(buf != NULL && buf_sz < SOURCE_MAX){
+
+        uint64_t now = stats_now();
+        struct pollfd pfd = { .fd = fd[0], .events = POLLIN };
+        if(now >= deadline
+                || poll(&pfd, 1, (deadline - now + 999999) / 1000000) == 0){
+            timed_out = true;
+            break;
+        }
+
+        ssize_t bytes = read(fd[0], buf + buf_sz, SOURCE_MAX - buf_sz);
+        if(bytes <= 0)
+            break;
+        buf_sz += bytes;
+    }
+    close(fd[0]);
+
+    kill(-pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    sigprocmask(SIG_SETMASK, &old, NULL);
+
+    if(timed_out)
+        LOG("Completion source '%s' timed out after %dms\n", source->command,
+                timeout);
+
+    if(buf == NULL){
+        perror("malloc");
+        return;
+    }
+
+    /* The last line is dropped if it was cut */
+    buf[buf_sz] = '\0';
+    if(buf_sz > 0 && buf[buf_sz - 1] != '\n'
+            && (timed_out || buf_sz == SOURCE_MAX)){
+        char *last = strrchr(buf, '\n');
+        *(last != NULL ? last : buf) = '\0';
+    }
+
+    size_t limit = 0;
+    for(char *word, *next = buf; (word = next_token(&next, "\n")) != NULL;){
+        word[strcspn(word, "\r")] = '\0';
+        if(*word == '\0')
+            continue;
+
+        if(source->lines_sz == limit){
+            limit = limit ? limit * 2 : 16;
+            char **temp = realloc(source->lines, limit * sizeof(char *));
+            if(!temp){
+                perror("realloc");
+                break;
+            }
+            source->lines = temp;
+        }
+        if((source->lines[source->lines_sz] = strdup(word)) == NULL)
+            break;
+        source->lines_sz++;
+    }
+    free(buf);
+}
+
+/** This function returns the output of a run source, running its command the
+ *  first time only.
+ *
+ *  Returns: the source, NULL if memory could not be allocated.
+ */
+static struct source *source_get(const char *command, int timeout){
+
+    for(size_t i = 0; i < sources_sz; i++){
+        if(!strcmp(sources[i].command, command))
+            return &sources[i];
+    }
+
+    struct source *temp = realloc(sources,
+            (sources_sz + 1) * sizeof(struct source));
+    if(!temp){
+        perror("realloc");
+        return NULL;
+    }
+    sources = temp;
+
+    struct source *source = &sources[sources_sz];
+    memset(source, 0, sizeof(struct source));
+    if(!(source->command = strdup(command))){
+        perror("strdup");
+        return NULL;
+    }
+    sources_sz++;
+
+    uint64_t start = stats_now();
+    source_run(source, timeout);
+    LOG("Completion source '%s': %zu lines in %.1fms\n", command,
+            source->lines_sz, (stats_now() - start) / 1e6);
+    return source;
+}
+
+/** This helper function appends a copy of a match to a list.
+ *
+ *  Returns: 0 if succeded. -1 if memory could not be allocated.
+ */
+static int match_add(char ***matches, size_t *matches_sz, const char *match){
+
+    char **temp = realloc(*matches, (*matches_sz + 2) * sizeof(char *));
+    if(!temp){
+        perror("realloc");
+        return -1;
+    }
+    *matches = temp;
+
+    if(((*matches)[*matches_sz] = strdup(match)) == NULL){
+        perror("strdup");
+        return -1;
+    }
+    (*matches)[++*matches_sz] = NULL;
+    return 0;
+}
+
+/** This function completes an argument from the spec of its command. The
+ *  subcommands before it, e.g. `remote add` in `git remote add -`, pick the
+ *  section of the spec.
+ *
+ *  -line: the line being edited.
+ *  -start: start of the argument in line.
+ *  -text: the argument.
+ *  -files: set to COMPSPEC_FILES or COMPSPEC_DIRS if file or directory names
+ *   have to be offered too.
+ *
+ *  Returns: the matches, NULL terminated, which may be none. NULL if the
+ *  command has no spec.
+ */
+char **compspec_complete(const char *line, int start, const char *text,
+        int *files){
+
+    /* The command starts after the last | ; or & */
+    int begin = start;
+    while(begin > 0 && !strchr("|;&", line[begin - 1]))
+        begin--;
+
+    char *words = strndup(line + begin, start - begin);
+    if(!words){
+        perror("strndup");
+        return NULL;
+    }
+
+    char *argv[SPEC_WORDS];
+    int argc = 0;
+    for(char *word, *next = words; argc < SPEC_WORDS
+            && (word = next_token(&next, " \t")) != NULL;){
+        if(*word != '\0')
+            argv[argc++] = word;
+    }
+
+    struct compspec *spec;
+    if(argc == 0 || (spec = spec_get(argv[0])) == NULL){
+        free(words);
+        return NULL;
+    }
+
+    /* The longest path of words, flags left out, which has a section */
+    struct spec_section *section = &spec->sections[0];
+    char path[1024] = "";
+    size_t path_sz = 0;
+    for(int i = 1; i < argc && path_sz < sizeof(path); i++){
+        if(*argv[i] == '-')
+            continue;
+
+        path_sz += snprintf(path + path_sz, sizeof(path) - path_sz, "%s%s",
+                path_sz ? " " : "", argv[i]);
+        for(size_t j = 1; j < spec->sections_sz; j++){
+            if(!strcmp(spec->sections[j].path, path)){
+                section = &spec->sections[j];
+                break;
+            }
+        }
+    }
+    free(words);
+
+    char **matches = calloc(1, sizeof(char *));
+    size_t matches_sz = 0;
+    if(!matches){
+        perror("calloc");
+        return NULL;
+    }
+
+    size_t text_sz = strlen(text);
+    for(size_t i = 0; i < section->items_sz; i++){
+
+        struct spec_item *item = &section->items[i];
+        if(item->kind == ITEM_FLAG && *text != '-')
+            continue;
+
+        if(item->kind != ITEM_RUN){
+            if(!strncmp(item->text, text, text_sz)
+                    && match_add(&matches, &matches_sz, item->text) == -1)
+                break;
+            continue;
+        }
+
+        struct source *source = source_get(item->text, item->timeout);
+        for(size_t j = 0; source != NULL && j < source->lines_sz; j++){
+            if(!strncmp(source->lines[j], text, text_sz)
+                    && match_add(&matches, &matches_sz, source->lines[j]) == -1)
+                break;
+        }
+    }
+
+    *files = section->files;
+    return matches;
+}
+
+/** This function saves the output memoised from the run sources to a
+ *  snapshot, so that a restarted shell does not run them again. The specs are
+ *  not saved, reading them again is cheap.
+ *
+ */
+void compspec_save(struct snapshot *snap){
+
+    snap_u32(snap, sources_sz);
+    for(size_t i = 0; i < sources_sz; i++){
+        snap_str(snap, sources[i].command);
+        snap_u32(snap, sources[i].lines_sz);
+        for(size_t j = 0; j < sources[i].lines_sz; j++)
+            snap_str(snap, sources[i].lines[j]);
+    }
+}
+
+/** This function restores what compspec_save() saved, keeping the output of
+ *  the sources which already ran.
+ *
+ */
+void compspec_load(struct snapshot *snap){
+
+    uint32_t total = snap_get_u32(snap);
+    for(uint32_t i = 0; i < total && !snap->failed; i++){
+
+        struct source source = { .command = snap_get_str(snap) };
+        uint32_t lines_sz = snap_get_u32(snap);
+        if(source.command == NULL || snap->failed
+                || lines_sz > snap->sz - snap->pos
+                || !(source.lines = calloc(lines_sz + 1, sizeof(char *)))){
+            free(source.command);
+            return;
+        }
+        for(; source.lines_sz < lines_sz && !snap->failed; source.lines_sz++)
+            source.lines[source.lines_sz] = snap_get_str(snap);
+
+        bool known = false;
+        for(size_t j = 0; j < sources_sz; j++)
+            known |= !strcmp(sources[j].command, source.command);
+
+        struct source *temp = known ? NULL : realloc(sources,
+                (sources_sz + 1) * sizeof(struct source));
+        if(temp == NULL || snap->failed){
+            for(size_t j = 0; j < source.lines_sz; j++)
+                free(source.lines[j]);
+            free(source.lines);
+            free(source.command);
+            continue;
+        }
+        sources = temp;
+        sources[sources_sz++] = source;
+    }
+}
@@ -0,0 +1,19 @@
+/**@file
+ *  Header file which contains the functions for completing the arguments of
+ *  commands from their completion specs.
+ */
+#ifndef _COMPSPEC_H_
+#define _COMPSPEC_H_
+
+/* What a spec completes besides its own words */
+#define COMPSPEC_NO_FILES 0
+#define COMPSPEC_FILES 1
+#define COMPSPEC_DIRS 2
+
+struct snapshot;
+
+char **compspec_complete(const char *, int, const char *, int *);
+void compspec_destroy(void);
+void compspec_save(struct snapshot *);
+void compspec_load(struct snapshot *);
+#endif
@@ -0,0 +1,646 @@
+/**@file
+ *  This file holds the cd, pushd, popd and dirs builtins, and the frecency
+ *  index of the directories cd went to.
+ *
+ *  Every successful change of directory bumps the score of the new directory,
+ *  which decays with a half-life of DIRS_HALF_LIFE seconds, so it counts how
+ *  often a directory is used, weighted by how recently. `cd -j fragments`
+ *  (or cd to a name which is not a directory) jumps to the directory with the
+ *  best score whose path holds the fragments, in order.
+ *
+ *  The index can be kept in a file shared by the sessions. Every visit is
+ *  appended to it as a single O_APPEND write of `time\tscore\tpath`, so the
+ *  index is updated incrementally and the appends of concurrent sessions never
+ *  interleave. The file is read when it is opened, and compacted to one record
+ *  per directory whenever it grows past DIRS_FILE_MAX bytes and twice its size
+ *  after the last compaction. The compaction reads the file again under an
+ *  exclusive lock, the appends taking a shared one, so that it keeps what the
+ *  other sessions appended.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dirs.h"
+#include "snapshot.h"
+#include "util.h"
+#include "logger.h"
+
+#define DIRS_HALF_LIFE (7 * 24 * 3600.0)
+/* Scores below this are forgotten when the file is compacted */
+#define DIRS_MIN_SCORE 0.01
+#define DIRS_FILE_MAX (256 * 1024)
+/* Number of matches listed by cd -l */
+#define DIRS_LIST 10
+
+/* Scores of the directories, keyed by path */
+static struct frecency dirs_index = { .half_life = DIRS_HALF_LIFE };
+static int dirs_fd = -1;
+/* Size of the index file after the last compaction */
+static off_t dirs_compacted = 0;
+
+/* Directory stack of pushd and popd, the top is the last one */
+static char **stack = NULL;
+static size_t stack_sz = 0;
+static size_t stack_limit = 0;
+
+/** This helper function reads the records of the index file into a table.
+ *
+ *  Returns: the number of bytes read. -1 if the file could not be read.
+ */
+static off_t dirs_read(struct frecency *table){
+
+    FILE *in = fdopen(dup(dirs_fd), "r");
+    if(!in){
+        perror("fdopen");
+        return -1;
+    }
+    /* The offset is shared with dirs_fd, whose appends go to the end */
+    rewind(in);
+
+    char *record = NULL;
+    size_t record_sz = 0;
+    ssize_t read_sz;
+    off_t file_sz = 0;
+    while((read_sz = getline(&record, &record_sz, in)) > 0){
+
+        file_sz += read_sz;
+        if(record[read_sz - 1] != '\n')
+            break;
+        record[read_sz - 1] = '\0';
+
+        char *p;
+        time_t when = strtol(record, &p, 10);
+        double score = strtod(p, &p);
+        if(*p != '\t' || p[1] != '/')
+            continue;
+        frecency_bump(table, p + 1, strlen(p + 1), when, score);
+    }
+    free(record);
+    fclose(in);
+    return file_sz;
+}
+
+/** This function rewrites the index file with one record per directory. The
+ *  file is read again under an exclusive lock, the sessions appending to it
+ *  holding a shared one, so that the records they appended since it was read
+ *  are kept; the index of the session then catches up with them.
+ *
+ */
+static void dirs_compact(void){
+
+    if(flock(dirs_fd, LOCK_EX) == -1){
+        perror("flock");
+        return;
+    }
+
+    struct frecency table = { .half_life = DIRS_HALF_LIFE };
+    FILE *out = NULL;
+    int fd = -1;
+    if(dirs_read(&table) == -1 || (fd = dup(dirs_fd)) == -1
+            || ftruncate(fd, 0) == -1 || !(out = fdopen(fd, "a"))){
+        perror("dirs compact");
+        if(fd != -1)
+            close(fd);
+        frecency_clear(&table);
+        flock(dirs_fd, LOCK_UN);
+        return;
+    }
+
+    time_t now = time(NULL);
+    for(size_t i = 0; i < table.size; i++){
+        struct frecency_entry *entry = &table.entries[i];
+        if(entry->key != NULL
+                && frecency_score(&table, entry, now) >= DIRS_MIN_SCORE)
+            fprintf(out, "%ld\t%.4f\t%s\n", (long) entry->last, entry->score,
+                    entry->key);
+    }
+
+    fflush(out);
+    dirs_compacted = ftello(out);
+    fclose(out);
+    flock(dirs_fd, LOCK_UN);
+
+    frecency_clear(&dirs_index);
+    dirs_index = table;
+}
+
+/** This function opens the index file shared by the sessions and loads it.
+ *
+ *  -path: path of the index file.
+ *
+ *  Returns: 0 if succeded. -1 if the file could not be opened or read.
+ */
+int dirs_open(const char *path){
+
+    dirs_fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if(dirs_fd == -1){
+        perror(path);
+        return -1;
+    }
+
+    off_t file_sz = dirs_read(&dirs_index);
+    if(file_sz == -1){
+        close(dirs_fd);
+        dirs_fd = -1;
+        return -1;
+    }
+
+    dirs_compacted = file_sz;
+    if(file_sz > DIRS_FILE_MAX)
+        dirs_compact();
+    return 0;
+}
+
+/** This function frees the index and the directory stack.
+ *
+ */
+void dirs_destroy(void){
+
+    frecency_clear(&dirs_index);
+
+    for(size_t i = 0; i < stack_sz; i++)
+        free(stack[i]);
+    free(stack);
+    stack = NULL;
+    stack_sz = stack_limit = 0;
+
+    if(dirs_fd != -1){
+        close(dirs_fd);
+        dirs_fd = -1;
+    }
+}
+
+/** This function records a visit to a directory, in the index and in the
+ *  index file if one is open.
+ *
+ */
+static void dirs_visit(const char *path){
+
+    time_t now = time(NULL);
+    frecency_bump(&dirs_index, path, strlen(path), now, 1.0);
+
+    if(dirs_fd == -1)
+        return;
+
+    /* The whole record goes out in one write, like the history */
+    char *record;
+    int record_sz = asprintf(&record, "%ld\t1\t%s\n", (long) now, path);
+    if(record_sz == -1){
+        perror("asprintf");
+        return;
+    }
+    /* Shared with the other appends, exclusive while compacting */
+    if(flock(dirs_fd, LOCK_SH) == -1)
+        perror("flock");
+    if(write(dirs_fd, record, record_sz) != record_sz)
+        perror("dirs write");
+    flock(dirs_fd, LOCK_UN);
+    free(record);
+
+    /* The other sessions make the file grow too */
+    struct stat st;
+    if(fstat(dirs_fd, &st) == 0 && st.st_size > DIRS_FILE_MAX
+            && st.st_size > 2 * dirs_compacted)
+        dirs_compact();
+}
+
+/** This function changes the current directory and keeps PWD and OLDPWD.
+ *
+ *  -path: the directory.
+ *  -print: print the new directory, e.g. when it was found through CDPATH.
+ *
+ *  Returns: 0 if succeded. -1 if the directory could not be changed, errno is
+ *  set.
+ */
+static int change_dir(const char *path, bool print){
+
+    char *old = getcwd(NULL, 0);
+    if(chdir(path) == -1){
+        int err = errno;
+        free(old);
+        errno = err;
+        return -1;
+    }
+
+    char *cwd = getcwd(NULL, 0);
+    if(cwd == NULL){
+        perror("getcwd");
+        free(old);
+        return 0;
+    }
+
+    if(old != NULL)
+        setenv("OLDPWD", old, 1);
+    setenv("PWD", cwd, 1);
+    dirs_visit(cwd);
+
+    if(print)
+        printf("%s\n", cwd);
+
+    free(old);
+    free(cwd);
+    return 0;
+}
+
+/** This helper function checks if the fragments of a jump appear in a path,
+ *  in order and ignoring case.
+ *
+ *  -path: the directory.
+ *  -frags: the fragments, NULL terminated.
+ *  -tail: set to true if the last fragment is in the last component.
+ *
+ */
+static bool dirs_match(const char *path, char *const frags[], bool *tail){
+
+    const char *p = path;
+    const char *last = NULL;
+    for(int i = 0; frags[i] != NULL; i++){
+        if((last = strcasestr(p, frags[i])) == NULL)
+            return false;
+        p = last + strlen(frags[i]);
+    }
+
+    *tail = last != NULL && strchr(last, '/') == NULL
+        && strrchr(path, '/') < last;
+    return true;
+}
+
+/** This helper function finds the best matches of a jump, best first.
+ *  Directories whose last component holds the last fragment come first, then
+ *  the order is the score. The current directory is skipped.
+ *
+ *  -frags: the fragments, NULL terminated.
+ *  -best: set to the matches.
+ *  -max: number of entries of best.
+ *
+ *  Returns: the number of matches.
+ */
+static size_t dirs_find(char *const frags[], struct frecency_entry **best,
+        size_t max){
+
+    char *cwd = getcwd(NULL, 0);
+    time_t now = time(NULL);
+    double keys[max];
+    size_t found = 0;
+
+    for(size_t i = 0; i < dirs_index.size; i++){
+
+        struct frecency_entry *entry = &dirs_index.entries[i];
+        bool tail;
+        if(entry->key == NULL || entry->score == 0
+                || (cwd != NULL && !strcmp(entry->key, cwd))
+                || !dirs_match(entry->key, frags, &tail))
+            continue;
+
+        /* A match in the last component beats any score */
+        double key = frecency_score(&dirs_index, entry, now) + (tail ? 1e9 : 0);
+        size_t j = found < max ? found++ : max;
+        while(j > 0 && keys[j - 1] < key){
+            if(j < max){
+                keys[j] = keys[j - 1];
+                best[j] = best[j - 1];
+            }
+            j--;
+        }
+        if(j < max){
+            keys[j] = key;
+            best[j] = entry;
+        }
+    }
+
+    free(cwd);
+    return found;
+}
+
+/** This function jumps to the best directory matching fragments of its path.
+ *  Directories which no longer exist are dropped from the index on the way.
+ *
+ *  -frags: the fragments, NULL terminated.
+ *
+ *  Returns: 0 if succeded. -1 if no directory matches.
+ */
+static int dirs_jump(char *const frags[]){
+
+    struct frecency_entry *best;
+    while(dirs_find(frags, &best, 1) > 0){
+
+        struct stat st;
+        if(stat(best->key, &st) == 0 && S_ISDIR(st.st_mode)
+                && change_dir(best->key, true) == 0)
+            return 0;
+
+        best->score = 0;
+    }
+
+    fprintf(stderr, "cd: no directory matches");
+    for(int i = 0; frags[i] != NULL; i++)
+        fprintf(stderr, " %s", frags[i]);
+    fprintf(stderr, "\n");
+    return -1;
+}
+
+/** This function lists the best directories matching fragments of their path,
+ *  with their score.
+ *
+ */
+static void dirs_list(char *const frags[]){
+
+    struct frecency_entry *best[DIRS_LIST];
+    size_t found = dirs_find(frags, best, DIRS_LIST);
+    time_t now = time(NULL);
+
+    for(size_t i = 0; i < found && i < DIRS_LIST; i++)
+        printf("%10.2f  %s\n", frecency_score(&dirs_index, best[i], now), best[i]->key);
+}
+
+/** This helper function changes to a directory given to cd or pushd. A
+ *  relative path is looked up in CDPATH first; a name which is not a directory
+ *  is taken for a jump.
+ *
+ *  -path: the directory as given.
+ *
+ *  Returns: 0 if succeded. -1 if the directory could not be changed.
+ */
+static int resolve_cd(const char *path){
+
+    const char *cdpath = getenv("CDPATH");
+    bool relative = *path != '/' && strcmp(path, ".") && strcmp(path, "..")
+        && strncmp(path, "./", 2) && strncmp(path, "../", 3);
+
+    while(relative && cdpath != NULL && *cdpath != '\0'){
+
+        size_t dir_sz = strcspn(cdpath, ":");
+        char *dir;
+        if(asprintf(&dir, "%.*s/%s", (int) dir_sz, dir_sz ? cdpath : ".",
+                    path) == -1){
+            perror("asprintf");
+            return -1;
+        }
+
+        /* A directory found through CDPATH is printed, as it may not be the
+         * one the user expected */
+        bool dot = dir_sz == 0 || (dir_sz == 1 && *cdpath == '.');
+        int ret = change_dir(dir, !dot);
+        free(dir);
+        if(ret == 0)
+            return 0;
+
+        cdpath += dir_sz;
+        if(*cdpath == ':')
+            cdpath++;
+    }
+
+    if(change_dir(path, false) == 0)
+        return 0;
+
+    struct frecency_entry *best;
+    char *frags[] = { (char *) path, NULL };
+    if(errno == ENOENT && relative && strchr(path, '/') == NULL
+            && dirs_find(frags, &best, 1) > 0)
+        return dirs_jump(frags);
+
+    perror(path);
+    return -1;
+}
+
+/** This function handles the cd builtin.
+ *
+ *      cd                  goes to the home directory
+ *      cd -                goes back to the previous directory
+ *      cd dir              goes to dir, looked up in CDPATH if relative
+ *      cd -j frag...       jumps to the best directory matching the fragments
+ *      cd -l [frag...]     lists the best directories matching the fragments
+ *
+ *  -args: command entered after being expanded.
+ *
+ *  Returns: 0 if succeded. -1 if the directory could not be changed.
+ */
+int dirs_cd(char **args){
+
+    if(args[1] == NULL){
+        if(change_dir(getpwd(), false) == -1){
+            perror(getpwd());
+            return -1;
+        }
+        return 0;
+    }
+
+    if(!strcmp(args[1], "-")){
+        const char *old = getenv("OLDPWD");
+        if(old == NULL){
+            fprintf(stderr, "cd: OLDPWD not set\n");
+            return -1;
+        }
+
+        char *path = strdup(old);
+        if(!path){
+            perror("strdup");
+            return -1;
+        }
+        int ret = change_dir(path, true);
+        if(ret == -1)
+            perror(path);
+        free(path);
+        return ret;
+    }
+
+    if(!strcmp(args[1], "-j")){
+        if(args[2] == NULL){
+            fprintf(stderr, "usage: cd -j fragment...\n");
+            return -1;
+        }
+        return dirs_jump(args + 2);
+    }
+
+    if(!strcmp(args[1], "-l")){
+        dirs_list(args + 2);
+        return 0;
+    }
+
+    return resolve_cd(args[1]);
+}
+
+/** This function prints the current directory and the directory stack, top
+ *  first.
+ *
+ */
+void dirs_print(void){
+
+    char *cwd = getcwd(NULL, 0);
+    printf("%s", cwd != NULL ? cwd : ".");
+    free(cwd);
+
+    for(size_t i = stack_sz; i > 0; i--)
+        printf(" %s", stack[i - 1]);
+    printf("\n");
+}
+
+/** This function handles the pushd builtin.
+ *
+ *      pushd       swaps the current directory with the top of the stack
+ *      pushd dir   pushes the current directory and goes to dir, like cd
+ *
+ *  -args: command entered after being expanded.
+ *
+ *  Returns: 0 if succeded. -1 if the directory could not be changed.
+ */
+int dirs_pushd(char **args){
+
+    if(args[1] == NULL && stack_sz == 0){
+        fprintf(stderr, "pushd: no other directory\n");
+        return -1;
+    }
+
+    char *cwd = getcwd(NULL, 0);
+    if(cwd == NULL){
+        perror("getcwd");
+        return -1;
+    }
+
+    if(args[1] == NULL){
+        if(change_dir(stack[stack_sz - 1], false) == -1){
+            perror(stack[stack_sz - 1]);
+            free(cwd);
+            return -1;
+        }
+        free(stack[stack_sz - 1]);
+        stack[stack_sz - 1] = cwd;
+        dirs_print();
+        return 0;
+    }
+
+    if(stack_sz == stack_limit){
+        size_t limit = stack_limit ? stack_limit * 2 : 8;
+        char **temp = realloc(stack, limit * sizeof(char *));
+        if(!temp){
+            perror("realloc");
+            free(cwd);
+            return -1;
+        }
+        stack = temp;
+        stack_limit = limit;
+    }
+
+    if(resolve_cd(args[1]) == -1){
+        free(cwd);
+        return -1;
+    }
+
+    stack[stack_sz++] = cwd;
+    dirs_print();
+    return 0;
+}
+
+/** This function handles the popd builtin: it goes to the directory at the
+ *  top of the stack and removes it.
+ *
+ *  Returns: 0 if succeded. -1 if the stack is empty or the directory could
+ *  not be changed.
+ */
+int dirs_popd(void){
+
+    if(stack_sz == 0){
+        fprintf(stderr, "popd: directory stack empty\n");
+        return -1;
+    }
+
+    char *top = stack[--stack_sz];
+    int ret = change_dir(top, false);
+    if(ret == -1)
+        perror(top);
+    free(top);
+
+    dirs_print();
+    return ret;
+}
+
+/** This function saves the current and previous directories, the directory
+ *  stack and the index to a snapshot.
+ *
+ */
+void dirs_save(struct snapshot *snap){
+
+    char *cwd = getcwd(NULL, 0);
+    snap_str(snap, cwd);
+    free(cwd);
+    snap_str(snap, getenv("OLDPWD"));
+
+    snap_u32(snap, stack_sz);
+    for(size_t i = 0; i < stack_sz; i++)
+        snap_str(snap, stack[i]);
+
+    snap_u32(snap, dirs_index.used);
+    for(size_t i = 0; i < dirs_index.size; i++){
+        const struct frecency_entry *entry = &dirs_index.entries[i];
+        if(entry->key == NULL)
+            continue;
+        snap_str(snap, entry->key);
+        snap_f64(snap, entry->score);
+        snap_u64(snap, entry->last);
+    }
+}
+
+/** This function restores what dirs_save() saved. The index is only restored
+ *  if no index file is open, as the file already holds it.
+ *
+ */
+void dirs_load(struct snapshot *snap){
+
+    char *cwd = snap_get_str(snap);
+    char *oldpwd = snap_get_str(snap);
+    if(cwd != NULL){
+        if(chdir(cwd) == -1)
+            perror(cwd);
+        else
+            setenv("PWD", cwd, 1);
+    }
+    if(oldpwd != NULL)
+        setenv("OLDPWD", oldpwd, 1);
+    free(cwd);
+    free(oldpwd);
+
+    /* The stack is replaced */
+    for(size_t i = 0; i < stack_sz; i++)
+        free(stack[i]);
+    stack_sz = 0;
+
+    uint32_t count = snap_get_u32(snap);
+    for(uint32_t i = 0; i < count && !snap->failed; i++){
+        char *dir = snap_get_str(snap);
+        if(dir == NULL)
+            continue;
+
+        if(stack_sz == stack_limit){
+            size_t limit = stack_limit ? stack_limit * 2 : 8;
+            char **temp = realloc(stack, limit * sizeof(char *));
+            if(!temp){
+                perror("realloc");
+                free(dir);
+                return;
+            }
+            stack = temp;
+            stack_limit = limit;
+        }
+        stack[stack_sz++] = dir;
+    }
+
+    count = snap_get_u32(snap);
+    for(uint32_t i = 0; i < count && !snap->failed; i++){
+        char *path = snap_get_str(snap);
+        double score = snap_get_f64(snap);
+        time_t last = snap_get_u64(snap);
+        if(path != NULL && !snap->failed && dirs_fd == -1)
+            frecency_bump(&dirs_index, path, strlen(path), last, score);
+        free(path);
+    }
+}
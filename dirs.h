@@ -0,0 +1,18 @@
+/**@file
+ *  Header file which contains the cd, pushd, popd and dirs builtins and the
+ *  frecency index of directories.
+ */
+#ifndef _DIRS_H_
+#define _DIRS_H_
+
+struct snapshot;
+
+int dirs_open(const char *);
+void dirs_destroy(void);
+int dirs_cd(char **);
+int dirs_pushd(char **);
+int dirs_popd(void);
+void dirs_print(void);
+void dirs_save(struct snapshot *);
+void dirs_load(struct snapshot *);
+#endif
@@ -0,0 +1,586 @@
+/**@file
+ *  This file contains a minimal line editor, which reads the terminal in raw
+ *  mode. It supports the same keys as the readline setup of the shell: line
+ *  editing, history with the up/down keys and completion with Tab, from the
+ *  same completion as readline (see complete.c). It does not use readline.
+ *
+ *  The screen is updated incrementally: typing at the end of the line only
+ *  writes the new characters, and an edit in the middle only rewrites the rest
+ *  of the line. Input is read in blocks and every run of printable characters
+ *  is inserted at once, so pasting a long line costs time linear in its size.
+ *  Output is collected and written once per block of input.
+ *
+ *  Every character whose first byte is below 0xF0 is assumed to take one
+ *  column, and four byte characters (emoji, like the prompt's) two.
+ */
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "complete.h"
+#include "editor.h"
+#include "ui.h"
+#include "logger.h"
+
+#define INPUT_SZ 4096
+#define WORD_BREAKS " \t\n\"'<>;|&{("
+
+/** This struct holds the line being edited.
+ *
+ *  -buf: the line, NUL terminated.
+ *  -len: length of the line.
+ *  -cap: allocated size of buf.
+ *  -pos: position of the cursor in buf.
+ *  -prompt: the prompt.
+ *  -prompt_w: columns taken by the prompt.
+ *  -cols: width of the terminal.
+ *  -cursor: column of the cursor, counted from the start of the prompt.
+ *
+ */
+struct editor {
+    char *buf;
+    size_t len;
+    size_t cap;
+    size_t pos;
+    const char *prompt;
+    size_t prompt_w;
+    size_t cols;
+    size_t cursor;
+};
+
+/* Input read but not used yet, e.g. the lines following the first one in a
+ * paste */
+static char input[INPUT_SZ];
+static size_t input_sz = 0;
+static size_t input_pos = 0;
+
+static char *output = NULL;
+static size_t output_sz = 0;
+static size_t output_cap = 0;
+
+/** This function returns the number of columns taken by a string.
+ *
+ */
+static size_t width(const char *s, size_t n){
+
+    size_t w = 0;
+    for(size_t i = 0; i < n; i++){
+        unsigned char c = s[i];
+        if((c & 0xC0) == 0x80)
+            continue;
+        w += c >= 0xF0 ? 2 : 1;
+    }
+    return w;
+}
+
+/** This function adds bytes to the output.
+ *
+ */
+static void out(const char *s, size_t n){
+
+    if(output_sz + n > output_cap){
+        size_t cap = output_cap ? output_cap * 2 : INPUT_SZ;
+        while(cap < output_sz + n)
+            cap *= 2;
+
+        char *temp = realloc(output, cap);
+        if(!temp){
+            perror("realloc");
+            return;
+        }
+        output = temp;
+        output_cap = cap;
+    }
+
+    memcpy(output + output_sz, s, n);
+    output_sz += n;
+}
+
+/** This function adds a formatted escape sequence to the output.
+ *
+ */
+static void out_seq(const char *fmt, size_t n){
+
+    char seq[32];
+    int seq_sz = snprintf(seq, sizeof(seq), fmt, n);
+    out(seq, seq_sz);
+}
+
+/** This function writes the output to the terminal.
+ *
+ */
+static void flush(void){
+
+    size_t written = 0;
+    while(written < output_sz){
+        ssize_t ret = write(STDOUT_FILENO, output + written,
+                output_sz - written);
+        if(ret == -1 && errno == EINTR)
+            continue;
+        if(ret == -1)
+            break;
+        written += ret;
+    }
+    output_sz = 0;
+}
+
+/** This function moves the cursor to a column, counted from the start of the
+ *  prompt. Columns past the width of the terminal are on the following rows.
+ *
+ */
+static void move_to(struct editor *ed, size_t col){
+
+    size_t row = ed->cursor / ed->cols;
+    size_t to_row = col / ed->cols;
+
+    if(to_row > row)
+        out_seq("\x1b[%zuB", to_row - row);
+    else if(to_row < row)
+        out_seq("\x1b[%zuA", row - to_row);
+
+    out("\r", 1);
+    if(col % ed->cols)
+        out_seq("\x1b[%zuC", col % ed->cols);
+
+    ed->cursor = col;
+}
+
+/** This function writes text at the cursor. Terminals don't move to the next
+ *  row until a character is written past the last column, so the cursor is
+ *  moved there explicitly to keep it where move_to() expects it.
+ *
+ */
+static void write_text(struct editor *ed, const char *s, size_t n){
+
+    out(s, n);
+    ed->cursor += width(s, n);
+    if(n > 0 && ed->cursor % ed->cols == 0)
+        out("\r\n", 2);
+}
+
+/** This function rewrites the line from the cursor to its end, clears what
+ *  was left after it and moves the cursor back to pos.
+ *
+ */
+static void redraw_tail(struct editor *ed, size_t from){
+
+    size_t col = ed->cursor;
+    write_text(ed, ed->buf + from, ed->len - from);
+    out("\x1b[J", 3);
+    move_to(ed, col + width(ed->buf + from, ed->pos - from));
+}
+
+/** This function redraws the prompt and the whole line.
+ *
+ */
+static void redraw(struct editor *ed){
+
+    move_to(ed, 0);
+    ed->cursor = 0;
+    write_text(ed, ed->prompt, strlen(ed->prompt));
+    size_t pos = ed->pos;
+    ed->pos = 0;
+    redraw_tail(ed, 0);
+    ed->pos = pos;
+    move_to(ed, ed->prompt_w + width(ed->buf, pos));
+}
+
+/** This function makes room for n more bytes in the line.
+ *
+ *  Returns: 0 if succeded. -1 if memory could not be allocated.
+ */
+static int reserve(struct editor *ed, size_t n){
+
+    if(ed->len + n + 1 <= ed->cap)
+        return 0;
+
+    size_t cap = ed->cap * 2;
+    while(cap < ed->len + n + 1)
+        cap *= 2;
+
+    char *temp = realloc(ed->buf, cap);
+    if(!temp){
+        perror("realloc");
+        return -1;
+    }
+    ed->buf = temp;
+    ed->cap = cap;
+    return 0;
+}
+
+/** This function inserts text at the cursor.
+ *
+ */
+static void insert(struct editor *ed, const char *s, size_t n){
+
+    if(reserve(ed, n) == -1)
+        return;
+
+    bool at_end = ed->pos == ed->len;
+    memmove(ed->buf + ed->pos + n, ed->buf + ed->pos, ed->len - ed->pos + 1);
+    memcpy(ed->buf + ed->pos, s, n);
+    ed->len += n;
+    ed->pos += n;
+
+    if(at_end)
+        write_text(ed, s, n);
+    else
+        redraw_tail(ed, ed->pos - n);
+}
+
+/** This function deletes the bytes from start to end of the line and leaves
+ *  the cursor at start.
+ *
+ */
+static void delete(struct editor *ed, size_t start, size_t end){
+
+    if(start >= end)
+        return;
+
+    move_to(ed, ed->cursor - width(ed->buf + start, ed->pos - start));
+    memmove(ed->buf + start, ed->buf + end, ed->len - end + 1);
+    ed->len -= end - start;
+    ed->pos = start;
+    redraw_tail(ed, start);
+}
+
+/** This function returns the position of the character before pos.
+ *
+ */
+static size_t prev_char(const struct editor *ed, size_t pos){
+
+    while(pos > 0 && (ed->buf[--pos] & 0xC0) == 0x80);
+    return pos;
+}
+
+/** This function returns the position of the character after pos.
+ *
+ */
+static size_t next_char(const struct editor *ed, size_t pos){
+
+    while(pos < ed->len && (ed->buf[++pos] & 0xC0) == 0x80);
+    return pos;
+}
+
+/** This function moves the cursor to a position of the line.
+ *
+ */
+static void move_pos(struct editor *ed, size_t pos){
+
+    if(pos < ed->pos)
+        move_to(ed, ed->cursor - width(ed->buf + pos, ed->pos - pos));
+    else
+        move_to(ed, ed->cursor + width(ed->buf + ed->pos, pos - ed->pos));
+    ed->pos = pos;
+}
+
+/** This function replaces the whole line, e.g. with a history entry.
+ *
+ */
+static void replace(struct editor *ed, const char *s){
+
+    size_t n = strlen(s);
+    move_pos(ed, 0);
+    ed->len = 0;
+    if(reserve(ed, n) == -1)
+        return;
+
+    memcpy(ed->buf, s, n + 1);
+    ed->len = ed->pos = n;
+    redraw_tail(ed, 0);
+}
+
+/** This function lists the matches of a completion under the line, in
+ *  columns, and redraws the line below them.
+ *
+ */
+static void list_matches(struct editor *ed, char **matches){
+
+    size_t longest = 0, total = 0;
+    for(size_t i = 1; matches[i] != NULL; i++, total++){
+        if(strlen(matches[i]) > longest)
+            longest = strlen(matches[i]);
+    }
+
+    size_t per_row = ed->cols / (longest + 2);
+    if(per_row == 0)
+        per_row = 1;
+
+    move_to(ed, ed->prompt_w + width(ed->buf, ed->len));
+    out("\r\n", 2);
+    for(size_t i = 0; i < total; i++){
+        out(matches[i + 1], strlen(matches[i + 1]));
+        if((i + 1) % per_row == 0 || i + 1 == total){
+            out("\r\n", 2);
+        } else {
+            for(size_t j = strlen(matches[i + 1]); j < longest + 2; j++)
+                out(" ", 1);
+        }
+    }
+
+    ed->cursor = 0;
+    redraw(ed);
+}
+
+/** This function completes the word before the cursor with complete_line().
+ *  A single match is inserted, followed by a space (or nothing after a
+ *  directory); otherwise the common prefix of the matches is inserted, and the
+ *  matches are listed if there is no common prefix to add.
+ *
+ */
+static void complete(struct editor *ed){
+
+    size_t start = ed->pos;
+    while(start > 0 && !strchr(WORD_BREAKS, ed->buf[start - 1]))
+        start--;
+
+    char *text = strndup(ed->buf + start, ed->pos - start);
+    if(!text){
+        perror("strndup");
+        return;
+    }
+
+    int kind;
+    char **matches = complete_line(ed->buf, text, start, &kind);
+    if(matches == NULL){
+        out("\a", 1);
+        free(text);
+        return;
+    }
+
+    size_t text_sz = strlen(text);
+    size_t prefix_sz = strlen(matches[0]);
+    if(prefix_sz > text_sz && !strncmp(matches[0], text, text_sz))
+        insert(ed, matches[0] + text_sz, prefix_sz - text_sz);
+
+    if(matches[1] == NULL){
+        if(prefix_sz == 0 || matches[0][prefix_sz - 1] != '/')
+            insert(ed, " ", 1);
+    } else if(prefix_sz <= text_sz){
+        list_matches(ed, matches);
+    }
+
+    for(size_t i = 0; matches[i] != NULL; i++)
+        free(matches[i]);
+    free(matches);
+    free(text);
+}
+
+/** This function returns the next byte of input, reading more from the
+ *  terminal if needed.
+ *
+ *  Returns: the byte, -1 at the end of the input.
+ */
+static int next_byte(void){
+
+    if(input_pos == input_sz){
+        flush();
+
+        ssize_t read_sz;
+        while((read_sz = read(STDIN_FILENO, input, INPUT_SZ)) == -1
+                && errno == EINTR);
+        if(read_sz <= 0)
+            return -1;
+
+        input_sz = read_sz;
+        input_pos = 0;
+    }
+
+    return (unsigned char) input[input_pos++];
+}
+
+/** This function handles an escape sequence: arrows, home, end and delete.
+ *  Other sequences are ignored.
+ *
+ */
+static void escape(struct editor *ed){
+
+    int c = next_byte();
+    if(c != '[' && c != 'O')
+        return;
+
+    char seq[16];
+    size_t seq_sz = 0;
+    while((c = next_byte()) != -1){
+        if(seq_sz + 1 < sizeof(seq))
+            seq[seq_sz++] = c;
+        if(c >= 0x40 && c <= 0x7E)
+            break;
+    }
+    seq[seq_sz] = '\0';
+
+    const char *line = NULL;
+    if(!strcmp(seq, "A")){
+        line = hist_browse(ed->buf, -1);
+    } else if(!strcmp(seq, "B")){
+        line = hist_browse(ed->buf, 1);
+    } else if(!strcmp(seq, "C")){
+        move_pos(ed, next_char(ed, ed->pos));
+    } else if(!strcmp(seq, "D")){
+        move_pos(ed, prev_char(ed, ed->pos));
+    } else if(!strcmp(seq, "H") || !strcmp(seq, "1~") || !strcmp(seq, "7~")){
+        move_pos(ed, 0);
+    } else if(!strcmp(seq, "F") || !strcmp(seq, "4~") || !strcmp(seq, "8~")){
+        move_pos(ed, ed->len);
+    } else if(!strcmp(seq, "3~")){
+        delete(ed, ed->pos, next_char(ed, ed->pos));
+    }
+
+    if(line != NULL)
+        replace(ed, line);
+}
+
+/** This function reads a line from the terminal, like readline().
+ *
+ *  -prompt: the prompt.
+ *
+ *  Returns: the line, which has to be freed by the caller. NULL at the end of
+ *  the input (Ctrl-D on an empty line).
+ */
+char *editor_read(const char *prompt){
+
+    struct editor ed = { 0 };
+    ed.cap = 256;
+    ed.buf = malloc(ed.cap);
+    if(!ed.buf){
+        perror("malloc");
+        return NULL;
+    }
+    *ed.buf = '\0';
+    ed.prompt = prompt;
+    ed.prompt_w = width(prompt, strlen(prompt));
+
+    struct winsize ws;
+    ed.cols = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 ?
+        ws.ws_col : 80;
+
+    struct termios saved, raw;
+    bool tty = tcgetattr(STDIN_FILENO, &saved) == 0;
+    if(tty){
+        raw = saved;
+        raw.c_iflag &= ~(ICRNL | IXON | BRKINT | ISTRIP);
+        raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+        raw.c_cc[VMIN] = 1;
+        raw.c_cc[VTIME] = 0;
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+    }
+
+    write_text(&ed, prompt, strlen(prompt));
+
+    bool done = false;
+    while(!done){
+
+        int c = next_byte();
+
+        if(c == -1){
+            if(ed.len == 0){
+                free(ed.buf);
+                ed.buf = NULL;
+            }
+            break;
+        }
+
+        if(c >= 0x20 && c != 0x7F){
+            /* Insert the whole run of printable characters at once */
+            size_t start = input_pos - 1;
+            while(input_pos < input_sz
+                    && (unsigned char) input[input_pos] >= 0x20
+                    && input[input_pos] != 0x7F)
+                input_pos++;
+            insert(&ed, input + start, input_pos - start);
+            continue;
+        }
+
+        switch(c){
+            case '\r':
+            case '\n':
+                /* A paste may end its lines with \r\n */
+                if(c == '\r' && input_pos < input_sz && input[input_pos] == '\n')
+                    input_pos++;
+                done = true;
+                break;
+            case '\t':
+                complete(&ed);
+                break;
+            case 0x7F:
+            case 0x08:
+                delete(&ed, prev_char(&ed, ed.pos), ed.pos);
+                break;
+            case 0x01: /* Ctrl-A */
+                move_pos(&ed, 0);
+                break;
+            case 0x05: /* Ctrl-E */
+                move_pos(&ed, ed.len);
+                break;
+            case 0x02: /* Ctrl-B */
+                move_pos(&ed, prev_char(&ed, ed.pos));
+                break;
+            case 0x06: /* Ctrl-F */
+                move_pos(&ed, next_char(&ed, ed.pos));
+                break;
+            case 0x04: /* Ctrl-D */
+                if(ed.len == 0){
+                    free(ed.buf);
+                    ed.buf = NULL;
+                    done = true;
+                } else {
+                    delete(&ed, ed.pos, next_char(&ed, ed.pos));
+                }
+                break;
+            case 0x0B: /* Ctrl-K */
+                delete(&ed, ed.pos, ed.len);
+                break;
+            case 0x15: /* Ctrl-U */
+                delete(&ed, 0, ed.pos);
+                break;
+            case 0x17: /* Ctrl-W */
+            {
+                size_t start = ed.pos;
+                while(start > 0 && ed.buf[start - 1] == ' ')
+                    start--;
+                while(start > 0 && ed.buf[start - 1] != ' ')
+                    start--;
+                delete(&ed, start, ed.pos);
+                break;
+            }
+            case 0x0C: /* Ctrl-L */
+                out("\x1b[H\x1b[2J", 7);
+                ed.cursor = 0;
+                redraw(&ed);
+                break;
+            case 0x10: /* Ctrl-P */
+            case 0x0E: /* Ctrl-N */
+            {
+                const char *line = hist_browse(ed.buf, c == 0x10 ? -1 : 1);
+                if(line != NULL)
+                    replace(&ed, line);
+                break;
+            }
+            case 0x03: /* Ctrl-C */
+                move_pos(&ed, ed.len);
+                out("^C", 2);
+                ed.len = ed.pos = 0;
+                *ed.buf = '\0';
+                done = true;
+                break;
+            case 0x1B:
+                escape(&ed);
+                break;
+        }
+    }
+
+    if(ed.buf != NULL)
+        move_pos(&ed, ed.len);
+    out("\r\n", 2);
+    flush();
+
+    if(tty)
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &saved);
+
+    return ed.buf;
+}
@@ -0,0 +1,9 @@
+/**@file
+ *  Header file which contains the built-in line editor, used instead of
+ *  readline when NASH_EDITOR=builtin.
+ */
+#ifndef _EDITOR_H_
+#define _EDITOR_H_
+
+char *editor_read(const char *);
+#endif
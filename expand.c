@@ -0,0 +1,429 @@
+/**@file
+ *  This file expands the words of a command right before it runs: quotes and
+ *  backslashes are removed, `~` becomes the home directory, $1...$9, $#, $@
+ *  and $* become the arguments of the function being run, $? the exit code of
+ *  the last pipeline and $name or ${name} the value of a variable, and
+ *  process substitutions are started (see procsub.c). Aliases are replaced by
+ *  their words at the same time.
+ *
+ *  Variables are looked up in the table of the shell (see symbols.c), then in
+ *  the environment.
+ *
+ *  The parsed tree keeps the words as they were entered, so a function or an
+ *  alias is parsed once and expanded again every time it runs. The words are
+ *  not split after the expansion, except for $@ alone, which gives one word
+ *  per argument.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "expand.h"
+#include "procsub.h"
+#include "symbols.h"
+#include "util.h"
+#include "logger.h"
+
+#define ALIAS_DEPTH 16
+
+/** This struct holds a string being built.
+ *
+ */
+struct buffer {
+    char *str;
+    size_t len;
+    size_t cap;
+};
+
+/** This struct holds a list of words being built, NULL terminated.
+ *
+ */
+struct words {
+    char **list;
+    size_t total;
+    size_t cap;
+};
+
+/* Arguments of the function being run, NULL terminated ($1 is params[0]) */
+static char *no_params[] = { NULL };
+static char **params = no_params;
+
+/* Exit code of the last pipeline, $? */
+static int last_status = 0;
+
+/** This function sets the exit code of the last pipeline, given by $?.
+ *
+ *  -status: the exit code, -1 if the pipeline could not run.
+ *
+ */
+void status_set(int status){
+
+    last_status = status < 0 ? 1 : status;
+}
+
+/** This function returns the exit code of the last pipeline.
+ *
+ */
+int status_get(void){
+
+    return last_status;
+}
+
+/** This function sets the arguments of the function being run.
+ *
+ *  -argv: the arguments, NULL terminated. They are not copied.
+ *
+ *  Returns: the previous arguments, to be set back once the function returns.
+ */
+char **params_set(char **argv){
+
+    char **old = params;
+    params = argv != NULL ? argv : no_params;
+    return old;
+}
+
+/** This function appends bytes to a buffer.
+ *
+ *  Returns: 0 if succeded. -1 if memory could not be allocated.
+ */
+static int buffer_add(struct buffer *b, const char *s, size_t n){
+
+    if(b->len + n + 1 > b->cap){
+        size_t cap = b->cap ? b->cap * 2 : 64;
+        while(cap < b->len + n + 1)
+            cap *= 2;
+
+        char *temp = realloc(b->str, cap);
+        if(!temp){
+            perror("realloc");
+            return -1;
+        }
+        b->str = temp;
+        b->cap = cap;
+    }
+
+    memcpy(b->str + b->len, s, n);
+    b->len += n;
+    b->str[b->len] = '\0';
+    return 0;
+}
+
+/** This function appends a word to a list of words. The word is taken over by
+ *  the list.
+ *
+ *  Returns: 0 if succeded. -1 if memory could not be allocated.
+ */
+static int words_add(struct words *w, char *word){
+
+    if(word == NULL)
+        return -1;
+
+    if(w->total + 2 > w->cap){
+        size_t cap = w->cap ? w->cap * 2 : 8;
+        char **temp = realloc(w->list, cap * sizeof(char *));
+        if(!temp){
+            perror("realloc");
+            free(word);
+            return -1;
+        }
+        w->list = temp;
+        w->cap = cap;
+    }
+
+    w->list[w->total++] = word;
+    w->list[w->total] = NULL;
+    return 0;
+}
+
+/** This function expands the parameter or the variable starting at c (right
+ *  after the $).
+ *
+ *  -c: the parameter, updated past it.
+ *  -b: where the value is appended.
+ *
+ *  Returns: 0 if succeded. -1 if memory could not be allocated. 1 if c is not
+ *  a parameter, in which case the $ is kept as it is.
+ */
+static int expand_param(const char **c, struct buffer *b){
+
+    size_t params_sz = 0;
+    while(params[params_sz] != NULL)
+        params_sz++;
+
+    if(**c >= '1' && **c <= '9'){
+        size_t n = *(*c)++ - '1';
+        if(n >= params_sz)
+            return 0;
+        return buffer_add(b, params[n], strlen(params[n]));
+    }
+
+    if(**c == '0'){
+        (*c)++;
+        return buffer_add(b, "nash", 4);
+    }
+
+    if(**c == '#'){
+        (*c)++;
+        char count[16];
+        snprintf(count, sizeof(count), "%zu", params_sz);
+        return buffer_add(b, count, strlen(count));
+    }
+
+    if(**c == '@' || **c == '*'){
+        (*c)++;
+        for(size_t i = 0; i < params_sz; i++){
+            if((i > 0 && buffer_add(b, " ", 1) == -1)
+                    || buffer_add(b, params[i], strlen(params[i])) == -1)
+                return -1;
+        }
+        return 0;
+    }
+
+    if(**c == '?'){
+        (*c)++;
+        char code[16];
+        snprintf(code, sizeof(code), "%d", last_status);
+        return buffer_add(b, code, strlen(code));
+    }
+
+    /* $name or ${name}, an unset variable is empty */
+    bool braces = **c == '{';
+    size_t len = name_len(*c + braces);
+    if(len == 0 || (braces && (*c)[len + 1] != '}'))
+        return 1;
+
+    char name[len + 1];
+    memcpy(name, *c + braces, len);
+    name[len] = '\0';
+    *c += len + 2 * braces;
+
+    const char *value = var_get(name);
+    return value != NULL ? buffer_add(b, value, strlen(value)) : 0;
+}
+
+/** This function expands a single word. A process substitution is started,
+ *  and becomes the path of its pipe.
+ *
+ *  -raw: the word as entered.
+ *
+ *  Returns: the expanded word, which has to be freed by the caller. NULL if
+ *  memory could not be allocated or the substitution could not be started.
+ */
+static char *expand_word(const char *raw){
+
+    if(procsub_word(raw))
+        return procsub_open(raw);
+
+    struct buffer b = { 0 };
+    if(buffer_add(&b, "", 0) == -1)
+        return NULL;
+
+    const char *c = raw;
+    if(*c == '~' && (c[1] == '/' || c[1] == '\0')){
+        char *home = getpwd();
+        if(buffer_add(&b, home, strlen(home)) == -1)
+            goto fail;
+        c++;
+    }
+
+    char quote = '\0';
+    while(*c != '\0'){
+
+        int ret = 0;
+        if(quote == '\0' && (*c == '\'' || *c == '"')){
+            quote = *c++;
+            continue;
+        }
+
+        if(*c == quote){
+            quote = '\0';
+            c++;
+            continue;
+        }
+
+        if(quote == '\'')
+            ret = buffer_add(&b, c++, 1);
+        else if(*c == '\\' && c[1] != '\0'
+                && (quote == '\0' || strchr("\"\\$`", c[1]))){
+            ret = buffer_add(&b, c + 1, 1);
+            c += 2;
+        } else if(*c == '$'){
+            c++;
+            if((ret = expand_param(&c, &b)) == 1)
+                ret = buffer_add(&b, "$", 1);
+        } else {
+            ret = buffer_add(&b, c++, 1);
+        }
+
+        if(ret == -1)
+            goto fail;
+    }
+
+    return b.str;
+
+fail:
+    free(b.str);
+    return NULL;
+}
+
+/** This function expands a list of words.
+ *
+ *  -raw: the words as entered, NULL terminated.
+ *
+ *  Returns: the expanded words, NULL terminated. The list and the words have
+ *  to be freed by the caller. NULL if memory could not be allocated.
+ */
+char **expand_words(char *const raw[]){
+
+    struct words w = { 0 };
+    w.cap = 8;
+    w.list = calloc(w.cap, sizeof(char *));
+    if(!w.list){
+        perror("calloc");
+        return NULL;
+    }
+
+    for(size_t i = 0; raw[i] != NULL; i++){
+
+        /* $@ alone gives one word per argument */
+        if(!strcmp(raw[i], "$@") || !strcmp(raw[i], "\"$@\"")){
+            for(size_t j = 0; params[j] != NULL; j++){
+                if(words_add(&w, strdup(params[j])) == -1)
+                    goto fail;
+            }
+            continue;
+        }
+
+        if(words_add(&w, expand_word(raw[i])) == -1)
+            goto fail;
+    }
+
+    return w.list;
+
+fail:
+    for(size_t i = 0; i < w.total; i++)
+        free(w.list[i]);
+    free(w.list);
+    return NULL;
+}
+
+/** This helper function expands the redirection files of a command into run.
+ *
+ *  Returns: 0 if succeded. -1 if memory could not be allocated.
+ */
+static int expand_files(struct command_line *run, const char *stdin_file,
+        const char *stdout_file){
+
+    if(stdin_file != NULL && (run->stdin_file = expand_word(stdin_file)) == NULL)
+        return -1;
+
+    if(stdout_file != NULL
+            && (run->stdout_file = expand_word(stdout_file)) == NULL)
+        return -1;
+
+    return 0;
+}
+
+/** This helper function expands one command into run. If the command starts
+ *  with an alias for a single command, the words of the alias replace its name
+ *  first, and the redirections of the alias apply unless the command has its
+ *  own.
+ *
+ *  Returns: 0 if succeded. -1 if memory could not be allocated.
+ */
+static int expand_command(const struct command_line *cmd,
+        struct command_line *run){
+
+    run->stdout_pipe = cmd->stdout_pipe;
+    run->append = cmd->append;
+
+    /* A compound stage is shared with the parsed tree, its words are expanded
+     * as it runs */
+    if(cmd->body != NULL){
+        run->body = cmd->body;
+        run->body->refs++;
+        return expand_files(run, cmd->stdin_file, cmd->stdout_file);
+    }
+
+    if(cmd->fanout != NULL){
+        run->fanout = expand_commands(cmd->fanout, cmd->fanout_sz - 1);
+        run->fanout_sz = cmd->fanout_sz;
+        return run->fanout != NULL ? 0 : -1;
+    }
+
+    const char *stdin_file = cmd->stdin_file;
+    const char *stdout_file = cmd->stdout_file;
+    char **raw = cmd->tokens;
+    char **spliced = NULL;
+
+    for(int depth = 0; depth < ALIAS_DEPTH; depth++){
+
+        const struct command_line *alias = alias_command(raw[0]);
+        if(alias == NULL || (depth > 0 && !strcmp(raw[0], cmd->tokens[0])))
+            break;
+
+        size_t raw_sz = 0;
+        while(raw[raw_sz] != NULL)
+            raw_sz++;
+
+        char **temp = malloc((alias->total_tokens + raw_sz) * sizeof(char *));
+        if(!temp){
+            perror("malloc");
+            free(spliced);
+            return -1;
+        }
+        memcpy(temp, alias->tokens, alias->total_tokens * sizeof(char *));
+        memcpy(temp + alias->total_tokens, raw + 1, raw_sz * sizeof(char *));
+        free(spliced);
+        raw = spliced = temp;
+
+        if(stdin_file == NULL)
+            stdin_file = alias->stdin_file;
+        if(stdout_file == NULL){
+            stdout_file = alias->stdout_file;
+            run->append = alias->append;
+        }
+
+        /* An alias for itself (alias ls='ls -F') is only replaced once */
+        if(!strcmp(raw[0], cmd->tokens[0]))
+            break;
+    }
+
+    run->tokens = expand_words(raw);
+    free(spliced);
+    if(run->tokens == NULL)
+        return -1;
+
+    while(run->tokens[run->total_tokens] != NULL)
+        run->total_tokens++;
+
+    return expand_files(run, stdin_file, stdout_file);
+}
+
+/** This function expands the commands of a pipeline, before they run.
+ *
+ *  -cmds: the commands as parsed.
+ *  -pipe: number of pipes, cmds holds pipe + 1 commands.
+ *
+ *  Returns: the expanded commands, to be freed with destroy_commands() and
+ *  free(). NULL if memory could not be allocated.
+ */
+struct command_line *expand_commands(const struct command_line *cmds, int pipe){
+
+    struct command_line *run = malloc((pipe + 1) * sizeof(struct command_line));
+    if(!run){
+        perror("malloc");
+        return NULL;
+    }
+    init_commands(run, pipe);
+
+    for(int i = 0; i < pipe + 1; i++){
+        if(expand_command(&cmds[i], &run[i]) == -1){
+            destroy_commands(run, pipe);
+            free(run);
+            return NULL;
+        }
+    }
+
+    return run;
+}
@@ -0,0 +1,15 @@
+/**@file
+ *  Header file which contains the expansion of the words of a command, done
+ *  every time the command runs.
+ */
+#ifndef _EXPAND_H_
+#define _EXPAND_H_
+
+#include "parse.h"
+
+char **expand_words(char *const []);
+struct command_line *expand_commands(const struct command_line *, int);
+char **params_set(char **);
+void status_set(int);
+int status_get(void);
+#endif
@@ -0,0 +1,291 @@
+/**@file
+ *  This file contains the relay of fan-out pipelines (`gen | {a; b; c}`). The
+ *  relay duplicates the producer's pipe into one pipe per consumer with tee(2)
+ *  and splice(2), so the data is never copied through user space.
+ *
+ *  tee(2) can't resume a partial copy, so every consumer gets a private
+ *  staging pipe at least as large as the input pipe. A chunk is tee'd into the
+ *  empty staging pipes (which therefore always takes the whole chunk), moved
+ *  out of the input pipe, and then spliced from each staging pipe to its
+ *  consumer as fast as that consumer reads.
+ *
+ *  Backpressure is configured with:
+ *  - NASH_FANOUT_BUF: size of the staging pipes (default 1M).
+ *  - NASH_FANOUT_POLICY: "block" (default) waits for the slowest consumer
+ *    before taking the next chunk, so the producer is slowed down to its pace.
+ *    "drop" discards the pending chunk of a consumer which is still busy when
+ *    the next chunk arrives, so a slow consumer never stalls the others.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fanout.h"
+#include "logger.h"
+
+#define DEFAULT_FANOUT_BUF (1024 * 1024)
+
+/** This struct holds the state of one consumer of the relay.
+ *
+ *  -out: write end of the consumer's pipe.
+ *  -stage: staging pipe holding the data not yet taken by the consumer.
+ *  -pending: bytes in the staging pipe.
+ *  -dropped: bytes discarded because the consumer was too slow.
+ *  -alive: false once the consumer closed its pipe.
+ *
+ */
+struct consumer {
+    int out;
+    int stage[2];
+    size_t pending;
+    size_t dropped;
+    bool alive;
+};
+
+/** This function reads the size of the staging pipes from NASH_FANOUT_BUF,
+ *  which accepts a K or M suffix.
+ *
+ */
+static int fanout_buf_sz(void){
+
+    char *env = getenv("NASH_FANOUT_BUF");
+    if(env == NULL)
+        return DEFAULT_FANOUT_BUF;
+
+    char *end;
+    long size = strtol(env, &end, 10);
+    if(*end == 'K' || *end == 'k')
+        size *= 1024;
+    else if(*end == 'M' || *end == 'm')
+        size *= 1024 * 1024;
+
+    if(size <= 0 || size > INT_MAX)
+        return DEFAULT_FANOUT_BUF;
+
+    return size;
+}
+
+/** This function stops feeding a consumer which closed its end.
+ *
+ */
+static void consumer_close(struct consumer *c){
+
+    c->alive = false;
+    c->pending = 0;
+    close(c->out);
+    close(c->stage[0]);
+    close(c->stage[1]);
+}
+
+/** This function moves as much staged data as the consumer accepts without
+ *  blocking.
+ *
+ */
+static void consumer_flush(struct consumer *c){
+
+    while(c->pending > 0){
+        ssize_t moved = splice(c->stage[0], NULL, c->out, NULL, c->pending,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if(moved > 0){
+            c->pending -= moved;
+            continue;
+        }
+
+        if(moved == -1 && errno == EAGAIN)
+            return;
+
+        /* EPIPE: the consumer exited */
+        int err = errno;
+        LOG("Fan-out consumer on fd %d closed: %s\n", c->out, strerror(err));
+        consumer_close(c);
+        return;
+    }
+}
+
+/** This function takes the next chunk from the input pipe and stages it for
+ *  every live consumer: it is tee'd to all of them but the last one, and moved
+ *  to the last one, which also consumes it from the input.
+ *
+ *  Returns: the size of the chunk, 0 at end of input, -1 if no data is ready.
+ */
+static ssize_t relay_chunk(int in, struct consumer *c, size_t c_sz,
+        int devnull){
+
+    ssize_t last = -1;
+    for(size_t i = 0; i < c_sz; i++){
+        if(c[i].alive)
+            last = i;
+    }
+
+    /* Nobody left to feed: drain the input so the producer can finish */
+    if(last == -1)
+        return splice(in, NULL, devnull, NULL, INT_MAX, SPLICE_F_MOVE);
+
+    ssize_t chunk = INT_MAX;
+    for(size_t i = 0; i < last; i++){
+        if(!c[i].alive)
+            continue;
+
+        ssize_t copied = tee(in, c[i].stage[1], chunk, SPLICE_F_NONBLOCK);
+        if(copied <= 0)
+            return copied;
+
+        chunk = copied;
+        c[i].pending = copied;
+    }
+
+    ssize_t moved = splice(in, NULL, c[last].stage[1], NULL, chunk,
+            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if(moved <= 0)
+        return moved;
+
+    c[last].pending = moved;
+    return moved;
+}
+
+/** This function runs the relay until the producer closes its end and every
+ *  consumer took its data, or every consumer exited.
+ *
+ *  -in: read end of the producer's pipe.
+ *  -outs: write ends of the consumers' pipes. They are closed by the relay.
+ *  -outs_sz: number of consumers.
+ *
+ *  Returns: 0 if succeded. -1 if the relay could not be set up.
+ */
+int fanout_relay(int in, int *outs, size_t outs_sz){
+
+    char *policy = getenv("NASH_FANOUT_POLICY");
+    bool drop = policy != NULL && !strcmp(policy, "drop");
+
+    int buf_sz = fanout_buf_sz();
+    int devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+
+    struct consumer *c = calloc(outs_sz, sizeof(struct consumer));
+    struct pollfd *fds = calloc(outs_sz + 1, sizeof(struct pollfd));
+    if(!c || !fds || devnull == -1){
+        perror("fanout");
+        if(devnull != -1)
+            close(devnull);
+        free(c);
+        free(fds);
+        return -1;
+    }
+
+    int stage_min = buf_sz;
+    for(size_t i = 0; i < outs_sz; i++){
+        c[i].out = outs[i];
+        c[i].alive = true;
+        if(pipe2(c[i].stage, O_CLOEXEC) == -1){
+            perror("pipe");
+            for(size_t j = 0; j < i; j++){
+                close(c[j].stage[0]);
+                close(c[j].stage[1]);
+            }
+            close(devnull);
+            free(c);
+            free(fds);
+            return -1;
+        }
+
+        int stage_sz = fcntl(c[i].stage[1], F_SETPIPE_SZ, buf_sz);
+        if(stage_sz == -1)
+            stage_sz = fcntl(c[i].stage[1], F_GETPIPE_SZ);
+        if(stage_sz < stage_min)
+            stage_min = stage_sz;
+    }
+
+    /* The staging pipes must be able to take everything the input holds */
+    if(fcntl(in, F_SETPIPE_SZ, stage_min) == -1
+            && fcntl(in, F_GETPIPE_SZ) > stage_min)
+        LOG("Fan-out input pipe larger than the staging pipes (%d)\n",
+                stage_min);
+
+    bool eof = false;
+    while(true){
+
+        bool busy = false;
+        nfds_t nfds = 0;
+        for(size_t i = 0; i < outs_sz; i++){
+            if(!c[i].alive || c[i].pending == 0)
+                continue;
+
+            busy = true;
+            fds[nfds].fd = c[i].out;
+            fds[nfds].events = POLLOUT;
+            nfds++;
+        }
+
+        bool want_input = !eof && (drop || !busy);
+        if(want_input){
+            fds[nfds].fd = in;
+            fds[nfds].events = POLLIN;
+            nfds++;
+        }
+
+        if(nfds == 0)
+            break;
+
+        if(poll(fds, nfds, -1) == -1){
+            if(errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+
+        for(size_t i = 0; i < outs_sz; i++){
+            if(c[i].alive && c[i].pending > 0)
+                consumer_flush(&c[i]);
+        }
+
+        if(!want_input || fds[nfds - 1].revents == 0)
+            continue;
+
+        /* Consumers which did not keep up lose their pending chunk */
+        for(size_t i = 0; drop && i < outs_sz; i++){
+            if(!c[i].alive || c[i].pending == 0)
+                continue;
+
+            c[i].dropped += c[i].pending;
+            while(c[i].pending > 0){
+                ssize_t moved = splice(c[i].stage[0], NULL, devnull, NULL,
+                        c[i].pending, SPLICE_F_MOVE);
+                if(moved <= 0)
+                    break;
+                c[i].pending -= moved;
+            }
+        }
+
+        ssize_t chunk = relay_chunk(in, c, outs_sz, devnull);
+        if(chunk == 0)
+            eof = true;
+        else if(chunk == -1 && errno != EAGAIN){
+            perror("fanout");
+            eof = true;
+        }
+
+        for(size_t i = 0; i < outs_sz; i++){
+            if(c[i].alive && c[i].pending > 0)
+                consumer_flush(&c[i]);
+        }
+    }
+
+    for(size_t i = 0; i < outs_sz; i++){
+        if(c[i].dropped > 0)
+            fprintf(stderr, "fanout: consumer %zu dropped %zu bytes\n", i + 1,
+                    c[i].dropped);
+        if(c[i].alive)
+            consumer_close(&c[i]);
+    }
+
+    close(devnull);
+    free(c);
+    free(fds);
+    return 0;
+}
@@ -0,0 +1,10 @@
+/**@file
+ *  Header file which contains the relay used by fan-out pipelines.
+ */
+#ifndef _FANOUT_H_
+#define _FANOUT_H_
+
+#include <stddef.h>
+
+int fanout_relay(int, int *, size_t);
+#endif
@@ -0,0 +1,619 @@
+/**@file
+ *  This file highlights the line being typed: the commands found in PATH,
+ *  the functions and the aliases in green, the builtins in cyan, the unknown
+ *  commands in red, the keywords in yellow, the redirections and their files
+ *  in magenta, and the pipes and the other operators in blue.
+ *
+ *  Whether a command exists is looked up in the set of the executables of the
+ *  directories of PATH, held in memory, so highlighting a keystroke makes no
+ *  system call. The set is built by a child process, which reads the
+ *  directories and writes the names to a pipe; the shell reads them while
+ *  readline waits for input, and keeps the previous set until they are all
+ *  there. The set is built again when PATH, or the mtime of one of its
+ *  directories, has changed, which is checked once per prompt.
+ */
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "highlight.h"
+#include "builtins.h"
+#include "symbols.h"
+#include "util.h"
+#include "logger.h"
+
+/* Longest command name looked up */
+#define NAME_LEN 256
+
+enum highlight_class {
+    HL_PLAIN,
+    HL_COMMAND,
+    HL_BUILTIN,
+    HL_UNKNOWN,
+    HL_KEYWORD,
+    HL_REDIRECT,
+    HL_OPERATOR
+};
+
+static const char *const colours[] = {
+    [HL_PLAIN] = NULL,
+    [HL_COMMAND] = "\x1b[32m",
+    [HL_BUILTIN] = "\x1b[36m",
+    [HL_UNKNOWN] = "\x1b[31m",
+    [HL_KEYWORD] = "\x1b[33m",
+    [HL_REDIRECT] = "\x1b[35m",
+    [HL_OPERATOR] = "\x1b[34m"
+};
+
+static const char *const keywords[] = {
+    "if", "then", "elif", "else", "fi", "while", "until", "do", "done", "for",
+    "function", "measure", "limit", NULL
+};
+
+/* The set of the executables: the names as read from the scanner, separated
+ * by '\0', and a table of their offsets plus one (0 is a free slot) */
+static char *names = NULL;
+static uint32_t *slots = NULL;
+static size_t slots_sz = 0;
+static char *set_path = NULL;
+static uint64_t set_stamp = 0;
+
+/* The scan being read */
+static int scan_fd = -1;
+static char *scan_buf = NULL;
+static size_t scan_sz = 0;
+static size_t scan_limit = 0;
+static char *scan_path = NULL;
+static uint64_t scan_stamp = 0;
+
+/* The highlighted line */
+static char *out = NULL;
+static size_t out_sz = 0;
+static size_t out_limit = 0;
+static bool out_failed = false;
+
+/** This helper function sums up PATH and the mtimes of its directories, to
+ *  tell when the set has to be built again.
+ *
+ */
+static uint64_t path_stamp(const char *path){
+
+    uint64_t h = fnv1a(FNV1A_START, path, strlen(path));
+    const char *dir = path;
+    while(*dir != '\0'){
+
+        size_t len = strcspn(dir, ":");
+        char buf[4096];
+        struct stat st;
+        memset(&st, 0, sizeof(st));
+        if(len > 0 && len < sizeof(buf)){
+            memcpy(buf, dir, len);
+            buf[len] = '\0';
+            stat(buf, &st);
+        }
+
+        h = fnv1a(h, &st.st_ino, sizeof(st.st_ino));
+        h = fnv1a(h, &st.st_mtim, sizeof(st.st_mtim));
+        dir += len + (dir[len] == ':');
+    }
+
+    return h;
+}
+
+/** This function runs in the scanner child: it writes the names of the
+ *  executables of the directories of PATH to the pipe, each one followed by
+ *  '\0', and an empty name at the end so that a list cut short is told apart.
+ *  Empty entries of PATH (the current directory) are left out.
+ *
+ */
+static void scan_write(int fd, const char *path){
+
+    FILE *pipe = fdopen(fd, "w");
+    if(pipe == NULL)
+        _exit(EXIT_FAILURE);
+
+    const char *dir = path;
+    while(*dir != '\0'){
+
+        size_t len = strcspn(dir, ":");
+        char buf[4096];
+        DIR *d = NULL;
+        if(len > 0 && len < sizeof(buf)){
+            memcpy(buf, dir, len);
+            buf[len] = '\0';
+            d = opendir(buf);
+        }
+        dir += len + (dir[len] == ':');
+        if(d == NULL)
+            continue;
+
+        struct dirent *entry;
+        while((entry = readdir(d)) != NULL){
+
+            if(entry->d_type == DT_DIR
+                    || faccessat(dirfd(d), entry->d_name, X_OK, 0) == -1)
+                continue;
+
+            /* Links and the file systems without d_type need a stat */
+            struct stat st;
+            if(entry->d_type != DT_REG && (fstatat(dirfd(d), entry->d_name,
+                            &st, 0) == -1 || !S_ISREG(st.st_mode)))
+                continue;
+
+            fwrite(entry->d_name, 1, strlen(entry->d_name) + 1, pipe);
+        }
+        closedir(d);
+    }
+
+    fputc('\0', pipe);
+    _exit(fclose(pipe) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+/** This helper function starts the scanner child for PATH.
+ *
+ */
+static void scan_start(const char *path, uint64_t stamp){
+
+    char *copy = strdup(path);
+    if(!copy){
+        perror("strdup");
+        return;
+    }
+
+    int fd[2];
+    if(pipe2(fd, O_CLOEXEC) == -1){
+        perror("pipe");
+        free(copy);
+        return;
+    }
+
+    pid_t pid = fork();
+    if(pid == 0){
+        signal(SIGINT, SIG_IGN);
+        close(fd[0]);
+        scan_write(fd[1], path);
+    }
+
+    close(fd[1]);
+    if(pid == -1){
+        perror("fork");
+        close(fd[0]);
+        free(copy);
+        return;
+    }
+
+    fcntl(fd[0], F_SETFL, fcntl(fd[0], F_GETFL) | O_NONBLOCK);
+    LOG("Scanning PATH for the highlighting, pid %d\n", pid);
+    scan_fd = fd[0];
+    scan_sz = 0;
+    free(scan_path);
+    scan_path = copy;
+    scan_stamp = stamp;
+}
+
+/** This helper function builds the set of the executables from a list read
+ *  from the scanner, which it takes.
+ *
+ *  Returns: 0 if succeded. -1 if the memory could not be allocated.
+ */
+static int set_build(char *list, size_t list_sz){
+
+    size_t total = 0;
+    for(size_t i = 0; i < list_sz; i++)
+        total += list[i] == '\0';
+
+    size_t sz = 64;
+    while(sz < 2 * total)
+        sz *= 2;
+
+    uint32_t *table = calloc(sz, sizeof(uint32_t));
+    if(!table){
+        perror("calloc");
+        return -1;
+    }
+
+    for(size_t i = 0; i < list_sz; i += strlen(list + i) + 1){
+
+        size_t len = strlen(list + i);
+        if(len == 0)
+            continue;
+
+        size_t slot = fnv1a(FNV1A_START, list + i, len) & (sz - 1);
+        while(table[slot] != 0 && strcmp(list + table[slot] - 1, list + i))
+            slot = (slot + 1) & (sz - 1);
+        table[slot] = i + 1;
+    }
+
+    free(names);
+    free(slots);
+    names = list;
+    slots = table;
+    slots_sz = sz;
+    return 0;
+}
+
+/** This helper function tells whether a name is in the set of the
+ *  executables.
+ *
+ */
+static bool set_contains(const char *name, size_t len){
+
+    size_t slot = fnv1a(FNV1A_START, name, len) & (slots_sz - 1);
+    while(slots[slot] != 0){
+        const char *entry = names + slots[slot] - 1;
+        if(!strncmp(entry, name, len) && entry[len] == '\0')
+            return true;
+        slot = (slot + 1) & (slots_sz - 1);
+    }
+
+    return false;
+}
+
+/** This function tells whether a scan is being read.
+ *
+ */
+bool highlight_pending(void){
+
+    return scan_fd != -1;
+}
+
+/** This function reads what the scanner wrote so far, without blocking. It
+ *  is called while readline waits for input, until the scan is over.
+ *
+ *  Returns: true if the scan is over and the set was replaced.
+ */
+bool highlight_poll(void){
+
+    if(scan_fd == -1)
+        return false;
+
+    ssize_t got;
+    while(true){
+
+        if(scan_sz == scan_limit){
+            size_t limit = scan_limit ? 2 * scan_limit : 65536;
+            char *temp = realloc(scan_buf, limit);
+            if(!temp){
+                perror("realloc");
+                got = -1;
+                break;
+            }
+            scan_buf = temp;
+            scan_limit = limit;
+        }
+
+        got = read(scan_fd, scan_buf + scan_sz, scan_limit - scan_sz);
+        if(got > 0){
+            scan_sz += got;
+            continue;
+        }
+        if(got == -1 && errno == EINTR)
+            continue;
+        if(got == -1 && errno == EAGAIN)
+            return false;
+        if(got == -1)
+            perror("read");
+        break;
+    }
+
+    close(scan_fd);
+    scan_fd = -1;
+
+    /* The list ends with an empty name, unless the scanner failed */
+    if(got == -1 || scan_sz == 0 || scan_buf[scan_sz - 1] != '\0'
+            || (scan_sz > 1 && scan_buf[scan_sz - 2] != '\0'))
+        return false;
+
+    if(set_build(scan_buf, scan_sz) == -1)
+        return false;
+
+    LOG("Highlighting with the executables of %s\n", scan_path);
+    scan_buf = NULL;
+    scan_limit = 0;
+    free(set_path);
+    set_path = scan_path;
+    set_stamp = scan_stamp;
+    scan_path = NULL;
+    return true;
+}
+
+/** This function is called before each prompt: it takes a scan which is over
+ *  and starts a new one when PATH or one of its directories has changed
+ *  since the set was built.
+ *
+ */
+void highlight_refresh(void){
+
+    highlight_poll();
+    if(scan_fd != -1)
+        return;
+
+    const char *path = getenv("PATH");
+    if(path == NULL)
+        path = "";
+
+    uint64_t stamp = path_stamp(path);
+    if(set_path != NULL && !strcmp(set_path, path) && stamp == set_stamp)
+        return;
+
+    scan_start(path, stamp);
+}
+
+/** This helper function appends n bytes to the highlighted line.
+ *
+ */
+static void out_put(const char *s, size_t n){
+
+    if(out_failed)
+        return;
+
+    if(out_sz + n + 1 > out_limit){
+        size_t limit = out_limit ? out_limit : 256;
+        while(out_sz + n + 1 > limit)
+            limit *= 2;
+        char *temp = realloc(out, limit);
+        if(!temp){
+            perror("realloc");
+            out_failed = true;
+            return;
+        }
+        out = temp;
+        out_limit = limit;
+    }
+
+    memcpy(out + out_sz, s, n);
+    out_sz += n;
+    out[out_sz] = '\0';
+}
+
+/** This helper function appends n bytes of the line in the colour of a
+ *  class.
+ *
+ */
+static void out_span(enum highlight_class class, const char *s, size_t n){
+
+    if(colours[class] == NULL){
+        out_put(s, n);
+        return;
+    }
+
+    out_put(colours[class], strlen(colours[class]));
+    out_put(s, n);
+    out_put("\x1b[0m", 4);
+}
+
+/** This helper function returns the end of the process substitution starting
+ *  at i, up to its closing parenthesis, like lex_line.
+ *
+ *  -closed: set to whether the closing parenthesis was typed.
+ *
+ */
+static size_t procsub_end(const char *line, size_t i, size_t len,
+        bool *closed){
+
+    int parens = 0;
+    char quote = '\0';
+    for(i++; i < len; i++){
+        if(line[i] == '\\' && quote != '\'' && i + 1 < len)
+            i++;
+        else if(quote == '\0' && (line[i] == '\'' || line[i] == '"'))
+            quote = line[i];
+        else if(line[i] == quote)
+            quote = '\0';
+        else if(quote == '\0' && line[i] == '(')
+            parens++;
+        else if(quote == '\0' && line[i] == ')' && --parens == 0){
+            *closed = true;
+            return i + 1;
+        }
+    }
+
+    *closed = false;
+    return len;
+}
+
+/** This helper function returns the end of the word starting at i, like
+ *  lex_line; a quote not closed yet runs to the end of the line.
+ *
+ */
+static size_t word_end(const char *line, size_t i, size_t len, int depth){
+
+    char quote = '\0';
+    while(i < len){
+        if(quote == '\0' && (strchr(" \t\r\n|&;<>", line[i])
+                    || (line[i] == '}' && depth > 0)))
+            break;
+
+        if(line[i] == '\\' && quote != '\'' && i + 1 < len){
+            i++;
+        } else if(quote != '\'' && line[i] == '$' && i + 1 < len
+                && line[i + 1] == '{'){
+            while(i + 1 < len && line[i] != '}')
+                i++;
+        } else if(quote == '\0' && (line[i] == '\'' || line[i] == '"')){
+            quote = line[i];
+        } else if(line[i] == quote){
+            quote = '\0';
+        }
+        i++;
+    }
+
+    return i;
+}
+
+/** This helper function classifies a word found where a command name is
+ *  expected.
+ *
+ *  -word: the word, n bytes long.
+ *  -rest: what follows it on the line, rest_sz bytes long.
+ *  -command: set to whether the next word is a command name too.
+ *
+ */
+static enum highlight_class classify(const char *word, size_t n,
+        const char *rest, size_t rest_sz, bool *command){
+
+    *command = false;
+    if(n >= NAME_LEN)
+        return HL_PLAIN;
+
+    char name[NAME_LEN];
+    memcpy(name, word, n);
+    name[n] = '\0';
+
+    for(size_t i = 0; keywords[i] != NULL; i++){
+        if(!strcmp(name, keywords[i])){
+            /* A loop variable or function name follows for and function */
+            *command = strcmp(name, "for") && strcmp(name, "function");
+            return HL_KEYWORD;
+        }
+    }
+
+    /* Assignments and the settings of limit come before the command */
+    if(strchr(name, '=') != NULL){
+        *command = true;
+        return HL_PLAIN;
+    }
+
+    /* The name of a function being defined */
+    size_t i = 0;
+    while(i < rest_sz && (rest[i] == ' ' || rest[i] == '\t'))
+        i++;
+    if((n > 2 && !strcmp(name + n - 2, "()"))
+            || (i + 1 < rest_sz && rest[i] == '(' && rest[i + 1] == ')'))
+        return HL_PLAIN;
+
+    /* Paths and names known once expanded can't be told without a lookup */
+    if(strpbrk(name, "/$`~'\"\\*?[") != NULL)
+        return HL_PLAIN;
+
+    if(builtin_lookup(name) != NULL)
+        return HL_BUILTIN;
+    if(function_lookup(name) != NULL || alias_command(name) != NULL
+            || alias_list(name) != NULL)
+        return HL_COMMAND;
+
+    /* Nothing is marked unknown before the first set is built */
+    if(slots == NULL)
+        return HL_PLAIN;
+
+    return set_contains(name, n) ? HL_COMMAND : HL_UNKNOWN;
+}
+
+/** This helper function appends the highlighted line to out. The commands of
+ *  a process substitution are highlighted like the line.
+ *
+ */
+static void render(const char *line, size_t len){
+
+    bool command = true;
+    bool redirect = false;
+    int depth = 0;
+    size_t i = 0;
+    while(i < len){
+
+        char c = line[i];
+        if(c == ' ' || c == '\t' || c == '\r' || c == '\n'){
+            if(c == '\n')
+                command = true;
+            out_put(line + i++, 1);
+            continue;
+        }
+
+        if(c == '#'){
+            out_put(line + i, len - i);
+            return;
+        }
+
+        if((c == '<' || c == '>') && i + 1 < len && line[i + 1] == '('){
+            bool closed;
+            size_t end = procsub_end(line, i, len, &closed);
+            out_span(HL_REDIRECT, line + i, 2);
+            render(line + i + 2, end - i - 2 - closed);
+            if(closed)
+                out_span(HL_REDIRECT, line + end - 1, 1);
+            command = redirect = false;
+            i = end;
+            continue;
+        }
+
+        if(strchr("|&;<>", c)){
+            size_t n = (c == '>' || c == '|' || c == '&') && i + 1 < len
+                && line[i + 1] == c ? 2 : 1;
+            redirect = c == '<' || c == '>';
+            if(!redirect)
+                command = true;
+            out_span(redirect ? HL_REDIRECT : HL_OPERATOR, line + i, n);
+            i += n;
+            continue;
+        }
+
+        /* Groups, e.g. the consumers of a fan-out or a function body */
+        if(c == '{' && command && (i + 1 == len || strchr(" \t", line[i + 1]))){
+            out_span(HL_KEYWORD, line + i++, 1);
+            depth++;
+            continue;
+        }
+        if(c == '}' && depth > 0){
+            out_span(HL_KEYWORD, line + i++, 1);
+            depth--;
+            command = false;
+            continue;
+        }
+
+        size_t end = word_end(line, i, len, depth);
+        enum highlight_class class = HL_PLAIN;
+        if(redirect)
+            class = HL_REDIRECT;
+        else if(command)
+            class = classify(line + i, end - i, line + end, len - end,
+                    &command);
+        redirect = false;
+        out_span(class, line + i, end - i);
+        i = end;
+    }
+}
+
+/** This function highlights a line with the escape sequences of the
+ *  terminal.
+ *
+ *  -line: the line, len bytes long.
+ *
+ *  Returns: the highlighted line, valid until the next call. NULL if the
+ *  memory could not be allocated.
+ */
+const char *highlight_line(const char *line, size_t len){
+
+    out_sz = 0;
+    out_failed = false;
+    out_put("", 0);
+    render(line, len);
+
+    return out_failed ? NULL : out;
+}
+
+/** This function frees the memory allocated for the highlighting.
+ *
+ */
+void highlight_destroy(void){
+
+    if(scan_fd != -1)
+        close(scan_fd);
+    scan_fd = -1;
+    free(scan_buf);
+    free(scan_path);
+    free(set_path);
+    free(names);
+    free(slots);
+    free(out);
+    scan_buf = scan_path = set_path = names = out = NULL;
+    slots = NULL;
+    scan_sz = scan_limit = out_sz = out_limit = slots_sz = 0;
+}
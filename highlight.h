@@ -0,0 +1,16 @@
+/**@file
+ *  Header file which contains the highlighting of the line being typed and
+ *  the set of the commands found in PATH.
+ */
+#ifndef _HIGHLIGHT_H_
+#define _HIGHLIGHT_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+void highlight_refresh(void);
+bool highlight_pending(void);
+bool highlight_poll(void);
+const char *highlight_line(const char *, size_t);
+void highlight_destroy(void);
+#endif
@@ -2,13 +2,32 @@
  * This file handles the history structure which is used for the history
  * command.
  *
+ * The history can be shared between sessions through a history file. Every
+ * session appends its commands to the file with a single O_APPEND write, which
+ * the kernel performs atomically, so no lock is needed. Each session remembers
+ * the offset up to which it has read the file and only reads the records that
+ * were appended after it. A record is the time the command was entered, on a
+ * line of its own as `#seconds`, followed by the command; records written
+ * without the time are still read.
+ *
  */
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "history.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "util.h"
 #include "logger.h"
 
 /** This struct is used to hold all the history commands. Total is used for the
@@ -22,7 +41,88 @@ struct history {
     char **commands;
 };
 
+/* Half-life of the frecency scores of the command names */
+#define FRECENCY_HALF_LIFE (3 * 24 * 3600.0)
+
+/** This struct holds a dictionary of strings, each one stored once and
+ *  identified by its index, looked up through an open addressing table.
+ *
+ *  -names, names_sz: the strings, by id; id 0 is the empty string.
+ *  -slots, slots_sz: the table, holding the ids plus 1, 0 for a free slot.
+ *
+ */
+struct dict {
+    char **names;
+    size_t names_sz;
+    uint32_t *slots;
+    size_t slots_sz;
+};
+
+/** This struct holds the metadata of the commands, in columns, so that a
+ *  query scans only the columns it filters on, in tight loops over arrays.
+ *  The directories and command names are stored once, in dictionaries, and
+ *  the columns hold their ids.
+ *
+ *  -total, limit: used and allocated entries of each column.
+ *  -start: time the command started.
+ *  -duration: how long it ran, in milliseconds.
+ *  -status: its exit code.
+ *  -stages: number of commands it ran.
+ *  -cwd: id of the directory it ran in, in cwds.
+ *  -name: id of its first word, in names.
+ *  -text: offset of the command in texts.
+ *  -texts, texts_sz, texts_limit: the commands, each one terminated by a NUL.
+ *
+ */
+struct columns {
+    size_t total;
+    size_t limit;
+    int64_t *start;
+    uint32_t *duration;
+    int32_t *status;
+    uint16_t *stages;
+    uint32_t *cwd;
+    uint32_t *name;
+    size_t *text;
+    char *texts;
+    size_t texts_sz;
+    size_t texts_limit;
+    struct dict cwds;
+    struct dict names;
+};
+
 static struct history *c_history; 
+static int hist_fd = -1;
+static off_t hist_offset = 0;
+static size_t hist_bytes = 0;
+/* Frecency scores of the command names (first word of the lines) */
+static struct frecency scores = { .half_life = FRECENCY_HALF_LIFE };
+static struct columns meta;
+static int meta_fd = -1;
+static off_t meta_offset = 0;
+/* Time read for the next record of the history file, 0 if none */
+static time_t record_time = 0;
+
+/** This struct holds the candidates of the last suggestion, so that the next
+ *  keystroke, which usually extends the line, only narrows them.
+ *
+ *  -prefix: the line the candidates start with, NULL if there are none.
+ *  -total: number of commands of the history when they were found.
+ *  -cnums: numbers of the candidate commands, the most recent first.
+ *  -cnums_sz, cnums_limit: used and allocated entries of cnums.
+ *
+ */
+struct candidates {
+    char *prefix;
+    unsigned int total;
+    unsigned int *cnums;
+    size_t cnums_sz;
+    size_t cnums_limit;
+};
+
+static struct candidates suggest;
+
+static void dict_destroy(struct dict *);
 /** This function initializes the history struct using the limit which is passed
  *  as the max numbers of history commands to be saved.
  *
@@ -64,25 +164,283 @@ void hist_destroy(void)
     free(c_history->commands);
     free(c_history);
 
+    free(suggest.prefix);
+    free(suggest.cnums);
+    memset(&suggest, 0, sizeof(struct candidates));
+
+    frecency_clear(&scores);
+
+    if(hist_fd != -1){
+        close(hist_fd);
+        hist_fd = -1;
+    }
+
+    if(meta_fd != -1){
+        close(meta_fd);
+        meta_fd = -1;
+    }
+    free(meta.start);
+    free(meta.duration);
+    free(meta.status);
+    free(meta.stages);
+    free(meta.cwd);
+    free(meta.name);
+    free(meta.text);
+    free(meta.texts);
+    dict_destroy(&meta.cwds);
+    dict_destroy(&meta.names);
+    memset(&meta, 0, sizeof(struct columns));
 }
 
-/** This function adds a new  command to the history struct
+/** This function bumps the score of the command name of a history entry. The
+ *  entry ends at a NUL or a newline.
+ *
+ *  -cmd: the entry.
+ *  -when: time the command was entered.
  *
  */
-void hist_add(const char *cmd)
+static void frecency_update(const char *cmd, time_t when)
+{
+    while(*cmd == ' ' || *cmd == '\t')
+        cmd++;
+
+    if(*cmd != '\0' && *cmd != '\n')
+        frecency_bump(&scores, cmd, strcspn(cmd, " \t\n"), when, 1.0);
+}
+
+/** This function returns the frecency score of a command name, i.e. how often
+ *  and how recently it was used. The lookup is a single hash probe.
+ *
+ *  Returns: the score, 0 if the command is not in the history.
+ */
+double hist_frecency(const char *name)
+{
+    struct frecency_entry *entry = frecency_find(&scores, name,
+            strcspn(name, " \t\n"));
+    if(entry == NULL)
+        return 0;
+
+    return frecency_score(&scores, entry, time(NULL));
+}
+
+/** This function stores a command in the history ring.
+ *
+ *  -cmd: command to store.
+ *  -cmd_sz: length of the command.
+ *  -when: time the command was entered.
+ *
+ */
+static void hist_store(const char *cmd, size_t cmd_sz, time_t when)
 {
     if(c_history->commands[c_history->total % c_history->limit] != NULL){
+       hist_bytes -= strlen(c_history->commands[c_history->total % c_history->limit]);
        free(c_history->commands[c_history->total % c_history->limit]);  
     }
-    c_history->commands[c_history->total % c_history->limit] = strdup(cmd);
+    c_history->commands[c_history->total % c_history->limit] = strndup(cmd, cmd_sz);
     if(!c_history->commands[c_history->total % c_history->limit]){
     
-        perror("strdup");
+        perror("strndup");
         return;
     }
     c_history->total += 1;
+    hist_bytes += strlen(c_history->commands[(c_history->total - 1) % c_history->limit]);
+
+    frecency_update(cmd, when);
+}
+
+/** This function adds a new  command to the history struct. If a history file
+ *  is open, the command is appended to it as one record and then read back
+ *  together with the records other sessions appended in the meantime, so every
+ *  session numbers the commands in file order.
+ *
+ */
+void hist_add(const char *cmd)
+{
+    time_t now = time(NULL);
+    if(hist_fd == -1){
+        hist_store(cmd, strlen(cmd), now);
+        return;
+    }
+
+    size_t cmd_sz = strlen(cmd);
+    char *record;
+    int record_sz = asprintf(&record, "#%lld\n%s\n", (long long) now, cmd);
+    if(record_sz == -1){
+        perror("asprintf");
+        return;
+    }
+
+    /* The whole record goes out in one write so that appends of concurrent
+     * sessions never interleave. */
+    ssize_t written = write(hist_fd, record, record_sz);
+    free(record);
+
+    if(written != record_sz){
+        perror("history write");
+        hist_store(cmd, cmd_sz, now);
+        return;
+    }
+
+    hist_sync();
+}
+
+/** This helper function reads the time line of a record, `#seconds`.
+ *
+ *  Returns: the time, -1 if the line is a command.
+ */
+static time_t record_line_time(const char *line, size_t line_sz)
+{
+    if(line_sz < 2 || line_sz > 20 || *line != '#')
+        return -1;
+
+    time_t when = 0;
+    for(size_t i = 1; i < line_sz; i++){
+        if(!isdigit((unsigned char) line[i]))
+            return -1;
+        when = when * 10 + line[i] - '0';
+    }
+    return when;
+}
+
+/** This function reads the records appended to the history file since the
+ *  last call and adds them to the history. A record which is not complete yet
+ *  is left for the next call.
+ *
+ */
+void hist_sync(void)
+{
+    if(hist_fd == -1)
+        return;
+
+    stats_inc(STAT_HIST_SYNCS);
+    size_t buf_sz = 65536;
+    size_t used = 0;
+    char *buf = malloc(buf_sz);
+    if(!buf){
+        perror("malloc");
+        return;
+    }
+
+    while(true){
+        ssize_t read_sz = pread(hist_fd, buf + used, buf_sz - used,
+                hist_offset + used);
+        if(read_sz <= 0)
+            break;
+
+        used += read_sz;
+
+        char *start = buf;
+        char *end;
+        while((end = memchr(start, '\n', buf + used - start)) != NULL){
+            time_t when = record_line_time(start, end - start);
+            if(when != -1)
+                record_time = when;
+            else if(end != start){
+                hist_store(start, end - start,
+                        record_time ? record_time : time(NULL));
+                record_time = 0;
+            }
+            start = end + 1;
+        }
+
+        hist_offset += start - buf;
+        used = buf + used - start;
+        memmove(buf, start, used);
+
+        /* A single record larger than the buffer */
+        if(used == buf_sz){
+            char *temp = realloc(buf, buf_sz * 2);
+            if(!temp){
+                perror("realloc");
+                break;
+            }
+            buf = temp;
+            buf_sz *= 2;
+        }
+    }
+
+    free(buf);
+}
+
+/** This function opens the history file shared by the sessions and loads its
+ *  last entries. Only the tail of the file is read: the file is scanned
+ *  backwards until 'limit' records are found.
+ *
+ *  -path: path of the history file.
+ *
+ *  Returns: 0 if succeded. -1 if the file could not be opened.
+ */
+int hist_open(const char *path)
+{
+    hist_fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if(hist_fd == -1){
+        perror(path);
+        return -1;
+    }
+
+    struct stat st;
+    if(fstat(hist_fd, &st) == -1){
+        perror("fstat");
+        close(hist_fd);
+        hist_fd = -1;
+        return -1;
+    }
+
+    char buf[8192];
+    off_t pos = st.st_size;
+    unsigned int lines = 0;
+    hist_offset = 0;
+
+    /* Only the lines of the commands are counted; next is the first byte of
+     * the line following buf[i] */
+    int next = -1;
+    while(pos > 0 && hist_offset == 0){
+        size_t chunk = pos < sizeof(buf) ? pos : sizeof(buf);
+        pos -= chunk;
+        if(pread(hist_fd, buf, chunk, pos) != chunk)
+            break;
+
+        for(int i = chunk - 1; i >= 0; i--){
+            /* The newline ending the last record does not start a record */
+            bool counted = buf[i] == '\n' && pos + i != st.st_size - 1
+                && next != '#';
+            next = (unsigned char) buf[i];
+            if(!counted || ++lines < c_history->limit)
+                continue;
+
+            hist_offset = pos + i + 1;
+            break;
+        }
+    }
+
+    /* The first command loaded keeps the time line before it */
+    char line[24];
+    ssize_t line_sz = hist_offset > 0 ? pread(hist_fd, line,
+            hist_offset < sizeof(line) ? hist_offset : sizeof(line),
+            hist_offset - (hist_offset < sizeof(line) ? hist_offset
+                : sizeof(line))) : 0;
+    if(line_sz > 1){
+        ssize_t start = line_sz - 1;
+        while(start > 0 && line[start - 1] != '\n')
+            start--;
+        if((start > 0 || hist_offset == line_sz)
+                && record_line_time(line + start, line_sz - 1 - start) != -1)
+            hist_offset -= line_sz - start;
+    }
 
+    hist_sync();
 
+    /* The metadata of the commands is kept next to the history file, and
+     * only read once the history is queried */
+    char *meta_path;
+    if(asprintf(&meta_path, "%s.meta", path) != -1){
+        meta_fd = open(meta_path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC,
+                0600);
+        if(meta_fd == -1)
+            perror(meta_path);
+        free(meta_path);
+    }
+    return 0;
 }
 
 /** This function prints all the commands in the history up to limit commands
@@ -133,6 +491,84 @@ const char *hist_search_prefix(char *prefix)
     return NULL;
 }
 
+/** This function suggests how to complete the line being typed: the most
+ *  recent command of the history which starts with it. The candidates found
+ *  for the last line are kept, so a line which extends it (the next keystroke)
+ *  only filters them; any other line, or a change of the history, looks
+ *  through the whole history again.
+ *
+ *  The search gives up once it took budget nanoseconds, and then suggests
+ *  nothing: a suggestion must never slow down typing.
+ *
+ *  -line: the line typed so far.
+ *  -budget: the time the search may take, in nanoseconds.
+ *
+ *  Returns: the command suggested, NULL if none.
+ */
+const char *hist_suggest(const char *line, uint64_t budget)
+{
+    size_t line_sz = strlen(line);
+    if(line_sz == 0 || c_history == NULL)
+        return NULL;
+
+    uint64_t deadline = stats_now() + budget;
+    bool narrow = suggest.prefix != NULL && suggest.total == c_history->total
+        && !strncmp(line, suggest.prefix, strlen(suggest.prefix));
+
+    if(narrow){
+        size_t kept = 0;
+        for(size_t i = 0; i < suggest.cnums_sz; i++){
+            if(i % 64 == 63 && stats_now() > deadline)
+                goto over;
+
+            const char *cmd = hist_search_cnum(suggest.cnums[i]);
+            if(cmd != NULL && !strncmp(cmd, line, line_sz))
+                suggest.cnums[kept++] = suggest.cnums[i];
+        }
+        suggest.cnums_sz = kept;
+    } else {
+        if(suggest.cnums_limit < c_history->limit){
+            unsigned int *temp = realloc(suggest.cnums,
+                    c_history->limit * sizeof(unsigned int));
+            if(!temp){
+                perror("realloc");
+                goto over;
+            }
+            suggest.cnums = temp;
+            suggest.cnums_limit = c_history->limit;
+        }
+
+        suggest.cnums_sz = 0;
+        unsigned int lower = c_history->total > c_history->limit
+            ? c_history->total - c_history->limit : 0;
+        for(unsigned int cnum = c_history->total; cnum > lower; cnum--){
+            if(cnum % 64 == 0 && stats_now() > deadline)
+                goto over;
+
+            const char *cmd = c_history->commands[(cnum - 1) % c_history->limit];
+            if(cmd != NULL && !strncmp(cmd, line, line_sz))
+                suggest.cnums[suggest.cnums_sz++] = cnum;
+        }
+    }
+
+    free(suggest.prefix);
+    suggest.prefix = strdup(line);
+    suggest.total = c_history->total;
+
+    for(size_t i = 0; i < suggest.cnums_sz; i++){
+        const char *cmd = hist_search_cnum(suggest.cnums[i]);
+        if(cmd != NULL && cmd[line_sz] != '\0')
+            return cmd;
+    }
+    return NULL;
+
+over:
+    /* The candidates are incomplete, the next line starts over */
+    free(suggest.prefix);
+    suggest.prefix = NULL;
+    return NULL;
+}
+
 /** This function returns the command corresponding to the command_number 
  *
  */
@@ -152,6 +588,20 @@ const char *hist_search_cnum(int command_number)
     return NULL;
 }
 
+/** This function returns the size of the history, for nashstat.
+ *
+ *  -entries: set to the number of commands entered.
+ *  -bytes: set to the size of the commands kept in memory.
+ *  -file_bytes: set to the offset read up to in the history file.
+ *
+ */
+void hist_stats(unsigned int *entries, size_t *bytes, long *file_bytes)
+{
+    *entries = c_history->total;
+    *bytes = hist_bytes;
+    *file_bytes = hist_offset;
+}
+
 /** This function returns the index of the last command
  *  the prompt starts from 1, hence the +1
  */
@@ -161,3 +611,779 @@ unsigned int hist_last_cnum(void)
         return (c_history->total + 1);
     return 0;
 }
+
+/** This function returns the id of a string in a dictionary, adding it if it
+ *  is not there yet.
+ *
+ *  Returns: the id, 0 (the empty string) if memory could not be allocated.
+ */
+static uint32_t dict_intern(struct dict *dict, const char *str, size_t len)
+{
+    if(dict->names_sz == 0 || (dict->names_sz + 1) * 2 > dict->slots_sz){
+        size_t slots_sz = dict->slots_sz ? dict->slots_sz * 2 : 64;
+        uint32_t *slots = calloc(slots_sz, sizeof(uint32_t));
+        char **names = realloc(dict->names, slots_sz / 2 * sizeof(char *));
+        if(!slots || !names){
+            perror("calloc");
+            free(slots);
+            if(names)
+                dict->names = names;
+            return 0;
+        }
+        dict->names = names;
+
+        /* Slots hold the id plus 1, 0 being a free slot */
+        for(size_t i = 0; i < dict->names_sz; i++){
+            size_t slot = fnv1a(FNV1A_START, dict->names[i],
+                    strlen(dict->names[i]))
+                & (slots_sz - 1);
+            while(slots[slot] != 0)
+                slot = (slot + 1) & (slots_sz - 1);
+            slots[slot] = i + 1;
+        }
+        free(dict->slots);
+        dict->slots = slots;
+        dict->slots_sz = slots_sz;
+
+        if(dict->names_sz == 0){
+            if(!(dict->names[0] = strdup(""))){
+                perror("strdup");
+                return 0;
+            }
+            dict->names_sz = 1;
+            dict->slots[fnv1a(FNV1A_START, "", 0) & (slots_sz - 1)] = 1;
+        }
+    }
+
+    size_t slot = fnv1a(FNV1A_START, str, len) & (dict->slots_sz - 1);
+    for(; dict->slots[slot] != 0; slot = (slot + 1) & (dict->slots_sz - 1)){
+        const char *name = dict->names[dict->slots[slot] - 1];
+        if(!strncmp(name, str, len) && name[len] == '\0')
+            return dict->slots[slot] - 1;
+    }
+
+    if(!(dict->names[dict->names_sz] = strndup(str, len))){
+        perror("strndup");
+        return 0;
+    }
+    dict->slots[slot] = dict->names_sz + 1;
+    return dict->names_sz++;
+}
+
+/** This function frees a dictionary.
+ *
+ */
+static void dict_destroy(struct dict *dict)
+{
+    for(size_t i = 0; i < dict->names_sz; i++)
+        free(dict->names[i]);
+    free(dict->names);
+    free(dict->slots);
+    memset(dict, 0, sizeof(struct dict));
+}
+
+/** This helper function grows a column to hold limit entries.
+ *
+ *  Returns: 0 if succeded. -1 if memory could not be allocated.
+ */
+static int column_grow(void *column, size_t size, size_t limit)
+{
+    void *temp = realloc(*(void **) column, limit * size);
+    if(!temp){
+        perror("realloc");
+        return -1;
+    }
+    *(void **) column = temp;
+    return 0;
+}
+
+/** This function appends the metadata of a command to the columns.
+ *
+ *  -start: time the command started.
+ *  -duration: how long it ran, in milliseconds.
+ *  -status: its exit code.
+ *  -stages: number of commands it ran.
+ *  -cwd, cwd_sz: the directory it ran in.
+ *  -cmd, cmd_sz: the command.
+ *
+ */
+static void columns_add(int64_t start, uint32_t duration, int32_t status,
+        uint16_t stages, const char *cwd, size_t cwd_sz, const char *cmd,
+        size_t cmd_sz)
+{
+    struct columns *c = &meta;
+    if(c->total == c->limit){
+        size_t limit = c->limit ? c->limit * 2 : 1024;
+        if(column_grow(&c->start, sizeof(int64_t), limit) == -1
+                || column_grow(&c->duration, sizeof(uint32_t), limit) == -1
+                || column_grow(&c->status, sizeof(int32_t), limit) == -1
+                || column_grow(&c->stages, sizeof(uint16_t), limit) == -1
+                || column_grow(&c->cwd, sizeof(uint32_t), limit) == -1
+                || column_grow(&c->name, sizeof(uint32_t), limit) == -1
+                || column_grow(&c->text, sizeof(size_t), limit) == -1)
+            return;
+        c->limit = limit;
+    }
+
+    if(c->texts_sz + cmd_sz + 1 > c->texts_limit){
+        size_t limit = c->texts_limit ? c->texts_limit : 65536;
+        while(c->texts_sz + cmd_sz + 1 > limit)
+            limit *= 2;
+        if(column_grow(&c->texts, 1, limit) == -1)
+            return;
+        c->texts_limit = limit;
+    }
+
+    size_t i = c->total++;
+    c->start[i] = start;
+    c->duration[i] = duration;
+    c->status[i] = status;
+    c->stages[i] = stages;
+    c->cwd[i] = dict_intern(&c->cwds, cwd, cwd_sz);
+    c->name[i] = dict_intern(&c->names, cmd, strcspn(cmd, " \t|;&"));
+    c->text[i] = c->texts_sz;
+    memcpy(c->texts + c->texts_sz, cmd, cmd_sz);
+    c->texts[c->texts_sz + cmd_sz] = '\0';
+    c->texts_sz += cmd_sz + 1;
+}
+
+/** This function parses a record of the metadata file:
+ *
+ *      start \t duration \t status \t stages \t cwd \t command
+ *
+ *  A record which can't be parsed is skipped.
+ *
+ */
+static void meta_parse(char *record, size_t record_sz)
+{
+    record[record_sz] = '\0';
+
+    long long fields[4];
+    char *pos = record;
+    for(int i = 0; i < 4; i++){
+        char *end;
+        fields[i] = strtoll(pos, &end, 10);
+        if(end == pos || *end != '\t')
+            return;
+        pos = end + 1;
+    }
+
+    char *cwd = pos;
+    char *cmd = strchr(cwd, '\t');
+    if(cmd == NULL)
+        return;
+
+    columns_add(fields[0], fields[1], fields[2], fields[3], cwd, cmd - cwd,
+            cmd + 1, record + record_sz - cmd - 1);
+}
+
+/** This function reads the records appended to the metadata file since the
+ *  last call, like hist_sync() does for the commands.
+ *
+ */
+static void meta_sync(void)
+{
+    if(meta_fd == -1)
+        return;
+
+    size_t buf_sz = 1 << 20;
+    size_t used = 0;
+    char *buf = malloc(buf_sz + 1);
+    if(!buf){
+        perror("malloc");
+        return;
+    }
+
+    ssize_t read_sz;
+    while((read_sz = pread(meta_fd, buf + used, buf_sz - used,
+                    meta_offset + used)) > 0){
+
+        used += read_sz;
+
+        char *start = buf;
+        char *end;
+        while((end = memchr(start, '\n', buf + used - start)) != NULL){
+            meta_parse(start, end - start);
+            start = end + 1;
+        }
+
+        meta_offset += start - buf;
+        used = buf + used - start;
+        memmove(buf, start, used);
+
+        if(used == buf_sz){
+            char *temp = realloc(buf, buf_sz * 2 + 1);
+            if(!temp){
+                perror("realloc");
+                break;
+            }
+            buf = temp;
+            buf_sz *= 2;
+        }
+    }
+
+    free(buf);
+}
+
+/** This function records the metadata of a command once it has run. With a
+ *  history file, the record is appended to its metadata file with a single
+ *  O_APPEND write, and read back with those of the other sessions when the
+ *  history is queried.
+ *
+ *  -cmd: the command.
+ *  -start: time the command started.
+ *  -duration: how long it ran, in milliseconds.
+ *  -status: its exit code.
+ *  -cwd: the directory it ran in.
+ *  -stages: number of commands it ran.
+ *
+ */
+void hist_meta(const char *cmd, time_t start, uint32_t duration, int status,
+        const char *cwd, unsigned int stages)
+{
+    if(stages > UINT16_MAX)
+        stages = UINT16_MAX;
+
+    if(meta_fd == -1){
+        columns_add(start, duration, status, stages, cwd, strlen(cwd), cmd,
+                strlen(cmd));
+        return;
+    }
+
+    /* Tabs and newlines of the directory would break the record */
+    char *safe_cwd = strdup(cwd);
+    if(!safe_cwd){
+        perror("strdup");
+        return;
+    }
+    for(char *c = safe_cwd; *c != '\0'; c++){
+        if(*c == '\t' || *c == '\n')
+            *c = '?';
+    }
+
+    char *record;
+    int record_sz = asprintf(&record, "%lld\t%u\t%d\t%u\t%s\t%s\n",
+            (long long) start, duration, status, stages, safe_cwd, cmd);
+    free(safe_cwd);
+    if(record_sz == -1){
+        perror("asprintf");
+        return;
+    }
+
+    /* A single write, so that records of concurrent sessions never
+     * interleave */
+    if(write(meta_fd, record, record_sz) != record_sz)
+        perror("history write");
+    free(record);
+}
+
+/** This struct holds the filters and the output of a history query.
+ *
+ *  -since, until: range of start times, -1 if not set.
+ *  -status: exit code the commands must have, -1 if not set.
+ *  -failed: only the commands which failed.
+ *  -slower: minimal duration, in milliseconds.
+ *  -stages: minimal number of commands.
+ *  -cwd: prefix of the directory the commands ran in, NULL if not set.
+ *  -cmd: text the commands must hold, NULL if not set.
+ *  -by_duration: sort by duration, slowest first, instead of by start time.
+ *  -top: number of rows printed, 0 for all.
+ *  -by: column the commands are grouped by, NULL if not grouped.
+ *
+ */
+struct query {
+    int64_t since;
+    int64_t until;
+    int64_t status;
+    bool failed;
+    uint32_t slower;
+    uint16_t stages;
+    const char *cwd;
+    const char *cmd;
+    bool by_duration;
+    size_t top;
+    const char *by;
+};
+
+/** This struct holds the aggregates of a group of commands.
+ *
+ */
+struct group {
+    size_t count;
+    size_t fails;
+    uint64_t total;
+    uint32_t max;
+    uint32_t key;
+};
+
+/** This helper function parses a duration such as 500ms, 30 (seconds), 5m,
+ *  2h or 1d.
+ *
+ *  Returns: the duration in milliseconds, -1 if it is not valid.
+ */
+static int64_t parse_duration(const char *value)
+{
+    char *unit;
+    double number = strtod(value, &unit);
+    if(unit == value || number < 0)
+        return -1;
+
+    static const struct { const char *unit; double ms; } units[] = {
+        { "", 1000 }, { "ms", 1 }, { "s", 1000 }, { "m", 60000 },
+        { "h", 3600000 }, { "d", 86400000 }
+    };
+    for(size_t i = 0; i < sizeof(units) / sizeof(*units); i++){
+        if(!strcmp(unit, units[i].unit))
+            return number * units[i].ms;
+    }
+    return -1;
+}
+
+/** This helper function parses a time: today, yesterday, a date (YYYY-MM-DD)
+ *  or a duration ago (e.g. 2h).
+ *
+ *  Returns: the time, -1 if it is not valid.
+ */
+static int64_t parse_time(const char *value)
+{
+    time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+    tm.tm_isdst = -1;
+
+    if(!strcmp(value, "today"))
+        return mktime(&tm);
+
+    if(!strcmp(value, "yesterday")){
+        tm.tm_mday--;
+        return mktime(&tm);
+    }
+
+    char *end = strptime(value, "%Y-%m-%d", &tm);
+    if(end != NULL && *end == '\0')
+        return mktime(&tm);
+
+    int64_t ago = parse_duration(value);
+    return ago == -1 ? -1 : now - ago / 1000;
+}
+
+/** This helper function parses the filters of a query, given as key=value
+ *  words like the limit prefix.
+ *
+ *  Returns: 0 if succeded. -1 if a filter is not valid.
+ */
+static int query_parse(char **args, struct query *q)
+{
+    memset(q, 0, sizeof(struct query));
+    q->since = q->until = q->status = -1;
+
+    for(int i = 0; args[i] != NULL; i++){
+
+        char *value = strchr(args[i], '=');
+        if(value == NULL){
+            fprintf(stderr, "history: %s: expected key=value\n", args[i]);
+            return -1;
+        }
+        size_t key_sz = value++ - args[i];
+        const char *key = args[i];
+        int64_t number = 0;
+
+        if(!strncmp(key, "since", key_sz) && key_sz == 5){
+            number = q->since = parse_time(value);
+        } else if(!strncmp(key, "until", key_sz) && key_sz == 5){
+            number = q->until = parse_time(value);
+        } else if(!strncmp(key, "day", key_sz) && key_sz == 3){
+            number = q->since = parse_time(value);
+            if(number != -1){
+                struct tm tm;
+                time_t since = q->since;
+                localtime_r(&since, &tm);
+                tm.tm_mday++;
+                tm.tm_isdst = -1;
+                q->until = mktime(&tm);
+            }
+        } else if(!strncmp(key, "status", key_sz) && key_sz == 6){
+            if(!strcmp(value, "fail"))
+                q->failed = true;
+            else
+                number = q->status = isdigit((unsigned char) *value)
+                    ? atoi(value) : -1;
+        } else if(!strncmp(key, "slower", key_sz) && key_sz == 6){
+            number = parse_duration(value);
+            q->slower = number > UINT32_MAX ? UINT32_MAX : number;
+        } else if(!strncmp(key, "stages", key_sz) && key_sz == 6){
+            number = atoi(value) > 0 ? atoi(value) : -1;
+            q->stages = number > UINT16_MAX ? UINT16_MAX : number;
+        } else if(!strncmp(key, "cwd", key_sz) && key_sz == 3){
+            q->cwd = value;
+        } else if(!strncmp(key, "cmd", key_sz) && key_sz == 3){
+            q->cmd = value;
+        } else if(!strncmp(key, "sort", key_sz) && key_sz == 4){
+            q->by_duration = !strcmp(value, "duration");
+            if(!q->by_duration && strcmp(value, "start"))
+                number = -1;
+        } else if(!strncmp(key, "top", key_sz) && key_sz == 3){
+            number = atoi(value) > 0 ? (q->top = atoi(value)) : -1;
+        } else if(!strncmp(key, "by", key_sz) && key_sz == 2){
+            q->by = value;
+            if(strcmp(value, "cwd") && strcmp(value, "command")
+                    && strcmp(value, "status"))
+                number = -1;
+        } else {
+            fprintf(stderr, "history: %.*s: unknown filter\n", (int) key_sz,
+                    key);
+            return -1;
+        }
+
+        if(number == -1){
+            fprintf(stderr, "history: %s: invalid value\n", args[i]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/** This function selects the commands matching the filters of a query. Each
+ *  filter is a branchless loop over one column, clearing the entries of sel
+ *  that don't match, which the compiler can vectorize; only the cmd filter
+ *  looks at the text, and only of the commands left.
+ *
+ *  -q: the query.
+ *  -sel: set to 1 for the commands matching, 0 for the others.
+ *
+ *  Returns: 0 if succeded. -1 if memory could not be allocated.
+ */
+static int query_select(const struct query *q, uint8_t *sel)
+{
+    const size_t n = meta.total;
+    memset(sel, 1, n);
+
+    if(q->since != -1){
+        for(size_t i = 0; i < n; i++)
+            sel[i] &= meta.start[i] >= q->since;
+    }
+    if(q->until != -1){
+        for(size_t i = 0; i < n; i++)
+            sel[i] &= meta.start[i] < q->until;
+    }
+    if(q->failed){
+        for(size_t i = 0; i < n; i++)
+            sel[i] &= meta.status[i] != 0;
+    }
+    if(q->status != -1){
+        for(size_t i = 0; i < n; i++)
+            sel[i] &= meta.status[i] == q->status;
+    }
+    if(q->slower > 0){
+        for(size_t i = 0; i < n; i++)
+            sel[i] &= meta.duration[i] >= q->slower;
+    }
+    if(q->stages > 0){
+        for(size_t i = 0; i < n; i++)
+            sel[i] &= meta.stages[i] >= q->stages;
+    }
+
+    /* The prefix is matched once per directory, then looked up by id */
+    if(q->cwd != NULL){
+        uint8_t *match = malloc(meta.cwds.names_sz);
+        if(!match){
+            perror("malloc");
+            return -1;
+        }
+        size_t cwd_sz = strlen(q->cwd);
+        while(cwd_sz > 1 && q->cwd[cwd_sz - 1] == '/')
+            cwd_sz--;
+        for(size_t i = 0; i < meta.cwds.names_sz; i++){
+            const char *name = meta.cwds.names[i];
+            match[i] = !strncmp(name, q->cwd, cwd_sz)
+                && (name[cwd_sz] == '\0' || name[cwd_sz] == '/'
+                        || q->cwd[cwd_sz - 1] == '/');
+        }
+        for(size_t i = 0; i < n; i++)
+            sel[i] &= match[meta.cwd[i]];
+        free(match);
+    }
+
+    if(q->cmd != NULL){
+        for(size_t i = 0; i < n; i++){
+            if(sel[i])
+                sel[i] = strstr(meta.texts + meta.text[i], q->cmd) != NULL;
+        }
+    }
+    return 0;
+}
+
+/** This helper function formats a duration given in milliseconds.
+ *
+ */
+static void format_duration(char *buf, size_t buf_sz, uint64_t ms)
+{
+    unsigned long long t = ms;
+    if(t < 1000)
+        snprintf(buf, buf_sz, "%llums", t);
+    else if(t < 60000)
+        snprintf(buf, buf_sz, "%.1fs", t / 1000.0);
+    else if(t < 3600000)
+        snprintf(buf, buf_sz, "%llum%02llus", t / 60000, t / 1000 % 60);
+    else
+        snprintf(buf, buf_sz, "%lluh%02llum", t / 3600000, t / 60000 % 60);
+}
+
+/** These functions compare the selected commands by duration, slowest first,
+ *  and the groups by total duration, largest first.
+ *
+ */
+static int compare_duration(const void *a, const void *b)
+{
+    uint32_t d1 = meta.duration[*(const size_t *) a];
+    uint32_t d2 = meta.duration[*(const size_t *) b];
+    return d1 < d2 ? 1 : d1 > d2 ? -1 : 0;
+}
+
+static int compare_groups(const void *a, const void *b)
+{
+    const struct group *g1 = a, *g2 = b;
+    return g1->total < g2->total ? 1 : g1->total > g2->total ? -1 : 0;
+}
+
+/** This helper function prints the selected commands grouped by the column
+ *  of the query: their count, failures, and total, mean and maximal
+ *  durations, the groups taking the most time first.
+ *
+ *  Returns: 0 if succeded. -1 if memory could not be allocated.
+ */
+static int query_groups(const struct query *q, const size_t *rows,
+        size_t rows_sz)
+{
+    /* Groups are indexed by the dictionary id; statuses get ids on the fly */
+    bool by_status = !strcmp(q->by, "status");
+    bool by_cwd = !strcmp(q->by, "cwd");
+    size_t groups_sz = by_status ? 0
+        : by_cwd ? meta.cwds.names_sz : meta.names.names_sz;
+    size_t limit = by_status ? 16 : groups_sz;
+    struct group *groups = calloc(limit > 0 ? limit : 1, sizeof(struct group));
+    if(!groups){
+        perror("calloc");
+        return -1;
+    }
+    for(size_t i = 0; !by_status && i < groups_sz; i++)
+        groups[i].key = i;
+
+    for(size_t r = 0; r < rows_sz; r++){
+        size_t i = rows[r];
+        size_t g;
+        if(by_status){
+            for(g = 0; g < groups_sz
+                    && groups[g].key != (uint32_t) meta.status[i]; g++);
+            if(g == groups_sz){
+                if(groups_sz == limit){
+                    struct group *temp = realloc(groups,
+                            limit * 2 * sizeof(struct group));
+                    if(!temp){
+                        perror("realloc");
+                        free(groups);
+                        return -1;
+                    }
+                    groups = temp;
+                    limit *= 2;
+                }
+                memset(&groups[groups_sz], 0, sizeof(struct group));
+                groups[groups_sz++].key = meta.status[i];
+            }
+        } else {
+            g = by_cwd ? meta.cwd[i] : meta.name[i];
+        }
+
+        groups[g].count++;
+        groups[g].fails += meta.status[i] != 0;
+        groups[g].total += meta.duration[i];
+        if(meta.duration[i] > groups[g].max)
+            groups[g].max = meta.duration[i];
+    }
+
+    /* The names no matching command has are left out before sorting, as
+     * their total of 0 ties with the commands quicker than 1 ms */
+    size_t used = 0;
+    for(size_t g = 0; g < groups_sz; g++){
+        if(groups[g].count > 0)
+            groups[used++] = groups[g];
+    }
+    qsort(groups, used, sizeof(struct group), compare_groups);
+
+    printf("%8s %6s %9s %9s %9s  %s\n", "count", "fails", "total", "mean",
+            "max", q->by);
+    for(size_t g = 0; g < used && (q->top == 0 || g < q->top); g++){
+        char total[32], mean[32], max[32];
+        format_duration(total, sizeof(total), groups[g].total);
+        format_duration(mean, sizeof(mean), groups[g].total / groups[g].count);
+        format_duration(max, sizeof(max), groups[g].max);
+
+        printf("%8zu %6zu %9s %9s %9s  ", groups[g].count, groups[g].fails,
+                total, mean, max);
+        if(by_status)
+            printf("%d\n", (int32_t) groups[g].key);
+        else
+            printf("%s\n", by_cwd ? meta.cwds.names[groups[g].key]
+                    : meta.names.names[groups[g].key]);
+    }
+
+    free(groups);
+    return 0;
+}
+
+/** This function handles `history -q`, which queries the metadata of the
+ *  commands: when they started, how long they ran, their exit code, the
+ *  directory they ran in and how many commands they ran.
+ *
+ *      history -q [key=value...]
+ *
+ *  The filters are since=, until=, day= (today, yesterday, YYYY-MM-DD or a
+ *  duration ago such as 2h), status= (a code or fail), slower= (a duration
+ *  such as 500ms or 2m), stages=, cwd= (a directory and its subdirectories)
+ *  and cmd= (text the command holds). sort=duration lists the slowest first,
+ *  top=N prints N rows and by=cwd|command|status groups the commands.
+ *
+ *  -args: the filters, NULL terminated.
+ *
+ *  Returns: 0 if succeded. -1 if the query is not valid.
+ */
+int hist_query(char **args)
+{
+    struct query q;
+    if(query_parse(args, &q) == -1)
+        return -1;
+
+    uint64_t started = stats_now();
+    meta_sync();
+
+    uint8_t *sel = malloc(meta.total + 1);
+    size_t *rows = malloc((meta.total + 1) * sizeof(size_t));
+    if(!sel || !rows){
+        perror("malloc");
+        free(sel);
+        free(rows);
+        return -1;
+    }
+
+    if(query_select(&q, sel) == -1){
+        free(sel);
+        free(rows);
+        return -1;
+    }
+
+    size_t rows_sz = 0;
+    for(size_t i = 0; i < meta.total; i++){
+        rows[rows_sz] = i;
+        rows_sz += sel[i];
+    }
+    free(sel);
+    LOG("history: %zu of %zu commands selected in %.2fms\n", rows_sz,
+            meta.total, (stats_now() - started) / 1e6);
+
+    int ret = 0;
+    if(q.by != NULL){
+        ret = query_groups(&q, rows, rows_sz);
+        free(rows);
+        return ret;
+    }
+
+    /* By start time, the most recent ones are kept by top */
+    size_t first = 0;
+    if(q.by_duration)
+        qsort(rows, rows_sz, sizeof(size_t), compare_duration);
+    else if(q.top > 0 && rows_sz > q.top)
+        first = rows_sz - q.top;
+
+    for(size_t r = first; r < rows_sz && (q.top == 0 || r - first < q.top);
+            r++){
+        size_t i = rows[r];
+        char start[32], duration[32];
+        time_t t = meta.start[i];
+        struct tm tm;
+        strftime(start, sizeof(start), "%Y-%m-%d %H:%M:%S",
+                localtime_r(&t, &tm));
+        format_duration(duration, sizeof(duration), meta.duration[i]);
+
+        printf("%s %8s %4d %3u  %s  %s\n", start, duration, meta.status[i],
+                meta.stages[i], meta.cwds.names[meta.cwd[i]],
+                meta.texts + meta.text[i]);
+    }
+
+    free(rows);
+    return ret;
+}
+
+/** This function saves the commands of the history kept in memory and the
+ *  frecency scores of the commands to a snapshot.
+ *
+ */
+void hist_save(struct snapshot *snap)
+{
+    unsigned int first = c_history->total > c_history->limit
+        ? c_history->total - c_history->limit : 0;
+
+    snap_u32(snap, c_history->total);
+    snap_u32(snap, c_history->total - first);
+    for(unsigned int i = first; i < c_history->total; i++)
+        snap_str(snap, c_history->commands[i % c_history->limit]);
+
+    snap_u32(snap, scores.used);
+    for(size_t i = 0; i < scores.size; i++){
+        const struct frecency_entry *entry = &scores.entries[i];
+        if(entry->key == NULL)
+            continue;
+        snap_str(snap, entry->key);
+        snap_f64(snap, entry->score);
+        snap_u64(snap, entry->last);
+    }
+}
+
+/** This function restores what hist_save() saved. The commands are only
+ *  restored if no history file is open, as the file already holds them; the
+ *  scores, which count every command ever entered and not only the ones
+ *  loaded, replace those computed from the file.
+ *
+ */
+void hist_load(struct snapshot *snap)
+{
+    unsigned int total = snap_get_u32(snap);
+    unsigned int count = snap_get_u32(snap);
+    if(snap->failed || count > total)
+        return;
+
+    bool restore = hist_fd == -1;
+    if(restore){
+        for(unsigned int i = 0; i < c_history->limit; i++){
+            free(c_history->commands[i]);
+            c_history->commands[i] = NULL;
+        }
+        hist_bytes = 0;
+        c_history->total = total - count;
+    }
+
+    for(unsigned int i = 0; i < count && !snap->failed; i++){
+        char *cmd = snap_get_str(snap);
+        if(cmd != NULL && restore)
+            hist_store(cmd, strlen(cmd), time(NULL));
+        free(cmd);
+    }
+
+    size_t used = snap_get_u32(snap);
+    if(snap->failed)
+        return;
+
+    struct frecency table = { .half_life = FRECENCY_HALF_LIFE };
+    for(size_t i = 0; i < used && !snap->failed; i++){
+        char *name = snap_get_str(snap);
+        double score = snap_get_f64(snap);
+        time_t last = snap_get_u64(snap);
+        if(name != NULL && *name != '\0' && !snap->failed
+                && frecency_find(&table, name, strlen(name)) == NULL)
+            frecency_bump(&table, name, strlen(name), last, score);
+        free(name);
+    }
+
+    frecency_clear(&scores);
+    scores = table;
+}
@@ -7,12 +7,28 @@
 #ifndef _HISTORY_H_
 #define _HISTORY_H_
 
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+struct snapshot;
+
 void hist_init(unsigned int);
 void hist_destroy(void);
 void hist_add(const char *);
+void hist_sync(void);
+int hist_open(const char *);
 void hist_print(void);
 const char *hist_search_prefix(char *);
 const char *hist_search_cnum(int);
+const char *hist_suggest(const char *, uint64_t);
 unsigned int hist_last_cnum(void);
+double hist_frecency(const char *);
+void hist_stats(unsigned int *, size_t *, long *);
+void hist_meta(const char *, time_t, uint32_t, int, const char *,
+        unsigned int);
+int hist_query(char **);
+void hist_save(struct snapshot *);
+void hist_load(struct snapshot *);
 
 #endif
@@ -1,21 +1,90 @@
 /**@file
  *  This file is used for handling the background jobs.
+ *
+ *  The stdout and stderr of a background job go to a pipe, read by a relay
+ *  process into a ring in shared memory (a memfd mapped by the shell and the
+ *  relay), so the job never writes to the terminal and never waits on it.
+ *  `jobs -o ID` prints what the ring holds. The ring keeps the last
+ *  NASH_JOB_RING bytes (1M by default, 0 to let the jobs write to the
+ *  terminal); with NASH_JOB_SPILL set to a directory, the output about to be
+ *  overwritten is appended to a file there instead of being lost. The rings of
+ *  the last FINISHED_MAX jobs are kept once they end.
+ *
+ *  At most NASH_JOBS_MAX jobs run at once (10 by default): `cpus` sets it to
+ *  the number of CPUs the shell may run on, and `load` to the CPUs the load
+ *  average leaves to the jobs. The jobs started beyond it are queued, the
+ *  highest priority (`limit prio=N`) first, then in the order they were
+ *  started. A queued job is only kept by the shell, as the function which
+ *  starts it: nothing is forked, and it gets no ring, CPUs or cgroup until it
+ *  is admitted. The shell admits the queued jobs from its main loop, between
+ *  two commands and while it waits at the prompt, never from the SIGCHLD
+ *  handler. Queued jobs are dropped when the shell exits.
+ *
+ *  The SIGCHLD handler only reaps the children and records their pids. The
+ *  jobs which ended are deleted, with their cgroup, timer and CPUs, by
+ *  jobs_reap(), which the shell calls from its main loop too, so the handler
+ *  never touches the list or the heap.
  */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/sysinfo.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include "jobs.h"
+#include "snapshot.h"
 #include "util.h"
+#include "limits.h"
 #include "logger.h"
 
+#define DEFAULT_JOB_RING (1024 * 1024)
+/* Rings of finished jobs kept for jobs -o */
+#define FINISHED_MAX 8
+/* Largest read of the relay, the data a reader may see half written */
+#define RING_CHUNK (64 * 1024)
+/* Children reaped by the SIGCHLD handler until jobs_reap() runs */
+#define REAPED_MAX 64
+
+/** This struct is the header of a ring, shared by the shell and the relay.
+ *
+ *  -written: bytes written to the ring since the job started. The data ends at
+ *   written modulo the size of the ring.
+ *  -spilled: bytes appended to the spill file.
+ *  -status: exit code of the job, once done.
+ *  -done: set by the relay once the job ended.
+ *  -spill: path of the spill file, empty if none.
+ *  -data: the ring.
+ *
+ */
+struct ring {
+    uint64_t written;
+    uint64_t spilled;
+    int32_t status;
+    uint32_t done;
+    char spill[256];
+    char data[];
+};
 
 /** This struct holds the different nodes which store the background jobs.
  *  
- *  -total: the total number of jobs.
- *  -size:  the maximum number of jobs it can hold.
+ *  -total: the total number of jobs, running or queued.
+ *  -running: the number of jobs running.
+ *  -limit: the maximum number of jobs running at once, the number of CPUs for
+ *   the limits following the CPUs.
  *  -head:  the first member of the list. In this case a dummy head.
  */
 struct jobs_list {
     size_t total;
+    size_t running;
     size_t limit;
     struct node *head;
 };
@@ -24,18 +93,245 @@ struct jobs_list {
  *
  *  -bg_job: name of the job.
  *  -pid: pid associated with job.
+ *  -cgroup: cgroup the job was placed in, NULL if none.
+ *  -cpus: CPUs given to the job by the spread mode, NULL if none.
+ *  -output: output captured for the job.
+ *  -prio: priority of the job in the queue.
+ *  -start: starts a queued job, which is given to jobs_add() from there,
+ *   NULL once the job runs.
+ *  -drop: frees arg, once the job is started or dropped.
+ *  -arg: the job as kept by the shell while it is queued.
  *  -next: pointer to next job in the list.
  *
  */
 struct node {
     char *bg_job;
     pid_t pid;
+    char *cgroup;
+    char *cpus;
+    struct capture output;
+    int prio;
+    int (*start)(void *);
+    void (*drop)(void *);
+    void *arg;
     struct node *next;
 
 };
 
 static struct jobs_list *jobs = NULL;
 static struct node *head = NULL;
+static unsigned int next_id = 1;
+static struct capture finished[FINISHED_MAX];
+static size_t finished_next = 0;
+static unsigned int default_limit = 0;
+static enum { LIMIT_FIXED, LIMIT_CPUS, LIMIT_LOAD } limit_mode = LIMIT_FIXED;
+/* The queued job being started, which jobs_add() fills */
+static struct node *admitted = NULL;
+/* Only the shell admits its queued jobs, not a forked copy of it */
+static pid_t shell_pid = 0;
+/* Pids reaped by the SIGCHLD handler, and whether it left children unreaped */
+static volatile pid_t reaped[REAPED_MAX];
+static volatile sig_atomic_t reaped_sz = 0;
+static volatile sig_atomic_t reaped_lost = false;
+
+static size_t jobs_limit(void);
+static void jobs_limit_read(void);
+
+/** This function reads the size of the rings from NASH_JOB_RING, which
+ *  accepts a K or M suffix.
+ *
+ */
+static size_t job_ring_sz(void){
+
+    char *env = getenv("NASH_JOB_RING");
+    if(env == NULL)
+        return DEFAULT_JOB_RING;
+
+    char *end;
+    long size = strtol(env, &end, 10);
+    if(*end == 'K' || *end == 'k')
+        size *= 1024;
+    else if(*end == 'M' || *end == 'm')
+        size *= 1024 * 1024;
+
+    if(size < 0 || size > INT_MAX)
+        return DEFAULT_JOB_RING;
+
+    return size;
+}
+
+/** This helper function unmaps the ring of a capture.
+ *
+ */
+static void capture_free(struct capture *c){
+
+    if(c->ring != NULL)
+        munmap(c->ring, sizeof(struct ring) + c->size);
+    free(c->command);
+    c->ring = NULL;
+    c->command = NULL;
+}
+
+/** This function prepares the capture of the output of a job about to be
+ *  started: its ring, and the pipe the job writes to.
+ *
+ *  -c: set to the capture. Its ring is NULL if the output is not captured.
+ *
+ *  Returns: 0 if succeded. -1 if the ring or the pipe could not be created,
+ *  in which case the job writes to the terminal.
+ */
+int jobs_capture_init(struct capture *c){
+
+    memset(c, 0, sizeof(struct capture));
+    c->fd[0] = c->fd[1] = -1;
+    if((c->size = job_ring_sz()) == 0)
+        return 0;
+
+    int memfd = memfd_create("nash-job", MFD_CLOEXEC);
+    if(memfd == -1 || ftruncate(memfd, sizeof(struct ring) + c->size) == -1){
+        perror("memfd");
+        if(memfd != -1)
+            close(memfd);
+        return -1;
+    }
+
+    c->ring = mmap(NULL, sizeof(struct ring) + c->size, PROT_READ | PROT_WRITE,
+            MAP_SHARED, memfd, 0);
+    close(memfd);
+    if(c->ring == MAP_FAILED){
+        perror("mmap");
+        c->ring = NULL;
+        return -1;
+    }
+
+    if(pipe2(c->fd, O_CLOEXEC) == -1){
+        perror("pipe");
+        capture_free(c);
+        return -1;
+    }
+
+    return 0;
+}
+
+/** This function gives up a capture whose job could not be started.
+ *
+ */
+void jobs_capture_cancel(struct capture *c){
+
+    if(c->fd[0] != -1){
+        close(c->fd[0]);
+        close(c->fd[1]);
+    }
+    capture_free(c);
+}
+
+/** This helper function appends the oldest data of the ring, about to be
+ *  overwritten, to the spill file in dir, opened on the first overflow.
+ *
+ */
+static void ring_spill(struct ring *ring, int *spill, const char *dir,
+        const char *data, size_t size){
+
+    if(*spill == -1){
+
+        snprintf(ring->spill, sizeof(ring->spill), "%s/nash-job-%d.out", dir,
+                getpid());
+        *spill = open(ring->spill, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                0600);
+        if(*spill == -1){
+            perror(ring->spill);
+            ring->spill[0] = '\0';
+            *spill = -2;
+        }
+    }
+
+    if(*spill >= 0 && write(*spill, data, size) == (ssize_t) size)
+        ring->spilled += size;
+}
+
+/** This function splits the current process, the child of a background job,
+ *  in two. The child returns, with stdout and stderr going to the pipe, and
+ *  goes on to run the job. The parent becomes the relay: it reads the pipe
+ *  into the ring until the job is done, waits for it and exits with its
+ *  status, so that it stands for the job.
+ *
+ *  -c: the capture prepared by jobs_capture_init().
+ *
+ */
+void jobs_capture_start(struct capture *c){
+
+    if(c->ring == NULL)
+        return;
+
+    pid_t pid = fork();
+    if(pid == -1){
+        perror("fork");
+        close(c->fd[0]);
+        close(c->fd[1]);
+        return;
+    }
+
+    if(pid == 0){
+        if(dup2(c->fd[1], STDOUT_FILENO) == -1
+                || dup2(c->fd[1], STDERR_FILENO) == -1){
+            perror("dup2");
+            exit(EXIT_FAILURE);
+        }
+        close(c->fd[0]);
+        close(c->fd[1]);
+        return;
+    }
+
+    /* The relay outlives an interrupt, which ends the job and so the data,
+     * and stays out of a process group the job has of its own, for a timer
+     * to kill it */
+    signal(SIGINT, SIG_IGN);
+    setpgid(0, getpgid(getppid()));
+    signal(SIGCHLD, SIG_DFL);
+    close(c->fd[1]);
+
+    struct ring *ring = c->ring;
+    const char *spill_dir = getenv("NASH_JOB_SPILL");
+    if(spill_dir != NULL && *spill_dir == '\0')
+        spill_dir = NULL;
+
+    static char chunk[RING_CHUNK];
+    int spill = -1;
+    while(true){
+
+        /* Up to the end of the ring, then from its start */
+        size_t pos = ring->written % c->size;
+        size_t room = c->size - pos;
+        if(room > RING_CHUNK)
+            room = RING_CHUNK;
+
+        /* Once the ring is full, the data it loses is spilled first */
+        bool spilling = spill_dir != NULL && ring->written >= c->size;
+        char *to = spilling ? chunk : ring->data + pos;
+
+        ssize_t got = read(c->fd[0], to, room);
+        if(got == -1 && errno == EINTR)
+            continue;
+        if(got <= 0)
+            break;
+
+        if(spilling){
+            ring_spill(ring, &spill, spill_dir, ring->data + pos, got);
+            memcpy(ring->data + pos, chunk, got);
+        }
+
+        __atomic_store_n(&ring->written, ring->written + got, __ATOMIC_RELEASE);
+    }
+
+    int status = 0;
+    while(waitpid(pid, &status, 0) == -1 && errno == EINTR)
+        ;
+    ring->status = WIFSIGNALED(status) ? 128 + WTERMSIG(status)
+        : WEXITSTATUS(status);
+    __atomic_store_n(&ring->done, 1, __ATOMIC_RELEASE);
+
+    _exit(ring->status);
+}
 
 /** This function allocates the memory for the list of jobs and initializes a
  *  dummy head.
@@ -51,7 +347,9 @@ void jobs_init(unsigned int limit){
     }
 
     jobs->total = 0;
-    jobs->limit = limit;
+    jobs->running = 0;
+    jobs->limit = default_limit = limit;
+    shell_pid = getpid();
 
     head = jobs->head = malloc(1 * sizeof(struct node));
     if(!head){
@@ -61,6 +359,11 @@ void jobs_init(unsigned int limit){
 
     head->next = NULL;
     head->bg_job = NULL;
+    head->cgroup = NULL;
+    head->cpus = NULL;
+    head->start = NULL;
+    head->arg = NULL;
+    memset(&head->output, 0, sizeof(struct capture));
 
 }
 
@@ -69,6 +372,9 @@ void jobs_init(unsigned int limit){
  */
 void jobs_destroy(){
 
+    for(size_t i = 0; i < FINISHED_MAX; i++)
+        capture_free(&finished[i]);
+
     if(head->next == NULL){
         free(head);
         free(jobs);
@@ -81,23 +387,73 @@ void jobs_destroy(){
         if(temp_node->bg_job)
             free(temp_node->bg_job);
 
+        free(temp_node->cgroup);
+        free(temp_node->cpus);
+        capture_free(&temp_node->output);
+
+        if(temp_node->arg != NULL)
+            temp_node->drop(temp_node->arg);
+
         free(temp_node);
     }
     free(jobs);
 
 }
 
+/** This helper function appends a job to the list.
+ *
+ */
+static void job_append(struct node *new_node){
+
+    struct node *curr_node = head;
+    while(curr_node->next != NULL)
+        curr_node = curr_node->next;
+
+    curr_node->next = new_node;
+    jobs->total += 1;
+}
+
 /** This function add a new background job to the list.
  *
  *  -command: the command of the job.
  *  -pid: the pid associated with the job.
+ *  -cgroup: the cgroup of the job, NULL if none.
+ *  -cpus: the CPUs of the job, from spread_assign(). The job owns them and
+ *   gives them back when it ends. NULL if none.
+ *  -output: the capture of the job's output, from jobs_capture_init(). The
+ *   job takes its ring, and the shell's ends of the pipe are closed. NULL if
+ *   none.
+ *
+ *  A queued job being admitted keeps its place and its number.
  *
  */
-void jobs_add(char *command, int pid){
+void jobs_add(char *command, int pid, const char *cgroup, char *cpus,
+        struct capture *output){
+
+    if(admitted != NULL){
+        admitted->cgroup = NULL;
+        if(cgroup != NULL && (admitted->cgroup = strdup(cgroup)) == NULL){
+            perror("strdup");
+            exit(EXIT_FAILURE);
+        }
+        admitted->cpus = cpus;
+        if(output != NULL){
+            if(output->fd[0] != -1){
+                close(output->fd[0]);
+                close(output->fd[1]);
+            }
+            admitted->output.ring = output->ring;
+            admitted->output.size = output->size;
+            output->ring = NULL;
+        }
+        jobs->running += 1;
+        admitted->pid = pid;
+        return;
+    }
 
-    struct node *new_node = malloc(1 * sizeof(struct node));
+    struct node *new_node = calloc(1, sizeof(struct node));
     if(!new_node){
-        perror("malloc");
+        perror("calloc");
         exit(EXIT_FAILURE);
     }
 
@@ -108,23 +464,77 @@ void jobs_add(char *command, int pid){
     }
 
     new_node->pid = pid;
-    new_node->next = NULL;
+    new_node->cgroup = NULL;
+    if(cgroup != NULL && (new_node->cgroup = strdup(cgroup)) == NULL){
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
+    new_node->cpus = cpus;
+    if(output != NULL){
+        if(output->fd[0] != -1){
+            close(output->fd[0]);
+            close(output->fd[1]);
+        }
+        new_node->output.ring = output->ring;
+        new_node->output.size = output->size;
+        output->ring = NULL;
+    }
+    new_node->output.id = next_id++;
 
-    struct node *curr_node = head;
-    while(curr_node->next != NULL)
-        curr_node = curr_node->next;
+    jobs->running += 1;
+    job_append(new_node);
+}
 
-    curr_node->next = new_node;
-    jobs->total += 1;
+/** This function tells whether a background job about to be started has to
+ *  be queued: the limit of the jobs running is reached, or jobs are queued
+ *  already. The queued jobs which may run are admitted first.
+ *
+ */
+bool jobs_queueing(void){
+
+    jobs_limit_read();
+    jobs_admit();
 
+    return jobs->total > jobs->running || jobs->running >= jobs_limit();
 }
 
-/** This function deletes a job with the same pid passed as argument.
+/** This function queues a background job. Nothing is started: the job is
+ *  started by jobs_admit() once its turn comes, with start(arg), which gives
+ *  it to jobs_add() as any job started at once.
+ *
+ *  -command: the command of the job.
+ *  -prio: priority of the job in the queue.
+ *  -start: starts the job, returns -1 if it could not be started.
+ *  -drop: frees arg, once the job is started or if the shell exits first.
+ *  -arg: the job as kept by the shell.
+ *
+ */
+void jobs_queue(const char *command, int prio, int (*start)(void *),
+        void (*drop)(void *), void *arg){
+
+    struct node *new_node = calloc(1, sizeof(struct node));
+    if(!new_node || !(new_node->bg_job = strdup(command))){
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    new_node->output.id = next_id++;
+    new_node->prio = prio;
+    new_node->start = start;
+    new_node->drop = drop;
+    new_node->arg = arg;
+
+    job_append(new_node);
+    LOG("Job %u queued\n", new_node->output.id);
+}
+
+/** This function deletes a job with the same pid passed as argument. Its
+ *  captured output is kept among the finished jobs.
  *
  *  -pid: pid associated with background job.
  *
  */
-void jobs_delete(int pid){
+static void jobs_delete(int pid){
 
     if(!head)
         return;
@@ -135,7 +545,22 @@ void jobs_delete(int pid){
         if(curr_node->pid == pid){
 
             prev_node->next = curr_node->next;
-            free(curr_node->bg_job);
+            timeout_stop(pid);
+            cgroup_remove(curr_node->cgroup);
+            spread_release(curr_node->cpus);
+            free(curr_node->cgroup);
+            free(curr_node->cpus);
+
+            if(curr_node->output.ring != NULL){
+                struct capture *c = &finished[finished_next];
+                finished_next = (finished_next + 1) % FINISHED_MAX;
+                capture_free(c);
+                *c = curr_node->output;
+                c->command = curr_node->bg_job;
+            } else {
+                free(curr_node->bg_job);
+            }
+            jobs->running -= 1;
             free(curr_node);
             jobs->total -= 1;
             return;
@@ -147,30 +572,381 @@ void jobs_delete(int pid){
 
 }
 
-/** This function prints all the current background jobs.
+/** This function is called by the SIGCHLD handler. It reaps the children
+ *  which ended and records their pids for jobs_reap(); it only uses
+ *  async-signal-safe calls. Once the record is full the children are left to
+ *  jobs_reap().
+ *
+ */
+void jobs_collect(void){
+
+    int saved_errno = errno;
+    pid_t pid;
+    while(reaped_sz < REAPED_MAX && (pid = waitpid(-1, NULL, WNOHANG)) > 0)
+        reaped[reaped_sz++] = pid;
+
+    reaped_lost |= reaped_sz == REAPED_MAX;
+    errno = saved_errno;
+}
+
+/** This function deletes the jobs which ended: the ones reaped by the SIGCHLD
+ *  handler, and the ones it left once its record was full. It is called by
+ *  the shell from its main loop, through jobs_admit().
+ *
+ */
+void jobs_reap(void){
+
+    if(!head || getpid() != shell_pid)
+        return;
+
+    sigset_t block, saved;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &saved);
+
+    for(int i = 0; i < reaped_sz; i++)
+        jobs_delete(reaped[i]);
+    reaped_sz = 0;
+
+    /* Only the jobs are waited for, a foreground pipeline may be running */
+    if(reaped_lost){
+        reaped_lost = false;
+        struct node *curr_node = head->next;
+        while(curr_node != NULL){
+            struct node *next = curr_node->next;
+            if(curr_node->pid > 0
+                    && waitpid(curr_node->pid, NULL, WNOHANG) > 0)
+                jobs_delete(curr_node->pid);
+            curr_node = next;
+        }
+    }
+
+    sigprocmask(SIG_SETMASK, &saved, NULL);
+}
+
+/** This function prints all the current background jobs, running or queued.
+ *  Jobs placed in a cgroup also show their OOM and CPU throttling events.
  *
  */
 void jobs_print(){
 
+    jobs_admit();
+
     struct node *curr_node = head->next;
     while(curr_node != NULL){
 
-        printf("%s\n", curr_node->bg_job);
+        printf("[%u] %-7s %s", curr_node->output.id,
+                curr_node->start != NULL ? "queued" : "running",
+                curr_node->bg_job);
+        if(curr_node->prio != 0)
+            printf("  [prio %d]", curr_node->prio);
+        if(curr_node->cpus != NULL)
+            printf("  [cpus %s]", curr_node->cpus);
+        if(curr_node->cgroup != NULL)
+            cgroup_print_events(curr_node->cgroup);
+
+        printf("\n");
         curr_node = curr_node->next;
     }
 
+    if(jobs->total > jobs->running)
+        printf("%zu running, %zu queued, limit %zu\n", jobs->running,
+                jobs->total - jobs->running, jobs_limit());
 }
 
-/** This function checks wether or not the job limit has been reached.
- *  
- *  Returns: 0 if the limit has not been reached. -1 if limit has been reached.
+/** This helper function formats a number of bytes with a K, M or G suffix.
  *
  */
-int jobs_check(){
+static void format_bytes(char *buf, size_t buf_sz, uint64_t bytes){
+
+    if(bytes < 1024)
+        snprintf(buf, buf_sz, "%llu", (unsigned long long) bytes);
+    else if(bytes < 1024 * 1024)
+        snprintf(buf, buf_sz, "%.1fK", bytes / 1024.0);
+    else if(bytes < 1024 * 1024 * 1024)
+        snprintf(buf, buf_sz, "%.1fM", bytes / (1024.0 * 1024));
+    else
+        snprintf(buf, buf_sz, "%.1fG", bytes / (1024.0 * 1024 * 1024));
+}
 
-    if(jobs->total == 10)
+/** This helper function prints a line of jobs -o for a capture.
+ *
+ */
+static void capture_line(const struct capture *c, const char *command){
+
+    char bytes[16];
+    format_bytes(bytes, sizeof(bytes),
+            __atomic_load_n(&c->ring->written, __ATOMIC_ACQUIRE));
+
+    if(__atomic_load_n(&c->ring->done, __ATOMIC_ACQUIRE))
+        printf("[%u] done %-4d %8s  %s\n", c->id, c->ring->status, bytes,
+                command);
+    else
+        printf("[%u] running   %8s  %s\n", c->id, bytes, command);
+}
+
+/** This helper function prints the output held by a ring. The relay may go
+ *  on writing meanwhile: the oldest bytes, which it may have overwritten or
+ *  be reading into, are left out, told by how far it got once the copy is
+ *  done.
+ *
+ */
+static int capture_print(const struct capture *c){
+
+    struct ring *ring = c->ring;
+    uint64_t written = __atomic_load_n(&ring->written, __ATOMIC_ACQUIRE);
+    bool done = __atomic_load_n(&ring->done, __ATOMIC_ACQUIRE);
+    size_t n = written < c->size ? written : c->size;
+
+    char *buf = malloc(n + 1);
+    if(!buf){
+        perror("malloc");
         return -1;
+    }
 
+    size_t start = (written - n) % c->size;
+    size_t first = c->size - start < n ? c->size - start : n;
+    memcpy(buf, ring->data + start, first);
+    memcpy(buf + first, ring->data, n - first);
+
+    uint64_t reached = __atomic_load_n(&ring->written, __ATOMIC_ACQUIRE);
+    if(!done)
+        reached += RING_CHUNK;
+    size_t skip = 0;
+    if(reached > written - n + c->size)
+        skip = reached - (written - n + c->size);
+    if(skip > n)
+        skip = n;
+
+    if(ring->spilled > 0)
+        fprintf(stderr, "jobs: %llu older bytes in %s\n",
+                (unsigned long long) ring->spilled, ring->spill);
+    else if(written - n + skip > 0)
+        fprintf(stderr, "jobs: %llu older bytes lost\n",
+                (unsigned long long) (written - n + skip));
+
+    fwrite(buf + skip, 1, n - skip, stdout);
+    fflush(stdout);
+    free(buf);
     return 0;
+}
+
+/** This function handles jobs -o, which shows the captured output of the
+ *  jobs.
+ *
+ *      jobs -o         lists the jobs whose output is captured, running or
+ *                      finished, with the bytes they wrote
+ *      jobs -o ID      prints the output of job ID (also %ID)
+ *
+ *  -id: the ID given, NULL if none.
+ *
+ *  Returns: 0 if succeded. -1 if there is no captured output for the job.
+ */
+int jobs_output(const char *id){
+
+    jobs_reap();
+
+    if(id == NULL){
+        for(size_t i = 0; i < FINISHED_MAX; i++){
+            struct capture *c = &finished[(finished_next + i) % FINISHED_MAX];
+            if(c->ring != NULL)
+                capture_line(c, c->command);
+        }
+        for(struct node *curr_node = head->next; curr_node != NULL;
+                curr_node = curr_node->next){
+            if(curr_node->output.ring != NULL)
+                capture_line(&curr_node->output, curr_node->bg_job);
+        }
+        return 0;
+    }
+
+    char *end;
+    unsigned long n = strtoul(id + (*id == '%'), &end, 10);
+    if(*end != '\0'){
+        fprintf(stderr, "jobs: %s: not a job ID\n", id);
+        return -1;
+    }
 
+    for(struct node *curr_node = head->next; curr_node != NULL;
+            curr_node = curr_node->next){
+        if(curr_node->output.id == n && curr_node->output.ring != NULL)
+            return capture_print(&curr_node->output);
+    }
+    for(size_t i = 0; i < FINISHED_MAX; i++){
+        if(finished[i].ring != NULL && finished[i].id == n)
+            return capture_print(&finished[i]);
+    }
+
+    fprintf(stderr, "jobs: %s: no captured output\n", id);
+    return -1;
+}
+
+/** This helper function reads the limit of the jobs running at once from
+ *  NASH_JOBS_MAX: a number, `cpus` or `load`. The limit given to jobs_init()
+ *  is kept if it is not set or not valid.
+ *
+ */
+static void jobs_limit_read(void){
+
+    char *env = getenv("NASH_JOBS_MAX");
+    limit_mode = LIMIT_FIXED;
+    jobs->limit = default_limit;
+    if(env == NULL)
+        return;
+
+    if(!strcmp(env, "cpus") || !strcmp(env, "load")){
+        cpu_set_t set;
+        limit_mode = !strcmp(env, "cpus") ? LIMIT_CPUS : LIMIT_LOAD;
+        jobs->limit = sched_getaffinity(0, sizeof(set), &set) == 0
+            ? CPU_COUNT(&set) : 1;
+        return;
+    }
+
+    char *end;
+    long limit = strtol(env, &end, 10);
+    if(end != env && *end == '\0' && limit > 0 && limit <= UINT_MAX)
+        jobs->limit = limit;
+}
+
+/** This helper function returns how many jobs may run now. Following the
+ *  load average, the CPUs are shared with the load which is not the jobs',
+ *  at least one job running.
+ *
+ */
+static size_t jobs_limit(void){
+
+    struct sysinfo info;
+    if(limit_mode != LIMIT_LOAD || sysinfo(&info) == -1)
+        return jobs->limit;
+
+    /* The jobs running are part of the load */
+    double others = info.loads[0] / (double) (1 << SI_LOAD_SHIFT)
+        - jobs->running;
+    size_t busy = others > 0 ? others + 0.5 : 0;
+
+    return busy < jobs->limit ? jobs->limit - busy : 1;
+}
+
+/** This function admits the queued jobs while fewer jobs than the limit run:
+ *  the highest priority first, and the first queued among equal priorities.
+ *  It is called by the shell between two commands and at the prompt, not by
+ *  the SIGCHLD handler, as starting a job forks, and deletes the jobs which
+ *  ended first. A job which cannot be started is dropped.
+ *
+ */
+void jobs_admit(void){
+
+    if(!head || admitted != NULL || getpid() != shell_pid)
+        return;
+
+    /* The jobs which ended free their slots first */
+    jobs_reap();
+
+    while(jobs->running < jobs_limit()){
+
+        struct node *next = NULL;
+        for(struct node *curr_node = head->next; curr_node != NULL;
+                curr_node = curr_node->next){
+            if(curr_node->start != NULL && (next == NULL
+                        || curr_node->prio > next->prio))
+                next = curr_node;
+        }
+        if(next == NULL)
+            break;
+
+        int (*start)(void *) = next->start;
+        void (*drop)(void *) = next->drop;
+        void *arg = next->arg;
+        unsigned int id = next->output.id;
+        next->start = NULL;
+        next->arg = NULL;
+
+        admitted = next;
+        int started = start(arg);
+        admitted = NULL;
+        drop(arg);
+        if(started != -1){
+            LOG("Job %u admitted\n", id);
+            continue;
+        }
+
+        /* Not started, so not in the jobs either */
+        struct node *prev_node = head;
+        while(prev_node->next != next)
+            prev_node = prev_node->next;
+        prev_node->next = next->next;
+        jobs->total -= 1;
+
+        free(next->bg_job);
+        free(next);
+    }
+}
+
+/** This function returns the occupancy of the job table, for nashstat.
+ *
+ *  -running: set to the number of jobs running.
+ *  -queued: set to the number of jobs queued.
+ *  -limit: set to the maximum number of jobs running now.
+ *
+ */
+void jobs_stats(size_t *running, size_t *queued, size_t *limit){
+
+    jobs_reap();
+
+    *running = jobs ? jobs->running : 0;
+    *queued = jobs ? jobs->total - jobs->running : 0;
+    *limit = jobs ? jobs_limit() : 0;
+}
+
+/** This function saves the jobs running to a snapshot. The queued jobs are
+ *  dropped by a restart.
+ *
+ */
+void jobs_save(struct snapshot *snap){
+
+    snap_u32(snap, jobs->running);
+    for(struct node *curr_node = head->next; curr_node != NULL;
+            curr_node = curr_node->next){
+        if(curr_node->start != NULL)
+            continue;
+        snap_u32(snap, curr_node->pid);
+        snap_str(snap, curr_node->bg_job);
+        snap_str(snap, curr_node->cgroup);
+        snap_str(snap, curr_node->cpus);
+    }
+}
+
+/** This function restores the jobs saved by jobs_save(). Only the jobs which
+ *  are still children of the shell are restored, i.e. when the shell restarted
+ *  in the same process: the shell could not wait for the others. A job which
+ *  ended while the shell restarted is reaped here.
+ *
+ */
+void jobs_load(struct snapshot *snap){
+
+    uint32_t total = snap_get_u32(snap);
+    for(uint32_t i = 0; i < total && !snap->failed; i++){
+
+        pid_t pid = snap_get_u32(snap);
+        char *command = snap_get_str(snap);
+        char *cgroup = snap_get_str(snap);
+        char *cpus = snap_get_str(snap);
+
+        bool known = false;
+        for(struct node *curr_node = head->next; curr_node != NULL;
+                curr_node = curr_node->next)
+            known |= curr_node->pid == pid;
+
+        if(snap->failed || command == NULL || known
+                || waitpid(pid, NULL, WNOHANG) != 0){
+            LOG("Job %d is not restored\n", pid);
+            cgroup_remove(cgroup);
+            free(cpus);
+        } else {
+            spread_claim(cpus);
+            jobs_add(command, pid, cgroup, cpus, NULL);
+        }
+        free(command);
+        free(cgroup);
+    }
 }
@@ -4,10 +4,43 @@
 #ifndef _JOBS_H_
 #define _JOBS_H_
 
+#include <stdbool.h>
+#include <stddef.h>
+
+struct ring;
+struct snapshot;
+
+/** This struct holds the output captured for a job.
+ *
+ *  -ring: the shared ring, NULL if the output is not captured.
+ *  -size: size of the ring's data.
+ *  -fd: the pipe the job writes to, until the job is started.
+ *  -id: number of the job, shown by jobs.
+ *  -command: the command of the job, for a finished job.
+ *
+ */
+struct capture {
+    struct ring *ring;
+    size_t size;
+    int fd[2];
+    unsigned int id;
+    char *command;
+};
+
 void jobs_init(unsigned int);
 void jobs_destroy(void);
-void jobs_add(char *, int);
-void jobs_delete(int);
+void jobs_add(char *, int, const char *, char *, struct capture *);
+bool jobs_queueing(void);
+void jobs_queue(const char *, int, int (*)(void *), void (*)(void *), void *);
+void jobs_collect(void);
+void jobs_reap(void);
 void jobs_print(void);
-int jobs_check();
+int jobs_output(const char *);
+int jobs_capture_init(struct capture *);
+void jobs_capture_cancel(struct capture *);
+void jobs_capture_start(struct capture *);
+void jobs_admit(void);
+void jobs_stats(size_t *, size_t *, size_t *);
+void jobs_save(struct snapshot *);
+void jobs_load(struct snapshot *);
 #endif
@@ -0,0 +1,1093 @@
+/**@file
+ *  This file handles the `limit` prefix: resource limits set with setrlimit,
+ *  a wall-clock timeout, the CPU affinity, nice value, I/O priority and
+ *  scheduling policy, and the optional placement of a job in its own cgroup
+ *  v2 sub-group.
+ *
+ *  The timeout is enforced by the shell, with a timer for each job: once it
+ *  expires, every process of the job is killed, through cgroup.kill when the
+ *  job has a cgroup, otherwise through the process group the job then gets.
+ *
+ *  It also spreads the background jobs over the CPUs when NASH_SPREAD is set
+ *  to a number of CPUs per job: each job gets CPUs no other job uses, as long
+ *  as there are enough, taken from a single NUMA node when possible. Every
+ *  stage of a pipeline inherits the CPUs of its job, so they share a node.
+ */
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/statfs.h>
+#include <linux/magic.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "limits.h"
+#include "logger.h"
+
+static char cgroup_base[4096];
+static int cgroup_state = 0;
+static unsigned int cgroup_seq = 0;
+
+/* I/O priority classes and value, as in linux/ioprio.h */
+#define IOPRIO_CLASS_RT 1
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_VALUE(class, data) (((class) << 13) | (data))
+#define IOPRIO_WHO_PROCESS 1
+
+/* Jobs timed at once */
+#define TIMEOUTS_MAX 64
+
+/** This struct holds the timer of a job with a timeout.
+ *
+ *  -used: the entry holds a timer.
+ *  -timer: the timer, which raises SIGALRM.
+ *  -pid: the job, the leader of its process group when it has no cgroup.
+ *  -kill_path: cgroup.kill of the job's cgroup, NULL if none.
+ *  -terminal: the job was given the terminal.
+ *  -fired: the timer expired and the job was killed.
+ *
+ */
+struct timeout {
+    bool used;
+    timer_t timer;
+    pid_t pid;
+    char *kill_path;
+    bool terminal;
+    volatile sig_atomic_t fired;
+};
+
+static struct timeout timeouts[TIMEOUTS_MAX];
+static bool timeouts_ready = false;
+
+/* cgroups of the jobs which ended before every process in them did, removed
+ * once empty */
+#define CGROUPS_PENDING 16
+static char *cgroups_pending[CGROUPS_PENDING];
+
+/* CPUs the shell may use, their NUMA node and how many jobs use them */
+static bool spread_ready = false;
+static cpu_set_t spread_allowed;
+static short cpu_node[CPU_SETSIZE];
+static unsigned short cpu_use[CPU_SETSIZE];
+static int nodes_sz = 1;
+
+/** This function initializes the limits so that nothing is restricted.
+ *
+ */
+void limits_init(struct launch_limits *lim){
+
+    lim->cpu = RLIM_INFINITY;
+    lim->mem = RLIM_INFINITY;
+    lim->fds = RLIM_INFINITY;
+    lim->timeout = 0;
+    lim->cg_mem = NULL;
+    lim->cg_cpu = NULL;
+    lim->cpus = NULL;
+    lim->nice = NICE_UNSET;
+    lim->ioprio = -1;
+    lim->policy = -1;
+    lim->sched_prio = 0;
+    lim->prio = 0;
+}
+
+/** This function frees the memory allocated for the limits.
+ *
+ */
+void limits_destroy(struct launch_limits *lim){
+
+    free(lim->cg_mem);
+    free(lim->cg_cpu);
+    free(lim->cpus);
+    lim->cg_mem = NULL;
+    lim->cg_cpu = NULL;
+    lim->cpus = NULL;
+}
+
+/** This function converts a list of CPUs such as 0-3,8 to a CPU set.
+ *
+ *  -list: string to convert.
+ *  -set: where the result is stored.
+ *
+ *  Returns: 0 if succeded. -1 if the list is not valid.
+ */
+static int parse_cpus(const char *list, cpu_set_t *set){
+
+    CPU_ZERO(set);
+    const char *c = list;
+    while(true){
+        char *end;
+        long first = strtol(c, &end, 10);
+        long last = first;
+        if(end == c || first < 0)
+            return -1;
+
+        if(*end == '-'){
+            c = end + 1;
+            last = strtol(c, &end, 10);
+            if(end == c || last < first)
+                return -1;
+        }
+
+        if(last >= CPU_SETSIZE)
+            return -1;
+        for(long cpu = first; cpu <= last; cpu++)
+            CPU_SET(cpu, set);
+
+        if(*end == '\0')
+            return CPU_COUNT(set) > 0 ? 0 : -1;
+        if(*end != ',')
+            return -1;
+        c = end + 1;
+    }
+}
+
+/** This function converts a CPU set to a list such as 0-3,8.
+ *
+ *  Returns: the list, which has to be freed by the caller. NULL if memory
+ *  could not be allocated.
+ */
+static char *format_cpus(const cpu_set_t *set){
+
+    char *list = malloc(CPU_SETSIZE * 5);
+    if(!list){
+        perror("malloc");
+        return NULL;
+    }
+
+    char *p = list;
+    *p = '\0';
+    for(int cpu = 0; cpu < CPU_SETSIZE; cpu++){
+        if(!CPU_ISSET(cpu, set))
+            continue;
+
+        int last = cpu;
+        while(last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set))
+            last++;
+
+        p += sprintf(p, p == list ? "%d" : ",%d", cpu);
+        if(last > cpu)
+            p += sprintf(p, "-%d", last);
+        cpu = last;
+    }
+    return list;
+}
+
+/** This function parses an I/O priority: idle, be:N, rt:N or N (for be:N).
+ *
+ *  Returns: 0 if succeded. -1 if the value is not valid.
+ */
+static int parse_ioprio(const char *value, int *ioprio){
+
+    if(!strcmp(value, "idle")){
+        *ioprio = IOPRIO_VALUE(IOPRIO_CLASS_IDLE, 0);
+        return 0;
+    }
+
+    int class = IOPRIO_CLASS_BE;
+    if(!strncmp(value, "be:", 3) || !strncmp(value, "rt:", 3)){
+        class = *value == 'r' ? IOPRIO_CLASS_RT : IOPRIO_CLASS_BE;
+        value += 3;
+    }
+
+    char *end;
+    long data = strtol(value, &end, 10);
+    if(end == value || *end != '\0' || data < 0 || data > 7)
+        return -1;
+
+    *ioprio = IOPRIO_VALUE(class, data);
+    return 0;
+}
+
+/** This function parses a scheduling policy: other, batch, idle, fifo:N or
+ *  rr:N, N being the real-time priority.
+ *
+ *  Returns: 0 if succeded. -1 if the value is not valid.
+ */
+static int parse_policy(const char *value, int *policy, int *prio){
+
+    static const struct { const char *name; int policy; } policies[] = {
+        { "other", SCHED_OTHER }, { "batch", SCHED_BATCH },
+        { "idle", SCHED_IDLE }, { "fifo", SCHED_FIFO }, { "rr", SCHED_RR }
+    };
+
+    size_t name_sz = strcspn(value, ":");
+    for(size_t i = 0; i < sizeof(policies) / sizeof(*policies); i++){
+        if(strncmp(value, policies[i].name, name_sz)
+                || policies[i].name[name_sz] != '\0')
+            continue;
+
+        *policy = policies[i].policy;
+        *prio = 0;
+        bool realtime = *policy == SCHED_FIFO || *policy == SCHED_RR;
+        if(value[name_sz] == '\0')
+            return realtime ? -1 : 0;
+
+        char *end;
+        long n = strtol(value + name_sz + 1, &end, 10);
+        if(!realtime || *end != '\0' || n < sched_get_priority_min(*policy)
+                || n > sched_get_priority_max(*policy))
+            return -1;
+
+        *prio = n;
+        return 0;
+    }
+    return -1;
+}
+
+/** This function converts a count, such as a number of seconds, which takes
+ *  no suffix.
+ *
+ *  -value: string to convert.
+ *  -count: where the result is stored.
+ *
+ *  Returns: 0 if succeded. -1 if the value is not a valid count.
+ */
+static int parse_count(const char *value, rlim_t *count){
+
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(value, &end, 10);
+    if(errno != 0 || end == value || *end != '\0' || *value == '-')
+        return -1;
+
+    *count = n;
+    return 0;
+}
+
+/** This function converts a size such as 512K, 64M or 2G to bytes.
+ *
+ *  -value: string to convert.
+ *  -size: where the result is stored.
+ *
+ *  Returns: 0 if succeded. -1 if the value is not a valid size, or does not
+ *  fit in a limit.
+ */
+static int parse_size(const char *value, rlim_t *size){
+
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(value, &end, 10);
+    if(errno != 0 || end == value || *value == '-')
+        return -1;
+
+    int shift = 0;
+    switch(*end){
+        case 'G': case 'g': shift = 30; end++; break;
+        case 'M': case 'm': shift = 20; end++; break;
+        case 'K': case 'k': shift = 10; end++; break;
+        case '\0': break;
+        default: return -1;
+    }
+
+    if(*end != '\0' || n > (RLIM_INFINITY >> shift))
+        return -1;
+
+    *size = (rlim_t) n << shift;
+    return 0;
+}
+
+/** This function parses the arguments of the `limit` prefix. The arguments
+ *  are key=value pairs followed by the command to run:
+ *
+ *      limit cpu=10 mem=512M fds=64 timeout=30 cgmem=1G cgcpu=50 cmd args
+ *      limit cpus=0-3 nice=10 ionice=idle sched=batch cmd args
+ *
+ *  -args: tokenized command, starting with "limit".
+ *  -lim: where the parsed limits are stored.
+ *
+ *  Returns: the index of the first token of the command, -1 if the arguments
+ *  are not valid.
+ */
+int limits_parse(char **args, struct launch_limits *lim){
+
+    int i = 1;
+    for(; args[i] != NULL; i++){
+
+        char *value = strchr(args[i], '=');
+        if(value == NULL)
+            break;
+
+        size_t key_sz = value - args[i];
+        value++;
+
+        rlim_t n;
+        int ret = 0;
+        if(!strncmp(args[i], "cpu", key_sz) && key_sz == 3){
+            ret = parse_count(value, &lim->cpu);
+        } else if(!strncmp(args[i], "mem", key_sz) && key_sz == 3){
+            ret = parse_size(value, &lim->mem);
+        } else if(!strncmp(args[i], "fds", key_sz) && key_sz == 3){
+            ret = parse_count(value, &lim->fds);
+        } else if(!strncmp(args[i], "timeout", key_sz) && key_sz == 7){
+            if((ret = parse_count(value, &n)) == 0 && n > UINT_MAX)
+                ret = -1;
+            if(ret == 0)
+                lim->timeout = n;
+        } else if(!strncmp(args[i], "cgmem", key_sz) && key_sz == 5){
+            free(lim->cg_mem);
+            lim->cg_mem = malloc(32);
+            if(!lim->cg_mem){
+                perror("malloc");
+                return -1;
+            }
+            if(!strcmp(value, "max"))
+                strcpy(lim->cg_mem, value);
+            else if((ret = parse_size(value, &n)) == 0)
+                snprintf(lim->cg_mem, 32, "%llu", (unsigned long long) n);
+        } else if(!strncmp(args[i], "cgcpu", key_sz) && key_sz == 5){
+            /* cpu.max takes "quota period"; the value is a percent of a CPU,
+             * and a quota of 0 is not valid */
+            free(lim->cg_cpu);
+            lim->cg_cpu = malloc(32);
+            if(!lim->cg_cpu){
+                perror("malloc");
+                return -1;
+            }
+            if(!strcmp(value, "max"))
+                strcpy(lim->cg_cpu, value);
+            else if((ret = parse_count(value, &n)) == 0 && n == 0)
+                ret = -1;
+            else if(ret == 0)
+                snprintf(lim->cg_cpu, 32, "%llu 100000",
+                        (unsigned long long) n * 1000);
+        } else if(!strncmp(args[i], "cpus", key_sz) && key_sz == 4){
+            cpu_set_t set;
+            free(lim->cpus);
+            if((ret = parse_cpus(value, &set)) == 0
+                    && (lim->cpus = strdup(value)) == NULL){
+                perror("strdup");
+                return -1;
+            }
+        } else if(!strncmp(args[i], "nice", key_sz) && key_sz == 4){
+            char *end;
+            long nice = strtol(value, &end, 10);
+            ret = (end == value || *end != '\0' || nice < -20 || nice > 19)
+                ? -1 : 0;
+            lim->nice = nice;
+        } else if(!strncmp(args[i], "ionice", key_sz) && key_sz == 6){
+            ret = parse_ioprio(value, &lim->ioprio);
+        } else if(!strncmp(args[i], "sched", key_sz) && key_sz == 5){
+            ret = parse_policy(value, &lim->policy, &lim->sched_prio);
+        } else if(!strncmp(args[i], "prio", key_sz) && key_sz == 4){
+            char *end;
+            long prio = strtol(value, &end, 10);
+            ret = (end == value || *end != '\0' || prio < INT_MIN
+                    || prio > INT_MAX) ? -1 : 0;
+            lim->prio = prio;
+        } else {
+            fprintf(stderr, "limit: unknown limit '%.*s'\n", (int) key_sz,
+                    args[i]);
+            return -1;
+        }
+
+        if(ret == -1){
+            fprintf(stderr, "limit: invalid value '%s'\n", args[i]);
+            return -1;
+        }
+    }
+
+    if(args[i] == NULL){
+        fprintf(stderr, "limit: missing command\n");
+        return -1;
+    }
+
+    return i;
+}
+
+/** This function checks if the limits require a cgroup.
+ *
+ */
+bool limits_use_cgroup(const struct launch_limits *lim){
+
+    return lim->cg_mem != NULL || lim->cg_cpu != NULL;
+}
+
+/** This function writes a value to a file of a cgroup.
+ *
+ *  Returns: 0 if succeded. -1 if it failed.
+ */
+static int cgroup_write(const char *cgroup, const char *file, const char *value){
+
+    char path[4200];
+    snprintf(path, sizeof(path), "%s/%s", cgroup, file);
+
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if(fd == -1)
+        return -1;
+
+    ssize_t ret = write(fd, value, strlen(value));
+    close(fd);
+    return ret == -1 ? -1 : 0;
+}
+
+/** This function finds the cgroup v2 directory of the shell. The lookup is
+ *  only done once.
+ *
+ *  Returns: 1 if the shell is in a writable cgroup v2 hierarchy. -1 if not.
+ */
+static int cgroup_find_base(void){
+
+    if(cgroup_state != 0)
+        return cgroup_state;
+
+    cgroup_state = -1;
+    FILE *file = fopen("/proc/self/cgroup", "re");
+    if(!file)
+        return cgroup_state;
+
+    char *line = NULL;
+    size_t line_sz = 0;
+    while(getline(&line, &line_sz, file) != -1){
+        if(strncmp(line, "0::", 3))
+            continue;
+
+        line[strcspn(line, "\n")] = '\0';
+        snprintf(cgroup_base, sizeof(cgroup_base), "/sys/fs/cgroup%s",
+                line + 3);
+        struct statfs fs;
+        if(statfs(cgroup_base, &fs) == 0 && fs.f_type == CGROUP2_SUPER_MAGIC
+                && access(cgroup_base, W_OK) == 0)
+            cgroup_state = 0;
+        break;
+    }
+    free(line);
+    fclose(file);
+
+    if(cgroup_state == 0){
+        /* Controllers have to be enabled for the children of our cgroup. This
+         * fails if they already are, or if the hierarchy does not allow it; in
+         * the latter case the limit files will be missing below. */
+        cgroup_write(cgroup_base, "cgroup.subtree_control", "+memory +cpu");
+        cgroup_state = 1;
+    }
+
+    LOG("cgroup base: %s (%s)\n", cgroup_base,
+            cgroup_state == 1 ? "writable" : "not writable");
+    return cgroup_state;
+}
+
+/** This function creates a cgroup for a job under the cgroup of the shell and
+ *  sets memory.max and cpu.max.
+ *
+ *  Returns: the path of the new cgroup, or NULL if the hierarchy is not
+ *  writable. The path has to be freed by the caller.
+ */
+char *cgroup_create(const struct launch_limits *lim){
+
+    if(cgroup_find_base() != 1){
+        fprintf(stderr, "limit: cgroup v2 hierarchy not writable, ignoring "
+                "cgroup limits\n");
+        return NULL;
+    }
+
+    char *path = malloc(4200);
+    if(!path){
+        perror("malloc");
+        return NULL;
+    }
+
+    snprintf(path, 4200, "%s/nash-%d-%u", cgroup_base, getpid(),
+            ++cgroup_seq);
+    if(mkdir(path, 0755) == -1){
+        perror("limit: mkdir");
+        free(path);
+        return NULL;
+    }
+
+    if(lim->cg_mem && cgroup_write(path, "memory.max", lim->cg_mem) == -1)
+        perror("limit: memory.max");
+
+    if(lim->cg_cpu && cgroup_write(path, "cpu.max", lim->cg_cpu) == -1)
+        perror("limit: cpu.max");
+
+    return path;
+}
+
+/** This function removes the cgroup of a job. This only succeeds once every
+ *  process of the job has exited: a stage of a pipeline may still run when
+ *  the last one ended, in which case the cgroup is removed later, by
+ *  cgroup_reap().
+ *
+ */
+void cgroup_remove(const char *cgroup){
+
+    if(cgroup == NULL || rmdir(cgroup) == 0)
+        return;
+
+    LOG("Could not remove %s: %s\n", cgroup, strerror(errno));
+    if(errno != EBUSY)
+        return;
+
+    for(size_t i = 0; i < CGROUPS_PENDING; i++){
+        if(cgroups_pending[i] == NULL){
+            cgroups_pending[i] = strdup(cgroup);
+            return;
+        }
+    }
+}
+
+/** This function removes the cgroups left by cgroup_remove() which are empty
+ *  now. It is called by the shell between two commands.
+ *
+ */
+void cgroup_reap(void){
+
+    for(size_t i = 0; i < CGROUPS_PENDING; i++){
+        if(cgroups_pending[i] != NULL && (rmdir(cgroups_pending[i]) == 0
+                    || errno != EBUSY)){
+            free(cgroups_pending[i]);
+            cgroups_pending[i] = NULL;
+        }
+    }
+}
+
+/** This function waits until no process is left in the cgroup of a
+ *  foreground job, the stages of a pipeline other than the one the shell
+ *  waited for included. It follows cgroup.events, whose changes wake poll().
+ *
+ */
+void cgroup_wait(const char *cgroup){
+
+    if(cgroup == NULL)
+        return;
+
+    char path[4200];
+    snprintf(path, sizeof(path), "%s/cgroup.events", cgroup);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd == -1)
+        return;
+
+    char events[256];
+    ssize_t events_sz;
+    while((events_sz = pread(fd, events, sizeof(events) - 1, 0)) > 0){
+        events[events_sz] = '\0';
+        if(strstr(events, "populated 0") != NULL)
+            break;
+
+        struct pollfd wait = { .fd = fd, .events = POLLPRI };
+        poll(&wait, 1, 100);
+    }
+    close(fd);
+}
+
+/** This function applies the limits in the child, before the pipeline is
+ *  started, so that every stage inherits them. The child moves itself into the
+ *  cgroup first.
+ *
+ *  -lim: limits to apply.
+ *  -cgroup: cgroup of the job, NULL if none.
+ *
+ */
+void limits_apply(const struct launch_limits *lim, const char *cgroup){
+
+    if(cgroup != NULL && cgroup_write(cgroup, "cgroup.procs", "0") == -1)
+        perror("limit: cgroup.procs");
+
+    struct rlimit rl;
+    if(lim->cpu != RLIM_INFINITY){
+        /* SIGXCPU at the soft limit, SIGKILL one second later */
+        rl.rlim_cur = lim->cpu;
+        rl.rlim_max = lim->cpu + 1;
+        if(setrlimit(RLIMIT_CPU, &rl) == -1)
+            perror("limit: cpu");
+    }
+
+    if(lim->mem != RLIM_INFINITY){
+        rl.rlim_cur = rl.rlim_max = lim->mem;
+        if(setrlimit(RLIMIT_AS, &rl) == -1)
+            perror("limit: mem");
+    }
+
+    if(lim->fds != RLIM_INFINITY){
+        rl.rlim_cur = rl.rlim_max = lim->fds;
+        if(setrlimit(RLIMIT_NOFILE, &rl) == -1)
+            perror("limit: fds");
+    }
+
+    if(lim->cpus != NULL)
+        spread_apply(lim->cpus);
+
+    if(lim->nice != NICE_UNSET && setpriority(PRIO_PROCESS, 0, lim->nice) == -1)
+        perror("limit: nice");
+
+    if(lim->ioprio != -1 && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                lim->ioprio) == -1)
+        perror("limit: ionice");
+
+    struct sched_param param = { .sched_priority = lim->sched_prio };
+    if(lim->policy != -1 && sched_setscheduler(0, lim->policy, &param) == -1)
+        perror("limit: sched");
+}
+
+/** This helper function gives the terminal to a process group, or back to the
+ *  shell. SIGTTOU is blocked meanwhile, as the caller may not be in the
+ *  foreground.
+ *
+ */
+static void terminal_give(pid_t pgrp){
+
+    sigset_t block, saved;
+    sigemptyset(&block);
+    sigaddset(&block, SIGTTOU);
+    sigprocmask(SIG_BLOCK, &block, &saved);
+
+    if(tcsetpgrp(STDIN_FILENO, pgrp) == -1)
+        LOG("tcsetpgrp: %s\n", strerror(errno));
+
+    sigprocmask(SIG_SETMASK, &saved, NULL);
+}
+
+/** This helper function tells whether a job with limits gets a process group
+ *  of its own, the timer having no cgroup to kill it through.
+ *
+ */
+static bool timeout_pgrp(const struct launch_limits *lim, const char *cgroup){
+
+    return lim->timeout > 0 && cgroup == NULL;
+}
+
+/** This function is called in the child of a job with limits, before
+ *  limits_apply(). A job with a timeout but no cgroup is put in a process
+ *  group of its own, so that the timer kills every stage; a foreground job
+ *  then gets the terminal, if the shell has it. The shell does the same in
+ *  timeout_start(), whichever runs first.
+ *
+ *  -lim: limits of the job.
+ *  -cgroup: cgroup of the job, NULL if none.
+ *  -foreground: the shell waits for the job.
+ *
+ */
+void timeout_apply(const struct launch_limits *lim, const char *cgroup,
+        bool foreground){
+
+    if(!timeout_pgrp(lim, cgroup))
+        return;
+
+    bool terminal = foreground && isatty(STDIN_FILENO)
+        && tcgetpgrp(STDIN_FILENO) == getpgrp();
+    if(setpgid(0, 0) == -1)
+        perror("limit: setpgid");
+    else if(terminal)
+        terminal_give(getpgrp());
+}
+
+/** This handler kills the job whose timer expired: through cgroup.kill, or
+ *  its process group. It only uses async-signal-safe calls.
+ *
+ */
+static void timeout_handler(int sig, siginfo_t *info, void *context){
+
+    (void) sig;
+    (void) context;
+
+    int slot = info->si_value.sival_int;
+    if(info->si_code != SI_TIMER || slot < 0 || slot >= TIMEOUTS_MAX
+            || !timeouts[slot].used)
+        return;
+
+    int saved_errno = errno;
+    struct timeout *t = &timeouts[slot];
+    t->fired = 1;
+
+    int fd = t->kill_path != NULL ? open(t->kill_path, O_WRONLY | O_CLOEXEC)
+        : -1;
+    if(fd != -1 && write(fd, "1", 1) == 1)
+        close(fd);
+    else {
+        if(fd != -1)
+            close(fd);
+        /* Without cgroup.kill (before Linux 5.14), the first process of
+         * the job is killed alone */
+        kill(t->kill_path != NULL ? t->pid : -t->pid, SIGKILL);
+    }
+    errno = saved_errno;
+}
+
+/** This function starts the timer of a job just forked, if it has a timeout.
+ *
+ *  -lim: limits of the job.
+ *  -pid: the job.
+ *  -cgroup: cgroup of the job, NULL if none.
+ *  -foreground: the shell waits for the job.
+ *
+ */
+void timeout_start(const struct launch_limits *lim, pid_t pid,
+        const char *cgroup, bool foreground){
+
+    if(lim->timeout == 0)
+        return;
+
+    if(!timeouts_ready){
+        struct sigaction action = { .sa_sigaction = timeout_handler,
+            .sa_flags = SA_SIGINFO | SA_RESTART };
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGALRM, &action, NULL);
+        timeouts_ready = true;
+    }
+
+    int slot = 0;
+    while(slot < TIMEOUTS_MAX && timeouts[slot].used)
+        slot++;
+    if(slot == TIMEOUTS_MAX){
+        fprintf(stderr, "limit: too many timeouts, the job is not timed\n");
+        return;
+    }
+
+    struct timeout *t = &timeouts[slot];
+    t->pid = pid;
+    t->fired = 0;
+    t->terminal = false;
+    t->kill_path = NULL;
+    if(cgroup != NULL && (t->kill_path = malloc(4200)) != NULL)
+        snprintf(t->kill_path, 4200, "%s/cgroup.kill", cgroup);
+
+    /* Only a foreground job is raced for its group: the relay of a
+     * background job leaves it, and must not be put back */
+    if(timeout_pgrp(lim, cgroup) && foreground){
+        t->terminal = isatty(STDIN_FILENO)
+            && tcgetpgrp(STDIN_FILENO) == getpgrp();
+        /* Fails once the child ran exec, having done it itself */
+        setpgid(pid, pid);
+        if(t->terminal)
+            terminal_give(pid);
+    }
+
+    struct sigevent event = { .sigev_notify = SIGEV_SIGNAL,
+        .sigev_signo = SIGALRM, .sigev_value.sival_int = slot };
+    struct itimerspec expiry = { .it_value.tv_sec = lim->timeout };
+    if(timer_create(CLOCK_MONOTONIC, &event, &t->timer) == -1){
+        perror("limit: timer_create");
+        free(t->kill_path);
+        if(t->terminal)
+            terminal_give(getpgrp());
+        return;
+    }
+    t->used = true;
+    if(timer_settime(t->timer, 0, &expiry, NULL) == -1)
+        perror("limit: timer_settime");
+}
+
+/** This function stops the timer of a job which ended, and gives the
+ *  terminal back to the shell if the job had it.
+ *
+ *  -pid: the job.
+ *
+ *  Returns: true if the job was killed by its timer.
+ */
+bool timeout_stop(pid_t pid){
+
+    sigset_t block, saved;
+    sigemptyset(&block);
+    sigaddset(&block, SIGALRM);
+    sigprocmask(SIG_BLOCK, &block, &saved);
+
+    bool fired = false;
+    for(int slot = 0; slot < TIMEOUTS_MAX; slot++){
+        struct timeout *t = &timeouts[slot];
+        if(!t->used || t->pid != pid)
+            continue;
+
+        timer_delete(t->timer);
+        if(t->terminal)
+            terminal_give(getpgrp());
+        free(t->kill_path);
+        t->kill_path = NULL;
+        t->used = false;
+        fired = t->fired;
+        break;
+    }
+
+    sigprocmask(SIG_SETMASK, &saved, NULL);
+    return fired;
+}
+
+/** This function reads a counter from a flat keyed cgroup file such as
+ *  memory.events or cpu.stat.
+ *
+ *  Returns: the value of the counter, 0 if it could not be read.
+ */
+static unsigned long cgroup_stat(const char *cgroup, const char *file,
+        const char *key){
+
+    char path[4200];
+    snprintf(path, sizeof(path), "%s/%s", cgroup, file);
+
+    FILE *stat = fopen(path, "re");
+    if(!stat)
+        return 0;
+
+    char name[64];
+    unsigned long value, ret = 0;
+    while(fscanf(stat, "%63s %lu", name, &value) == 2){
+        if(!strcmp(name, key)){
+            ret = value;
+            break;
+        }
+    }
+    fclose(stat);
+    return ret;
+}
+
+/** This function prints the OOM and throttling events of a cgroup.
+ *
+ */
+void cgroup_print_events(const char *cgroup){
+
+    printf("  [cgroup: oom=%lu oom_kill=%lu throttled=%lu (%lu us)]",
+            cgroup_stat(cgroup, "memory.events", "oom"),
+            cgroup_stat(cgroup, "memory.events", "oom_kill"),
+            cgroup_stat(cgroup, "cpu.stat", "nr_throttled"),
+            cgroup_stat(cgroup, "cpu.stat", "throttled_usec"));
+}
+
+/** This function reports why a limited foreground command was stopped.
+ *
+ *  -lim: limits the command was started with.
+ *  -status: status returned by waitpid.
+ *  -cgroup: cgroup of the command, NULL if none.
+ *  -timed_out: the command was killed by its timer, from timeout_stop().
+ *
+ */
+void limits_report(const struct launch_limits *lim, int status,
+        const char *cgroup, bool timed_out){
+
+    if(timed_out){
+        fprintf(stderr, "limit: timed out\n");
+        return;
+    }
+
+    if(cgroup != NULL && cgroup_stat(cgroup, "memory.events", "oom_kill") > 0){
+        fprintf(stderr, "limit: killed by the OOM killer (memory.max)\n");
+        return;
+    }
+
+    if(!WIFSIGNALED(status))
+        return;
+
+    switch(WTERMSIG(status)){
+        case SIGKILL:
+            if(lim->cpu == RLIM_INFINITY)
+                break;
+            /* fall through */
+        case SIGXCPU:
+            fprintf(stderr, "limit: CPU time limit exceeded\n");
+            break;
+    }
+}
+
+/** This function finds the CPUs the shell may use and their NUMA node. It is
+ *  only done once. Without NUMA information, every CPU is on node 0.
+ *
+ */
+static void spread_init(void){
+
+    if(spread_ready)
+        return;
+    spread_ready = true;
+
+    if(sched_getaffinity(0, sizeof(spread_allowed), &spread_allowed) == -1){
+        perror("sched_getaffinity");
+        CPU_ZERO(&spread_allowed);
+        CPU_SET(0, &spread_allowed);
+    }
+
+    DIR *dir = opendir("/sys/devices/system/node");
+    if(!dir)
+        return;
+
+    struct dirent *entry;
+    while((entry = readdir(dir)) != NULL){
+
+        int node;
+        if(sscanf(entry->d_name, "node%d", &node) != 1 || node < 0)
+            continue;
+
+        char path[300];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/%s/cpulist",
+                entry->d_name);
+        FILE *file = fopen(path, "re");
+        if(!file)
+            continue;
+
+        char list[4096];
+        cpu_set_t set;
+        if(fgets(list, sizeof(list), file) != NULL){
+            list[strcspn(list, "\n")] = '\0';
+            if(parse_cpus(list, &set) == 0){
+                for(int cpu = 0; cpu < CPU_SETSIZE; cpu++){
+                    if(CPU_ISSET(cpu, &set))
+                        cpu_node[cpu] = node;
+                }
+                if(node + 1 > nodes_sz)
+                    nodes_sz = node + 1;
+            }
+        }
+        fclose(file);
+    }
+    closedir(dir);
+    LOG("spread: %d CPUs on %d nodes\n", CPU_COUNT(&spread_allowed), nodes_sz);
+}
+
+/** This helper function finds the NUMA node with the most CPUs no job uses.
+ *
+ */
+static int spread_best_node(void){
+
+    int best = 0, best_free = -1;
+    for(int node = 0; node < nodes_sz; node++){
+        int node_free = 0;
+        for(int cpu = 0; cpu < CPU_SETSIZE; cpu++){
+            if(CPU_ISSET(cpu, &spread_allowed) && cpu_node[cpu] == node
+                    && cpu_use[cpu] == 0)
+                node_free++;
+        }
+        if(node_free > best_free){
+            best_free = node_free;
+            best = node;
+        }
+    }
+    return best;
+}
+
+/** This function picks the CPUs of a new background job, if NASH_SPREAD is
+ *  set. The CPUs no job uses on the node with the most of them come first,
+ *  then the free CPUs of the other nodes, then the least used ones, so jobs
+ *  only share CPUs once there are not enough for all of them.
+ *
+ *  Returns: the CPUs, as a list to be freed by the caller and given back with
+ *  spread_release(). NULL if NASH_SPREAD is not set.
+ */
+char *spread_assign(void){
+
+    const char *spread = getenv("NASH_SPREAD");
+    int want = spread != NULL ? atoi(spread) : 0;
+    if(want <= 0)
+        return NULL;
+
+    spread_init();
+    if(want > CPU_COUNT(&spread_allowed))
+        want = CPU_COUNT(&spread_allowed);
+
+    int node = spread_best_node();
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for(int picked = 0; picked < want; picked++){
+
+        /* The best CPU: least used, then on the node, then the lowest */
+        int best = -1;
+        for(int cpu = 0; cpu < CPU_SETSIZE; cpu++){
+            if(!CPU_ISSET(cpu, &spread_allowed) || CPU_ISSET(cpu, &set))
+                continue;
+
+            if(best == -1 || cpu_use[cpu] < cpu_use[best]
+                    || (cpu_use[cpu] == cpu_use[best] && cpu_node[cpu] == node
+                        && cpu_node[best] != node))
+                best = cpu;
+        }
+        CPU_SET(best, &set);
+    }
+
+    for(int cpu = 0; cpu < CPU_SETSIZE; cpu++){
+        if(CPU_ISSET(cpu, &set))
+            cpu_use[cpu]++;
+    }
+    return format_cpus(&set);
+}
+
+/** This function takes the CPUs of a job again, e.g. of a job restored from
+ *  a snapshot, so that the spread mode does not give them to other jobs.
+ *
+ */
+void spread_claim(const char *cpus){
+
+    cpu_set_t set;
+    if(cpus == NULL || parse_cpus(cpus, &set) == -1)
+        return;
+
+    spread_init();
+    for(int cpu = 0; cpu < CPU_SETSIZE; cpu++){
+        if(CPU_ISSET(cpu, &set))
+            cpu_use[cpu]++;
+    }
+}
+
+/** This function gives back the CPUs of a job which ended, once the shell
+ *  reaped it.
+ *
+ */
+void spread_release(const char *cpus){
+
+    cpu_set_t set;
+    if(cpus == NULL || parse_cpus(cpus, &set) == -1)
+        return;
+
+    for(int cpu = 0; cpu < CPU_SETSIZE; cpu++){
+        if(CPU_ISSET(cpu, &set) && cpu_use[cpu] > 0)
+            cpu_use[cpu]--;
+    }
+}
+
+/** This function picks the NUMA node of a foreground pipeline, if NASH_SPREAD
+ *  is set and there are several nodes: the one with the most free CPUs. The
+ *  pipeline may use any CPU of the node, they are not taken from the jobs.
+ *
+ *  Returns: the CPUs of the node, as a list to be freed by the caller. NULL if
+ *  the pipeline can run anywhere.
+ */
+char *spread_node(void){
+
+    const char *spread = getenv("NASH_SPREAD");
+    if(spread == NULL || atoi(spread) <= 0)
+        return NULL;
+
+    spread_init();
+    if(nodes_sz < 2)
+        return NULL;
+
+    int node = spread_best_node();
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for(int cpu = 0; cpu < CPU_SETSIZE; cpu++){
+        if(CPU_ISSET(cpu, &spread_allowed) && cpu_node[cpu] == node)
+            CPU_SET(cpu, &set);
+    }
+    return CPU_COUNT(&set) > 0 ? format_cpus(&set) : NULL;
+}
+
+/** This function sets the CPU affinity of the calling process, in the child
+ *  before the pipeline starts, so that every stage inherits it.
+ *
+ *  -cpus: the CPUs, as a list such as 0-3,8.
+ *
+ */
+void spread_apply(const char *cpus){
+
+    cpu_set_t set;
+    if(parse_cpus(cpus, &set) == -1){
+        fprintf(stderr, "limit: invalid CPU list '%s'\n", cpus);
+        return;
+    }
+
+    if(sched_setaffinity(0, sizeof(set), &set) == -1){
+        perror("limit: cpus");
+        return;
+    }
+
+    /* A background list spreads its own pipelines over its CPUs only */
+    if(spread_ready)
+        spread_allowed = set;
+}
@@ -0,0 +1,65 @@
+/**@file
+ *  Header file which contains the functions for applying resource limits and
+ *  cgroup placement to the launched commands.
+ */
+#ifndef _LIMITS_H_
+#define _LIMITS_H_
+
+#include <stdbool.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+
+/** This struct holds the limits requested with the `limit` prefix.
+ *
+ *  -cpu: CPU time in seconds (RLIMIT_CPU).
+ *  -mem: address space in bytes (RLIMIT_AS).
+ *  -fds: maximum number of open files (RLIMIT_NOFILE).
+ *  -timeout: wall-clock timeout in seconds, 0 if none.
+ *  -cg_mem: value written to memory.max of the job cgroup, NULL if none.
+ *  -cg_cpu: value written to cpu.max of the job cgroup, NULL if none.
+ *  -cpus: CPUs the command may run on, as a list such as 0-3,8. NULL if any.
+ *  -nice: nice value, NICE_UNSET if unchanged.
+ *  -ioprio: I/O priority as given to ioprio_set, -1 if unchanged.
+ *  -policy: scheduling policy (SCHED_BATCH, SCHED_FIFO...), -1 if unchanged.
+ *  -sched_prio: priority for the SCHED_FIFO and SCHED_RR policies.
+ *  -prio: priority of a background job in the queue of the jobs, 0 by
+ *   default.
+ *
+ */
+struct launch_limits {
+    rlim_t cpu;
+    rlim_t mem;
+    rlim_t fds;
+    unsigned int timeout;
+    char *cg_mem;
+    char *cg_cpu;
+    char *cpus;
+    int nice;
+    int ioprio;
+    int policy;
+    int sched_prio;
+    int prio;
+};
+
+#define NICE_UNSET 100
+
+void limits_init(struct launch_limits *);
+void limits_destroy(struct launch_limits *);
+int limits_parse(char **, struct launch_limits *);
+bool limits_use_cgroup(const struct launch_limits *);
+void limits_apply(const struct launch_limits *, const char *);
+char *cgroup_create(const struct launch_limits *);
+void cgroup_remove(const char *);
+void cgroup_reap(void);
+void cgroup_wait(const char *);
+void cgroup_print_events(const char *);
+void timeout_apply(const struct launch_limits *, const char *, bool);
+void timeout_start(const struct launch_limits *, pid_t, const char *, bool);
+bool timeout_stop(pid_t);
+void limits_report(const struct launch_limits *, int, const char *, bool);
+char *spread_assign(void);
+char *spread_node(void);
+void spread_claim(const char *);
+void spread_release(const char *);
+void spread_apply(const char *);
+#endif
@@ -0,0 +1,326 @@
+/**@file
+ *  This file contains the relays of measured pipelines (`measure a | b | c`)
+ *  and the tuning of the pipe capacity.
+ *
+ *  In a measured pipeline every stage writes to a pipe of its own, and the
+ *  shell moves the data to the pipe the next stage reads with splice(2), so
+ *  it is never copied through user space. Between the two pipes the relay
+ *  sees what each link is doing: how many bytes went through it, and how long
+ *  the input pipe of the next stage was empty (the next stage waiting on this
+ *  one) or full (this stage waiting on the next one). The pipes are sampled
+ *  on every event and at least every SAMPLE_MS milliseconds.
+ *
+ *  NASH_PIPE_SZ sets the capacity of the pipes between the stages of every
+ *  pipeline, measured or not, with F_SETPIPE_SZ. It accepts a K or M suffix.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "measure.h"
+#include "parse.h"
+#include "stats.h"
+#include "logger.h"
+
+/* Longest time between two samples of the pipes */
+#define SAMPLE_MS 5
+/* Width of the commands in the report */
+#define COMMAND_WIDTH 40
+
+/** This function reads the capacity of the pipes from NASH_PIPE_SZ.
+ *
+ *  Returns: the capacity, 0 if it is not set or not valid.
+ */
+static int pipe_sz(void){
+
+    char *env = getenv("NASH_PIPE_SZ");
+    if(env == NULL)
+        return 0;
+
+    char *end;
+    long size = strtol(env, &end, 10);
+    if(*end == 'K' || *end == 'k')
+        size *= 1024;
+    else if(*end == 'M' || *end == 'm')
+        size *= 1024 * 1024;
+
+    if(size <= 0 || size > INT_MAX)
+        return 0;
+
+    return size;
+}
+
+/** This function sets the capacity of a pipe to NASH_PIPE_SZ, if set. The
+ *  kernel rounds it up to a power of two pages; above
+ *  /proc/sys/fs/pipe-max-size it is refused to unprivileged users, which is
+ *  told once and leaves the pipe as it is.
+ *
+ *  -fd: either end of the pipe.
+ *
+ */
+void pipe_resize(int fd){
+
+    static bool warned = false;
+
+    int size = pipe_sz();
+    if(size == 0)
+        return;
+
+    if(fcntl(fd, F_SETPIPE_SZ, size) == -1 && !warned){
+        fprintf(stderr, "NASH_PIPE_SZ: %s\n", strerror(errno));
+        warned = true;
+    }
+}
+
+/** This helper function returns the bytes held by a pipe.
+ *
+ */
+static int pipe_bytes(int fd){
+
+    int bytes = 0;
+    if(ioctl(fd, FIONREAD, &bytes) == -1)
+        return 0;
+
+    return bytes;
+}
+
+/** This helper function moves everything it can on a link, without blocking.
+ *
+ *  Returns: 0 if the link is still open. 1 at the end of the data or once the
+ *  next stage exited. -1 if splice failed.
+ */
+static int link_move(int in, int out, struct link_stats *stats){
+
+    while(true){
+
+        ssize_t moved = splice(in, NULL, out, NULL, INT_MAX,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if(moved > 0){
+            stats->bytes += moved;
+            continue;
+        }
+
+        if(moved == 0)
+            return 1;
+        if(errno == EINTR)
+            continue;
+        if(errno == EAGAIN)
+            return 0;
+
+        /* EPIPE: the next stage exited */
+        if(errno == EPIPE)
+            return 1;
+
+        perror("splice");
+        return -1;
+    }
+}
+
+/** This function runs the relays of a measured pipeline until every link is
+ *  done, that is its stage closed its end or the next stage exited.
+ *
+ *  -ins: read ends of the pipes the stages write, one per link.
+ *  -outs: write ends of the pipes the next stages read. Both are closed by
+ *   the relay.
+ *  -links: number of links, the stages but the last one.
+ *  -stats: filled with what was measured on each link.
+ *
+ *  Returns: 0 if succeded. -1 if a relay failed.
+ */
+int measure_relay(const int *ins, const int *outs, size_t links,
+        struct link_stats *stats){
+
+    bool open[links];
+    bool empty[links];
+    bool full[links];
+    struct pollfd fds[links];
+
+    for(size_t i = 0; i < links; i++){
+        fcntl(ins[i], F_SETFL, fcntl(ins[i], F_GETFL) | O_NONBLOCK);
+        fcntl(outs[i], F_SETFL, fcntl(outs[i], F_GETFL) | O_NONBLOCK);
+        memset(&stats[i], 0, sizeof(struct link_stats));
+        stats[i].capacity = fcntl(outs[i], F_GETPIPE_SZ);
+        open[i] = true;
+        empty[i] = true;
+        full[i] = false;
+    }
+
+    int ret = 0;
+    size_t alive = links;
+    uint64_t start = stats_now();
+    uint64_t last = start;
+    while(alive > 0){
+
+        /* The pipes stayed as they were sampled until now */
+        uint64_t now = stats_now();
+        for(size_t i = 0; i < links; i++){
+            if(!open[i])
+                continue;
+            if(empty[i])
+                stats[i].empty_ns += now - last;
+            if(full[i])
+                stats[i].full_ns += now - last;
+        }
+        last = now;
+
+        size_t fds_sz = 0;
+        for(size_t i = 0; i < links; i++){
+            if(!open[i])
+                continue;
+
+            int done = link_move(ins[i], outs[i], &stats[i]);
+            if(done != 0){
+                if(done == -1)
+                    ret = -1;
+                close(ins[i]);
+                close(outs[i]);
+                open[i] = false;
+                stats[i].done_ns = stats_now() - start;
+                alive--;
+                continue;
+            }
+
+            /* What is left behind did not fit in the next stage's pipe */
+            empty[i] = pipe_bytes(outs[i]) == 0;
+            full[i] = pipe_bytes(ins[i]) > 0;
+
+            fds[fds_sz].fd = full[i] ? outs[i] : ins[i];
+            fds[fds_sz].events = full[i] ? POLLOUT : POLLIN;
+            fds_sz++;
+        }
+
+        if(alive > 0 && poll(fds, fds_sz, SAMPLE_MS) == -1 && errno != EINTR){
+            perror("poll");
+            ret = -1;
+            break;
+        }
+    }
+
+    for(size_t i = 0; i < links; i++){
+        if(open[i]){
+            close(ins[i]);
+            close(outs[i]);
+        }
+    }
+
+    return ret;
+}
+
+/** This helper function formats a number of bytes with a K, M or G suffix.
+ *
+ */
+static void format_bytes(char *buf, size_t buf_sz, uint64_t bytes){
+
+    if(bytes < 1024)
+        snprintf(buf, buf_sz, "%llu", (unsigned long long) bytes);
+    else if(bytes < 1024 * 1024)
+        snprintf(buf, buf_sz, "%.1fK", bytes / 1024.0);
+    else if(bytes < 1024 * 1024 * 1024)
+        snprintf(buf, buf_sz, "%.1fM", bytes / (1024.0 * 1024));
+    else
+        snprintf(buf, buf_sz, "%.1fG", bytes / (1024.0 * 1024 * 1024));
+}
+
+/** This helper function formats a time given in nanoseconds.
+ *
+ */
+static void format_time(char *buf, size_t buf_sz, uint64_t ns){
+
+    uint64_t ms = ns / 1000000;
+    if(ms < 1000)
+        snprintf(buf, buf_sz, "%llums", (unsigned long long) ms);
+    else
+        snprintf(buf, buf_sz, "%.2fs", ms / 1000.0);
+}
+
+/** This helper function formats the words of a stage, cut to the width of
+ *  the report.
+ *
+ */
+static void format_command(char *buf, size_t buf_sz,
+        const struct command_line *cmds){
+
+    if(cmds->fanout != NULL){
+        snprintf(buf, buf_sz, "{ %zu consumers }", cmds->fanout_sz);
+        return;
+    }
+
+    if(cmds->body != NULL){
+        snprintf(buf, buf_sz, "%s", cmds->body->text);
+        if(strlen(cmds->body->text) >= buf_sz)
+            strcpy(buf + buf_sz - 4, "...");
+        return;
+    }
+
+    size_t len = 0;
+    *buf = '\0';
+    for(size_t i = 0; i < cmds->total_tokens && len < buf_sz - 1; i++)
+        len += snprintf(buf + len, buf_sz - len, "%s%s", i ? " " : "",
+                cmds->tokens[i]);
+
+    if(len >= buf_sz - 1)
+        strcpy(buf + buf_sz - 4, "...");
+}
+
+/** This function prints the report of a measured pipeline to stderr: for each
+ *  stage the bytes it wrote to the next one and at which rate, how long its
+ *  input pipe was empty (it waited on the stage before) and full (the stage
+ *  before waited on it), and its exit code. The bottleneck is the stage whose
+ *  input is full while its output is empty.
+ *
+ *  -cmds: the stages.
+ *  -stages: number of stages.
+ *  -stats: what was measured on the links between them.
+ *  -statuses: the statuses returned by waitpid for the stages.
+ *  -elapsed: time the pipeline took, in nanoseconds.
+ *
+ */
+void measure_report(const struct command_line *cmds, size_t stages,
+        const struct link_stats *stats, const int *statuses, uint64_t elapsed){
+
+    char total[16];
+    char capacity[16];
+    format_time(total, sizeof(total), elapsed);
+    format_bytes(capacity, sizeof(capacity), stats[0].capacity);
+
+    fprintf(stderr, "measure: %zu stages in %s, pipes of %s\n", stages, total,
+            capacity);
+    fprintf(stderr, "%5s %9s %9s %9s %9s %6s  %s\n", "stage", "bytes", "MB/s",
+            "in empty", "in full", "status", "command");
+
+    for(size_t i = 0; i < stages; i++){
+
+        char bytes[16] = "-";
+        char rate[16] = "-";
+        char empty[16] = "-";
+        char full[16] = "-";
+        char command[COMMAND_WIDTH + 1];
+
+        if(i < stages - 1){
+            format_bytes(bytes, sizeof(bytes), stats[i].bytes);
+            if(stats[i].done_ns > 0)
+                snprintf(rate, sizeof(rate), "%.1f", stats[i].bytes * 1000.0
+                        / stats[i].done_ns);
+        }
+        if(i > 0){
+            format_time(empty, sizeof(empty), stats[i - 1].empty_ns);
+            format_time(full, sizeof(full), stats[i - 1].full_ns);
+        }
+        format_command(command, sizeof(command), &cmds[i]);
+
+        int status = WIFSIGNALED(statuses[i]) ? 128 + WTERMSIG(statuses[i])
+            : WEXITSTATUS(statuses[i]);
+
+        fprintf(stderr, "%5zu %9s %9s %9s %9s %6d  %s\n", i + 1, bytes, rate,
+                empty, full, status, command);
+    }
+}
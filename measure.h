@@ -0,0 +1,36 @@
+/**@file
+ *  Header file which contains the relays of measured pipelines and the tuning
+ *  of the pipe capacity.
+ */
+#ifndef _MEASURE_H_
+#define _MEASURE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct command_line;
+
+/** This struct holds what was measured on the link between two stages.
+ *
+ *  -bytes: bytes moved from the stage to the next one.
+ *  -empty_ns: time the input pipe of the next stage was empty, the next stage
+ *   waiting on this one.
+ *  -full_ns: time the input pipe of the next stage was full, this stage
+ *   waiting on the next one.
+ *  -done_ns: time from the start of the relay to the end of the data.
+ *  -capacity: capacity of the input pipe of the next stage.
+ *
+ */
+struct link_stats {
+    uint64_t bytes;
+    uint64_t empty_ns;
+    uint64_t full_ns;
+    uint64_t done_ns;
+    int capacity;
+};
+
+void pipe_resize(int);
+int measure_relay(const int *, const int *, size_t, struct link_stats *);
+void measure_report(const struct command_line *, size_t,
+        const struct link_stats *, const int *, uint64_t);
+#endif
@@ -0,0 +1,67 @@
+/**@file
+ *  Header file for the builtins loaded with `enable -f lib.so name`. It is the
+ *  whole interface between nash and such a builtin, and it only changes along
+ *  with NASH_BUILTIN_ABI, so a library built against it keeps working with
+ *  later versions of the shell.
+ *
+ *  A library provides the builtin `name` by defining a nash_builtin_name
+ *  symbol:
+ *
+ *      static int run(const struct nash_command *cmd){ ... return 0; }
+ *
+ *      struct nash_builtin nash_builtin_name = {
+ *          NASH_BUILTIN_ABI, "name", run, "usage: name [args]", 0
+ *      };
+ *
+ *  and is built with `cc -shared -fPIC -o name.so name.c`. The builtin runs in
+ *  the shell itself: it must not exit, and it has to free what it allocates.
+ *  When it leads a pipeline it runs in a child of the shell, unless its flags
+ *  hold NASH_BUILTIN_READONLY. A library built for ABI 1, without the flags,
+ *  still loads.
+ */
+#ifndef _NASH_BUILTIN_H_
+#define _NASH_BUILTIN_H_
+
+#define NASH_BUILTIN_ABI 2
+
+/* The builtin does not change the state of the shell */
+#define NASH_BUILTIN_READONLY 1
+
+/** This struct holds the command a loaded builtin runs for.
+ *
+ *  -argc: number of arguments, argv[0] being the name of the builtin.
+ *  -argv: the arguments after being expanded, NULL terminated.
+ *  -stdin_file: file of the < redirection, NULL if none.
+ *  -stdout_file: file of the > or >> redirection, NULL if none.
+ *  -append: the output is appended to stdout_file (>>).
+ *  -in_fd, out_fd: descriptors to read the input from and write the output
+ *   to, with the redirections and pipes already applied.
+ *
+ */
+struct nash_command {
+    int argc;
+    char **argv;
+    const char *stdin_file;
+    const char *stdout_file;
+    int append;
+    int in_fd;
+    int out_fd;
+};
+
+/** This struct describes a loaded builtin.
+ *
+ *  -abi: NASH_BUILTIN_ABI the library was built with.
+ *  -name: name of the builtin.
+ *  -run: runs the builtin, returns its exit code.
+ *  -usage: one line shown by `enable`, may be NULL.
+ *  -flags: NASH_BUILTIN_READONLY or 0, read from ABI 2.
+ *
+ */
+struct nash_builtin {
+    unsigned int abi;
+    const char *name;
+    int (*run)(const struct nash_command *);
+    const char *usage;
+    unsigned int flags;
+};
+#endif
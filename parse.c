@@ -0,0 +1,897 @@
+/**@file
+ *  This file contains the parser of command lines. The tokens produced by
+ *  lex_line() are parsed once into a tree:
+ *
+ *      list     := and_or ((';' | '&') and_or)* [';' | '&']
+ *      and_or   := pipeline (('&&' | '||') pipeline)*
+ *      pipeline := function | if | while | for
+ *                | ['measure'] ['limit' key=value...] command ('|' command)* ['|' fanout]
+ *      fanout   := '{' command (';' command)* [';'] '}'
+ *      function := (name '()' | name() | 'function' name) '{' list '}'
+ *      if       := 'if' list 'then' list ('elif' list 'then' list)*
+ *                  ['else' list] 'fi'
+ *      while    := ('while' | 'until') list 'do' list 'done'
+ *      for      := 'for' name ['in' word*] ';' 'do' list 'done'
+ *
+ *  The words are kept as they were entered, quotes included; they are expanded
+ *  every time the command runs (see expand.c), so the body of a loop is parsed
+ *  once however many times it runs.
+ *
+ *  A line which stops inside a loop, a conditional or a function, or right
+ *  after |, && or ||, is incomplete: the shell reads the next line and parses
+ *  both again, joined with a ; (see shell.c).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "parse.h"
+#include "procsub.h"
+#include "util.h"
+#include "logger.h"
+
+/* Words which can't start a command, they end a part of a compound command */
+static const char *const reserved[] = {
+    "then", "elif", "else", "fi", "do", "done", NULL
+};
+
+/* Set when the line being parsed is incomplete, NULL to report it */
+static bool *incomplete = NULL;
+
+/** This helper function initializes the values of the struct command_line.
+ *
+ *  -cmds: struct of commands that have been entered on one line.
+ *  -pipe: number of commands.
+ *
+ */
+void init_commands(struct command_line *cmds, int pipe){
+
+    for(int i = 0; i < (pipe + 1); i++){
+        cmds[i].tokens = NULL;
+        cmds[i].stdout_pipe = false;
+        cmds[i].stdout_file = NULL;
+        cmds[i].stdin_file = NULL;
+        cmds[i].append = -1;
+        cmds[i].total_tokens = 0;
+        cmds[i].fanout = NULL;
+        cmds[i].fanout_sz = 0;
+        cmds[i].body = NULL;
+    }
+
+
+}
+/** This helper function frees the memory allocated for the struct command_line.
+ *
+ *  -cmds: struct of commands that have been entered on one line.
+ *  -pipe: number of commands.
+ */
+void destroy_commands(struct command_line *cmds, int pipe){
+
+    for(int i = 0; i < pipe + 1; i++){
+        for(int j = 0; j < cmds[i].total_tokens; j++){
+            free(cmds[i].tokens[j]);
+        }
+        if(cmds[i].stdout_file != NULL)
+            free(cmds[i].stdout_file);
+
+        if(cmds[i].stdin_file != NULL)
+            free(cmds[i].stdin_file);
+
+        if(cmds[i].fanout != NULL){
+            destroy_commands(cmds[i].fanout, cmds[i].fanout_sz - 1);
+            free(cmds[i].fanout);
+        }
+
+        node_destroy(cmds[i].body);
+        free(cmds[i].tokens);
+    }
+
+}
+
+/** This helper function prints a syntax error. An error at the end of the
+ *  tokens only marks the line as incomplete, if the caller asked for it.
+ *
+ *  -args: command entered after being tokenized.
+ *  -i: index of the unexpected token.
+ *  -tokens: number of tokens.
+ *
+ */
+static void syntax_error(char *const args[], int i, int tokens){
+
+    if(i >= tokens && incomplete != NULL){
+        *incomplete = true;
+        return;
+    }
+
+    fprintf(stderr, "nash: syntax error near '%s'\n",
+            i < tokens ? args[i] : "newline");
+}
+
+/** This helper function joins tokens with spaces, to keep the text of a
+ *  pipeline or a list.
+ *
+ *  Returns: the text, which has to be freed by the caller.
+ */
+static char *join_tokens(char *const args[], int start, int end){
+
+    size_t text_sz = 1;
+    for(int i = start; i < end; i++)
+        text_sz += strlen(args[i]) + 1;
+
+    char *text = malloc(text_sz);
+    if(!text){
+        perror("malloc");
+        return NULL;
+    }
+
+    *text = '\0';
+    for(int i = start; i < end; i++){
+        strcat(text, args[i]);
+        if(i + 1 < end)
+            strcat(text, " ");
+    }
+    return text;
+}
+
+/** This helper function tells whether a token is a redirection, i.e. < or >
+ *  but not a process substitution.
+ *
+ */
+static bool is_redirect(const char *arg){
+
+    return (*arg == '<' || *arg == '>') && !procsub_word(arg);
+}
+
+/** This helper function parses a redirection and the file following it.
+ *
+ *  -args: command entered after being tokenized.
+ *  -i: index of the redirection, updated to the file.
+ *  -tokens: number of tokens.
+ *  -cmd: the command the redirection applies to.
+ *
+ *  Returns: 0 if succeded. -1 if the file is missing.
+ */
+static int parse_redirect(char *const args[], int *i, int tokens,
+        struct command_line *cmd){
+
+    char *arg = args[*i];
+    if(*i + 1 >= tokens || (strchr("|;&<>", *args[*i + 1])
+                && !procsub_word(args[*i + 1]))){
+        fprintf(stderr, "nash: syntax error: missing file after '%s'\n", arg);
+        return -1;
+    }
+
+    char **file = (*arg == '<') ? &cmd->stdin_file : &cmd->stdout_file;
+    free(*file);
+    *file = strdup(args[++(*i)]);
+    if(!*file){
+        perror("strdup");
+        return -1;
+    }
+
+    if(*arg == '>')
+        cmd->append = strcmp(arg, ">>") ? -1 : 0;
+    return 0;
+}
+
+/** This helper function parses one command of a pipeline: its words and its
+ *  redirections. It stops at the first |, ;, }, & or at the end of the tokens.
+ *
+ *  -args: command entered after being tokenized.
+ *  -i: index of the first token of the command, updated past the command.
+ *  -tokens: number of tokens.
+ *  -cmd: where the command is stored.
+ *
+ *  Returns: 0 if succeded. -1 if the command is not valid.
+ */
+static int parse_command(char *const args[], int *i, int tokens,
+        struct command_line *cmd){
+
+    size_t command_sz = 8;
+    cmd->tokens = malloc(command_sz * sizeof(char*));
+    if(!cmd->tokens){
+        perror("malloc");
+        return -1;
+    }
+
+    for(; *i < tokens; (*i)++){
+
+        char *arg = args[*i];
+        if(strchr("|;&", *arg) || !strcmp(arg, "}"))
+            break;
+
+        if(is_redirect(arg)){
+            if(parse_redirect(args, i, tokens, cmd) == -1)
+                return -1;
+            continue;
+        }
+
+        /* One slot is kept for the NULL at the end */
+        if(cmd->total_tokens + 1 == command_sz){
+
+            command_sz *= 2;
+            char **temp = realloc(cmd->tokens, command_sz * sizeof(char*));
+            if(!temp){
+                perror("realloc");
+                return -1;
+            }
+            cmd->tokens = temp;
+        }
+
+        cmd->tokens[cmd->total_tokens] = strdup(arg);
+        if(!cmd->tokens[cmd->total_tokens]){
+            perror("strdup");
+            return -1;
+        }
+        cmd->total_tokens += 1;
+    }
+
+    cmd->tokens[cmd->total_tokens] = (char *) NULL;
+
+    if(cmd->total_tokens == 0){
+        syntax_error(args, *i, tokens);
+        return -1;
+    }
+
+    return 0;
+}
+
+/** This helper function parses a fan-out group `{a; b; c}`: the consumers,
+ *  separated by ;, up to the closing }.
+ *
+ *  -args: command entered after being tokenized.
+ *  -i: index of the token following {, updated past }.
+ *  -tokens: number of tokens.
+ *  -stage: the fan-out stage.
+ *
+ *  Returns: 0 if succeded. -1 if the group is not valid.
+ */
+static int parse_fanout(char *const args[], int *i, int tokens,
+        struct command_line *stage){
+
+    while(true){
+
+        struct command_line *temp = realloc(stage->fanout,
+                (stage->fanout_sz + 1) * sizeof(struct command_line));
+        if(!temp){
+            perror("realloc");
+            return -1;
+        }
+        stage->fanout = temp;
+        init_commands(&stage->fanout[stage->fanout_sz], 0);
+        stage->fanout_sz += 1;
+
+        if(parse_command(args, i, tokens,
+                    &stage->fanout[stage->fanout_sz - 1]) == -1)
+            return -1;
+
+        if(*i < tokens && !strcmp(args[*i], ";")){
+            (*i)++;
+            /* A ; right before the } is allowed */
+            if(*i < tokens && !strcmp(args[*i], "}")){
+                (*i)++;
+                return 0;
+            }
+            continue;
+        }
+
+        if(*i < tokens && !strcmp(args[*i], "}")){
+            (*i)++;
+            return 0;
+        }
+
+        fprintf(stderr, "nash: syntax error: missing '}'\n");
+        return -1;
+    }
+}
+
+/** This helper function frees a pipeline.
+ *
+ */
+static void pipeline_destroy(struct pipeline *pl){
+
+    if(pl->cmds != NULL){
+        destroy_commands(pl->cmds, pl->pipe);
+        free(pl->cmds);
+    }
+
+    if(pl->limits != NULL){
+        limits_destroy(pl->limits);
+        free(pl->limits);
+    }
+
+    free(pl->text);
+    free(pl);
+}
+
+static struct node *parse_list(char *const [], int *, int,
+        const char *const []);
+
+/** This helper function checks if a token is one of a list of words.
+ *
+ *  -arg: the token.
+ *  -words: the words, NULL terminated. NULL for an empty list.
+ *
+ */
+static bool is_word(const char *arg, const char *const words[]){
+
+    for(int i = 0; words != NULL && words[i] != NULL; i++){
+        if(!strcmp(arg, words[i]))
+            return true;
+    }
+    return false;
+}
+
+/** This helper function skips the token expected at i.
+ *
+ *  Returns: 0 if succeded. -1 if the token at i is not the expected one.
+ */
+static int expect(char *const args[], int *i, int tokens, const char *word){
+
+    if(*i >= tokens || strcmp(args[*i], word)){
+        syntax_error(args, *i, tokens);
+        return -1;
+    }
+    (*i)++;
+    return 0;
+}
+
+/** This helper function allocates a node.
+ *
+ *  Returns: the node, NULL if memory could not be allocated.
+ */
+static struct node *node_new(enum node_type type){
+
+    struct node *node = calloc(1, sizeof(struct node));
+    if(!node){
+        perror("calloc");
+        return NULL;
+    }
+    node->type = type;
+    return node;
+}
+
+/** This helper function checks if a function definition starts at i.
+ *
+ *  Returns: the number of tokens before the {, 0 if there is no definition.
+ */
+static int function_start(char *const args[], int i, int tokens){
+
+    if(i + 2 < tokens && !strcmp(args[i], "function")
+            && !strcmp(args[i + 2], "{"))
+        return 2;
+
+    size_t len = strlen(args[i]);
+    if(i + 1 < tokens && len > 2 && !strcmp(args[i] + len - 2, "()")
+            && !strcmp(args[i + 1], "{"))
+        return 1;
+
+    if(i + 2 < tokens && !strcmp(args[i + 1], "()")
+            && !strcmp(args[i + 2], "{"))
+        return 2;
+
+    return 0;
+}
+
+/** This helper function parses a function definition.
+ *
+ *  -args: command entered after being tokenized.
+ *  -i: index of the definition, updated past its }.
+ *  -tokens: number of tokens.
+ *  -skip: number of tokens before the {, as returned by function_start().
+ *
+ *  Returns: the NODE_FUNCTION node, NULL if the definition is not valid.
+ */
+static struct node *parse_function(char *const args[], int *i, int tokens,
+        int skip){
+
+    const char *name = !strcmp(args[*i], "function") ? args[*i + 1] : args[*i];
+    size_t name_sz = strlen(name);
+    if(name_sz > 2 && !strcmp(name + name_sz - 2, "()"))
+        name_sz -= 2;
+
+    static const char *const end[] = { "}", NULL };
+
+    *i += skip + 1;
+    struct node *body = parse_list(args, i, tokens, end);
+    if(body == NULL)
+        return NULL;
+
+    if(*i >= tokens || strcmp(args[*i], "}")){
+        syntax_error(args, *i, tokens);
+        node_destroy(body);
+        return NULL;
+    }
+    (*i)++;
+
+    struct node *node = calloc(1, sizeof(struct node));
+    if(!node || !(node->name = strndup(name, name_sz))){
+        perror("calloc");
+        free(node);
+        node_destroy(body);
+        return NULL;
+    }
+    node->type = NODE_FUNCTION;
+    node->left = body;
+    return node;
+}
+
+/** This helper function parses an if, from its if (or elif) to its fi. An elif
+ *  is parsed as an if in the else branch.
+ *
+ *  -args: command entered after being tokenized.
+ *  -i: index of the if, updated past the fi.
+ *  -tokens: number of tokens.
+ *
+ *  Returns: the NODE_IF node, NULL if it is not valid.
+ */
+static struct node *parse_if(char *const args[], int *i, int tokens){
+
+    static const char *const then[] = { "then", NULL };
+    static const char *const branch_end[] = { "elif", "else", "fi", NULL };
+    static const char *const fi[] = { "fi", NULL };
+
+    struct node *node = node_new(NODE_IF);
+    if(node == NULL)
+        return NULL;
+
+    (*i)++;
+    if((node->left = parse_list(args, i, tokens, then)) == NULL
+            || expect(args, i, tokens, "then") == -1
+            || (node->right = parse_list(args, i, tokens, branch_end)) == NULL)
+        goto fail;
+
+    if(*i < tokens && !strcmp(args[*i], "elif")){
+        if((node->otherwise = parse_if(args, i, tokens)) == NULL)
+            goto fail;
+        return node;
+    }
+
+    if(*i < tokens && !strcmp(args[*i], "else")){
+        (*i)++;
+        if((node->otherwise = parse_list(args, i, tokens, fi)) == NULL)
+            goto fail;
+    }
+
+    if(expect(args, i, tokens, "fi") == -1)
+        goto fail;
+    return node;
+
+fail:
+    node_destroy(node);
+    return NULL;
+}
+
+/** This helper function parses a while or an until loop.
+ *
+ *  -args: command entered after being tokenized.
+ *  -i: index of the while, updated past the done.
+ *  -tokens: number of tokens.
+ *
+ *  Returns: the NODE_WHILE node, NULL if it is not valid.
+ */
+static struct node *parse_while(char *const args[], int *i, int tokens){
+
+    static const char *const cond_end[] = { "do", NULL };
+    static const char *const body_end[] = { "done", NULL };
+
+    struct node *node = node_new(NODE_WHILE);
+    if(node == NULL)
+        return NULL;
+
+    node->until = !strcmp(args[(*i)++], "until");
+    if((node->left = parse_list(args, i, tokens, cond_end)) == NULL
+            || expect(args, i, tokens, "do") == -1
+            || (node->right = parse_list(args, i, tokens, body_end)) == NULL
+            || expect(args, i, tokens, "done") == -1){
+        node_destroy(node);
+        return NULL;
+    }
+    return node;
+}
+
+/** This helper function parses a for loop. Without `in`, the loop goes over
+ *  the arguments of the function being run, like `for name in "$@"`.
+ *
+ *  -args: command entered after being tokenized.
+ *  -i: index of the for, updated past the done.
+ *  -tokens: number of tokens.
+ *
+ *  Returns: the NODE_FOR node, NULL if it is not valid.
+ */
+static struct node *parse_for(char *const args[], int *i, int tokens){
+
+    static const char *const body_end[] = { "done", NULL };
+
+    struct node *node = node_new(NODE_FOR);
+    if(node == NULL)
+        return NULL;
+
+    (*i)++;
+    if(*i >= tokens || name_len(args[*i]) != strlen(args[*i])){
+        syntax_error(args, *i, tokens);
+        goto fail;
+    }
+    if(!(node->name = strdup(args[(*i)++]))){
+        perror("strdup");
+        goto fail;
+    }
+
+    bool in = *i < tokens && !strcmp(args[*i], "in");
+    int start = in ? ++(*i) : *i;
+    while(in && *i < tokens && strcmp(args[*i], ";"))
+        (*i)++;
+
+    node->words = calloc(*i - start + 2, sizeof(char *));
+    if(!node->words){
+        perror("calloc");
+        goto fail;
+    }
+    for(int j = start; j < *i; j++){
+        if(!(node->words[j - start] = strdup(args[j]))){
+            perror("strdup");
+            goto fail;
+        }
+    }
+    if(!in && !(node->words[0] = strdup("\"$@\""))){
+        perror("strdup");
+        goto fail;
+    }
+
+    if(*i < tokens && !strcmp(args[*i], ";"))
+        (*i)++;
+
+    if(expect(args, i, tokens, "do") == -1
+            || (node->right = parse_list(args, i, tokens, body_end)) == NULL
+            || expect(args, i, tokens, "done") == -1)
+        goto fail;
+    return node;
+
+fail:
+    node_destroy(node);
+    return NULL;
+}
+
+/** This helper function checks if a token starts a compound command, i.e. an
+ *  if or a loop.
+ *
+ */
+static bool compound_start(const char *arg){
+
+    static const char *const starts[] = { "if", "while", "until", "for", NULL };
+    return is_word(arg, starts);
+}
+
+/** This helper function parses a stage of a pipeline: a compound command
+ *  followed by its redirections, or a simple command.
+ *
+ *  -args: command entered after being tokenized.
+ *  -i: index of the first token of the stage, updated past the stage.
+ *  -tokens: number of tokens.
+ *  -cmd: where the stage is stored.
+ *
+ *  Returns: 0 if succeded. -1 if the stage is not valid.
+ */
+static int parse_stage(char *const args[], int *i, int tokens,
+        struct command_line *cmd){
+
+    if(*i >= tokens || !compound_start(args[*i]))
+        return parse_command(args, i, tokens, cmd);
+
+    int start = *i;
+    if(!strcmp(args[*i], "if"))
+        cmd->body = parse_if(args, i, tokens);
+    else if(!strcmp(args[*i], "for"))
+        cmd->body = parse_for(args, i, tokens);
+    else
+        cmd->body = parse_while(args, i, tokens);
+    if(cmd->body == NULL
+            || !(cmd->body->text = join_tokens(args, start, *i)))
+        return -1;
+
+    for(; *i < tokens && is_redirect(args[*i]); (*i)++){
+        if(parse_redirect(args, i, tokens, cmd) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+/** This helper function parses a pipeline, with its optional `measure` and
+ *  `limit` prefixes and fan-out group. A compound command alone is returned
+ *  as its own node, so that it runs in the shell; one piped to or from other
+ *  commands, redirected or prefixed becomes a compound stage of the pipeline.
+ *
+ *  -args: command entered after being tokenized.
+ *  -i: index of the first token of the pipeline, updated past the pipeline.
+ *  -tokens: number of tokens.
+ *
+ *  Returns: the pipeline node, NULL if the pipeline is not valid.
+ */
+static struct node *parse_pipeline(char *const args[], int *i, int tokens){
+
+    int skip;
+    if(*i < tokens && (skip = function_start(args, *i, tokens)) > 0)
+        return parse_function(args, i, tokens, skip);
+
+    if(*i < tokens && is_word(args[*i], reserved)){
+        syntax_error(args, *i, tokens);
+        return NULL;
+    }
+
+    int start = *i;
+    struct pipeline *pl = calloc(1, sizeof(struct pipeline));
+    struct node *node = calloc(1, sizeof(struct node));
+    if(!pl || !node){
+        perror("calloc");
+        free(pl);
+        free(node);
+        return NULL;
+    }
+    node->type = NODE_PIPELINE;
+    node->pipeline = pl;
+
+    if(*i < tokens && !strcmp(args[*i], "measure")){
+        pl->measure = true;
+        (*i)++;
+    }
+
+    if(*i < tokens && !strcmp(args[*i], "limit")){
+        pl->limits = malloc(sizeof(struct launch_limits));
+        if(!pl->limits){
+            perror("malloc");
+            node_destroy(node);
+            return NULL;
+        }
+        limits_init(pl->limits);
+
+        int ret = limits_parse((char **) args + *i, pl->limits);
+        if(ret == -1){
+            node_destroy(node);
+            return NULL;
+        }
+        *i += ret;
+    }
+
+    /* The commands grow as the pipes are found, the | of a compound stage
+     * being inside it */
+    size_t cmds_sz = 4;
+    pl->cmds = malloc(cmds_sz * sizeof(struct command_line));
+    if(!pl->cmds){
+        perror("malloc");
+        node_destroy(node);
+        return NULL;
+    }
+    init_commands(pl->cmds, 0);
+
+    while(true){
+
+        struct command_line *p = &pl->cmds[pl->pipe];
+        int ret;
+        if(*i < tokens && !strcmp(args[*i], "{") && pl->pipe > 0){
+            (*i)++;
+            ret = parse_fanout(args, i, tokens, p);
+        } else {
+            ret = parse_stage(args, i, tokens, p);
+        }
+
+        if(ret == -1){
+            node_destroy(node);
+            return NULL;
+        }
+
+        if(*i >= tokens || strcmp(args[*i], "|") || p->fanout != NULL)
+            break;
+
+        if((size_t) pl->pipe + 1 == cmds_sz){
+            cmds_sz *= 2;
+            struct command_line *temp = realloc(pl->cmds,
+                    cmds_sz * sizeof(struct command_line));
+            if(!temp){
+                perror("realloc");
+                node_destroy(node);
+                return NULL;
+            }
+            pl->cmds = temp;
+        }
+
+        pl->cmds[pl->pipe].stdout_pipe = true;
+        pl->pipe++;
+        init_commands(&pl->cmds[pl->pipe], 0);
+        (*i)++;
+    }
+
+    struct command_line *first = pl->cmds;
+    if(first->body != NULL && pl->pipe == 0 && !pl->measure
+            && pl->limits == NULL && first->stdin_file == NULL
+            && first->stdout_file == NULL){
+        struct node *compound = first->body;
+        first->body = NULL;
+        node_destroy(node);
+        return compound;
+    }
+
+    pl->text = join_tokens(args, start, *i);
+    return node;
+}
+
+/** This helper function parses pipelines joined by && and ||. Both operators
+ *  have the same precedence and associate to the left.
+ *
+ *  Returns: the node, NULL if the list is not valid.
+ */
+static struct node *parse_and_or(char *const args[], int *i, int tokens){
+
+    int start = *i;
+    struct node *node = parse_pipeline(args, i, tokens);
+
+    while(node != NULL && *i < tokens
+            && (!strcmp(args[*i], "&&") || !strcmp(args[*i], "||"))){
+
+        enum node_type type = !strcmp(args[*i], "&&") ? NODE_AND : NODE_OR;
+        (*i)++;
+
+        struct node *right = parse_pipeline(args, i, tokens);
+        struct node *parent = calloc(1, sizeof(struct node));
+        if(!right || !parent){
+            node_destroy(node);
+            node_destroy(right);
+            free(parent);
+            return NULL;
+        }
+
+        parent->type = type;
+        parent->left = node;
+        parent->right = right;
+        node = parent;
+    }
+
+    if(node != NULL && node->type != NODE_PIPELINE && node->text == NULL)
+        node->text = join_tokens(args, start, *i);
+
+    return node;
+}
+
+/** This helper function parses a list, up to the end of the tokens or up to
+ *  one of the given tokens.
+ *
+ *  -args: command entered after being tokenized.
+ *  -i: index of the first token of the list, updated past the list.
+ *  -tokens: number of tokens.
+ *  -end: the tokens ending the list (e.g. "}"), NULL terminated. NULL for the
+ *   end of the line.
+ *
+ *  Returns: the root of the list, NULL if the list is empty or not valid.
+ */
+static struct node *parse_list(char *const args[], int *i, int tokens,
+        const char *const end[]){
+
+    struct node *root = NULL;
+
+    /* A ; may follow {, do, then or else, where lines are joined */
+    while(end != NULL && *i < tokens && !strcmp(args[*i], ";"))
+        (*i)++;
+
+    while(*i < tokens && !is_word(args[*i], end)){
+
+        struct node *node = parse_and_or(args, i, tokens);
+        if(node == NULL){
+            node_destroy(root);
+            return NULL;
+        }
+
+        if(*i < tokens && !strcmp(args[*i], "&")){
+            if(node->type == NODE_PIPELINE)
+                node->pipeline->background = true;
+            else
+                node->background = true;
+            (*i)++;
+        } else if(*i < tokens && !strcmp(args[*i], ";")){
+            (*i)++;
+        } else if(*i < tokens && !is_word(args[*i], end)){
+            syntax_error(args, *i, tokens);
+            node_destroy(node);
+            node_destroy(root);
+            return NULL;
+        }
+
+        if(root == NULL){
+            root = node;
+            continue;
+        }
+
+        struct node *seq = calloc(1, sizeof(struct node));
+        if(!seq){
+            perror("calloc");
+            node_destroy(node);
+            node_destroy(root);
+            return NULL;
+        }
+        seq->type = NODE_SEQ;
+        seq->left = root;
+        seq->right = node;
+        root = seq;
+    }
+
+    if(root == NULL && end != NULL)
+        syntax_error(args, *i, tokens);
+
+    return root;
+}
+
+/** This function parses a command line into a tree of nodes.
+ *
+ *  -args: command entered after being tokenized.
+ *  -tokens: number of tokens.
+ *  -more: if not NULL, set to true instead of reporting an error when the line
+ *   is incomplete, e.g. it ends inside a loop.
+ *
+ *  Returns: the root of the tree, NULL if the line is empty or not valid. The
+ *  tree has to be freed with node_destroy().
+ */
+struct node *parse_line(char *const args[], int tokens, bool *more){
+
+    if(more != NULL)
+        *more = false;
+    incomplete = more;
+
+    int i = 0;
+    struct node *root = parse_list(args, &i, tokens, NULL);
+
+    if(root != NULL && i < tokens){
+        syntax_error(args, i, tokens);
+        node_destroy(root);
+        return NULL;
+    }
+
+    return root;
+}
+
+/** This function frees a tree of nodes.
+ *
+ */
+void node_destroy(struct node *node){
+
+    if(node == NULL)
+        return;
+
+    if(node->refs > 0){
+        node->refs--;
+        return;
+    }
+
+    if(node->pipeline != NULL)
+        pipeline_destroy(node->pipeline);
+
+    node_destroy(node->left);
+    node_destroy(node->right);
+    node_destroy(node->otherwise);
+    for(int i = 0; node->words != NULL && node->words[i] != NULL; i++)
+        free(node->words[i]);
+    free(node->words);
+    free(node->text);
+    free(node->name);
+    free(node);
+}
+
+/** This function counts the commands of a tree, e.g. 3 for `a | b && c`. The
+ *  body of a loop counts once, a fan-out group for each of its consumers and
+ *  a compound stage for the commands inside it.
+ *
+ */
+unsigned int node_commands(const struct node *node){
+
+    if(node == NULL)
+        return 0;
+
+    unsigned int commands = 0;
+    if(node->pipeline != NULL){
+        for(int i = 0; i <= node->pipeline->pipe; i++){
+            const struct command_line *cmd = &node->pipeline->cmds[i];
+            commands += cmd->body != NULL ? node_commands(cmd->body)
+                : cmd->fanout != NULL ? cmd->fanout_sz : 1;
+        }
+    }
+
+    return commands + node_commands(node->left) + node_commands(node->right)
+        + node_commands(node->otherwise);
+}
@@ -0,0 +1,109 @@
+/**@file
+ *  Header file which contains the parser of command lines. A line is parsed
+ *  once into a tree of nodes, which the shell then executes.
+ */
+#ifndef _PARSE_H_
+#define _PARSE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "limits.h"
+
+struct node;
+
+/** This struct is used to hold the commands that come as input which are
+ *  not builtins.
+ *  - tokens: holds the commands entered.
+ *  - total_token: keeps track of the number of strings.
+ *  - stdout_pipe: is used to determine if we are at the last command.
+ *  - stdout_file ,stdin_file: are used to store the location for io redirection.
+ *  - append: is used to determine if we need to append to a file, `>>`.
+ *  - fanout, fanout_sz: the consumers of a fan-out stage (`| {a; b; c}`). A
+ *    fan-out stage has no tokens of its own.
+ *  - body: the loop or the if of a compound stage (`for ...; done | wc -l`),
+ *    NULL for a simple command. A compound stage has no tokens of its own.
+ *
+ */
+struct command_line {
+    char **tokens;
+    size_t total_tokens;
+    bool stdout_pipe;
+    char *stdout_file;
+    char *stdin_file;
+    int append;
+    struct command_line *fanout;
+    size_t fanout_sz;
+    struct node *body;
+};
+
+/** This struct holds a pipeline.
+ *  - cmds: the commands of the pipeline.
+ *  - pipe: number of pipes, cmds holds pipe + 1 commands.
+ *  - background: the pipeline ends with &.
+ *  - limits: limits set with the `limit` prefix, NULL if none.
+ *  - measure: the pipeline has the `measure` prefix.
+ *  - text: the pipeline as entered, shown by jobs.
+ *
+ */
+struct pipeline {
+    struct command_line *cmds;
+    int pipe;
+    bool background;
+    struct launch_limits *limits;
+    bool measure;
+    char *text;
+};
+
+/** Types of the nodes of a parsed line. */
+enum node_type {
+    NODE_PIPELINE,
+    NODE_AND,
+    NODE_OR,
+    NODE_SEQ,
+    NODE_FUNCTION,
+    NODE_IF,
+    NODE_WHILE,
+    NODE_FOR
+};
+
+/** This struct holds a node of a parsed line.
+ *  - type: NODE_PIPELINE runs pipeline. NODE_AND and NODE_OR run right only
+ *    if left succeeded or failed. NODE_SEQ runs left, then right.
+ *    NODE_FUNCTION defines the function name, whose body is left.
+ *    NODE_IF runs right if left succeeds, otherwise if it fails. NODE_WHILE
+ *    runs right as long as left succeeds (fails for until). NODE_FOR runs
+ *    right once for each of words, with the variable name set to the word.
+ *  - pipeline: the pipeline of a NODE_PIPELINE.
+ *  - left, right: the operands of the other nodes.
+ *  - otherwise: the else branch of a NODE_IF, NULL if there is none.
+ *  - words: the words of a NODE_FOR as entered, NULL terminated.
+ *  - until: the NODE_WHILE is an until loop.
+ *  - background: the list ends with & and runs in a forked copy of the shell.
+ *  - text: the list as entered, shown by jobs for background lists.
+ *  - name: name of the function of a NODE_FUNCTION, of the variable of a
+ *    NODE_FOR.
+ *  - refs: number of references to the node besides its parent, e.g. from the
+ *    table of functions. node_destroy() only frees a node without any.
+ *
+ */
+struct node {
+    enum node_type type;
+    struct pipeline *pipeline;
+    struct node *left;
+    struct node *right;
+    struct node *otherwise;
+    char **words;
+    bool until;
+    bool background;
+    char *text;
+    char *name;
+    unsigned int refs;
+};
+
+void init_commands(struct command_line *, int);
+void destroy_commands(struct command_line *, int);
+struct node *parse_line(char *const [], int, bool *);
+void node_destroy(struct node *);
+unsigned int node_commands(const struct node *);
+#endif
@@ -0,0 +1,207 @@
+/**@file
+ *  This file contains the process substitutions: `<(cmd)` is replaced by a
+ *  /dev/fd/N path the command reads the output of cmd from, and `>(cmd)` by
+ *  one it writes the input of cmd to, e.g. `diff <(sort a) <(sort b)`.
+ *
+ *  Each substitution is a pipe and a child running cmd, started when the word
+ *  is expanded, so it runs concurrently with the command it is given to and
+ *  nothing is written to the filesystem. The shell keeps its end of the pipe,
+ *  close-on-exec like every descriptor it opens, until the command is
+ *  started: the command's process keeps the ends named by its words open
+ *  across exec and closes everything else.
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "procsub.h"
+#include "parse.h"
+#include "util.h"
+#include "logger.h"
+
+static int (*run_node)(struct node *) = NULL;
+static int fds[PROCSUB_MAX];
+static size_t fds_sz = 0;
+
+/** This function sets the function which runs the substituted commands in
+ *  the children, the one running the lines of the shell.
+ *
+ */
+void procsub_init(int (*run)(struct node *)){
+
+    run_node = run;
+}
+
+/** This function tells whether a word, as entered, is a process
+ *  substitution.
+ *
+ */
+bool procsub_word(const char *word){
+
+    return (*word == '<' || *word == '>') && word[1] == '(';
+}
+
+/** This function starts a process substitution.
+ *
+ *  -word: the substitution as entered, `<(cmd)` or `>(cmd)`.
+ *
+ *  Returns: the /dev/fd/N path standing for it, to be freed by the caller.
+ *  NULL if the command is not valid or could not be started.
+ */
+char *procsub_open(const char *word){
+
+    if(fds_sz == PROCSUB_MAX){
+        fprintf(stderr, "nash: too many process substitutions\n");
+        return NULL;
+    }
+
+    size_t len = strlen(word);
+    char *line = strndup(word + 2, len - 3);
+    char *buf = malloc(2 * len + 1);
+    char *args[4096];
+    if(!line || !buf){
+        perror("malloc");
+        free(line);
+        free(buf);
+        return NULL;
+    }
+
+    int tokens = lex_line(line, buf, args, 4096);
+    struct node *tree = tokens > 0 ? parse_line(args, tokens, NULL) : NULL;
+    if(tree == NULL){
+        if(tokens == 0)
+            fprintf(stderr, "nash: %s: empty process substitution\n", word);
+        free(line);
+        free(buf);
+        return NULL;
+    }
+
+    /* <(cmd) writes to the pipe, >(cmd) reads from it */
+    bool reads = *word == '<';
+    int fd[2];
+    if(pipe2(fd, O_CLOEXEC) == -1){
+        perror("pipe");
+        node_destroy(tree);
+        free(line);
+        free(buf);
+        return NULL;
+    }
+
+    pid_t pid = fork();
+    if(pid == 0){
+
+        signal(SIGCHLD, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+
+        /* The ends of the other substitutions are not this one's to keep */
+        for(size_t i = 0; i < fds_sz; i++)
+            close(fds[i]);
+        fds_sz = 0;
+
+        int target = reads ? STDOUT_FILENO : STDIN_FILENO;
+        if(dup2(fd[reads ? 1 : 0], target) == -1){
+            perror("dup2");
+            _exit(EXIT_FAILURE);
+        }
+        close(fd[0]);
+        close(fd[1]);
+
+        int status = run_node(tree);
+        fflush(stdout);
+        _exit(status < 0 ? EXIT_FAILURE : status);
+    }
+
+    node_destroy(tree);
+    free(line);
+    free(buf);
+    close(fd[reads ? 1 : 0]);
+
+    if(pid == -1){
+        perror("fork");
+        close(fd[reads ? 0 : 1]);
+        return NULL;
+    }
+
+    int keep = fd[reads ? 0 : 1];
+    char *path;
+    if(asprintf(&path, "/dev/fd/%d", keep) == -1){
+        perror("asprintf");
+        close(keep);
+        return NULL;
+    }
+
+    LOG("Process substitution %s on %s, pid %d\n", word, path, pid);
+    fds[fds_sz++] = keep;
+    return path;
+}
+
+/** This function is called in the child about to exec a command. The ends of
+ *  the substitutions named by its words are kept open across exec.
+ *
+ *  -words: the words of the command, expanded.
+ *  -keep: set to the descriptors to keep.
+ *  -keep_sz: number of entries of keep.
+ *
+ *  Returns: the number of descriptors to keep.
+ */
+size_t procsub_keep(char *const words[], int *keep, size_t keep_sz){
+
+    size_t total = 0;
+    for(size_t i = 0; i < fds_sz && total < keep_sz; i++){
+
+        char path[32];
+        snprintf(path, sizeof(path), "/dev/fd/%d", fds[i]);
+
+        bool named = false;
+        for(size_t j = 0; words[j] != NULL && !named; j++)
+            named = !strcmp(words[j], path);
+
+        if(named && fcntl(fds[i], F_SETFD, 0) != -1)
+            keep[total++] = fds[i];
+    }
+
+    return total;
+}
+
+/** This function closes the shell's ends of the substitutions once the
+ *  command they were given to is started, so that each child sees EOF or
+ *  SIGPIPE when the command is done with it. The children are reaped like
+ *  the other children of the shell, when they exit.
+ *
+ */
+void procsub_close(void){
+
+    for(size_t i = 0; i < fds_sz; i++)
+        close(fds[i]);
+    fds_sz = 0;
+}
+
+/** This function takes the shell's ends of the substitutions away from
+ *  procsub_close(), for a command which is not started yet: a queued job
+ *  keeps them until it is.
+ *
+ *  -taken: set to the descriptors, PROCSUB_MAX entries.
+ *
+ *  Returns: the number of descriptors taken.
+ */
+size_t procsub_take(int *taken){
+
+    size_t total = fds_sz;
+    memcpy(taken, fds, fds_sz * sizeof(*fds));
+    fds_sz = 0;
+    return total;
+}
+
+/** This function gives back the descriptors of procsub_take(), when the
+ *  command they were taken for is about to be started.
+ *
+ */
+void procsub_give(const int *given, size_t given_sz){
+
+    for(size_t i = 0; i < given_sz && fds_sz < PROCSUB_MAX; i++)
+        fds[fds_sz++] = given[i];
+}
@@ -0,0 +1,23 @@
+/**@file
+ *  Header file which contains the process substitutions, `<(cmd)` and
+ *  `>(cmd)`.
+ */
+#ifndef _PROCSUB_H_
+#define _PROCSUB_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Substitutions open at once */
+#define PROCSUB_MAX 64
+
+struct node;
+
+void procsub_init(int (*)(struct node *));
+bool procsub_word(const char *);
+char *procsub_open(const char *);
+size_t procsub_keep(char *const [], int *, size_t);
+void procsub_close(void);
+size_t procsub_take(int *);
+void procsub_give(const int *, size_t);
+#endif
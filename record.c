@@ -0,0 +1,362 @@
+/**@file
+ *  This file records sessions and replays them, so that a session recorded on
+ *  a production machine can be used as a benchmark.
+ *
+ *  With NASH_RECORD=file every line read by the shell is written to the file
+ *  with the time it was entered, the wall-clock and CPU time it took and its
+ *  exit status:
+ *
+ *      # nash record 1
+ *      <offset ms>\t<wall us>\t<cpu us>\t<status>\t<line>
+ *
+ *  With NASH_REPLAY=file the lines are read from the recording instead of
+ *  stdin and go through the same execution path. They run back to back, or at
+ *  the pace they were entered with NASH_REPLAY_PACING=original. At the end the
+ *  replayed timings are compared with the recorded ones.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "record.h"
+#include "stats.h"
+#include "logger.h"
+
+#define RECORD_HEADER "# nash record 1"
+#define REPORT_SLOWDOWNS 10
+
+/** This struct holds one line of a recording, and how long it took when it
+ *  was replayed.
+ *
+ *  -line: the line.
+ *  -offset_ms: when it was entered, since the start of the session.
+ *  -wall_us, cpu_us, status: as recorded.
+ *  -replay_wall_us, replay_cpu_us, replay_status: as replayed.
+ *
+ */
+struct replay_entry {
+    char *line;
+    unsigned long offset_ms;
+    unsigned long wall_us;
+    unsigned long cpu_us;
+    int status;
+    unsigned long replay_wall_us;
+    unsigned long replay_cpu_us;
+    int replay_status;
+};
+
+static int record_fd = -1;
+static pid_t owner = -1;
+static uint64_t session_start = 0;
+
+static char *replay_buf = NULL;
+static char *replay_pos = NULL;
+static bool paced = false;
+static struct replay_entry *entries = NULL;
+static size_t entries_sz = 0;
+static size_t entries_limit = 0;
+
+static bool pending = false;
+static char *pending_line = NULL;
+static uint64_t pending_start = 0;
+static unsigned long pending_cpu = 0;
+
+/** This function returns the CPU time used by the children waited for, in
+ *  microseconds.
+ *
+ */
+static unsigned long children_cpu_us(void){
+
+    struct rusage ru;
+    if(getrusage(RUSAGE_CHILDREN, &ru) == -1)
+        return 0;
+
+    return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000UL
+        + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+/** This function reads a whole recording into memory, so that the children
+ *  forked while replaying don't share a file offset with the shell.
+ *
+ *  Returns: 0 if succeded. -1 if the file can't be read or is not a recording.
+ */
+static int replay_load(const char *path){
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd == -1){
+        perror(path);
+        return -1;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) == -1){
+        perror("fstat");
+        close(fd);
+        return -1;
+    }
+
+    replay_buf = malloc(st.st_size + 1);
+    if(!replay_buf){
+        perror("malloc");
+        close(fd);
+        return -1;
+    }
+
+    size_t total = 0;
+    ssize_t read_sz;
+    while(total < (size_t) st.st_size
+            && (read_sz = read(fd, replay_buf + total, st.st_size - total)) > 0)
+        total += read_sz;
+    close(fd);
+    replay_buf[total] = '\0';
+
+    if(strncmp(replay_buf, RECORD_HEADER, strlen(RECORD_HEADER))){
+        fprintf(stderr, "%s: not a nash recording\n", path);
+        free(replay_buf);
+        replay_buf = NULL;
+        return -1;
+    }
+
+    replay_pos = replay_buf;
+    return 0;
+}
+
+/** This function starts recording or replaying a session, as requested by
+ *  NASH_RECORD and NASH_REPLAY.
+ *
+ */
+void record_init(void){
+
+    owner = getpid();
+    session_start = stats_now();
+
+    char *path = getenv("NASH_RECORD");
+    if(path != NULL && *path != '\0'){
+        record_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if(record_fd == -1)
+            perror(path);
+        else
+            dprintf(record_fd, "%s\n", RECORD_HEADER);
+    }
+
+    path = getenv("NASH_REPLAY");
+    if(path != NULL && *path != '\0' && replay_load(path) == 0){
+        char *pacing = getenv("NASH_REPLAY_PACING");
+        paced = pacing != NULL && !strcmp(pacing, "original");
+        LOG("Replaying %s (%s)\n", path, paced ? "original pacing" : "fast");
+    }
+}
+
+/** This function tells if the session is replayed from a recording.
+ *
+ */
+bool record_replaying(void){
+
+    return replay_buf != NULL;
+}
+
+/** This function returns the next line of the recording. With the original
+ *  pacing it first waits until the time the line was entered.
+ *
+ *  Returns: the line, which has to be freed by the caller. NULL at the end of
+ *  the recording.
+ */
+char *replay_next(void){
+
+    while(replay_pos != NULL && *replay_pos != '\0'){
+
+        char *line = replay_pos;
+        char *end = strchr(line, '\n');
+        if(end != NULL){
+            *end = '\0';
+            replay_pos = end + 1;
+        } else {
+            replay_pos += strlen(line);
+        }
+
+        if(*line == '#' || *line == '\0')
+            continue;
+
+        struct replay_entry entry = { 0 };
+        char *p = line;
+        entry.offset_ms = strtoul(p, &p, 10);
+        entry.wall_us = strtoul(p, &p, 10);
+        entry.cpu_us = strtoul(p, &p, 10);
+        entry.status = strtol(p, &p, 10);
+        if(*p != '\t'){
+            fprintf(stderr, "nash: skipping malformed record: %s\n", line);
+            continue;
+        }
+        entry.line = p + 1;
+
+        if(entries_sz == entries_limit){
+            entries_limit = entries_limit ? entries_limit * 2 : 64;
+            struct replay_entry *temp = realloc(entries,
+                    entries_limit * sizeof(struct replay_entry));
+            if(!temp){
+                perror("realloc");
+                return NULL;
+            }
+            entries = temp;
+        }
+        entries[entries_sz++] = entry;
+
+        if(paced){
+            uint64_t due = session_start + entry.offset_ms * 1000000ULL;
+            uint64_t now = stats_now();
+            if(due > now){
+                struct timespec ts = { (due - now) / 1000000000,
+                    (due - now) % 1000000000 };
+                while(nanosleep(&ts, &ts) == -1 && errno == EINTR);
+            }
+        }
+
+        char *copy = strdup(entry.line);
+        if(!copy)
+            perror("strdup");
+        return copy;
+    }
+
+    return NULL;
+}
+
+/** This function marks the start of a line read by the shell.
+ *
+ *  -line: the line, as returned by read_command.
+ *
+ */
+void record_begin(const char *line){
+
+    if(record_fd == -1 && replay_buf == NULL)
+        return;
+
+    free(pending_line);
+    pending_line = record_fd != -1 ? strdup(line) : NULL;
+    pending_cpu = children_cpu_us();
+    pending_start = stats_now();
+    pending = true;
+}
+
+/** This function marks the end of the line started with record_begin(), and
+ *  writes it to the recording or keeps its replayed timings.
+ *
+ *  -status: exit status of the line.
+ *
+ */
+void record_end(int status){
+
+    /* Children running a builtin or a background list are not the session */
+    if(!pending || getpid() != owner)
+        return;
+    pending = false;
+
+    unsigned long wall_us = (stats_now() - pending_start) / 1000;
+    unsigned long cpu_us = children_cpu_us() - pending_cpu;
+
+    if(record_fd != -1 && pending_line != NULL){
+        dprintf(record_fd, "%lu\t%lu\t%lu\t%d\t%s\n",
+                (unsigned long) ((pending_start - session_start) / 1000000),
+                wall_us, cpu_us, status, pending_line);
+    }
+    free(pending_line);
+    pending_line = NULL;
+
+    if(replay_buf != NULL && entries_sz > 0){
+        struct replay_entry *entry = &entries[entries_sz - 1];
+        entry->replay_wall_us = wall_us;
+        entry->replay_cpu_us = cpu_us;
+        entry->replay_status = status;
+    }
+}
+
+/** This function orders replayed lines by how much slower they got.
+ *
+ */
+static int compare_slowdown(const void *a, const void *b){
+
+    const struct replay_entry *x = a;
+    const struct replay_entry *y = b;
+    long dx = (long) x->replay_wall_us - (long) x->wall_us;
+    long dy = (long) y->replay_wall_us - (long) y->wall_us;
+
+    return (dy > dx) - (dy < dx);
+}
+
+/** This function prints how the replay compares with the recording: total
+ *  wall-clock and CPU time, the lines whose exit status changed and the lines
+ *  which slowed down the most.
+ *
+ */
+static void replay_report(void){
+
+    unsigned long wall = 0, replay_wall = 0, cpu = 0, replay_cpu = 0;
+    size_t changed = 0;
+
+    for(size_t i = 0; i < entries_sz; i++){
+        wall += entries[i].wall_us;
+        replay_wall += entries[i].replay_wall_us;
+        cpu += entries[i].cpu_us;
+        replay_cpu += entries[i].replay_cpu_us;
+        if(entries[i].status != entries[i].replay_status){
+            fprintf(stderr, "replay: line %zu exited with %d instead of %d: "
+                    "%s\n", i + 1, entries[i].replay_status, entries[i].status,
+                    entries[i].line);
+            changed++;
+        }
+    }
+
+    fprintf(stderr, "replay: %zu lines, wall %.3fs -> %.3fs (%+.1f%%), cpu "
+            "%.3fs -> %.3fs (%+.1f%%), %zu exit status changes\n", entries_sz,
+            wall / 1e6, replay_wall / 1e6,
+            wall ? 100.0 * ((double) replay_wall - wall) / wall : 0,
+            cpu / 1e6, replay_cpu / 1e6,
+            cpu ? 100.0 * ((double) replay_cpu - cpu) / cpu : 0, changed);
+
+    struct replay_entry *sorted = malloc(entries_sz * sizeof(*sorted));
+    if(!sorted)
+        return;
+    memcpy(sorted, entries, entries_sz * sizeof(*sorted));
+    qsort(sorted, entries_sz, sizeof(*sorted), compare_slowdown);
+
+    for(size_t i = 0; i < entries_sz && i < REPORT_SLOWDOWNS; i++){
+        long delta = (long) sorted[i].replay_wall_us - (long) sorted[i].wall_us;
+        if(delta <= 0)
+            break;
+        fprintf(stderr, "replay: %+10.3fms  %10.3fms -> %10.3fms  %s\n",
+                delta / 1e3, sorted[i].wall_us / 1e3,
+                sorted[i].replay_wall_us / 1e3, sorted[i].line);
+    }
+    free(sorted);
+}
+
+/** This function finishes the recording, or prints the report of the replay.
+ *  A line still running (e.g. exit) is recorded with status 0.
+ *
+ */
+void record_destroy(void){
+
+    if(getpid() == owner){
+        record_end(0);
+
+        if(replay_buf != NULL)
+            replay_report();
+    }
+
+    if(record_fd != -1)
+        close(record_fd);
+    record_fd = -1;
+
+    free(pending_line);
+    free(entries);
+    free(replay_buf);
+    pending_line = NULL;
+    entries = NULL;
+    replay_buf = NULL;
+    entries_sz = entries_limit = 0;
+}
@@ -0,0 +1,15 @@
+/**@file
+ *  Header file which contains the recording and replay of sessions.
+ */
+#ifndef _RECORD_H_
+#define _RECORD_H_
+
+#include <stdbool.h>
+
+void record_init(void);
+void record_destroy(void);
+bool record_replaying(void);
+char *replay_next(void);
+void record_begin(const char *);
+void record_end(int);
+#endif
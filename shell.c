@@ -2,6 +2,8 @@
  * This file contains the main function and the functions for executing
  * commands.
  */
+#define _GNU_SOURCE
+#include <errno.h>
 #include <fcntl.h>
 #include <pwd.h>
 #include <stdbool.h>
@@ -14,99 +16,347 @@
 #include <unistd.h>
 #include <signal.h>
 
+#include "builtins.h"
+#include "dirs.h"
+#include "expand.h"
+#include "fanout.h"
+#include "parse.h"
+#include "procsub.h"
+#include "record.h"
+#include "snapshot.h"
 #include "jobs.h"
+#include "limits.h"
+#include "measure.h"
+#include "stats.h"
+#include "symbols.h"
 #include "history.h"
 #include "util.h"
 #include "logger.h"
 #include "ui.h"
 
 
-/** This struct is used to hold the commands that come as input which are
- *  not builtins.
- *  - tokens: holds the commands entered.
- *  - total_token: keeps track of the number of strings.
- *  - stdout_pipe: is used to determine if we are at the last command.
- *  - stdout_file ,stdin_file: are used to store the location for io redirection.
- *  - append: is used to determine if we need to append to a file, `>>`.
+static char *command = NULL;
+static char *command_copy = NULL;
+static struct node *tree = NULL;
+static pid_t child;
+static pid_t running = -1;
+/* Set by SIGINT, stops the loops of the line being run */
+static volatile sig_atomic_t interrupted = 0;
+/* Number of loops being run, and of the loops a break or a continue leaves */
+static unsigned int loops = 0;
+static unsigned int loop_jump = 0;
+static bool loop_continue = false;
+
+/** Maximum depth of nested function calls. */
+#define FUNCTION_DEPTH 1000
+static uint64_t forked_at = 0;
+
+bool shell_command(const struct command_line *cmd, int *status);
+int exec_node(struct node *node);
+
+/** This function opens the redirection files of a command and moves them on
+ *  top of stdin/stdout. The original descriptors are closed once duplicated so
+ *  that nothing but 0, 1 and 2 survives into the exec'd program.
+ *  - cmds: pointer to current command.
  *
  */
-struct command_line {
-    char **tokens;
-    size_t total_tokens;
-    bool stdout_pipe;
-    char *stdout_file;
-    char *stdin_file;
-    int append;
-};
+void redirect_files(struct command_line *cmds)
+{
+    if(cmds->stdin_file != NULL){
 
+        int file = open(cmds->stdin_file, O_RDONLY | O_CLOEXEC);
+        if(file == -1){
 
-static char *command = NULL;
-static int proc_status;
-static pid_t child;
-static int job = -1;
-static pid_t running = -1;
-/** This function executes recursively all the commands in cmds.
+            perror(cmds->stdin_file);
+            exit(EXIT_FAILURE);
+        }
+
+        if(dup2(file, STDIN_FILENO) == -1){
+
+            perror("dup2");
+            exit(EXIT_FAILURE);
+        }
+        close(file);
+    }
+
+    if(cmds->stdout_pipe == false && cmds->stdout_file != NULL){
+
+        int flags;
+        if(cmds->append == -1)
+            flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+        else
+            flags = O_WRONLY | O_APPEND | O_CLOEXEC;
+
+        int fd = open(cmds->stdout_file, flags, 0666);
+        if(fd == -1){
+
+            perror("open");
+            exit(EXIT_FAILURE);
+        }
+
+        if(dup2(fd, STDOUT_FILENO) == -1){
+
+            perror("dup2");
+            exit(EXIT_FAILURE);
+        }
+        close(fd);
+    }
+}
+
+/** This function replaces the current process with the command. Every
+ *  descriptor above stderr is closed first, so a leaked pipe end can never keep
+ *  a reader from seeing EOF.
  *  - cmds: pointer to current command.
  *
  */
-void pipeline_r(struct command_line *cmds)
+void exec_command(struct command_line *cmds)
 {
-    if(cmds->stdout_pipe == false){
+    /* A function, alias or builtin inside a pipeline runs in the forked
+     * child, and so does a compound stage, which waits for its own
+     * pipelines */
+    int status;
+    if(cmds->body != NULL){
+        signal(SIGCHLD, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+        status = exec_node(cmds->body);
+        fflush(stdout);
+        _exit(status < 0 ? EXIT_FAILURE : status);
+    }
 
-            if(cmds->stdout_file !=NULL){
+    if(cmds->total_tokens == 0)
+        exit(EXIT_SUCCESS);
 
-                int flags;
-                if(cmds->append == -1)
-                    flags = O_WRONLY | O_CREAT | O_TRUNC;
-                else
-                    flags = O_WRONLY | O_APPEND;
+    /* _exit, so that the stdin buffer of the shell is not synced back to the
+     * descriptor it shares with the shell */
+    if(shell_command(cmds, &status)){
+        fflush(stdout);
+        _exit(status < 0 ? EXIT_FAILURE : status);
+    }
 
-                int fd = open(cmds->stdout_file, flags, 0666);
-                if(fd == -1){
+    fd_check();
 
-                    perror("open");
-                    exit(EXIT_FAILURE);
-                }
+    /* The pipes of its process substitutions are the only descriptors the
+     * command inherits besides stdin, stdout and stderr */
+    int keep[PROCSUB_MAX];
+    size_t keep_sz = procsub_keep(cmds->tokens, keep, PROCSUB_MAX);
+    close_inherited_fds(keep, keep_sz);
 
+    stats_inc(STAT_EXECS);
+    stats_time(TIMER_EXEC, stats_now() - forked_at);
 
-                if(dup2(fd, STDOUT_FILENO) == -1){
+    execvp(cmds->tokens[0], cmds->tokens);
+    stats_inc(STAT_EXEC_FAILS);
+    perror(cmds->tokens[0]);
 
-                    perror("dup2");
-                    exit(EXIT_FAILURE);
-                }
+    close(fileno(stdin));
+    close(fileno(stdout));
+    close(fileno(stderr));
+    exit(EXIT_FAILURE);
+}
+
+/** This function runs a fan-out stage. The current process, whose stdin is
+ *  the producer's pipe, starts one child per consumer, each one reading from
+ *  its own pipe, and becomes the relay copying the producer's output to them.
+ *  It exits once every consumer is done, with the status of the last one that
+ *  failed.
+ *  - cmds: the fan-out stage.
+ *
+ */
+void fanout_stage(struct command_line *cmds)
+{
+    int outs[cmds->fanout_sz];
+    pid_t pids[cmds->fanout_sz];
+
+    /* The relay waits for its own children */
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+
+    for(size_t i = 0; i < cmds->fanout_sz; i++){
+
+        int fd[2];
+        if(pipe2(fd, O_CLOEXEC) == -1){
+
+            perror("pipe");
+            _exit(EXIT_FAILURE);
+        }
+
+        uint64_t start = stats_now();
+        pids[i] = fork();
+        if(pids[i] == 0){
+
+            forked_at = stats_now();
+
+            if(dup2(fd[0], STDIN_FILENO) == -1){
+
+                perror("dup2");
+                _exit(EXIT_FAILURE);
+            }
+            redirect_files(&cmds->fanout[i]);
+            exec_command(&cmds->fanout[i]);
+        } else if(pids[i] == -1){
+
+            perror("fork");
+            _exit(EXIT_FAILURE);
+        }
+
+        stats_inc(STAT_FORKS);
+        stats_time(TIMER_FORK, stats_now() - start);
+
+        close(fd[0]);
+        outs[i] = fd[1];
+    }
+
+    /* A consumer exiting early must not kill the relay */
+    signal(SIGPIPE, SIG_IGN);
+
+    int ret = fanout_relay(STDIN_FILENO, outs, cmds->fanout_sz);
+    close(STDIN_FILENO);
+
+    int status;
+    for(size_t i = 0; i < cmds->fanout_sz; i++){
+        if(waitpid(pids[i], &status, 0) != -1 && status != 0)
+            ret = WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+    }
+
+    _exit(ret == -1 ? EXIT_FAILURE : ret);
+}
+
+/** This function runs a measured pipeline. The current process starts the
+ *  stages, each one writing to a pipe of its own, becomes the relay moving
+ *  the data to the pipe of the next stage, and prints the report once every
+ *  stage is done. It exits with the status of the last stage.
+ *  - cmds: the stages.
+ *  - stages: number of stages, at least 2.
+ *
+ */
+void measure_stages(struct command_line *cmds, size_t stages)
+{
+    size_t links = stages - 1;
+    int ins[links], writes[links];
+    int outs[links], reads[links];
+    pid_t pids[stages];
+    int statuses[stages];
+    struct link_stats stats[links];
+
+    /* The relay waits for its own children */
+    signal(SIGCHLD, SIG_DFL);
+    uint64_t start = stats_now();
+
+    for(size_t i = 0; i < links; i++){
+
+        int in[2], out[2];
+        if(pipe2(in, O_CLOEXEC) == -1 || pipe2(out, O_CLOEXEC) == -1){
+
+            perror("pipe");
+            _exit(EXIT_FAILURE);
+        }
+        pipe_resize(in[0]);
+        pipe_resize(out[0]);
+
+        ins[i] = in[0];
+        writes[i] = in[1];
+        outs[i] = out[1];
+        reads[i] = out[0];
+    }
+
+    for(size_t i = 0; i < stages; i++){
+
+        uint64_t fork_start = stats_now();
+        pids[i] = fork();
+        if(pids[i] == 0){
+
+            forked_at = stats_now();
+
+            if(i > 0 && dup2(reads[i - 1], STDIN_FILENO) == -1){
+
+                perror("dup2");
+                _exit(EXIT_FAILURE);
             }
+            if(cmds[i].fanout == NULL)
+                redirect_files(&cmds[i]);
+            if(i < links && dup2(writes[i], STDOUT_FILENO) == -1){
 
-            if(cmds->stdin_file != NULL){
+                perror("dup2");
+                _exit(EXIT_FAILURE);
+            }
 
-                int file = open(cmds->stdin_file, O_RDONLY);
-                dup2(file, STDIN_FILENO);
+            /* A builtin stage does not exec, its copies must go now */
+            for(size_t j = 0; j < links; j++){
+                close(ins[j]);
+                close(writes[j]);
+                close(outs[j]);
+                close(reads[j]);
             }
 
-            execvp(cmds->tokens[0], cmds->tokens);
-            perror(cmds->tokens[0]);
+            if(cmds[i].fanout != NULL)
+                fanout_stage(&cmds[i]);
+            exec_command(&cmds[i]);
+        } else if(pids[i] == -1){
 
-            close(fileno(stdin));
-            close(fileno(stdout));
-            close(fileno(stderr));
-            exit(EXIT_FAILURE);
+            perror("fork");
+            _exit(EXIT_FAILURE);
+        }
+
+        stats_inc(STAT_FORKS);
+        stats_time(TIMER_FORK, stats_now() - fork_start);
+    }
+
+    for(size_t i = 0; i < links; i++){
+        close(writes[i]);
+        close(reads[i]);
+    }
+
+    /* An interrupted pipeline is still reported, and a stage exiting early
+     * must not kill the relay */
+    signal(SIGINT, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+
+    measure_relay(ins, outs, links, stats);
+
+    for(size_t i = 0; i < stages; i++){
+        if(waitpid(pids[i], &statuses[i], 0) == -1)
+            statuses[i] = EXIT_FAILURE << 8;
+    }
+
+    measure_report(cmds, stages, stats, statuses, stats_now() - start);
+
+    int status = statuses[links];
+    _exit(WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status));
+}
+
+/** This function executes recursively all the commands in cmds.
+ *  - cmds: pointer to current command.
+ *
+ */
+void pipeline_r(struct command_line *cmds)
+{
+    if(cmds->fanout != NULL){
+
+        fanout_stage(cmds);
+
+    } else if(cmds->stdout_pipe == false){
+
+        redirect_files(cmds);
+        exec_command(cmds);
 
     } else {
 
         int fd[2];
-        if (pipe(fd) == -1) {
+        if (pipe2(fd, O_CLOEXEC) == -1) {
 
             perror("pipe");
             exit(EXIT_FAILURE);
         }
+        pipe_resize(fd[0]);
 
         int child_r;
+        uint64_t start = stats_now();
         child_r = fork();
         if(child_r == 0){
 
-            if(cmds->stdin_file != NULL){
-                int file = open(cmds->stdin_file, O_RDONLY);
-                dup2(file, STDIN_FILENO);
-            }
+            forked_at = stats_now();
+
+            redirect_files(cmds);
 
             if(dup2(fd[1], STDOUT_FILENO) == -1){
 
@@ -115,21 +365,24 @@ void pipeline_r(struct command_line *cmds)
             }
 
             close(fd[0]);
-            execvp(cmds->tokens[0], cmds->tokens);
-            perror(cmds->tokens[0]);
-            exit(EXIT_FAILURE);
+            close(fd[1]);
+            exec_command(cmds);
         } else if (child_r == -1){
 
             perror("fork");
             exit(EXIT_FAILURE);
         } else {
 
+            stats_inc(STAT_FORKS);
+            stats_time(TIMER_FORK, stats_now() - start);
+
             if(dup2(fd[0], STDIN_FILENO) == -1){
 
                 perror("dup2");
                 exit(EXIT_FAILURE);
             }
 
+            close(fd[0]);
             close(fd[1]);
             pipeline_r(cmds + 1);
         }
@@ -138,61 +391,186 @@ void pipeline_r(struct command_line *cmds)
 }
 
 
-/** This function is used for handling the builtins. The command entered as
- *  input and the same command tokenized are passed as arguments.
- *  - command: command entered.
- *  - args: command enter after being tokenized
+/** This function handles the alias builtin.
  *
- *  Returns: 0 is returned if a builtin is executed successfully. If not 0
- *  command was either not found or it failed.
+ *      alias               prints every alias
+ *      alias name          prints an alias
+ *      alias name=value    defines an alias
  *
+ *  - args: command entered after being expanded.
  *
+ *  Returns: 0 if succeded. -1 if an alias was not found or is not valid.
  */
-int handle_builtins(char *command, char **args){
+static int handle_alias(char **args){
 
-    if(!strcmp(args[0], "jobs")){
-        jobs_print();
+    if(args[1] == NULL){
+        alias_print(NULL);
         return 0;
     }
-    if(!strcmp(args[0], "cd")){
-        char path[256];
-        if(args[1] == NULL){
-            strcpy(path, getpwd());
-        } else if(!strncmp(args[1], "~", 1)){
-
-            if(strlen(args[1]) == 1){
-                strcpy(path, getpwd());
-            } else {
-                char *p = args[1];
-                sprintf(path, "%s%s", getpwd(), ++p);
-            }
 
-        } else {
-            strcpy(path, args[1]);
+    int ret = 0;
+    for(int i = 1; args[i] != NULL; i++){
+
+        char *value = strchr(args[i], '=');
+        if(value == NULL){
+            if(alias_command(args[i]) == NULL && alias_list(args[i]) == NULL){
+                fprintf(stderr, "alias: %s: not found\n", args[i]);
+                ret = -1;
+            }
+            alias_print(args[i]);
+            continue;
         }
 
-        int ret;
-        if((ret = chdir(path)) == 0)
-            set_prompt_cwd();
+        *value++ = '\0';
+        if(alias_define(args[i], value) == -1)
+            ret = -1;
+    }
+    return ret;
+}
+
+/** These functions are the builtins of the shell, dispatched through the
+ *  table of builtins.c.
+ *  - args: the builtin and its arguments, NULL terminated.
+ *
+ *  Returns: 0 is returned if a builtin is executed successfully. If not 0
+ *  the builtin failed.
+ *
+ */
+static int builtin_jobs(char **args){
+
+    if(args[1] != NULL && !strcmp(args[1], "-o"))
+        return jobs_output(args[2]);
 
-        return ret;
+    jobs_print();
+    return 0;
+}
+
+static int builtin_cd(char **args){
+
+    int ret;
+    if(!strcmp(args[0], "cd"))
+        ret = dirs_cd(args);
+    else if(!strcmp(args[0], "pushd"))
+        ret = dirs_pushd(args);
+    else
+        ret = dirs_popd();
+
+    if(ret == 0)
+        set_prompt_cwd();
+    return ret;
+}
+
+static int builtin_dirs(char **args){
+
+    dirs_print();
+    return 0;
+}
+
+static int builtin_exit(char **args){
+
+    record_destroy();
+    dirs_destroy();
+    node_destroy(tree);
+    symbols_destroy();
+    builtins_destroy();
+    free(command_copy);
+    free(command);
+    jobs_destroy();
+    hist_destroy();
+    clean_ui();
+    stats_destroy();
+    exit(0);
+}
+
+static int builtin_history(char **args){
+
+    if(args[1] != NULL && !strcmp(args[1], "-q"))
+        return hist_query(args + 2);
+
+    hist_print();
+    return 0;
+}
+
+static int builtin_true(char **args){
+
+    return 0;
+}
+
+static int builtin_false(char **args){
+
+    return 1;
+}
+
+static int builtin_break(char **args){
+
+    char *end = NULL;
+    long levels = args[1] != NULL ? strtol(args[1], &end, 10) : 1;
+    if(end != NULL && (*end != '\0' || end == args[1] || levels < 1)){
+        fprintf(stderr, "%s: %s: not a positive number\n", args[0], args[1]);
+        return 1;
+    }
+    if(loops == 0){
+        fprintf(stderr, "%s: only meaningful in a loop\n", args[0]);
+        return 1;
+    }
+
+    loop_jump = levels < loops ? levels : loops;
+    loop_continue = !strcmp(args[0], "continue");
+    return 0;
+}
+
+static int builtin_export(char **args){
+
+    int ret = 0;
+    for(int i = 1; args[i] != NULL; i++){
+        char *value = strchr(args[i], '=');
+        if(value != NULL){
+            *value++ = '\0';
+            if(var_set(args[i], value) == -1)
+                ret = -1;
+        }
+        if(var_export(args[i]) == -1){
+            fprintf(stderr, "export: %s: not set\n", args[i]);
+            ret = -1;
+        }
     }
+    return ret;
+}
 
-     if(!strcmp(args[0], "exit")){
-         free(command);
-         jobs_destroy();
-         hist_destroy();
-         clean_ui();
-         exit(0);
-     }
-     if(!strcmp(args[0], "history")){
-       hist_print();
-       return 0;
-     }
+static int builtin_unset(char **args){
 
-     return -1;
+    for(int i = 1; args[i] != NULL; i++)
+        var_unset(args[i]);
+    return 0;
 }
 
+static int builtin_unalias(char **args){
+
+    int ret = 0;
+    for(int i = 1; args[i] != NULL; i++){
+        if(alias_remove(args[i]) == -1){
+            fprintf(stderr, "unalias: %s: not found\n", args[i]);
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+static const struct builtin_def shell_builtins[] = {
+    { "jobs", builtin_jobs, true }, { "cd", builtin_cd, false },
+    { "pushd", builtin_cd, false }, { "popd", builtin_cd, false },
+    { "dirs", builtin_dirs, true }, { "exit", builtin_exit, false },
+    { "history", builtin_history, true },
+    { "nashstat", handle_nashstat, true }, { "alias", handle_alias, false },
+    { "unalias", builtin_unalias, false }, { "true", builtin_true, true },
+    { ":", builtin_true, true }, { "false", builtin_false, true },
+    { "enable", builtins_enable, false },
+    { "snapshot", snapshot_builtin, false },
+    { "restore", restore_builtin, false },
+    { "break", builtin_break, false }, { "continue", builtin_break, false },
+    { "export", builtin_export, false }, { "unset", builtin_unset, false }
+};
+
 /** This functions frees the memory allocated.
  *
  */
@@ -240,181 +618,335 @@ int handle_search(char *command){
 
     return -1;
 }
-/** This helper function allocates memory for the struct command_line and
- *  initializes its values.
+void sigint_handler();
+
+/** This helper function turns the status returned by waitpid into an exit
+ *  code: the exit status of the program, or 128 plus the number of the signal
+ *  that killed it.
+ *
+ */
+static int exit_code(int status){
+
+    if(WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+
+    return WEXITSTATUS(status);
+}
+
+int exec_node(struct node *node);
+
+/** This helper function runs a parsed tree with the given arguments, e.g. the
+ *  body of a function. The tree is referenced while it runs, so that it can
+ *  safely redefine itself.
  *
- *  -cmds: struct of commands that have been entered on one line.
- *  -pipe: number of commands.
+ *  -body: the tree.
+ *  -args: the command calling it; args[1] and onwards become $1, $2...
  *
+ *  Returns: the exit code of the tree.
  */
-void init_commands(struct command_line *cmds, int pipe){
+static int run_tree(struct node *body, char **args){
 
-    for(int i = 0; i < (pipe + 1); i++){
-        cmds[i].stdout_file = NULL;
-        cmds[i].stdin_file = NULL;
-        cmds[i].append = -1;
-        cmds[i].total_tokens = 0;
+    static int depth = 0;
+    if(depth >= FUNCTION_DEPTH){
+        fprintf(stderr, "nash: %s: maximum function nesting reached\n", args[0]);
+        return -1;
     }
 
+    char **saved = params_set(args + 1);
+    body->refs++;
+    depth++;
 
+    int status = exec_node(body);
+
+    depth--;
+    node_destroy(body);
+    params_set(saved);
+    return status;
 }
-/** This helper function frees the memory allocated for the struct command_line.
+
+/** This helper function counts the name=value words a command starts with.
  *
- *  -cmds: struct of commands that have been entered on one line.
- *  -pipe: number of commands.
  */
-void destroy_commands(struct command_line *cmds, int pipe){
+static int assignments_count(char **tokens){
 
-    for(int i = 0; i < pipe + 1; i++){
-        for(int j = 0; j < cmds[i].total_tokens; j++){
-            free(cmds[i].tokens[j]);
-        }
-        if(cmds[i].stdout_file != NULL)
-            free(cmds[i].stdout_file);
+    int assignments = 0;
+    for(size_t len; tokens[assignments] != NULL
+            && (len = name_len(tokens[assignments])) > 0
+            && tokens[assignments][len] == '='; assignments++);
 
-        if(cmds[i].stdin_file != NULL)
-            free(cmds[i].stdin_file);
+    return assignments;
+}
 
-        free(cmds[i].tokens);
-    }
+/** This helper function tells whether shell_command would run a command,
+ *  without running it.
+ *
+ */
+static bool is_shell_command(char **tokens){
 
+    return tokens[assignments_count(tokens)] == NULL
+        || function_lookup(tokens[0]) != NULL
+        || alias_list(tokens[0]) != NULL
+        || builtin_lookup(tokens[0]) != NULL;
 }
-void sigint_handler();
 
-/** This function handles the commands that are present in the path. The
- *  tokenization of the command, the number of commands (pipe), and the number of
- *  tokens is passed to the function. All the commands are parsed in the struct
- *  command_line. This function executes pipline_r and returns the status of the
- *  child process.
- *
- *  -args: command entered after being tokenized.
- *  -pipe: number of commands.
- *  -tokens: number of tokens.
+/** This function runs a command handled by the shell itself: variable
+ *  assignments, a function, an alias for a pipeline or a list, or a builtin.
+ *  They are looked up in this order.
  *
- *  Returns: 0 if the command succeded. Not 0 if the command failed.
+ *  -cmd: the command after being expanded.
+ *  -status: set to the exit code of the command.
  *
+ *  Returns: true if the command was run by the shell, false if it has to be
+ *  executed.
  */
-int handle_utils(char *const args[], int pipe, int tokens){
+bool shell_command(const struct command_line *cmd, int *status){
 
-    struct command_line cmds[pipe + 1];
-    struct command_line *p;
-    p = cmds;
+    char **tokens = cmd->tokens;
 
-    init_commands(cmds, pipe);
+    /* A command made of name=value words only sets variables */
+    int assignments = assignments_count(tokens);
 
-    size_t command_sz = 8;
-    char ***commands = NULL;
+    if(tokens[assignments] == NULL){
+        *status = 0;
+        for(int i = 0; i < assignments; i++){
+            char *value = strchr(tokens[i], '=');
+            *value++ = '\0';
+            if(var_set(tokens[i], value) == -1)
+                *status = -1;
+        }
+        return true;
+    }
 
-    commands = malloc((pipe + 1) * sizeof(char**));
-    if(!commands){
-        perror("malloc");
-        return EXIT_FAILURE;
+    struct node *body;
+    if((body = function_lookup(tokens[0])) != NULL){
+        *status = run_tree(body, tokens);
+        return true;
     }
 
-    for(int i = 0; i < pipe + 1; i++){
-        commands[i] = malloc(command_sz * sizeof(char*));
-        if(!(commands[i])){
-            perror("malloc");
-            return EXIT_FAILURE;
+    if((body = alias_list(tokens[0])) != NULL){
+        if(tokens[1] != NULL){
+            fprintf(stderr, "nash: %s: this alias takes no arguments, use a "
+                    "function\n", tokens[0]);
+            *status = -1;
+        } else {
+            *status = run_tree(body, tokens);
         }
+        return true;
     }
 
-    //pointer to list of array of strings 
-    char ***command_array = commands;
-    char **p_command = *commands;
-
+    const struct builtin *builtin;
+    if((builtin = builtin_lookup(tokens[0])) != NULL){
+        uint64_t builtin_start = stats_now();
+        *status = builtin_run(builtin, cmd);
+        stats_inc(STAT_BUILTINS);
+        stats_time(TIMER_BUILTIN, stats_now() - builtin_start);
+        fflush(stdout);
+        return true;
+    }
 
-    job = -1;
+    return false;
+}
 
-    for(int i = 0; i < tokens; i++){
+/** This helper function applies the redirections of a command in the shell
+ *  itself, for a command it runs without forking: stdin and stdout are saved
+ *  above stderr, then replaced.
+ *
+ *  -cmds: the command.
+ *  -out: descriptor to write to instead of stdout, -1 if none.
+ *  -saved: set to the saved stdin and stdout, -1 for the ones left as they are.
+ *
+ *  Returns: 0 if succeded. -1 if a file could not be opened, in which case
+ *  nothing is changed.
+ */
+static int redirect_shell(const struct command_line *cmds, int out,
+        int saved[2]){
 
-        if(p->total_tokens == command_sz){
+    saved[0] = saved[1] = -1;
 
-            command_sz *= 2;
+    int fds[2] = { -1, out };
+    if(cmds->stdin_file != NULL
+            && (fds[0] = open(cmds->stdin_file, O_RDONLY | O_CLOEXEC)) == -1){
+        perror(cmds->stdin_file);
+        return -1;
+    }
 
-            *command_array = realloc(*command_array, command_sz * sizeof(char*));
-            p_command = (*command_array + p->total_tokens);
-            if(!(*command_array)){
-                perror("realloc");
-                return EXIT_FAILURE;
-            }
+    if(out == -1 && !cmds->stdout_pipe && cmds->stdout_file != NULL){
+        int flags = O_WRONLY | O_CREAT | O_CLOEXEC
+            | (cmds->append == -1 ? O_TRUNC : O_APPEND);
+        if((fds[1] = open(cmds->stdout_file, flags, 0666)) == -1){
+            perror(cmds->stdout_file);
+            if(fds[0] != -1)
+                close(fds[0]);
+            return -1;
         }
+    }
 
-        if(*args[i] == '&'){
-            job = 0;
+    fflush(stdout);
+    int ret = 0;
+    for(int i = 0; i < 2; i++){
+        if(fds[i] == -1 || ret == -1)
             continue;
-        }
 
-        if(*args[i] == '<'){
-            p->stdin_file = strdup(args[++i]);
-            if(!p->stdin_file){
-                perror("strdup");
-                return -1;
-            }
-            continue;
+        if((saved[i] = fcntl(i, F_DUPFD_CLOEXEC, STDERR_FILENO + 1)) == -1
+                || dup2(fds[i], i) == -1){
+            perror("dup2");
+            ret = -1;
         }
+    }
 
-        if(!strcmp(args[i], ">>")){
+    if(fds[0] != -1)
+        close(fds[0]);
+    if(fds[1] != -1 && fds[1] != out)
+        close(fds[1]);
+    return ret;
+}
 
-            p->append = 0;
-            p->stdout_file = strdup(args[++i]);
-            if(!p->stdout_file){
-                perror("strdup");
-                return -1;
-            }
-            continue;
-        }
+/** This helper function puts back stdin and stdout saved by redirect_shell.
+ *
+ */
+static void redirect_restore(int saved[2]){
 
-        if(*args[i] == '>'){
-            p->stdout_file = strdup(args[++i]);
-            if(!p->stdout_file){
-                perror("strdup");
-                return -1;
-            }
+    fflush(stdout);
+    for(int i = 0; i < 2; i++){
+        if(saved[i] == -1)
             continue;
-        }
+        if(dup2(saved[i], i) == -1)
+            perror("dup2");
+        close(saved[i]);
+    }
+    clearerr(stdin);
+    clearerr(stdout);
+}
 
-        if(*args[i] == '|'){
+/** This helper function tells whether a read-only builtin leads a pipeline,
+ *  in which case it runs in the shell, writing to the rest of the pipeline.
+ *  Any other builtin runs in a child like the other stages, so that
+ *  `cd /tmp | cat` leaves the shell where it is.
+ *
+ */
+static bool builtin_leads(struct pipeline *pl, struct command_line *cmds){
+
+    return pl->pipe > 0 && !pl->background && pl->limits == NULL
+        && !pl->measure && cmds->fanout == NULL && cmds->total_tokens > 0
+        && function_lookup(cmds->tokens[0]) == NULL
+        && alias_list(cmds->tokens[0]) == NULL
+        && builtin_lookup(cmds->tokens[0]) != NULL
+        && builtin_readonly(builtin_lookup(cmds->tokens[0]));
+}
 
-            *p_command = (char*) NULL;
+/** This helper function runs the builtin leading a pipeline in the shell, its
+ *  output going to the pipe the rest of the pipeline reads. SIGPIPE is
+ *  ignored meanwhile, so that a reader exiting early (`history | head -1`)
+ *  does not kill the shell.
+ *
+ *  -cmds: the builtin.
+ *  -fd: write end of the pipe, closed once the builtin is done.
+ *
+ */
+static void builtin_lead(struct command_line *cmds, int fd){
 
-            p->tokens = *command_array;  //Adding the array of strings to struct
-            command_array++;
-            p->stdout_pipe = true;
+    void (*sigpipe)(int) = signal(SIGPIPE, SIG_IGN);
 
-            p++;                         //advancing one position with struct
+    int status;
+    int saved[2];
+    if(redirect_shell(cmds, fd, saved) == 0)
+        shell_command(cmds, &status);
+    redirect_restore(saved);
 
-            p_command = *command_array;
-            command_sz = 8;
-        } else {
+    close(fd);
+    signal(SIGPIPE, sigpipe);
+}
 
-            *p_command = strdup(args[i]);
-            if(!(*p_command)){
-                perror("strdup");
-                return -1;
-            }
-            p_command++;                //advancing one element in array
-            p->total_tokens += 1;
-        }
-    }
+/** This helper function runs the expanded commands of a pipeline. A single
+ *  function, alias, builtin or redirected compound command runs in the shell
+ *  itself, with its redirections applied in place; a read-only builtin leading a foreground pipeline runs in
+ *  the shell too, once the rest is started. Anything else runs in a child process
+ *  executing pipeline_r. A foreground pipeline is waited for, a background one
+ *  is added to the jobs.
+ *
+ *  -pl: the pipeline.
+ *  -cmds: its commands, expanded.
+ *
+ *  Returns: the exit code of the pipeline, 0 for a background pipeline. -1 if
+ *  the pipeline could not be started.
+ *
+ */
+static int run_pipeline(struct pipeline *pl, struct command_line *cmds){
+
+    const struct launch_limits *lim = pl->limits;
 
-    *p_command = (char*) NULL;
-    p->tokens = *command_array;
-    p->stdout_pipe = false;
+    int status;
+    if(pl->pipe == 0 && !pl->background && lim == NULL
+            && cmds->fanout == NULL){
 
-    if(job == 0 && jobs_check() == -1){
+        if(cmds->body == NULL && cmds->total_tokens == 0
+                && cmds->stdin_file == NULL && cmds->stdout_file == NULL)
+            return 0;
 
-        printf("Limit number of jobs reached. Wait for a job to finish, or \
-    terminate it.\n");
+        if(cmds->body != NULL || (cmds->total_tokens > 0
+                    && is_shell_command(cmds->tokens))){
+            int saved[2];
+            if(redirect_shell(cmds, -1, saved) == -1)
+                status = -1;
+            else if(cmds->body != NULL)
+                status = exec_node(cmds->body);
+            else
+                shell_command(cmds, &status);
+            redirect_restore(saved);
+            return status;
+        }
+    }
 
-        destroy_commands(cmds, pipe);
-        free(commands);
+    /* The pipe comes first, so that its failure has nothing to undo */
+    int lead[2] = { -1, -1 };
+    if(builtin_leads(pl, cmds) && pipe2(lead, O_CLOEXEC) == -1){
+        perror("pipe");
         return -1;
     }
 
+    char *cgroup = NULL;
+    if(lim != NULL && limits_use_cgroup(lim))
+        cgroup = cgroup_create(lim);
+
+    /* In the spread mode a job gets CPUs of its own, and the stages of a
+     * foreground pipeline share a NUMA node */
+    char *cpus = NULL;
+    if(lim == NULL || lim->cpus == NULL)
+        cpus = pl->background ? spread_assign()
+            : pl->pipe > 0 ? spread_node() : NULL;
+
+    /* The output of a background job goes to a ring instead of the
+     * terminal */
+    struct capture output = { .fd = { -1, -1 } };
+    if(pl->background)
+        jobs_capture_init(&output);
+
+    /* The SIGCHLD handler must neither reap the child waited here, nor a
+     * background job before it is in the jobs list */
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &old);
+
+    uint64_t start = stats_now();
     child = fork();
     if(child == 0){
 
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        forked_at = stats_now();
+
+        /* The builtin leading the pipeline runs in the shell, the child runs
+         * the rest, reading from it */
+        if(lead[0] != -1){
+            if(dup2(lead[0], STDIN_FILENO) == -1){
+                perror("dup2");
+                exit(EXIT_FAILURE);
+            }
+            close(lead[0]);
+            close(lead[1]);
+            cmds++;
+        }
+
         /* This commentend function puts the child process in another group
          * process in case of background execution. In this way, signals meant
          * to be directed to the foreground won't interfere with background
@@ -423,47 +955,455 @@ int handle_utils(char *const args[], int pipe, int tokens){
          * will keep running. That's why the following lines are commended.
          */
 
-        //if(job == 0)
+        //if(pl->background)
         //    setpgid(child, child);
 
+        /* The job gets its process group before the relay is forked */
+        if(lim != NULL)
+            timeout_apply(lim, cgroup, !pl->background);
+
+        jobs_capture_start(&output);
+
+        if(cpus != NULL)
+            spread_apply(cpus);
+
+        if(lim != NULL)
+            limits_apply(lim, cgroup);
+
+        if(pl->measure && pl->pipe > 0)
+            measure_stages(cmds, pl->pipe + 1);
         pipeline_r(cmds);
 
     } else if(child == -1){
 
         perror("fork");
-    } else {
+        spread_release(pl->background ? cpus : NULL);
+        if(lead[0] != -1){
+            close(lead[0]);
+            close(lead[1]);
+        }
+        jobs_capture_cancel(&output);
+        free(cpus);
+        cgroup_remove(cgroup);
+        free(cgroup);
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        return -1;
+    }
+
+    stats_inc(STAT_FORKS);
+    stats_time(TIMER_FORK, stats_now() - start);
+
+    /* The timeout is kept by the shell, not by the child */
+    if(lim != NULL)
+        timeout_start(lim, child, cgroup, !pl->background);
+
+    /* The child has the process substitutions now */
+    procsub_close();
+
+    if(lead[0] != -1){
+        close(lead[0]);
+        builtin_lead(cmds, lead[1]);
+    }
+
+    if(pl->background){
+        jobs_add(pl->text, child, cgroup, cpus, &output);
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        free(cgroup);
+        return 0;
+    }
+    free(cpus);
+
+    uint64_t wait_start = stats_now();
+    pid_t waited;
+    running = 0;
+    while((waited = waitpid(child, &status, 0)) == -1 && errno == EINTR);
+    running = -1;
+    if(waited == -1){
+        perror("waitpid");
+        status = EXIT_FAILURE << 8;
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    stats_inc(STAT_WAITS);
+    stats_time(TIMER_WAIT, stats_now() - wait_start);
+
+    /* The other stages may still run in the cgroup, under the timer */
+    if(lim != NULL){
+        cgroup_wait(cgroup);
+        limits_report(lim, status, cgroup, timeout_stop(child));
+        cgroup_remove(cgroup);
+    }
+    free(cgroup);
+
+    return exit_code(status);
+}
+
+/** This struct holds a background job while it is queued, until it is started
+ *  by job_start().
+ *
+ *  -node: the pipeline or the list, kept from the parsed line.
+ *  -cmds: the commands of a pipeline, expanded when it was queued. NULL for a
+ *   list, whose words are expanded once it runs.
+ *  -subs, subs_sz: the process substitutions of the commands.
+ *
+ */
+struct queued_job {
+    struct node *node;
+    struct command_line *cmds;
+    int subs[PROCSUB_MAX];
+    size_t subs_sz;
+};
+
+static int exec_background(struct node *node);
+
+/** This helper function starts a queued job, once admitted by jobs_admit().
+ *
+ *  Returns: 0 if the job was started, -1 if it could not be.
+ *
+ */
+static int job_start(void *arg){
+
+    struct queued_job *job = arg;
+    if(job->cmds == NULL)
+        return exec_background(job->node);
+
+    procsub_give(job->subs, job->subs_sz);
+    job->subs_sz = 0;
+    int status = run_pipeline(job->node->pipeline, job->cmds);
+    procsub_close();
+    return status;
+}
 
-        if(job == 0){
-            jobs_add(command, child);
+/** This helper function frees a queued job, started or dropped.
+ *
+ */
+static void job_drop(void *arg){
+
+    struct queued_job *job = arg;
+    for(size_t i = 0; i < job->subs_sz; i++)
+        close(job->subs[i]);
+    if(job->cmds != NULL){
+        destroy_commands(job->cmds, job->node->pipeline->pipe);
+        free(job->cmds);
+    }
+    node_destroy(job->node);
+    free(job);
+}
+
+/** This helper function queues a background pipeline or list. Only the shell
+ *  keeps it: it is forked once admitted.
+ *
+ *  -node: the pipeline or the list, referenced until the job is started.
+ *  -cmds: the commands of a pipeline, expanded. NULL for a list.
+ *
+ */
+static void job_queue(struct node *node, struct command_line *cmds){
+
+    struct queued_job *job = malloc(sizeof(struct queued_job));
+    if(!job){
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    node->refs++;
+    job->node = node;
+    job->cmds = cmds;
+    job->subs_sz = cmds != NULL ? procsub_take(job->subs) : 0;
+
+    const struct launch_limits *lim = cmds != NULL
+        ? node->pipeline->limits : NULL;
+    jobs_queue(cmds != NULL ? node->pipeline->text : node->text,
+            lim != NULL ? lim->prio : 0, job_start, job_drop, job);
+}
+
+/** This function runs a pipeline. Its words are expanded first, from the
+ *  parsed tree, which is left as it is so that it can run again. A background
+ *  pipeline beyond the limit of the jobs is queued, expanded.
+ *
+ *  -node: the node of the pipeline.
+ *
+ *  Returns: the exit code of the pipeline, 0 for a background pipeline. -1 if
+ *  the pipeline could not be started.
+ *
+ */
+int handle_utils(struct node *node){
+
+    struct pipeline *pl = node->pipeline;
+    stats_inc(STAT_COMMANDS);
+
+    /* Decided first, as admitting the queued jobs starts their
+     * substitutions */
+    bool queue = pl->background && jobs_queueing();
+
+    struct command_line *cmds = expand_commands(pl->cmds, pl->pipe);
+    if(cmds == NULL){
+        procsub_close();
+        return -1;
+    }
+
+    if(queue){
+        job_queue(node, cmds);
+        return 0;
+    }
+
+    int status = run_pipeline(pl, cmds);
+    procsub_close();
+
+    destroy_commands(cmds, pl->pipe);
+    free(cmds);
+    return status;
+}
+
+/** This helper function runs a list ending with & (e.g. `make && ./test &`) in
+ *  a forked copy of the shell, which evaluates the list like the foreground
+ *  would and is added to the jobs.
+ *
+ *  -node: the list.
+ *
+ *  Returns: 0 if the list was started. -1 if it could not be started.
+ *
+ */
+static int exec_background(struct node *node){
+
+    char *cpus = spread_assign();
+
+    struct capture output;
+    jobs_capture_init(&output);
+
+    /* A quick list must not be reaped before it is in the jobs list */
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &old);
+
+    uint64_t start = stats_now();
+    pid_t pid = fork();
+    if(pid == 0){
+
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        jobs_capture_start(&output);
+
+        /* The copy waits for its own pipelines */
+        signal(SIGCHLD, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+
+        if(cpus != NULL)
+            spread_apply(cpus);
+
+        node->background = false;
+        int status = exec_node(node);
+        fflush(stdout);
+        _exit(status < 0 ? EXIT_FAILURE : status & 0xff);
+
+    } else if(pid == -1){
+
+        perror("fork");
+        spread_release(cpus);
+        jobs_capture_cancel(&output);
+        free(cpus);
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        return -1;
+    }
+
+    stats_inc(STAT_FORKS);
+    stats_time(TIMER_FORK, stats_now() - start);
+
+    jobs_add(node->text, pid, NULL, cpus, &output);
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    return 0;
+}
+
+/** This helper function tells whether the loop being run has to stop after a
+ *  break or a continue, which leave loop_jump loops. A continue leaving this
+ *  loop only ends its iteration.
+ *
+ *  Returns: true if the loop has to stop, false if it goes on.
+ *
+ */
+static bool loop_done(void){
+
+    if(loop_jump == 0)
+        return false;
+
+    if(--loop_jump == 0 && loop_continue)
+        return false;
+    return true;
+}
+
+/** This helper function runs a for loop. The words are expanded once, when
+ *  the loop starts, the body is run from the parsed tree for each of them.
+ *
+ *  -node: the loop.
+ *
+ *  Returns: the exit code of the last pipeline that ran, 0 if none did.
+ *
+ */
+static int exec_for(struct node *node){
+
+    char **words = expand_words(node->words);
+    if(words == NULL)
+        return -1;
+
+    int status = 0;
+    loops++;
+    for(int i = 0; words[i] != NULL; i++){
+        if(!interrupted){
+            var_set(node->name, words[i]);
+            status = exec_node(node->right);
         }
-        if(job == -1){
-            running = 0;
-            running = waitpid(child, &proc_status, 0);
-            running = -1;
+        free(words[i]);
+        if(loop_done()){
+            for(int j = i + 1; words[j] != NULL; j++)
+                free(words[j]);
+            break;
         }
     }
+    loops--;
+    free(words);
+    return status;
+}
 
-    destroy_commands(cmds, pipe);
-    free(commands);
+/** This function runs a parsed line. The right side of && only runs if the
+ *  left side succeeded, the right side of || only if it failed; ; runs both.
+ *  Loops stop early on SIGINT.
+ *
+ *  -node: the root of the line.
+ *
+ *  Returns: the exit code of the last pipeline that ran.
+ *
+ */
+int exec_node(struct node *node){
 
-    if(job == 0)
+    if(node->background){
+        if(!jobs_queueing())
+            return exec_background(node);
+        job_queue(node, NULL);
         return 0;
+    }
+
+    int status;
+    switch(node->type){
+
+        case NODE_PIPELINE:
+            status = handle_utils(node);
+            status_set(status);
+            return status;
+
+        case NODE_AND:
+            if((status = exec_node(node->left)) != 0 || loop_jump > 0)
+                return status;
+            return exec_node(node->right);
 
-    return proc_status;
+        case NODE_OR:
+            if((status = exec_node(node->left)) == 0 || loop_jump > 0)
+                return status;
+            return exec_node(node->right);
+
+        case NODE_SEQ:
+            status = exec_node(node->left);
+            if(loop_jump > 0)
+                return status;
+            return exec_node(node->right);
+
+        case NODE_FUNCTION:
+            function_define(node->name, node->left);
+            return 0;
+
+        case NODE_IF:
+            if((status = exec_node(node->left)) == 0 && loop_jump == 0)
+                return exec_node(node->right);
+            if(loop_jump > 0)
+                return status;
+            return node->otherwise != NULL ? exec_node(node->otherwise) : 0;
+
+        case NODE_WHILE:
+            status = 0;
+            loops++;
+            while(!interrupted){
+                bool cond = (exec_node(node->left) == 0) != node->until;
+                if(loop_jump > 0){
+                    if(loop_done())
+                        break;
+                    continue;
+                }
+                if(!cond || interrupted)
+                    break;
+                status = exec_node(node->right);
+                if(loop_done())
+                    break;
+            }
+            loops--;
+            return status;
+
+        case NODE_FOR:
+            return exec_for(node);
+    }
+
+    return -1;
 }
-/** This handler is called everytime a SIGCHLD is sent to the program. If a
- * background process ends is removed by the jobs list.
+/** This handler is called everytime a SIGCHLD is sent to the program. The
+ * children which ended are reaped and recorded by jobs_collect(), the jobs
+ * among them are removed from the jobs list later, from the main loop.
+ * Children ending together raise a single SIGCHLD, so all of them are reaped.
  *
  */ 
 void sigchild_handler(){
 
-    pid_t pid;
-    if((pid = waitpid(-1, &proc_status, WNOHANG)) > 0){
+    jobs_collect();
+}
 
-        jobs_delete(pid);
-        fflush(stdout);
+/** This helper function reads the next line of an incomplete command and
+ *  joins it to the command. The tokens read so far are joined back rather
+ *  than the line itself, which drops a trailing comment, and the lines are
+ *  separated with a ; unless the command ends with an operator.
+ *
+ *  -args: the tokens of the command.
+ *  -tokens: number of tokens.
+ *
+ *  Returns: 0 if succeded. -1 at the end of the input.
+ */
+static int join_next_line(char *const args[], int tokens){
+
+    char *next;
+    while(true){
+        if((next = read_continuation()) == NULL){
+            fprintf(stderr, "nash: syntax error: unexpected end of file\n");
+            return -1;
+        }
+
+        char *c = next + strspn(next, " \t\r");
+        if(*c != '\0' && *c != '#')
+            break;
+        free(next);
+    }
+
+    const char *last = args[tokens - 1];
+    const char *sep = strchr("|&;", *last) ? " " : " ; ";
+
+    size_t command_sz = strlen(next) + strlen(sep) + 1;
+    for(int i = 0; i < tokens; i++)
+        command_sz += strlen(args[i]) + 1;
+
+    char *joined = malloc(command_sz);
+    if(!joined){
+        perror("malloc");
+        free(next);
+        return -1;
     }
 
+    *joined = '\0';
+    for(int i = 0; i < tokens; i++){
+        if(i > 0)
+            strcat(joined, " ");
+        strcat(joined, args[i]);
+    }
+    strcat(joined, sep);
+    strcat(joined, next);
+    free(next);
+
+    free(command);
+    command = joined;
+    record_begin(command);
+    return 0;
 }
 
 /** This handler stops a currently running program (if any) and refreshes
@@ -472,6 +1412,7 @@ void sigchild_handler(){
  */
 void sigint_handler(){
 
+    interrupted = 1;
     sigint(running);
 
 }
@@ -479,79 +1420,130 @@ void sigint_handler(){
  *  the different handlers(builtin, utils).
  *
  */
-int main(void)
+int main(int argc, char **argv)
 {
     signal(SIGINT, sigint_handler);
     signal(SIGCHLD, sigchild_handler); 
+    stats_init();
+    record_init();
     init_ui();
     hist_init(100);
     jobs_init(10);
+    snapshot_init(argv[0]);
+    procsub_init(exec_node);
+    symbols_init(64);
+    builtins_init(shell_builtins,
+            sizeof(shell_builtins) / sizeof(*shell_builtins));
+
+    /* Interactive sessions share ~/.nash_history unless NASH_HISTFILE points
+     * somewhere else. Scripts only share it when NASH_HISTFILE is set, and a
+     * replayed session never does, so it only sees its own history. */
+    char hist_path[4096];
+    char *hist_file = getenv("NASH_HISTFILE");
+    if(hist_file == NULL && isatty(STDIN_FILENO)){
+        snprintf(hist_path, sizeof(hist_path), "%s/.nash_history", getpwd());
+        hist_file = hist_path;
+    }
+    if(hist_file != NULL && *hist_file != '\0' && !record_replaying())
+        hist_open(hist_file);
+
+    /* The directory index follows the same rules, with NASH_DIRSFILE */
+    char dirs_path[4096];
+    char *dirs_file = getenv("NASH_DIRSFILE");
+    if(dirs_file == NULL && isatty(STDIN_FILENO)){
+        snprintf(dirs_path, sizeof(dirs_path), "%s/.nash_dirs", getpwd());
+        dirs_file = dirs_path;
+    }
+    if(dirs_file != NULL && *dirs_file != '\0' && !record_replaying())
+        dirs_open(dirs_file);
+
+    /* Set by `snapshot -r` to resume from its snapshot, once */
+    char *restore = getenv("NASH_RESTORE");
+    if(restore != NULL && *restore != '\0'){
+        snapshot_load(restore);
+        unsetenv("NASH_RESTORE");
+    }
 
     while (true) {
+        /* Following the load average, slots free up with no job ending */
+        jobs_admit();
+        cgroup_reap();
         command = read_command();
         if (command == NULL) {
             break;
         }
+        record_begin(command);
         char *args[4096];
         LOG("Input command: %s\n", command);
-        char *p_comment = strstr(command, "#");
-        if(p_comment){
-            *p_comment = '\0';
-        }
         if(*command == '!'){
             int search;
            if((search = handle_search(command)) == -1){
+               record_end(-1);
                cleanup();
                continue;
            }
         }
 
-        hist_add(command);
-
-        char *command_copy = strdup(command);
-        if(!command_copy){
-            cleanup();
-            continue;
-        }
-
-        int status;
-        int pipe = 0;
+        /* The line is parsed once into a tree, then executed. A line which
+         * is incomplete, e.g. stops inside a loop, is joined with the next */
         int tokens = 0;
-        char *next_tok = command_copy;
-        char *curr_tok;
-        while((curr_tok = next_token(&next_tok, " \n\t\r")) != NULL){
-            if(*curr_tok == '|')
-                pipe++;
-
-            args[tokens++] = curr_tok;
-        }
-        args[tokens] = (char *) 0;
+        bool more = false;
+        do {
+            if(more && join_next_line(args, tokens) == -1)
+                break;
 
-        if(args[0] == NULL){
             free(command_copy);
-            cleanup();
-            continue;
-        }
+            command_copy = malloc(2 * strlen(command) + 1);
+            if(!command_copy){
+                perror("malloc");
+                tokens = 0;
+                break;
+            }
 
+            uint64_t parse_start = stats_now();
+            tokens = lex_line(command, command_copy, args, 4096);
+            tree = parse_line(args, tokens, &more);
+            stats_time(TIMER_PARSE, stats_now() - parse_start);
+        } while(more);
 
-        if((status = handle_builtins(command_copy, args)) == 0){
+        hist_add(command);
+
+        int status = 0;
+        if(tree != NULL){
+            /* The metadata of the command is recorded once it has run */
+            char cwd[4096];
+            if(getcwd(cwd, sizeof(cwd)) == NULL)
+                *cwd = '\0';
+            time_t started = time(NULL);
+            uint64_t exec_start = stats_now();
+
+            interrupted = 0;
+            status = exec_node(tree);
             set_prompt_stat(status, hist_last_cnum());
-            free(command_copy);
-            fflush(stdout);
-            cleanup();
-            continue;
-        }
 
-        status = handle_utils(args, pipe, tokens);
-        set_prompt_stat(status, hist_last_cnum());
+            hist_meta(command, started, (stats_now() - exec_start) / 1000000,
+                    status, cwd, node_commands(tree));
+        } else if(tokens != 0){
+            status = -1;
+            set_prompt_stat(status, hist_last_cnum());
+        }
+        record_end(status);
 
+        node_destroy(tree);
+        tree = NULL;
         free(command_copy);
+        command_copy = NULL;
         cleanup();
     }
 
+    record_destroy();
+    dirs_destroy();
+    symbols_destroy();
+    builtins_destroy();
     jobs_destroy();
     hist_destroy();
     destroy_ui();
+    stats_destroy();
     free(command);
     return 0;
 }
@@ -0,0 +1,458 @@
+/**@file
+ *  This file saves the state of the shell to a snapshot file and restores it,
+ *  so that a restarted or upgraded shell resumes warm: the current and
+ *  previous directories and the directory stack, the history and the frecency
+ *  scores of the commands, the jobs, the exit code shown by the prompt, and
+ *  the output memoised from the completion sources.
+ *
+ *  The file starts with a header (magic and version) and holds a section per
+ *  part of the state, each one a tag and a length followed by its data, so a
+ *  shell skips the sections it does not know. Numbers are written in the byte
+ *  order of the machine: a snapshot is meant to be restored on the machine
+ *  which wrote it.
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "snapshot.h"
+#include "compspec.h"
+#include "dirs.h"
+#include "expand.h"
+#include "history.h"
+#include "jobs.h"
+#include "symbols.h"
+#include "ui.h"
+#include "util.h"
+#include "logger.h"
+
+#define SNAPSHOT_MAGIC "NASHSNAP"
+#define SNAPSHOT_VERSION 1
+/* Length written for a NULL string */
+#define SNAP_NULL UINT32_MAX
+
+/* Path of the shell binary, which `snapshot -r` starts again */
+static char self_path[4096];
+
+enum snapshot_tag {
+    SNAP_DIRS = 1,
+    SNAP_HISTORY,
+    SNAP_JOBS,
+    SNAP_PROMPT,
+    SNAP_COMPSPEC,
+    SNAP_VARIABLES
+};
+
+/** This function finds the path of the shell binary from the name it was
+ *  started with, looked up in PATH if it holds no /. The path is made
+ *  absolute but its links are kept, so that a restart runs the binary found
+ *  there then, e.g. once it was upgraded, rather than the one started.
+ *
+ *  -argv0: the name the shell was started with.
+ *
+ */
+void snapshot_init(const char *argv0){
+
+    *self_path = '\0';
+    if(argv0 == NULL || *argv0 == '\0')
+        return;
+
+    char found[4096];
+    if(strchr(argv0, '/') != NULL){
+        snprintf(found, sizeof(found), "%s", argv0);
+    } else {
+        const char *dir = getenv("PATH");
+        *found = '\0';
+        while(dir != NULL && *dir != '\0' && *found == '\0'){
+            size_t len = strcspn(dir, ":");
+            snprintf(found, sizeof(found), "%.*s/%s", (int) len, dir, argv0);
+            if(len == 0 || access(found, X_OK) == -1)
+                *found = '\0';
+            dir += len + (dir[len] == ':');
+        }
+        if(*found == '\0')
+            return;
+    }
+
+    char cwd[4096];
+    if(*found == '/')
+        snprintf(self_path, sizeof(self_path), "%s", found);
+    else if(getcwd(cwd, sizeof(cwd)) != NULL
+            && strlen(cwd) + strlen(found) + 2 <= sizeof(self_path)){
+        strcpy(self_path, cwd);
+        strcat(self_path, "/");
+        strcat(self_path, found);
+    }
+}
+
+/** This function appends data to a snapshot being written.
+ *
+ */
+void snap_put(struct snapshot *snap, const void *data, size_t size){
+
+    if(snap->failed)
+        return;
+
+    if(snap->sz + size > snap->limit){
+        size_t limit = snap->limit ? snap->limit : 4096;
+        while(snap->sz + size > limit)
+            limit *= 2;
+        char *temp = realloc(snap->buf, limit);
+        if(!temp){
+            perror("realloc");
+            snap->failed = true;
+            return;
+        }
+        snap->buf = temp;
+        snap->limit = limit;
+    }
+
+    memcpy(snap->buf + snap->sz, data, size);
+    snap->sz += size;
+}
+
+void snap_u32(struct snapshot *snap, uint32_t value){
+
+    snap_put(snap, &value, sizeof(value));
+}
+
+void snap_u64(struct snapshot *snap, uint64_t value){
+
+    snap_put(snap, &value, sizeof(value));
+}
+
+void snap_f64(struct snapshot *snap, double value){
+
+    snap_put(snap, &value, sizeof(value));
+}
+
+/** This function appends a string, as its length followed by its bytes. A
+ *  NULL string is written as the length SNAP_NULL.
+ *
+ */
+void snap_str(struct snapshot *snap, const char *str){
+
+    if(str == NULL){
+        snap_u32(snap, SNAP_NULL);
+        return;
+    }
+
+    size_t len = strlen(str);
+    snap_u32(snap, len);
+    snap_put(snap, str, len);
+}
+
+/** This function reads data from a snapshot.
+ *
+ *  Returns: 0 if succeded. -1 if the data ends before.
+ */
+int snap_get(struct snapshot *snap, void *data, size_t size){
+
+    if(snap->failed || size > snap->sz - snap->pos){
+        snap->failed = true;
+        memset(data, 0, size);
+        return -1;
+    }
+
+    memcpy(data, snap->buf + snap->pos, size);
+    snap->pos += size;
+    return 0;
+}
+
+uint32_t snap_get_u32(struct snapshot *snap){
+
+    uint32_t value;
+    snap_get(snap, &value, sizeof(value));
+    return value;
+}
+
+uint64_t snap_get_u64(struct snapshot *snap){
+
+    uint64_t value;
+    snap_get(snap, &value, sizeof(value));
+    return value;
+}
+
+double snap_get_f64(struct snapshot *snap){
+
+    double value;
+    snap_get(snap, &value, sizeof(value));
+    return value;
+}
+
+/** This function reads a string.
+ *
+ *  Returns: the string, to be freed by the caller. NULL for a NULL string or
+ *  if the snapshot is broken, which sets failed.
+ */
+char *snap_get_str(struct snapshot *snap){
+
+    uint32_t len = snap_get_u32(snap);
+    if(len == SNAP_NULL || snap->failed)
+        return NULL;
+
+    if(len > snap->sz - snap->pos){
+        snap->failed = true;
+        return NULL;
+    }
+
+    char *str = strndup(snap->buf + snap->pos, len);
+    if(!str){
+        perror("strndup");
+        snap->failed = true;
+        return NULL;
+    }
+    snap->pos += len;
+    return str;
+}
+
+/** These functions save and restore the exit code shown by the prompt and
+ *  given by $?.
+ *
+ */
+static void prompt_save(struct snapshot *snap){
+
+    snap_u32(snap, status_get());
+}
+
+static void prompt_load(struct snapshot *snap){
+
+    int status = snap_get_u32(snap);
+    if(snap->failed)
+        return;
+
+    status_set(status);
+    set_prompt_stat(status, hist_last_cnum());
+}
+
+/** The sections of a snapshot, in the order they are written and restored:
+ *  the history comes before the prompt, which shows its last number.
+ */
+static const struct {
+    enum snapshot_tag tag;
+    const char *name;
+    void (*save)(struct snapshot *);
+    void (*load)(struct snapshot *);
+} sections[] = {
+    { SNAP_DIRS, "directories", dirs_save, dirs_load },
+    { SNAP_HISTORY, "history", hist_save, hist_load },
+    { SNAP_JOBS, "jobs", jobs_save, jobs_load },
+    { SNAP_PROMPT, "prompt", prompt_save, prompt_load },
+    { SNAP_COMPSPEC, "completion", compspec_save, compspec_load },
+    { SNAP_VARIABLES, "variables", vars_save, vars_load }
+};
+
+/** This helper function returns the path of the snapshot: the one given, or
+ *  NASH_SNAPSHOT, or ~/.nash_snapshot.
+ *
+ */
+static const char *snapshot_path(const char *path, char *buf, size_t buf_sz){
+
+    if(path != NULL)
+        return path;
+
+    if((path = getenv("NASH_SNAPSHOT")) != NULL && *path != '\0')
+        return path;
+
+    snprintf(buf, buf_sz, "%s/.nash_snapshot", getpwd());
+    return buf;
+}
+
+/** This function writes the state of the shell to a snapshot file. The file
+ *  is written next to its path first, then renamed, so that a snapshot is
+ *  never seen half written.
+ *
+ *  Returns: 0 if succeded. -1 if the file could not be written.
+ */
+static int snapshot_save(const char *path){
+
+    struct snapshot snap = { 0 };
+    snap_put(&snap, SNAPSHOT_MAGIC, strlen(SNAPSHOT_MAGIC));
+    snap_u32(&snap, SNAPSHOT_VERSION);
+
+    for(size_t i = 0; i < sizeof(sections) / sizeof(*sections); i++){
+        snap_u32(&snap, sections[i].tag);
+        size_t length_at = snap.sz;
+        snap_u32(&snap, 0);
+        sections[i].save(&snap);
+
+        if(!snap.failed){
+            uint32_t length = snap.sz - length_at - sizeof(uint32_t);
+            memcpy(snap.buf + length_at, &length, sizeof(length));
+        }
+    }
+
+    if(snap.failed){
+        free(snap.buf);
+        return -1;
+    }
+
+    char *temp;
+    if(asprintf(&temp, "%s.tmp", path) == -1){
+        perror("asprintf");
+        free(snap.buf);
+        return -1;
+    }
+
+    int ret = 0;
+    int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if(fd == -1 || write(fd, snap.buf, snap.sz) != (ssize_t) snap.sz){
+        perror(temp);
+        ret = -1;
+    }
+    if(fd != -1 && close(fd) == -1 && ret == 0){
+        perror(temp);
+        ret = -1;
+    }
+    if(ret == 0 && rename(temp, path) == -1){
+        perror(path);
+        ret = -1;
+    }
+    if(ret == -1)
+        unlink(temp);
+    else
+        LOG("Snapshot of %zu bytes written to %s\n", snap.sz, path);
+    free(temp);
+    free(snap.buf);
+    return ret;
+}
+
+/** This function restores the state of the shell from a snapshot file. A
+ *  section which is broken is skipped, the others are still restored.
+ *
+ *  -path: the file.
+ *
+ *  Returns: 0 if succeded. -1 if the file could not be read or is not a
+ *  snapshot.
+ */
+int snapshot_load(const char *path){
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd == -1){
+        perror(path);
+        return -1;
+    }
+
+    struct stat st;
+    struct snapshot snap = { 0 };
+    if(fstat(fd, &st) == -1 || !(snap.buf = malloc(st.st_size + 1))
+            || read(fd, snap.buf, st.st_size) != st.st_size){
+        perror(path);
+        close(fd);
+        free(snap.buf);
+        return -1;
+    }
+    close(fd);
+    snap.sz = st.st_size;
+
+    char magic[sizeof(SNAPSHOT_MAGIC) - 1];
+    snap_get(&snap, magic, sizeof(magic));
+    uint32_t version = snap_get_u32(&snap);
+    if(snap.failed || memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic))
+            || version != SNAPSHOT_VERSION){
+        fprintf(stderr, "restore: %s: not a snapshot of this version\n", path);
+        free(snap.buf);
+        return -1;
+    }
+
+    while(snap.pos < snap.sz){
+
+        uint32_t tag = snap_get_u32(&snap);
+        uint32_t length = snap_get_u32(&snap);
+        if(snap.failed || length > snap.sz - snap.pos){
+            fprintf(stderr, "restore: %s: truncated snapshot\n", path);
+            break;
+        }
+
+        /* Each section is read on its own, it can't read past its end */
+        struct snapshot section = { .buf = snap.buf + snap.pos, .sz = length };
+        snap.pos += length;
+
+        size_t i;
+        for(i = 0; i < sizeof(sections) / sizeof(*sections); i++){
+            if(sections[i].tag == tag)
+                break;
+        }
+        if(i == sizeof(sections) / sizeof(*sections)){
+            LOG("Skipping the unknown section %u\n", tag);
+            continue;
+        }
+
+        sections[i].load(&section);
+        if(section.failed)
+            fprintf(stderr, "restore: %s: broken %s section\n", path,
+                    sections[i].name);
+    }
+
+    free(snap.buf);
+    return 0;
+}
+
+/** This function handles the snapshot builtin.
+ *
+ *      snapshot [file]     writes the state of the shell to the snapshot file
+ *      snapshot -r [file]  writes it, then restarts the shell binary from it
+ *
+ *  The restart replaces the shell with the binary at the path it was started
+ *  from, which may have been upgraded, in the same process: the jobs stay its
+ *  children. A script carries on from its next line, so its input must be a
+ *  file: the lines read ahead from a pipe would be lost.
+ *
+ *  -args: command entered after being expanded.
+ *
+ *  Returns: 0 if succeded. -1 if the snapshot could not be written.
+ */
+int snapshot_builtin(char **args){
+
+    bool restart = args[1] != NULL && !strcmp(args[1], "-r");
+    char buf[4096];
+    const char *path = snapshot_path(args[restart ? 2 : 1], buf, sizeof(buf));
+
+    /* The new shell reads the input from where this one is: the lines read
+     * ahead are given back by seeking the input back */
+    if(restart && !isatty(STDIN_FILENO) && (fflush(stdin) == EOF
+                || lseek(STDIN_FILENO, 0, SEEK_CUR) == -1)){
+        fprintf(stderr, "snapshot: -r needs a terminal or a file as input\n");
+        return -1;
+    }
+
+    if(snapshot_save(path) == -1)
+        return -1;
+
+    if(!restart)
+        return 0;
+
+    if(setenv("NASH_RESTORE", path, 1) == -1){
+        perror("setenv");
+        return -1;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    char *argv[] = { *self_path ? self_path : "nash", NULL };
+    if(*self_path != '\0'){
+        execv(self_path, argv);
+        perror(self_path);
+    }
+    execv("/proc/self/exe", argv);
+    perror("snapshot: exec");
+    unsetenv("NASH_RESTORE");
+    return -1;
+}
+
+/** This function handles the restore builtin, which restores the state of
+ *  the shell from a snapshot file (by default the one of snapshot).
+ *
+ *  -args: command entered after being expanded.
+ *
+ *  Returns: 0 if succeded. -1 if the snapshot could not be read.
+ */
+int restore_builtin(char **args){
+
+    char buf[4096];
+    return snapshot_load(snapshot_path(args[1], buf, sizeof(buf)));
+}
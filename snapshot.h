@@ -0,0 +1,45 @@
+/**@file
+ *  Header file which contains the functions for saving the state of the shell
+ *  to a snapshot and restoring it.
+ */
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** This struct holds a snapshot being written or read.
+ *
+ *  -buf: the data.
+ *  -sz: size of the data.
+ *  -limit: allocated size of buf, when writing.
+ *  -pos: position of the next read.
+ *  -failed: set once a write could not allocate memory, or a read went past
+ *   the end of the data.
+ *
+ */
+struct snapshot {
+    char *buf;
+    size_t sz;
+    size_t limit;
+    size_t pos;
+    bool failed;
+};
+
+void snap_put(struct snapshot *, const void *, size_t);
+void snap_u32(struct snapshot *, uint32_t);
+void snap_u64(struct snapshot *, uint64_t);
+void snap_f64(struct snapshot *, double);
+void snap_str(struct snapshot *, const char *);
+int snap_get(struct snapshot *, void *, size_t);
+uint32_t snap_get_u32(struct snapshot *);
+uint64_t snap_get_u64(struct snapshot *);
+double snap_get_f64(struct snapshot *);
+char *snap_get_str(struct snapshot *);
+
+void snapshot_init(const char *);
+int snapshot_builtin(char **);
+int restore_builtin(char **);
+int snapshot_load(const char *);
+#endif
@@ -0,0 +1,304 @@
+/**@file
+ *  This file holds the performance counters and latency histograms of the
+ *  shell and implements the nashstat builtin.
+ *
+ *  The counters live in a shared anonymous mapping, so the children forked for
+ *  a pipeline update the same counters as the shell (e.g. the time they spend
+ *  setting up before exec). Updates are atomic adds.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "history.h"
+#include "jobs.h"
+#include "stats.h"
+
+/** The histograms have 8 buckets per power of two, so percentiles are
+ *  accurate to 12.5%. Values below 8ns get a bucket each. */
+#define HIST_BUCKETS 496
+
+/** This struct holds a latency histogram in nanoseconds.
+ *
+ *  -count: number of samples.
+ *  -sum: sum of the samples.
+ *  -max: largest sample.
+ *  -buckets: number of samples in each bucket.
+ *
+ */
+struct histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+/** This struct holds every counter of the shell.
+ *
+ */
+struct stats {
+    uint64_t counters[STAT_COUNTERS];
+    struct histogram timers[STAT_TIMERS];
+};
+
+static struct stats *stats = NULL;
+
+static const char *counter_names[STAT_COUNTERS] = {
+    "forks", "execs", "exec_failures", "waits", "commands", "builtins",
+    "completions", "dir_cache_hits", "dir_cache_misses", "history_syncs"
+};
+
+static const char *timer_names[STAT_TIMERS] = {
+    "fork", "exec_setup", "wait", "parse", "builtin", "completion"
+};
+
+/** This function maps the shared memory holding the counters.
+ *
+ */
+void stats_init(void){
+
+    stats = mmap(NULL, sizeof(struct stats), PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(stats == MAP_FAILED){
+        perror("mmap");
+        stats = NULL;
+    }
+}
+
+/** This function unmaps the counters.
+ *
+ */
+void stats_destroy(void){
+
+    if(stats != NULL)
+        munmap(stats, sizeof(struct stats));
+    stats = NULL;
+}
+
+/** This function returns a monotonic timestamp in nanoseconds.
+ *
+ */
+uint64_t stats_now(void){
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** This function increments a counter.
+ *
+ */
+void stats_inc(enum stat_counter counter){
+
+    if(stats != NULL)
+        __atomic_fetch_add(&stats->counters[counter], 1, __ATOMIC_RELAXED);
+}
+
+/** This function returns the bucket of a value.
+ *
+ */
+static int bucket_of(uint64_t value){
+
+    if(value < 8)
+        return value;
+
+    int exp = 63 - __builtin_clzll(value);
+    return (exp - 2) * 8 + ((value >> (exp - 3)) & 7);
+}
+
+/** This function returns the upper bound of a bucket.
+ *
+ */
+static uint64_t bucket_limit(int bucket){
+
+    if(bucket < 8)
+        return bucket;
+
+    int exp = bucket / 8 + 2;
+    return ((uint64_t) (9 + bucket % 8) << (exp - 3)) - 1;
+}
+
+/** This function records a sample in a latency histogram.
+ *
+ *  -timer: the histogram.
+ *  -ns: the latency in nanoseconds.
+ *
+ */
+void stats_time(enum stat_timer timer, uint64_t ns){
+
+    if(stats == NULL)
+        return;
+
+    struct histogram *h = &stats->timers[timer];
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->buckets[bucket_of(ns)], 1, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while(ns > max && !__atomic_compare_exchange_n(&h->max, &max, ns, false,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/** This function sets every counter back to 0.
+ *
+ */
+void stats_reset(void){
+
+    if(stats != NULL)
+        memset(stats, 0, sizeof(struct stats));
+}
+
+/** This function returns a percentile of a histogram.
+ *
+ *  -h: the histogram.
+ *  -percent: the percentile, e.g. 99.
+ *
+ */
+static uint64_t percentile(const struct histogram *h, double percent){
+
+    if(h->count == 0)
+        return 0;
+
+    uint64_t rank = h->count * percent / 100.0;
+    uint64_t seen = 0;
+    for(int i = 0; i < HIST_BUCKETS; i++){
+        seen += h->buckets[i];
+        if(seen > rank)
+            return bucket_limit(i) < h->max ? bucket_limit(i) : h->max;
+    }
+    return h->max;
+}
+
+/** This function formats a duration in a human readable way.
+ *
+ */
+static char *format_ns(uint64_t ns, char *buf, size_t buf_sz){
+
+    if(ns < 10000)
+        snprintf(buf, buf_sz, "%luns", (unsigned long) ns);
+    else if(ns < 10000000)
+        snprintf(buf, buf_sz, "%.1fus", ns / 1e3);
+    else if(ns < 10000000000)
+        snprintf(buf, buf_sz, "%.1fms", ns / 1e6);
+    else
+        snprintf(buf, buf_sz, "%.1fs", ns / 1e9);
+    return buf;
+}
+
+/** This function prints the counters. The machine readable mode prints a
+ *  single JSON object.
+ *
+ *  -machine: true for JSON output.
+ *
+ */
+void stats_print(bool machine){
+
+    if(stats == NULL)
+        return;
+
+    unsigned int hist_entries;
+    size_t hist_bytes;
+    long hist_file;
+    hist_stats(&hist_entries, &hist_bytes, &hist_file);
+
+    size_t jobs_running, jobs_queued, jobs_limit;
+    jobs_stats(&jobs_running, &jobs_queued, &jobs_limit);
+
+    struct rusage self, children;
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &children);
+
+    uint64_t *c = stats->counters;
+    uint64_t lookups = c[STAT_DIR_CACHE_HITS] + c[STAT_DIR_CACHE_MISSES];
+    double hit_rate = lookups ? 100.0 * c[STAT_DIR_CACHE_HITS] / lookups : 0;
+
+    if(machine){
+        printf("{");
+        for(int i = 0; i < STAT_COUNTERS; i++)
+            printf("\"%s\":%lu,", counter_names[i], (unsigned long) c[i]);
+
+        for(int i = 0; i < STAT_TIMERS; i++){
+            struct histogram *h = &stats->timers[i];
+            printf("\"%s_ns\":{\"count\":%lu,\"sum\":%lu,\"p50\":%lu,"
+                    "\"p90\":%lu,\"p99\":%lu,\"max\":%lu},", timer_names[i],
+                    (unsigned long) h->count, (unsigned long) h->sum,
+                    (unsigned long) percentile(h, 50),
+                    (unsigned long) percentile(h, 90),
+                    (unsigned long) percentile(h, 99),
+                    (unsigned long) h->max);
+        }
+
+        printf("\"dir_cache_hit_rate\":%.1f,\"history_entries\":%u,"
+                "\"history_bytes\":%zu,\"history_file_bytes\":%ld,"
+                "\"jobs\":%zu,\"jobs_queued\":%zu,\"jobs_limit\":%zu,"
+                "\"peak_rss_kb\":%ld,"
+                "\"children_peak_rss_kb\":%ld}\n", hit_rate, hist_entries,
+                hist_bytes, hist_file, jobs_running, jobs_queued, jobs_limit,
+                self.ru_maxrss, children.ru_maxrss);
+        return;
+    }
+
+    printf("%-14s %10s %10s %10s %10s %10s\n", "latency", "count", "p50",
+            "p90", "p99", "max");
+    for(int i = 0; i < STAT_TIMERS; i++){
+        struct histogram *h = &stats->timers[i];
+        char p50[32], p90[32], p99[32], max[32];
+        printf("%-14s %10lu %10s %10s %10s %10s\n", timer_names[i],
+                (unsigned long) h->count,
+                format_ns(percentile(h, 50), p50, sizeof(p50)),
+                format_ns(percentile(h, 90), p90, sizeof(p90)),
+                format_ns(percentile(h, 99), p99, sizeof(p99)),
+                format_ns(h->max, max, sizeof(max)));
+    }
+
+    printf("\ncommands: %lu (builtins %lu)  forks: %lu  execs: %lu "
+            "(failed %lu)  waits: %lu\n", (unsigned long) c[STAT_COMMANDS],
+            (unsigned long) c[STAT_BUILTINS], (unsigned long) c[STAT_FORKS],
+            (unsigned long) c[STAT_EXECS], (unsigned long) c[STAT_EXEC_FAILS],
+            (unsigned long) c[STAT_WAITS]);
+    printf("completion: %lu  dir cache: %lu hits, %lu misses (%.1f%%)\n",
+            (unsigned long) c[STAT_COMPLETIONS],
+            (unsigned long) c[STAT_DIR_CACHE_HITS],
+            (unsigned long) c[STAT_DIR_CACHE_MISSES], hit_rate);
+    printf("history: %u entries, %zu bytes in memory, %ld bytes read from "
+            "file, %lu syncs\n", hist_entries, hist_bytes, hist_file,
+            (unsigned long) c[STAT_HIST_SYNCS]);
+    printf("jobs: %zu/%zu, %zu queued\n", jobs_running, jobs_limit,
+            jobs_queued);
+    printf("peak rss: %ld KB (children %ld KB)\n", self.ru_maxrss,
+            children.ru_maxrss);
+}
+
+/** This function handles the nashstat builtin.
+ *
+ *      nashstat        prints the counters
+ *      nashstat -j     prints the counters as JSON
+ *      nashstat -r     sets the counters back to 0
+ *
+ *  -args: command entered after being tokenized.
+ *
+ *  Returns: 0 if succeded. -1 if the option is not valid.
+ */
+int handle_nashstat(char **args){
+
+    if(args[1] == NULL){
+        stats_print(false);
+        return 0;
+    }
+
+    if(!strcmp(args[1], "-j")){
+        stats_print(true);
+        return 0;
+    }
+
+    if(!strcmp(args[1], "-r")){
+        stats_reset();
+        return 0;
+    }
+
+    fprintf(stderr, "usage: nashstat [-j | -r]\n");
+    return -1;
+}
@@ -0,0 +1,45 @@
+/**@file
+ *  Header file which contains the performance counters of the shell, shown by
+ *  the nashstat builtin.
+ */
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/** Event counters. */
+enum stat_counter {
+    STAT_FORKS,
+    STAT_EXECS,
+    STAT_EXEC_FAILS,
+    STAT_WAITS,
+    STAT_COMMANDS,
+    STAT_BUILTINS,
+    STAT_COMPLETIONS,
+    STAT_DIR_CACHE_HITS,
+    STAT_DIR_CACHE_MISSES,
+    STAT_HIST_SYNCS,
+    STAT_COUNTERS
+};
+
+/** Latency histograms. */
+enum stat_timer {
+    TIMER_FORK,
+    TIMER_EXEC,
+    TIMER_WAIT,
+    TIMER_PARSE,
+    TIMER_BUILTIN,
+    TIMER_COMPLETION,
+    STAT_TIMERS
+};
+
+void stats_init(void);
+void stats_destroy(void);
+uint64_t stats_now(void);
+void stats_inc(enum stat_counter);
+void stats_time(enum stat_timer, uint64_t);
+void stats_reset(void);
+void stats_print(bool);
+int handle_nashstat(char **);
+#endif
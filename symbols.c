@@ -0,0 +1,389 @@
+/**@file
+ *  This file holds the aliases, the functions and the variables of the shell
+ *  in a hash table, looked up every time a command runs. Aliases and functions
+ *  are parsed once, when they are defined, and kept as parsed trees, so running
+ *  them costs a lookup. Variables stay in the table, out of the environment of
+ *  the commands, until they are exported.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "symbols.h"
+#include "util.h"
+#include "logger.h"
+
+/** This struct holds the alias, the function and the variable with the same
+ *  name.
+ *
+ *  -name: the name.
+ *  -alias_text: the alias as entered, NULL if there is no alias.
+ *  -alias: the alias, parsed.
+ *  -function: the body of the function, NULL if there is no function.
+ *  -value: the value of the variable, NULL if there is none or if it is
+ *   exported, in which case the environment holds it.
+ *  -next: next symbol in the same bucket.
+ *
+ */
+struct symbol {
+    char *name;
+    char *alias_text;
+    struct node *alias;
+    struct node *function;
+    char *value;
+    struct symbol *next;
+};
+
+static struct symbol **buckets = NULL;
+static size_t buckets_sz = 0;
+
+/** This function allocates the table.
+ *
+ *  -size: number of buckets, rounded up to a power of two.
+ *
+ */
+void symbols_init(unsigned int size){
+
+    buckets_sz = 1;
+    while(buckets_sz < size)
+        buckets_sz *= 2;
+
+    buckets = calloc(buckets_sz, sizeof(struct symbol *));
+    if(!buckets){
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/** This function frees a symbol.
+ *
+ */
+static void symbol_free(struct symbol *sym){
+
+    free(sym->name);
+    free(sym->alias_text);
+    node_destroy(sym->alias);
+    node_destroy(sym->function);
+    free(sym->value);
+    free(sym);
+}
+
+/** This function frees the table.
+ *
+ */
+void symbols_destroy(void){
+
+    for(size_t i = 0; i < buckets_sz; i++){
+        struct symbol *sym = buckets[i];
+        while(sym != NULL){
+            struct symbol *next = sym->next;
+            symbol_free(sym);
+            sym = next;
+        }
+    }
+    free(buckets);
+    buckets = NULL;
+    buckets_sz = 0;
+}
+
+/** This function looks a name up, and adds it to the table if asked to.
+ *
+ *  -name: the name.
+ *  -add: true to add the name if it is not in the table.
+ *
+ *  Returns: the symbol, NULL if it is not in the table.
+ */
+static struct symbol *lookup(const char *name, bool add){
+
+    if(buckets == NULL)
+        return NULL;
+
+    struct symbol **bucket = &buckets[fnv1a(FNV1A_START, name, strlen(name))
+        & (buckets_sz - 1)];
+    for(struct symbol *sym = *bucket; sym != NULL; sym = sym->next){
+        if(!strcmp(sym->name, name))
+            return sym;
+    }
+
+    if(!add)
+        return NULL;
+
+    struct symbol *sym = calloc(1, sizeof(struct symbol));
+    if(!sym || !(sym->name = strdup(name))){
+        perror("calloc");
+        free(sym);
+        return NULL;
+    }
+    sym->next = *bucket;
+    *bucket = sym;
+    return sym;
+}
+
+/** This function removes a symbol once it has neither an alias, a function
+ *  nor a variable.
+ *
+ */
+static void remove_if_unused(struct symbol *sym){
+
+    if(sym->alias != NULL || sym->function != NULL || sym->value != NULL)
+        return;
+
+    struct symbol **p = &buckets[fnv1a(FNV1A_START, sym->name,
+                strlen(sym->name)) & (buckets_sz - 1)];
+    while(*p != sym)
+        p = &(*p)->next;
+    *p = sym->next;
+    symbol_free(sym);
+}
+
+/** This function defines an alias. The value is parsed right away.
+ *
+ *  -name: name of the alias.
+ *  -value: what the alias stands for.
+ *
+ *  Returns: 0 if succeded. -1 if the value is not valid.
+ */
+int alias_define(const char *name, const char *value){
+
+    char buf[2 * strlen(value) + 1];
+    char *args[4096];
+    int tokens = lex_line(value, buf, args, 4096);
+    if(tokens <= 0){
+        if(tokens == 0)
+            fprintf(stderr, "alias: %s: empty alias\n", name);
+        return -1;
+    }
+
+    struct node *tree = parse_line(args, tokens, NULL);
+    if(tree == NULL)
+        return -1;
+
+    struct symbol *sym = lookup(name, true);
+    char *text = strdup(value);
+    if(sym == NULL || text == NULL){
+        node_destroy(tree);
+        free(text);
+        return -1;
+    }
+
+    node_destroy(sym->alias);
+    free(sym->alias_text);
+    sym->alias = tree;
+    sym->alias_text = text;
+    return 0;
+}
+
+/** This function removes an alias.
+ *
+ *  Returns: 0 if succeded. -1 if there is no such alias.
+ */
+int alias_remove(const char *name){
+
+    struct symbol *sym = lookup(name, false);
+    if(sym == NULL || sym->alias == NULL)
+        return -1;
+
+    node_destroy(sym->alias);
+    free(sym->alias_text);
+    sym->alias = NULL;
+    sym->alias_text = NULL;
+    remove_if_unused(sym);
+    return 0;
+}
+
+/** This function prints an alias, or all of them.
+ *
+ *  -name: the alias, NULL for all of them.
+ *
+ */
+void alias_print(const char *name){
+
+    for(size_t i = 0; i < buckets_sz; i++){
+        for(struct symbol *sym = buckets[i]; sym != NULL; sym = sym->next){
+            if(sym->alias != NULL && (name == NULL || !strcmp(name, sym->name)))
+                printf("alias %s='%s'\n", sym->name, sym->alias_text);
+        }
+    }
+}
+
+/** This function returns the command an alias stands for, if the alias is a
+ *  single command (e.g. alias ll='ls -l'). Such an alias is replaced by its
+ *  words, and can take arguments and be used in a pipeline.
+ *
+ *  Returns: the command, NULL if name is not an alias for a single command.
+ */
+const struct command_line *alias_command(const char *name){
+
+    struct symbol *sym = lookup(name, false);
+    if(sym == NULL || sym->alias == NULL || sym->alias->type != NODE_PIPELINE)
+        return NULL;
+
+    struct pipeline *pl = sym->alias->pipeline;
+    if(pl->pipe != 0 || pl->background || pl->limits != NULL
+            || pl->cmds->fanout != NULL)
+        return NULL;
+
+    return pl->cmds;
+}
+
+/** This function returns an alias which is not a single command, e.g. a
+ *  pipeline or a list. Such an alias runs like a function without arguments.
+ *
+ *  Returns: the parsed alias, NULL if name is not such an alias.
+ */
+struct node *alias_list(const char *name){
+
+    struct symbol *sym = lookup(name, false);
+    if(sym == NULL || sym->alias == NULL || alias_command(name) != NULL)
+        return NULL;
+
+    return sym->alias;
+}
+
+/** This function defines a function. The body is shared with the parsed line
+ *  which defined it, so it is not parsed or copied again.
+ *
+ *  -name: name of the function.
+ *  -body: body of the function.
+ *
+ */
+void function_define(const char *name, struct node *body){
+
+    struct symbol *sym = lookup(name, true);
+    if(sym == NULL)
+        return;
+
+    body->refs++;
+    node_destroy(sym->function);
+    sym->function = body;
+}
+
+/** This function returns the body of a function.
+ *
+ *  Returns: the body, NULL if there is no such function.
+ */
+struct node *function_lookup(const char *name){
+
+    struct symbol *sym = lookup(name, false);
+    return sym != NULL ? sym->function : NULL;
+}
+
+/** This function sets a variable. A variable which is exported, i.e. in the
+ *  environment, is changed there; any other stays in the table, so that it is
+ *  not passed to the commands the shell runs.
+ *
+ *  -name: name of the variable.
+ *  -value: its value.
+ *
+ *  Returns: 0 if succeded. -1 if memory could not be allocated.
+ */
+int var_set(const char *name, const char *value){
+
+    if(getenv(name) != NULL){
+        if(setenv(name, value, 1) == -1){
+            perror("setenv");
+            return -1;
+        }
+        return 0;
+    }
+
+    struct symbol *sym = lookup(name, true);
+    char *copy = strdup(value);
+    if(sym == NULL || copy == NULL){
+        perror("strdup");
+        free(copy);
+        return -1;
+    }
+    free(sym->value);
+    sym->value = copy;
+    return 0;
+}
+
+/** This function returns the value of a variable, from the table or else from
+ *  the environment.
+ *
+ *  Returns: the value, NULL if the variable is not set.
+ */
+const char *var_get(const char *name){
+
+    struct symbol *sym = lookup(name, false);
+    if(sym != NULL && sym->value != NULL)
+        return sym->value;
+    return getenv(name);
+}
+
+/** This function exports a variable: it moves from the table to the
+ *  environment, which the commands run by the shell inherit.
+ *
+ *  Returns: 0 if succeded. -1 if the variable is not set or could not be
+ *  exported.
+ */
+int var_export(const char *name){
+
+    struct symbol *sym = lookup(name, false);
+    if(sym == NULL || sym->value == NULL)
+        return getenv(name) != NULL ? 0 : -1;
+
+    if(setenv(name, sym->value, 1) == -1){
+        perror("setenv");
+        return -1;
+    }
+    free(sym->value);
+    sym->value = NULL;
+    remove_if_unused(sym);
+    return 0;
+}
+
+/** This function removes a variable, from the table and from the environment.
+ *
+ */
+void var_unset(const char *name){
+
+    struct symbol *sym = lookup(name, false);
+    if(sym != NULL && sym->value != NULL){
+        free(sym->value);
+        sym->value = NULL;
+        remove_if_unused(sym);
+    }
+    unsetenv(name);
+}
+
+/** This function saves the variables which are not exported to a snapshot;
+ *  the exported ones are kept by the environment.
+ *
+ */
+void vars_save(struct snapshot *snap){
+
+    uint32_t count = 0;
+    for(size_t i = 0; i < buckets_sz; i++){
+        for(struct symbol *sym = buckets[i]; sym != NULL; sym = sym->next)
+            count += sym->value != NULL;
+    }
+
+    snap_u32(snap, count);
+    for(size_t i = 0; i < buckets_sz; i++){
+        for(struct symbol *sym = buckets[i]; sym != NULL; sym = sym->next){
+            if(sym->value == NULL)
+                continue;
+            snap_str(snap, sym->name);
+            snap_str(snap, sym->value);
+        }
+    }
+}
+
+/** This function restores what vars_save() saved.
+ *
+ */
+void vars_load(struct snapshot *snap){
+
+    uint32_t count = snap_get_u32(snap);
+    for(uint32_t i = 0; i < count && !snap->failed; i++){
+        char *name = snap_get_str(snap);
+        char *value = snap_get_str(snap);
+        if(name != NULL && value != NULL)
+            var_set(name, value);
+        free(name);
+        free(value);
+    }
+}
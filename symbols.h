@@ -0,0 +1,25 @@
+/**@file
+ *  Header file which contains the table of aliases, functions and variables.
+ */
+#ifndef _SYMBOLS_H_
+#define _SYMBOLS_H_
+
+#include "parse.h"
+#include "snapshot.h"
+
+void symbols_init(unsigned int);
+void symbols_destroy(void);
+int alias_define(const char *, const char *);
+int alias_remove(const char *);
+void alias_print(const char *);
+const struct command_line *alias_command(const char *);
+struct node *alias_list(const char *);
+void function_define(const char *, struct node *);
+struct node *function_lookup(const char *);
+int var_set(const char *, const char *);
+const char *var_get(const char *);
+int var_export(const char *);
+void var_unset(const char *);
+void vars_save(struct snapshot *);
+void vars_load(struct snapshot *);
+#endif
@@ -5,31 +5,33 @@
 #include <readline/readline.h>
 #include <locale.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
-#include "dirent.h"
 #include "pwd.h"
+#include "complete.h"
+#include "compspec.h"
+#include "editor.h"
+#include "highlight.h"
 #include "history.h"
+#include "jobs.h"
+#include "record.h"
+#include "stats.h"
 #include "util.h"
 #include "logger.h"
 #include "ui.h"
 
-/** This struct is used for the autocomplete. It keeps track of different
- *  information used for checking if the input matches a command or a file.
- *
- *  -env_dirs: is used to store the environment paths.
- *  -size: stores the number of different paths.
- *  -index: keeps track of the current path we are checking.
- *  -builtins: keeps track of the current builtin we are checking.
- *
- */
-struct tab_completion {
-    char **env_dirs;
-    size_t size;
-    int index;
-    int builtins;
-};
+#ifndef BUILTIN_EDITOR
+#define BUILTIN_EDITOR 0
+#endif
+
+/* Time a suggestion may take per keystroke, in microseconds */
+#define DEFAULT_SUGGEST_BUDGET 1000
+
 static int readline_init(void);
+static void line_redisplay(void);
+static int prompt_event(void);
 static char prompt_str[4096] = { 0 };
 static char *username = NULL;
 static char hostname[64];
@@ -43,10 +45,12 @@ static char emoji[5];
 static unsigned int c_num;
 static int key_search = 0;
 static char *key_buffer = NULL;
-static DIR *directory;
-static struct tab_completion *tab_dirs;
-
-static char builtins[4][16] = {"cd", "history", "exit", "jobs"};
+static bool builtin_editor = BUILTIN_EDITOR;
+static uint64_t suggest_budget = DEFAULT_SUGGEST_BUDGET * 1000;
+static const char *suggestion = NULL;
+static bool suggestion_shown = false;
+static bool suggestion_off = false;
+static bool highlight = true;
 
 /** This function initializes the ui and gathers some initial information, such
  *  as hostname, login, home directory, and if we are in a interactive shell.
@@ -60,6 +64,21 @@ void init_ui(void)
     LOG("Setting locale: %s\n",
             (locale != NULL) ? locale : "could not set locale!");
 
+    /* NASH_EDITOR overrides the line editor chosen at build time */
+    char *editor = getenv("NASH_EDITOR");
+    if(editor != NULL)
+        builtin_editor = !strcmp(editor, "builtin");
+
+    /* NASH_SUGGEST_BUDGET=0 turns the suggestions off */
+    char *budget = getenv("NASH_SUGGEST_BUDGET");
+    if(budget != NULL)
+        suggest_budget = strtoull(budget, NULL, 10) * 1000;
+
+    /* NASH_HIGHLIGHT=0 turns the highlighting off */
+    char *colours = getenv("NASH_HIGHLIGHT");
+    if(colours != NULL)
+        highlight = strcmp(colours, "0") != 0;
+
     if(!isatty(STDIN_FILENO)){
         scripting = true;
     }else{
@@ -98,6 +117,9 @@ void init_ui(void)
 void destroy_ui(){
 
     free(line);
+    complete_destroy();
+    compspec_destroy();
+    highlight_destroy();
 }
 
 /** This function resets the parameter for lineread to 0 and frees the memory
@@ -166,6 +188,9 @@ void set_prompt_stat(int status, unsigned int cnum){
  */
 char *read_command(void)
 {
+    if(record_replaying())
+        return replay_next();
+
     if(scripting){
 
         size_t read_sz;
@@ -178,10 +203,52 @@ char *read_command(void)
         return line;
     } else {
 
+        /* Pick up the commands other sessions added to the shared history */
+        hist_sync();
+        key_search = c_num = hist_last_cnum();
+
+        if(builtin_editor)
+            return editor_read(prompt_line());
+
+        if(highlight)
+            highlight_refresh();
+
         return readline(prompt_line());
     }
 }
 
+/** This function reads the next line of a command which goes on over several
+ *  lines, e.g. the body of a loop.
+ *
+ *  Returns: the line, which has to be freed by the caller. NULL at the end of
+ *  the input.
+ */
+char *read_continuation(void)
+{
+    if(record_replaying())
+        return replay_next();
+
+    if(scripting){
+
+        char *next = NULL;
+        size_t next_sz = 0;
+        ssize_t read_sz;
+        if((read_sz = getline(&next, &next_sz, stdin)) == -1){
+            free(next);
+            return NULL;
+        }
+
+        if(read_sz > 0 && next[read_sz - 1] == '\n')
+            next[read_sz - 1] = '\0';
+        return next;
+    }
+
+    if(builtin_editor)
+        return editor_read("> ");
+
+    return readline("> ");
+}
+
 /** This function sets different handlers for different keys and some initial
  *  settings for readline.
  *
@@ -190,37 +257,73 @@ int readline_init(void)
 {
     rl_bind_keyseq("\\e[A", key_up);
     rl_bind_keyseq("\\e[B", key_down);
+    if(suggest_budget > 0 || highlight)
+        rl_redisplay_function = line_redisplay;
+    size_t running, queued, limit;
+    jobs_stats(&running, &queued, &limit);
+    if((highlight && highlight_pending()) || queued > 0 || running > 0)
+        rl_event_hook = prompt_event;
+    if(suggest_budget > 0){
+        rl_bind_keyseq("\\e[C", key_accept);
+        rl_bind_keyseq("\\e[F", key_accept);
+        rl_bind_keyseq("\\eOF", key_accept);
+        rl_bind_key(CTRL('F'), key_accept);
+        rl_bind_key(CTRL('E'), key_accept);
+        rl_bind_key('\r', key_enter);
+        rl_bind_key('\n', key_enter);
+    }
+    suggestion_off = false;
     rl_variable_bind("show-all-if-ambiguous", "on");
     rl_variable_bind("colored-completion-prefix", "on");
     rl_attempted_completion_function = command_completion;
     return 0;
 }
 
-/** This function replaces the line with the commands executed in the history
- *  going back.
+/** This function moves through the history from the line being edited. The
+ *  line being edited is saved when the browsing starts, and given back once
+ *  the browsing goes past the last command.
  *
+ *  -current: the line being edited.
+ *  -step: -1 to go back, 1 to go forward.
+ *
+ *  Returns: the line to show, NULL if the line does not change.
  */
-int key_up(int count, int key)
+const char *hist_browse(const char *current, int step)
 {
 
     if(c_num == key_search){
         if(key_buffer){
-            if(strcmp(key_buffer, rl_line_buffer)){
+            if(strcmp(key_buffer, current)){
                 free(key_buffer);
-                key_buffer = strdup(rl_line_buffer);
+                key_buffer = strdup(current);
             }
 
         } else {
-            key_buffer = strdup(rl_line_buffer);
+            key_buffer = strdup(current);
         }
     }
 
-    key_search--;
+    key_search += step;
     if(key_search <= 0)
         key_search = 1;
 
+    if(step > 0 && key_search >= c_num){
+        key_search = c_num;
+        return key_buffer == NULL ? "" : key_buffer;
+    }
+
+    return hist_search_cnum(key_search);
+}
+
+/** This function replaces the line with the commands executed in the history
+ *  going back.
+ *
+ */
+int key_up(int count, int key)
+{
+
     const char *search;
-    if((search = hist_search_cnum(key_search)) == NULL){
+    if((search = hist_browse(rl_line_buffer, -1)) == NULL){
         return 0;
     }
 
@@ -241,31 +344,8 @@ int key_up(int count, int key)
 int key_down(int count, int key)
 {
 
-    if(c_num == key_search){
-        if(key_buffer){
-            if(strcmp(key_buffer, rl_line_buffer)){
-                free(key_buffer);
-                key_buffer = strdup(rl_line_buffer);
-            }
-
-        } else {
-            key_buffer = strdup(rl_line_buffer);
-        }
-    }
-    key_search++;
-    if(key_search >= c_num){
-        key_search = c_num;
-
-        if(key_buffer == NULL)
-            rl_replace_line("", 1);
-        else
-            rl_replace_line(key_buffer, 1);
-
-        rl_point = rl_end;
-        return 0;
-    }
     const char *search;
-    if((search = hist_search_cnum(key_search)) == NULL){
+    if((search = hist_browse(rl_line_buffer, 1)) == NULL){
         return 0;
     }
     rl_replace_line(search, 1);
@@ -277,129 +357,189 @@ int key_down(int count, int key)
     return 0;
 }
 
-/** This function is used for command completion. The found commands are handled
- *  through command_generator().
- *
- *  -text: the string entered as input.
- *  -start: beginning of string.
- *  -end: end of string.
- *
- *  Returns: an array of string which matched the string searched
+/** This helper function returns the columns taken by n bytes of text, with
+ *  the same rule as the built-in editor: four byte characters (emoji) take two
+ *  columns, the others one.
  *
  */
-char **command_completion(const char *text, int start, int end)
+static size_t text_width(const char *s, size_t n)
 {
-    /* Tell readline that if we don't find a suitable completion, it should fall
-     * back on its built-in filename completion. */
-    rl_attempted_completion_over = 0;
-
-    return rl_completion_matches(text, command_generator);
+    size_t w = 0;
+    for(size_t i = 0; i < n; i++){
+        unsigned char c = s[i];
+        if((c & 0xC0) != 0x80)
+            w += c >= 0xF0 ? 2 : 1;
+    }
+    return w;
 }
-/** This function frees the memory allocated for the struct tab_completion.
+
+/** This helper function paints the line again in the colours of the
+ *  highlighting, over what readline displayed, and moves the cursor back to
+ *  its point. Only a line which fits on the row of the end of the prompt and
+ *  holds no control character is painted, as it is then displayed character
+ *  for character.
  *
- */ 
-void clean_tabs(){
+ */
+static void highlight_repaint(void)
+{
+    if(rl_end == 0 || RL_ISSTATE(RL_STATE_ISEARCH | RL_STATE_NSEARCH))
+        return;
 
-    for(int i = 0; i < tab_dirs->index; i++){
-        free(tab_dirs->env_dirs[i]);
+    for(int i = 0; i < rl_end; i++){
+        if((unsigned char) rl_line_buffer[i] < 0x20
+                || rl_line_buffer[i] == 0x7F)
+            return;
     }
-    free(tab_dirs->env_dirs);
-    free(tab_dirs);
 
+    int rows, cols;
+    rl_get_screen_size(&rows, &cols);
+    const char *prompt = rl_display_prompt ? rl_display_prompt : "";
+    size_t start = text_width(prompt, strlen(prompt)) % cols;
+    size_t width = text_width(rl_line_buffer, rl_end);
+    if(start + width >= (size_t) cols)
+        return;
+
+    const char *colours = highlight_line(rl_line_buffer, rl_end);
+    if(colours == NULL)
+        return;
+
+    fputc('\r', rl_outstream);
+    if(start > 0)
+        fprintf(rl_outstream, "\x1b[%zuC", start);
+    fputs(colours, rl_outstream);
+
+    size_t back = width - text_width(rl_line_buffer, rl_point);
+    if(back > 0)
+        fprintf(rl_outstream, "\x1b[%zuD", back);
+    fflush(rl_outstream);
 }
-/**
- * This function is called repeatedly by the readline library to build a list of
- * possible completions. It returns one match per function call. Once there are
- * no more completions available, it returns NULL.
- *
- * -text: string to search.
- * -state: iterator for number of callse.
+
+/** This function is called by readline while it waits for input, as long as
+ *  the set of the commands used by the highlighting is being built, or jobs
+ *  run or are queued. The line is highlighted again once the set is built,
+ *  the jobs which ended are deleted and the queued jobs are admitted in their
+ *  place.
  *
- * Returns: returns the match found or NULL if no match.
  */
-char *command_generator(const char *text, int state)
+static int prompt_event(void)
 {
+    if(highlight && highlight_pending() && highlight_poll())
+        (*rl_redisplay_function)();
 
-    if(state == 0){
-        tab_dirs = calloc(1, sizeof(struct tab_completion)); 
-        if(!tab_dirs){
-            perror("calloc");
-            return NULL;
-        }
-        tab_dirs->builtins = 0;
-        tab_dirs->index = 0;
-        tab_dirs->size = 0;
-
-        char *env_path = NULL;
-        env_path = strdup(getenv("PATH"));
-        if(!env_path){
-            perror("strdup");
-            return NULL;
-        }
+    size_t running, queued, limit;
+    jobs_admit();
+    jobs_stats(&running, &queued, &limit);
 
-        size_t paths_sz = 4;
-        tab_dirs->env_dirs = malloc(paths_sz * sizeof(char*));
-
-        if(*env_path != '\0'){
-            char *next_tok = env_path;
-            char *curr_tok;
-            while((curr_tok = next_token(&next_tok, ":")) != NULL){
-                if(paths_sz == tab_dirs->size){
-
-                    paths_sz *= 2;
-                    tab_dirs->env_dirs = realloc(tab_dirs->env_dirs, paths_sz * sizeof(char*));
-                }
-
-                tab_dirs->env_dirs[tab_dirs->size] = strdup(curr_tok);
-                if(!tab_dirs->env_dirs[tab_dirs->size]){
-                    perror("strdup");
-                    return NULL;
-                }
-                tab_dirs->size += 1;
-            }
+    if(!(highlight && highlight_pending()) && queued == 0 && running == 0)
+        rl_event_hook = NULL;
+    return 0;
+}
 
-            while(tab_dirs->index < tab_dirs->size){
-                if((directory = opendir(tab_dirs->env_dirs[tab_dirs->index])) != NULL)
-                    break;
-                else
-                    tab_dirs->index += 1;
-            }
-            free(env_path);
-        }
+/** This function redisplays the line for readline, highlighted, followed by
+ *  the suggestion from the history in grey when the cursor is at the end of
+ *  the line. The suggestion is cut to the row of the cursor, which then moves
+ *  back to the end of the line, where readline expects it: the next redisplay
+ *  erases the suggestion from there first.
+ *
+ */
+static void line_redisplay(void)
+{
+    if(suggestion_shown){
+        fputs("\x1b[K", rl_outstream);
+        suggestion_shown = false;
     }
-
-    while(tab_dirs->index < tab_dirs->size){
-        struct dirent *entry;
-        while((entry = readdir(directory)) != NULL){
-            char *search;
-            if((search = strstr(entry->d_name, text)) == entry->d_name)
-                return strdup(entry->d_name);
-        }
-        tab_dirs->index += 1;
-        while(tab_dirs->index < tab_dirs->size){
-            if((directory = opendir(tab_dirs->env_dirs[tab_dirs->index])) != NULL)
-                break;
-            else
-                tab_dirs->index += 1;
-        }
+    rl_redisplay();
+    if(highlight)
+        highlight_repaint();
+
+    suggestion = NULL;
+    if(suggest_budget == 0 || suggestion_off || rl_point != rl_end
+            || rl_end == 0 || RL_ISSTATE(RL_STATE_ISEARCH | RL_STATE_NSEARCH))
+        return;
+
+    const char *cmd = hist_suggest(rl_line_buffer, suggest_budget);
+    if(cmd == NULL)
+        return;
+    suggestion = cmd + rl_end;
+
+    int rows, cols;
+    rl_get_screen_size(&rows, &cols);
+    const char *prompt = rl_display_prompt ? rl_display_prompt : "";
+    size_t col = (text_width(prompt, strlen(prompt))
+            + text_width(rl_line_buffer, rl_end)) % cols;
+
+    /* Up to the end of the row, or of the first line of the command */
+    size_t n = 0;
+    size_t w = 0;
+    while(suggestion[n] != '\0' && suggestion[n] != '\n'){
+        size_t next = n + 1;
+        while((suggestion[next] & 0xC0) == 0x80)
+            next++;
+        size_t next_w = text_width(suggestion + n, next - n);
+        if(col + w + next_w >= (size_t) cols)
+            break;
+        w += next_w;
+        n = next;
     }
+    if(n == 0)
+        return;
 
-    while(tab_dirs->builtins < sizeof(builtins)/sizeof(*builtins)){
-
-        int i = tab_dirs->builtins;
-        tab_dirs->builtins += 1;
-        if(*text == '\0')
-            return strdup(builtins[i]);
+    fprintf(rl_outstream, "\x1b[90m%.*s\x1b[0m\x1b[%zuD", (int) n, suggestion,
+            w);
+    fflush(rl_outstream);
+    suggestion_shown = true;
+}
 
-        char *search;
-        if((search = strstr(builtins[i], text)) == builtins[i])
-            return strdup(builtins[i]);
+/** This function takes the suggestion shown into the line, bound to the keys
+ *  which move to the right or to the end of the line; without a suggestion
+ *  they just move.
+ *
+ */
+int key_accept(int count, int key)
+{
+    if(suggestion != NULL && rl_point == rl_end){
+        rl_insert_text(suggestion);
+        suggestion = NULL;
+        return 0;
     }
 
+    if(key == CTRL('F') || key == 'C')
+        return rl_forward_char(count, key);
+    return rl_end_of_line(count, key);
+}
+
+/** This function erases the suggestion before the line is accepted, so it
+ *  does not stay on the screen.
+ *
+ */
+int key_enter(int count, int key)
+{
+    suggestion_off = true;
+    suggestion = NULL;
+    if(suggestion_shown){
+        fputs("\x1b[K", rl_outstream);
+        suggestion_shown = false;
+    }
+    return rl_newline(count, key);
+}
 
-    clean_tabs();
-    return NULL;
+/** This function is used for command completion by readline. The matches
+ *  come from complete_line(), readline only lists and inserts them.
+ *
+ */
+char **command_completion(const char *text, int start, int end)
+{
+    int kind;
+    char **matches = complete_line(rl_line_buffer, text, start, &kind);
+
+    /* Our own file name completion is used instead of readline's, and the
+     * commands keep their frecency order */
+    rl_attempted_completion_over = 1;
+    rl_filename_completion_desired = kind == COMPLETE_FILES;
+    rl_sort_completion_matches = kind != COMPLETE_COMMANDS;
+    return matches;
 }
+
 /** This handler stops an executing command and refreshes the prompt if there is
  *  no command running.
  */
@@ -409,7 +549,7 @@ void sigint(int running){
     if(!scripting){
 
         printf("\n");
-        if(running != 0){
+        if(running != 0 && !builtin_editor){
             rl_on_new_line();
             rl_replace_line("",1);
             rl_redisplay();
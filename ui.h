@@ -9,13 +9,16 @@
 #define _UI_H_
 
 char **command_completion(const char *text, int start, int end);
-char *command_generator(const char *text, int state);
+const char *hist_browse(const char *current, int step);
 void init_ui(void);
 void destroy_ui();
 int key_up(int, int);
 int key_down(int, int);
+int key_accept(int, int);
+int key_enter(int, int);
 char *prompt_line(void);
 char *read_command(void);
+char *read_continuation(void);
 void set_prompt_cwd();
 void set_prompt_stat(int, unsigned int);
 void sigint(int);
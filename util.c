@@ -1,6 +1,13 @@
 /**@file
  *
  */
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <sys/types.h>
@@ -8,6 +15,7 @@
 #include <unistd.h>
 
 #include "util.h"
+#include "logger.h"
 
 
 /**
@@ -62,6 +70,140 @@ char *next_token(char **str_ptr, const char *delim)
     return current_ptr;
 }
 
+/** This helper function checks if a `{` at the current token opens a group:
+ *  a fan-out group right after a pipe, or a function body when it is a word of
+ *  its own after `name()`, `name ()` or `function name`.
+ *
+ */
+static bool opens_group(const char *c, char **args, int total)
+{
+    if(total > 0 && !strcmp(args[total - 1], "|"))
+        return true;
+
+    if(c[1] != '\0' && !strchr(" \t\r\n", c[1]))
+        return false;
+
+    if(total > 0){
+        size_t len = strlen(args[total - 1]);
+        if(len >= 2 && !strcmp(args[total - 1] + len - 2, "()"))
+            return true;
+    }
+
+    return total > 1 && !strcmp(args[total - 2], "function");
+}
+
+/**
+ * Splits a command line into words and operators. Unlike next_token, operators
+ * don't need to be surrounded by spaces: `ls>out|wc -l` gives the same tokens
+ * as `ls > out | wc -l`. The operators are |, &, ;, <, >, >>, || and &&. A `{`
+ * right after a pipe (fan-out group) or starting a function body opens a
+ * group, and a `}` closes it.
+ *
+ * A process substitution, `<(cmd)` or `>(cmd)`, is a single word up to its
+ * closing parenthesis.
+ *
+ * Words can be quoted with '', "" or \, which makes spaces and operators part
+ * of the word. The quotes are kept in the words, they are removed when the
+ * words are expanded (see expand.c), so that a quoted operator is never taken
+ * for an operator. An unquoted # at the start of a word starts a comment.
+ *
+ * Parameters:
+ * - line: the command line.
+ * - buf: where the tokens are stored. It must hold 2 * strlen(line) + 1 bytes.
+ * - args: set to the tokens, followed by NULL.
+ * - max_args: number of entries of args.
+ *
+ * Returns: the number of tokens. -1 if a quote is not closed.
+ */
+int lex_line(const char *line, char *buf, char **args, int max_args)
+{
+    int total = 0;
+    int depth = 0;
+    const char *c = line;
+
+    while(*c != '\0' && total < max_args - 1){
+
+        if(strchr(" \t\r\n", *c)){
+            c++;
+            continue;
+        }
+
+        if(*c == '#')
+            break;
+
+        args[total] = buf;
+
+        if((*c == '<' || *c == '>') && c[1] == '('){
+            /* A process substitution is one word, up to its closing ) */
+            int parens = 0;
+            char quote = '\0';
+            *buf++ = *c++;
+            do {
+                if(*c == '\\' && quote != '\'' && c[1] != '\0')
+                    *buf++ = *c++;
+                else if(quote == '\0' && (*c == '\'' || *c == '"'))
+                    quote = *c;
+                else if(*c == quote)
+                    quote = '\0';
+                else if(quote == '\0' && *c == '(')
+                    parens++;
+                else if(quote == '\0' && *c == ')')
+                    parens--;
+                *buf++ = *c++;
+            } while(*c != '\0' && parens > 0);
+
+            if(parens > 0){
+                fprintf(stderr, "nash: unterminated (\n");
+                return -1;
+            }
+        } else if(strchr("|&;<>", *c)){
+            *buf++ = *c;
+            if((*c == '>' || *c == '|' || *c == '&') && c[1] == *c)
+                *buf++ = *++c;
+            c++;
+        } else if(*c == '{' && opens_group(c, args, total)){
+            *buf++ = *c++;
+            depth++;
+        } else if(*c == '}' && depth > 0){
+            *buf++ = *c++;
+            depth--;
+        } else {
+            char quote = '\0';
+            while(*c != '\0'){
+                if(quote == '\0' && (strchr(" \t\r\n|&;<>", *c)
+                            || (*c == '}' && depth > 0)))
+                    break;
+
+                if(*c == '\\' && quote != '\'' && c[1] != '\0'){
+                    *buf++ = *c++;
+                } else if(quote != '\'' && *c == '$' && c[1] == '{'){
+                    /* ${name} is part of the word, its } closes no group */
+                    while(*c != '\0' && *c != '}')
+                        *buf++ = *c++;
+                    if(*c == '\0')
+                        continue;
+                } else if(quote == '\0' && (*c == '\'' || *c == '"')){
+                    quote = *c;
+                } else if(*c == quote){
+                    quote = '\0';
+                }
+                *buf++ = *c++;
+            }
+
+            if(quote != '\0'){
+                fprintf(stderr, "nash: unterminated %c\n", quote);
+                return -1;
+            }
+        }
+
+        *buf++ = '\0';
+        total++;
+    }
+
+    args[total] = NULL;
+    return total;
+}
+
 /** This function returns the home directory of the current user.
  *
  */
@@ -88,3 +230,241 @@ int isDigitOnly(char *text){
     }
     return 0;
 }
+
+/** This function returns the length of the variable name at the start of a
+ *  string: a letter or _, followed by letters, digits and _.
+ *
+ *  -text: string to check.
+ *  -Returns: the length of the name, 0 if the string does not start with one.
+ *
+ */
+size_t name_len(const char *text){
+
+    const char *c = text;
+    if(!isalpha((unsigned char) *c) && *c != '_')
+        return 0;
+
+    while(isalnum((unsigned char) *c) || *c == '_')
+        c++;
+    return c - text;
+}
+
+/** This function is a debug check run in a child right before exec. It walks
+ *  /proc/self/fd and reports every descriptor above stderr that would be
+ *  inherited by the new program, i.e. that is missing FD_CLOEXEC. Every fd the
+ *  shell opens is close-on-exec, so anything reported here is a leak.
+ *  It is compiled out when LOGGER is 0.
+ *
+ */
+void fd_check(void){
+
+    if(!LOGGER)
+        return;
+
+    DIR *fds = opendir("/proc/self/fd");
+    if(!fds)
+        return;
+
+    struct dirent *entry;
+    while((entry = readdir(fds)) != NULL){
+        if(*entry->d_name == '.')
+            continue;
+
+        int fd = atoi(entry->d_name);
+        if(fd <= STDERR_FILENO || fd == dirfd(fds))
+            continue;
+
+        int flags = fcntl(fd, F_GETFD);
+        if(flags != -1 && !(flags & FD_CLOEXEC)){
+            char target[256] = { 0 };
+            char link[64];
+            snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+            if(readlink(link, target, sizeof(target) - 1) == -1)
+                strcpy(target, "?");
+
+            LOG("Unexpected inherited fd %d -> %s in pid %d\n", fd, target,
+                    getpid());
+        }
+    }
+    closedir(fds);
+}
+
+/** This helper function closes the descriptors from first to last. If
+ *  close_range is not available they are closed one by one.
+ *
+ */
+static void close_fds(unsigned int first, unsigned int last){
+
+    if(close_range(first, last, 0) == 0)
+        return;
+
+    long max_fd = sysconf(_SC_OPEN_MAX);
+    if(max_fd < 0)
+        max_fd = 1024;
+    if(last >= (unsigned long) max_fd)
+        last = max_fd - 1;
+
+    for(unsigned int fd = first; fd <= last; fd++)
+        close(fd);
+}
+
+/** This function closes every descriptor above stderr but the ones to keep.
+ *  It is called by children right before exec so they only inherit stdin,
+ *  stdout, stderr and the descriptors they were given on purpose, such as the
+ *  pipes of process substitutions.
+ *
+ *  -keep: the descriptors to keep, NULL if none.
+ *  -keep_sz: number of descriptors to keep.
+ *
+ */
+void close_inherited_fds(const int *keep, size_t keep_sz){
+
+    unsigned int first = STDERR_FILENO + 1;
+    while(true){
+
+        /* The lowest descriptor to keep from first on */
+        unsigned int next = ~0U;
+        for(size_t i = 0; i < keep_sz; i++){
+            if(keep[i] >= (int) first && (unsigned int) keep[i] < next)
+                next = keep[i];
+        }
+
+        if(next == ~0U){
+            close_fds(first, ~0U);
+            return;
+        }
+
+        if(next > first)
+            close_fds(first, next - 1);
+        first = next + 1;
+    }
+}
+
+/** This function hashes n bytes with FNV-1a, starting from h: FNV1A_START for
+ *  a new hash, or the hash of the bytes before to go on with it.
+ *
+ */
+uint64_t fnv1a(uint64_t h, const void *data, size_t n){
+
+    const unsigned char *p = data;
+    for(size_t i = 0; i < n; i++){
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/** This helper function looks up the slot of a key in the entries of a
+ *  frecency table.
+ *
+ *  Returns: the slot of the key, which is empty if it is not in the table.
+ */
+static struct frecency_entry *frecency_slot(struct frecency_entry *entries,
+        size_t size, const char *key, size_t key_sz){
+
+    size_t i = fnv1a(FNV1A_START, key, key_sz) & (size - 1);
+    while(entries[i].key != NULL){
+        if(!strncmp(entries[i].key, key, key_sz)
+                && entries[i].key[key_sz] == '\0')
+            return &entries[i];
+        i = (i + 1) & (size - 1);
+    }
+    return &entries[i];
+}
+
+/** This function looks up a key in a frecency table. The lookup is a single
+ *  hash probe.
+ *
+ *  -table: the table.
+ *  -key: the key, of key_sz bytes.
+ *
+ *  Returns: the entry of the key, NULL if it is not in the table.
+ */
+struct frecency_entry *frecency_find(const struct frecency *table,
+        const char *key, size_t key_sz){
+
+    if(table->entries == NULL)
+        return NULL;
+
+    struct frecency_entry *entry = frecency_slot(table->entries, table->size,
+            key, key_sz);
+    return entry->key != NULL ? entry : NULL;
+}
+
+/** This function adds a use of a key to a frecency table, adding the key if
+ *  it is new. A use older than the last one adds its own decayed weight. The
+ *  table is doubled when it is 70% full.
+ *
+ *  -table: the table.
+ *  -key: the key, of key_sz bytes.
+ *  -when: time of the use.
+ *  -score: what the use adds to the score, 1 for a single use.
+ *
+ *  Returns: the entry of the key, NULL if memory could not be allocated.
+ */
+struct frecency_entry *frecency_bump(struct frecency *table, const char *key,
+        size_t key_sz, time_t when, double score){
+
+    if((table->used + 1) * 10 > table->size * 7){
+        size_t new_sz = table->size ? table->size * 2 : 256;
+        struct frecency_entry *entries = calloc(new_sz,
+                sizeof(struct frecency_entry));
+        if(!entries){
+            perror("calloc");
+            return NULL;
+        }
+        for(size_t i = 0; i < table->size; i++){
+            struct frecency_entry *old = &table->entries[i];
+            if(old->key != NULL)
+                *frecency_slot(entries, new_sz, old->key,
+                        strlen(old->key)) = *old;
+        }
+        free(table->entries);
+        table->entries = entries;
+        table->size = new_sz;
+    }
+
+    struct frecency_entry *entry = frecency_slot(table->entries, table->size,
+            key, key_sz);
+    if(entry->key == NULL){
+        if(!(entry->key = strndup(key, key_sz))){
+            perror("strndup");
+            return NULL;
+        }
+        entry->score = 0;
+        entry->last = when;
+        table->used += 1;
+    }
+
+    if(difftime(when, entry->last) < 0){
+        entry->score += score * exp2(-difftime(entry->last, when)
+                / table->half_life);
+        return entry;
+    }
+
+    entry->score = frecency_score(table, entry, when) + score;
+    entry->last = when;
+    return entry;
+}
+
+/** This function returns the score of an entry decayed to the time now.
+ *
+ */
+double frecency_score(const struct frecency *table,
+        const struct frecency_entry *entry, time_t now){
+
+    return entry->score * exp2(-difftime(now, entry->last) / table->half_life);
+}
+
+/** This function frees the keys and the slots of a frecency table, which is
+ *  left empty.
+ *
+ */
+void frecency_clear(struct frecency *table){
+
+    for(size_t i = 0; i < table->size; i++)
+        free(table->entries[i].key);
+    free(table->entries);
+    table->entries = NULL;
+    table->size = table->used = 0;
+}
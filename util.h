@@ -5,7 +5,56 @@
 #ifndef _UTIL_H_
 #define _UTIL_H_
 
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Offset basis of the 64-bit FNV-1a hash */
+#define FNV1A_START 14695981039346656037ULL
+
+/** This struct holds an entry of a frecency table.
+ *
+ *  -key: the key (a command name, a directory), NULL for an empty slot.
+ *  -score: score at time 'last'.
+ *  -last: last time the key was used.
+ *
+ */
+struct frecency_entry {
+    char *key;
+    double score;
+    time_t last;
+};
+
+/** This struct holds a frecency table: an open addressing table of scores
+ *  which decay with a half-life, so that they count how often a key is used,
+ *  weighted by how recently.
+ *
+ *  -entries: the slots, a power of two of them.
+ *  -size: number of slots.
+ *  -used: number of keys.
+ *  -half_life: half-life of the scores in seconds.
+ *
+ */
+struct frecency {
+    struct frecency_entry *entries;
+    size_t size;
+    size_t used;
+    double half_life;
+};
+
 char *next_token(char **, const char *);
+int lex_line(const char *, char *, char **, int);
 char *getpwd();
 int isDigitOnly(char *);
+size_t name_len(const char *);
+void fd_check(void);
+void close_inherited_fds(const int *, size_t);
+uint64_t fnv1a(uint64_t, const void *, size_t);
+struct frecency_entry *frecency_find(const struct frecency *, const char *,
+        size_t);
+struct frecency_entry *frecency_bump(struct frecency *, const char *, size_t,
+        time_t, double);
+double frecency_score(const struct frecency *, const struct frecency_entry *,
+        time_t);
+void frecency_clear(struct frecency *);
 #endif